@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ENGINE_INTERNAL
+#include "engine.h"
+#include "lz4.h"
+#include "stats.h"
+
+// compressed classic images (mkfs -c). a regular file's block is compressed
+// with lz4.c and, if it shrinks below PACK_BYPASS, appended as a fragment
+// to the open pack block; otherwise it is kept raw in a block of its own,
+// as on any other image. a write never changes a fragment: it appends a new
+// one and drops the old, and a pack is freed once nothing points into it.
+// the open pack is only remembered in memory, so after a restart new
+// fragments go to a new one. directories are never compressed, as the
+// handlers scan their blocks straight out of the mapping
+
+pack_stats_t pack_stats;
+int pack_open = -1; // pack block new fragments go to, -1 for none
+
+// the last fragments decompressed, so small reads of one block do not
+// decompress it each time. a read can need two at once
+static struct
+{
+    unsigned int ptr;
+    char data[UFS_BLOCK_SIZE];
+} cache[2] = {{-1}, {-1}};
+static int cache_next = 0;
+
+// a newly mapped image has no open pack and nothing decompressed yet
+void pack_Open()
+{
+    pack_open = -1;
+    cache[0].ptr = cache[1].ptr = -1;
+}
+
+/**
+ * decompress fragment ptr, return where it is, valid until the second next
+ * call, or NULL if it is corrupt
+ */
+char *pack_read(unsigned int ptr)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        if (cache[i].ptr == ptr)
+        {
+            cache_next = i ^ 1;
+            return cache[i].data;
+        }
+    }
+
+    pack_header_t *h = (pack_header_t *)block_data(pack_block(ptr));
+    int f = pack_frag(ptr);
+    if (f >= h->count || h->frags[f].offset + h->frags[f].length > UFS_BLOCK_SIZE)
+        return NULL;
+    int i = cache_next;
+    cache[i].ptr = -1;
+    if (lz4_decompress(block_data(pack_block(ptr)) + h->frags[f].offset, h->frags[f].length,
+                       cache[i].data, UFS_BLOCK_SIZE) != UFS_BLOCK_SIZE)
+        return NULL;
+    cache[i].ptr = ptr;
+    cache_next = i ^ 1;
+    return cache[i].data;
+}
+
+// nothing points at fragment ptr any more
+void pack_release(unsigned int ptr)
+{
+    unsigned int block = pack_block(ptr);
+    pack_header_t *h = (pack_header_t *)block_data(block);
+    h->live &= ~(1u << pack_frag(ptr));
+    for (int i = 0; i < 2; i++)
+    {
+        if (cache[i].ptr == ptr)
+            cache[i].ptr = -1;
+    }
+    if (h->live == 0)
+    {
+        data_release(block);
+        punch_queue(block);
+        if ((int)block == pack_open)
+            pack_open = -1;
+    }
+}
+
+// append len compressed bytes to the open pack, or a new one, near goal, if
+// they do not fit or a snapshot holds it. return the fragment, or -1 if failed
+unsigned int pack_append(const char *data, int len, int goal)
+{
+    pack_header_t *h = pack_open == -1 ? NULL : (pack_header_t *)block_data(pack_open);
+    if (h == NULL || h->count == PACK_FRAGS || h->end + len > UFS_BLOCK_SIZE || snap_holds(pack_open))
+    {
+        int block = data_alloc(goal);
+        if (block == -1)
+        {
+            thread_stats.data_alloc_failures++;
+            return -1;
+        }
+        pack_open = block;
+        h = (pack_header_t *)block_data(block);
+        memset(h, 0, sizeof(*h));
+        h->end = sizeof(*h);
+    }
+
+    if (pwrite(fd, data, len, (off_t)pack_open * UFS_BLOCK_SIZE + h->end) != len)
+    {
+        if (h->live == 0)
+        {
+            data_release(pack_open);
+            pack_open = -1;
+        }
+        return -1;
+    }
+    int f = h->count++;
+    h->frags[f].offset = h->end;
+    h->frags[f].length = len;
+    h->end += len;
+    h->live |= 1u << f;
+    return PACK_BIT | f << 24 | pack_open;
+}
+
+/**
+ * block_write for a regular file of a compressed image: the whole block
+ * with the write merged in is compressed and packed, or written raw if it
+ * does not compress. return -1 if failed, 0 otherwise
+ */
+int pack_block_write(int inum, int index, const char *buffer, int offset, int nbytes)
+{
+    inode_t *inode = &inode_table[inum];
+    unsigned int old = inode->direct[index];
+    char block[UFS_BLOCK_SIZE];
+    char packed[PACK_BYPASS];
+
+    if (nbytes < UFS_BLOCK_SIZE)
+    {
+        char *from = (int)old == -1 ? NULL : file_block(old);
+        if ((int)old != -1 && from == NULL)
+            return -1;
+        if (from == NULL)
+            memset(block, 0, UFS_BLOCK_SIZE);
+        else
+            memcpy(block, from, UFS_BLOCK_SIZE);
+    }
+    memcpy(block + offset, buffer, nbytes);
+
+    int len = lz4_compress(block, UFS_BLOCK_SIZE, packed, PACK_BYPASS);
+    if (len == 0)
+    {
+        pack_stats.bypassed++;
+        if (!is_packed(old))
+            return raw_block_write(inum, index, buffer, offset, nbytes);
+        inode->direct[index] = -1;
+        if (raw_block_write(inum, index, block, 0, UFS_BLOCK_SIZE) == -1)
+        {
+            inode->direct[index] = old;
+            return -1;
+        }
+        pack_release(old);
+        return 0;
+    }
+
+    unsigned int ptr = pack_append(packed, len, block_goal(inum, index));
+    if ((int)ptr == -1)
+        return -1;
+    inode->direct[index] = ptr;
+    pack_stats.packed++;
+    pack_stats.packed_bytes += len;
+    if ((int)old != -1)
+        data_free(old);
+    return 0;
+}
+
+// block_copy of fragment ptr: its compressed bytes are appended as they are
+int pack_block_copy(int inum, int index, unsigned int ptr)
+{
+    inode_t *inode = &inode_table[inum];
+    unsigned int old = inode->direct[index];
+    pack_header_t *h = (pack_header_t *)block_data(pack_block(ptr));
+    int f = pack_frag(ptr);
+    char packed[PACK_BYPASS];
+    if (f >= h->count || h->frags[f].length > PACK_BYPASS || h->frags[f].offset + h->frags[f].length > UFS_BLOCK_SIZE)
+        return -1;
+    int len = h->frags[f].length;
+    memcpy(packed, block_data(pack_block(ptr)) + h->frags[f].offset, len);
+
+    unsigned int copy = pack_append(packed, len, block_goal(inum, index));
+    if ((int)copy == -1)
+        return -1;
+    inode->direct[index] = copy;
+    pack_stats.packed++;
+    pack_stats.packed_bytes += len;
+    if ((int)old != -1)
+        data_free(old);
+    return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef __cycles_h__
+#define __cycles_h__
+
+// cheap timestamp for hot-path accounting: the TSC on x86, nanoseconds
+// everywhere else
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+
+static inline unsigned long long cycles_now(void)
+{
+    return __rdtsc();
+}
+#else
+#include <time.h>
+
+static inline unsigned long long cycles_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+#endif // __cycles_h__
@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ENGINE_INTERNAL
+#include "engine.h"
+#include "stats.h"
+#include "trace.h"
+
+// deduplicated classic images (mkfs -D). every block a regular file writes
+// is fingerprinted and looked up in the fingerprint index; if a block with
+// the same contents is there the file points at it too. dedup_refs counts
+// how many file blocks point at each data block, and a block more than one
+// points at, or a snapshot holds, is never written in place. the index is
+// an open-addressed table in the image; it is mapped like the bitmaps, so
+// the page cache is its in-memory cache. a fingerprint only narrows the
+// search down: blocks are compared before they are shared. directories
+// keep their blocks to themselves, with a count of 0
+
+dedup_stats_t dedup_stats;
+unsigned int *dedup_refs = NULL; // per data block, NULL unless the image is deduplicated
+dedup_entry_t *dedup_index;
+unsigned int dedup_mask;         // index slots - 1
+
+// 64-bit multiply-xorshift over the block in four lanes, folded to 32 bits
+unsigned int block_fingerprint(const char *data)
+{
+    const unsigned long long *words = (const unsigned long long *)data;
+    unsigned long long a = 1, b = 2, c = 3, d = 4;
+    for (int i = 0; i < UFS_BLOCK_SIZE / 8; i += 4)
+    {
+        a = (a ^ words[i]) * 0x9e3779b97f4a7c15ULL;
+        b = (b ^ words[i + 1]) * 0x9e3779b97f4a7c15ULL;
+        c = (c ^ words[i + 2]) * 0x9e3779b97f4a7c15ULL;
+        d = (d ^ words[i + 3]) * 0x9e3779b97f4a7c15ULL;
+        a ^= a >> 29;
+        b ^= b >> 29;
+        c ^= c >> 29;
+        d ^= d >> 29;
+    }
+    unsigned long long h = ((a * 31 + b) * 31 + c) * 31 + d;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (unsigned int)h;
+}
+
+// point the globals at the image's refcounts and index, wherever the
+// mapping and the super block now have them
+void dedup_map()
+{
+    if (SUPERBLOCK->layout != UFS_LAYOUT_CLASSIC || !SUPERBLOCK->dedup)
+    {
+        dedup_refs = NULL;
+        return;
+    }
+    dedup_refs = (unsigned int *)block_data(SUPERBLOCK->dedup_refs_addr);
+    dedup_index = (dedup_entry_t *)block_data(SUPERBLOCK->dedup_index_addr);
+    dedup_mask = SUPERBLOCK->dedup_index_slots - 1;
+}
+
+// point the globals at a newly mapped image's refcounts and index
+void dedup_Open()
+{
+    memset(&dedup_stats, 0, sizeof(dedup_stats));
+    dedup_map();
+    if (dedup_refs == NULL)
+        return;
+    for (int i = 0; i < SUPERBLOCK->num_data; i++)
+    {
+        if (dedup_refs[i] == 0)
+            continue;
+        dedup_stats.file_blocks += dedup_refs[i];
+        dedup_stats.data_blocks++;
+    }
+}
+
+// a block with data's contents that files already point at, -1 if none
+int dedup_find(unsigned int tag, const char *data)
+{
+    for (unsigned int i = tag & dedup_mask; dedup_index[i].block != 0; i = (i + 1) & dedup_mask)
+    {
+        if (dedup_index[i].tag == tag && memcmp(block_data(dedup_index[i].block), data, UFS_BLOCK_SIZE) == 0)
+            return dedup_index[i].block;
+    }
+    return -1;
+}
+
+void dedup_insert(unsigned int tag, unsigned int block)
+{
+    unsigned int i = tag & dedup_mask;
+    while (dedup_index[i].block != 0)
+        i = (i + 1) & dedup_mask;
+    dedup_index[i].tag = tag;
+    dedup_index[i].block = block;
+}
+
+// take block out of the index, moving back the entries after it that
+// would otherwise no longer be found
+void dedup_remove(unsigned int tag, unsigned int block)
+{
+    unsigned int i = tag & dedup_mask;
+    while (dedup_index[i].block != block)
+    {
+        if (dedup_index[i].block == 0)
+            return;
+        i = (i + 1) & dedup_mask;
+    }
+    for (unsigned int j = (i + 1) & dedup_mask; dedup_index[j].block != 0; j = (j + 1) & dedup_mask)
+    {
+        // entry j may move to the hole at i if its home is not in (i, j]
+        unsigned int home = dedup_index[j].tag & dedup_mask;
+        if (((j - home) & dedup_mask) >= ((j - i) & dedup_mask))
+        {
+            dedup_index[i] = dedup_index[j];
+            i = j;
+        }
+    }
+    dedup_index[i].block = 0;
+}
+
+// one less file block points at block; it is freed when none does
+void dedup_release(unsigned int block)
+{
+    int b = block - SUPERBLOCK->data_region_addr;
+    dedup_stats.file_blocks--;
+    if (--dedup_refs[b] > 0)
+        return;
+    dedup_remove(block_fingerprint(block_data(block)), block);
+    data_release(block);
+    punch_queue(block);
+    dedup_stats.data_blocks--;
+}
+
+/**
+ * block_write for a regular file of a deduplicated image: the whole block
+ * with the write merged in is shared with a block that has the same
+ * contents, or else written, in place if nothing else needs the old block.
+ * return -1 if failed, 0 otherwise
+ */
+int dedup_block_write(int inum, int index, const char *buffer, int offset, int nbytes)
+{
+    inode_t *inode = &inode_table[inum];
+    int old = inode->direct[index];
+    char block[UFS_BLOCK_SIZE];
+
+    if (nbytes < UFS_BLOCK_SIZE)
+    {
+        if (old == -1)
+            memset(block, 0, UFS_BLOCK_SIZE);
+        else
+            memcpy(block, block_data(old), UFS_BLOCK_SIZE);
+    }
+    memcpy(block + offset, buffer, nbytes);
+
+    unsigned int tag = block_fingerprint(block);
+    int match = dedup_find(tag, block);
+    if (match != -1)
+    {
+        dedup_stats.shared++;
+        if (match == old)
+            return 0;
+        dedup_refs[match - SUPERBLOCK->data_region_addr]++;
+        dedup_stats.file_blocks++;
+        inode->direct[index] = match;
+        if (old != -1)
+            dedup_release(old);
+        return 0;
+    }
+
+    int target = old;
+    if (old != -1 && dedup_refs[old - SUPERBLOCK->data_region_addr] == 1 && !snap_holds(old))
+        dedup_remove(block_fingerprint(block_data(old)), old);
+    else
+    {
+        target = data_alloc(block_goal(inum, index));
+        if (target == -1)
+        {
+            thread_stats.data_alloc_failures++;
+            return -1;
+        }
+    }
+
+    TRACE_BEGIN(TRACE_DATA, inum);
+    int rc = pwrite(fd, block, UFS_BLOCK_SIZE, (off_t)target * UFS_BLOCK_SIZE) == UFS_BLOCK_SIZE;
+    TRACE_END(TRACE_DATA, inum);
+    if (!rc)
+    {
+        // an old block rewritten in place just stays out of the index
+        if (target != old)
+            data_release(target);
+        return -1;
+    }
+    dedup_insert(tag, target);
+    dedup_stats.written++;
+    if (target != old)
+    {
+        dedup_refs[target - SUPERBLOCK->data_region_addr] = 1;
+        dedup_stats.file_blocks++;
+        dedup_stats.data_blocks++;
+        inode->direct[index] = target;
+        if (old != -1)
+            dedup_release(old);
+    }
+    return 0;
+}
+
+// block_copy on a deduplicated image: inum points at block too
+int dedup_block_share(int inum, int index, unsigned int block)
+{
+    inode_t *inode = &inode_table[inum];
+    int old = inode->direct[index];
+    dedup_stats.shared++;
+    if (old == (int)block)
+        return 0;
+    dedup_refs[block - SUPERBLOCK->data_region_addr]++;
+    dedup_stats.file_blocks++;
+    inode->direct[index] = block;
+    if (old != -1)
+        dedup_release(old);
+    return 0;
+}
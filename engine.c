@@ -0,0 +1,1741 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define ENGINE_INTERNAL
+#include "engine.h"
+#include "stats.h"
+#include "trace.h"
+
+#ifdef ENGINE_COUNT_SYSCALLS
+#undef lseek
+#undef read
+#undef write
+#undef pwrite
+#undef fsync
+#undef fallocate
+#undef copy_file_range
+
+// route the engine's I/O through counters, for the microbenchmarks
+unsigned long long engine_syscalls = 0;
+
+off_t counted_lseek(int fd, off_t offset, int whence)
+{
+    engine_syscalls++;
+    return lseek(fd, offset, whence);
+}
+
+ssize_t counted_read(int fd, void *buf, size_t count)
+{
+    engine_syscalls++;
+    return read(fd, buf, count);
+}
+
+ssize_t counted_write(int fd, const void *buf, size_t count)
+{
+    engine_syscalls++;
+    return write(fd, buf, count);
+}
+
+ssize_t counted_pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+    engine_syscalls++;
+    return pwrite(fd, buf, count, offset);
+}
+
+int counted_fsync(int fd)
+{
+    engine_syscalls++;
+    return fsync(fd);
+}
+
+int counted_fallocate(int fd, int mode, off_t offset, off_t len)
+{
+    engine_syscalls++;
+    return fallocate(fd, mode, offset, len);
+}
+
+#define lseek(fd, offset, whence) counted_lseek(fd, offset, whence)
+#define read(fd, buf, count) counted_read(fd, buf, count)
+#define write(fd, buf, count) counted_write(fd, buf, count)
+#define pwrite(fd, buf, count, offset) counted_pwrite(fd, buf, count, offset)
+#define fsync(fd) counted_fsync(fd)
+ssize_t counted_copy_file_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags)
+{
+    engine_syscalls++;
+    return copy_file_range(fd_in, off_in, fd_out, off_out, len, flags);
+}
+
+#define fallocate(fd, mode, offset, len) counted_fallocate(fd, mode, offset, len)
+#define copy_file_range(fd_in, off_in, fd_out, off_out, len, flags) \
+    counted_copy_file_range(fd_in, off_in, fd_out, off_out, len, flags)
+#endif
+
+void *image;
+long image_size;
+int fd = -1;
+super_t *SUPERBLOCK;
+inode_t *root_inode;
+dir_ent_t *root_dir;
+unsigned int *inodeMap;
+unsigned int *dataMap;
+inode_t *inode_table;
+int *data_table;
+int log_layout = 0;
+
+unsigned int get_bit(unsigned int *bitmap, int position)
+{
+    int index = position / 32;
+    int offset = 31 - (position % 32);
+    return (bitmap[index] >> offset) & 0x1;
+}
+
+// set_bit and set_bit_zero are atomic, so threads allocating at once do
+// not undo each other's changes to other bits of the word
+void set_bit(unsigned int *bitmap, int position)
+{
+    int index = position / 32;
+    int offset = 31 - (position % 32);
+    __atomic_fetch_or(&bitmap[index], 0x1u << offset, __ATOMIC_RELEASE);
+}
+
+void set_bit_zero(unsigned int *bitmap, int position)
+{
+    int index = position / 32;
+    int offset = 31 - (position % 32);
+    __atomic_fetch_and(&bitmap[index], ~(0x1u << offset), __ATOMIC_RELEASE);
+}
+
+// set position in bitmap, return 0 if it already was: another thread took it
+int bit_claim(unsigned int *bitmap, int position)
+{
+    unsigned int bit = 0x1u << (31 - (position % 32));
+    return (__atomic_fetch_or(&bitmap[position / 32], bit, __ATOMIC_ACQ_REL) & bit) == 0;
+}
+
+// the first position in [from, to) clear in bitmap and, unless it is NULL,
+// in busy; -1 if there is none. whole words of 32 taken are skipped at once
+int bitmap_find(unsigned int *bitmap, unsigned int *busy, int from, int to)
+{
+    int i = from;
+    while (i < to)
+    {
+        if (i % 32 == 0 && i + 32 <= to)
+        {
+            unsigned int taken = bitmap[i / 32] | (busy == NULL ? 0 : busy[i / 32]);
+            if (taken != 0xffffffff)
+                return i + __builtin_clz(~taken);
+            i += 32;
+            continue;
+        }
+        if (get_bit(bitmap, i) == 0 && (busy == NULL || get_bit(busy, i) == 0))
+            return i;
+        i++;
+    }
+    return -1;
+}
+
+// how many positions in [from, to) are set in bitmap
+int bitmap_count(unsigned int *bitmap, int from, int to)
+{
+    int n = 0;
+    int i = from;
+    while (i < to)
+    {
+        if (i % 32 == 0 && i + 32 <= to)
+        {
+            n += __builtin_popcount(bitmap[i / 32]);
+            i += 32;
+            continue;
+        }
+        n += get_bit(bitmap, i);
+        i++;
+    }
+    return n;
+}
+
+// the first position in [from, to) clear in bitmap and busy, as
+// bitmap_find, set in bitmap by this thread; -1 if there is none
+int bitmap_claim(unsigned int *bitmap, unsigned int *busy, int from, int to)
+{
+    int i;
+    while ((i = bitmap_find(bitmap, busy, from, to)) != -1)
+    {
+        if (bit_claim(bitmap, i))
+            return i;
+        from = i + 1;
+    }
+    return -1;
+}
+
+// allocation groups, in the FFS manner: group g is the g-th slice of the
+// inodes and of the data blocks. a file's inode goes in its directory's
+// group and its blocks after each other near the start of that group's
+// blocks, so a directory's files, and each file, read from one place. new
+// directories are what spreads the image out: each goes to a group with
+// room and few directories. log images have one group, the log deciding
+// where everything goes.
+//
+// allocating takes no lock. a bit is claimed with an atomic or, and each
+// group keeps atomic counts of the clear bits of its slices, so threads
+// working in different directories allocate in different groups without
+// touching the same words, and a full group is passed over without
+// scanning it. the counts are of the bitmaps, so they never say a group is
+// full while it is not; blocks snapshots hold count as free
+typedef struct
+{
+    int free_inodes;
+    int free_blocks;
+    int dirs;
+} group_t;
+
+int ngroups = 1;
+int group_inodes;
+int group_blocks;
+static group_t *groups = NULL;
+
+// the inodes of group g are [*from, *to)
+static void group_inode_range(int g, int *from, int *to)
+{
+    *from = g * group_inodes;
+    *to = *from + group_inodes;
+    if (*to > SUPERBLOCK->num_inodes)
+        *to = SUPERBLOCK->num_inodes;
+    if (*from > *to)
+        *from = *to;
+}
+
+void groups_Open()
+{
+    ngroups = 1;
+    group_inodes = SUPERBLOCK->num_inodes;
+    group_blocks = SUPERBLOCK->num_data;
+    if (!log_layout && SUPERBLOCK->groups > 0)
+    {
+        ngroups = SUPERBLOCK->groups;
+        group_inodes = SUPERBLOCK->group_inodes;
+        group_blocks = SUPERBLOCK->group_blocks;
+    }
+    groups = realloc(groups, ngroups * sizeof(group_t));
+    assert(groups != NULL);
+    memset(groups, 0, ngroups * sizeof(group_t));
+    if (log_layout)
+        return;
+    for (int g = 0; g < ngroups; g++)
+    {
+        int from, to;
+        group_inode_range(g, &from, &to);
+        groups[g].free_inodes = to - from - bitmap_count(inodeMap, from, to);
+        from = g * group_blocks;
+        to = g == ngroups - 1 ? SUPERBLOCK->num_data : from + group_blocks;
+        groups[g].free_blocks = to - from - bitmap_count(dataMap, from, to);
+    }
+    for (int i = 0; i < SUPERBLOCK->num_inodes; i++)
+    {
+        if (get_bit(inodeMap, i) && inode_table[i].type == UFS_DIRECTORY)
+            groups[i / group_inodes].dirs++;
+    }
+}
+
+// the image grew from old_inodes inodes and old_data data blocks: the
+// groups it now has are counted in, and what they gained is free
+static void groups_grow(int old_inodes, int old_data)
+{
+    int old_groups = ngroups;
+    if (SUPERBLOCK->groups == 0)
+    {
+        group_inodes = SUPERBLOCK->num_inodes;
+        group_blocks = SUPERBLOCK->num_data;
+    }
+    else
+        ngroups = SUPERBLOCK->groups;
+    groups = realloc(groups, ngroups * sizeof(group_t));
+    assert(groups != NULL);
+    memset(&groups[old_groups], 0, (ngroups - old_groups) * sizeof(group_t));
+    for (int i = old_inodes; i < SUPERBLOCK->num_inodes; i = (i / group_inodes + 1) * group_inodes)
+    {
+        int end = (i / group_inodes + 1) * group_inodes;
+        groups[i / group_inodes].free_inodes += (end < SUPERBLOCK->num_inodes ? end : SUPERBLOCK->num_inodes) - i;
+    }
+    for (int i = old_data; i < SUPERBLOCK->num_data; i = (i / group_blocks + 1) * group_blocks)
+    {
+        int end = (i / group_blocks + 1) * group_blocks;
+        groups[i / group_blocks].free_blocks += (end < SUPERBLOCK->num_data ? end : SUPERBLOCK->num_data) - i;
+    }
+}
+
+// the group a new directory under pinum goes in: of the groups with at
+// least the average number of free inodes and free blocks, the one with the
+// fewest directories, the first after pinum's on a tie
+static int dir_group(int pinum)
+{
+    int start = pinum / group_inodes;
+    if (ngroups == 1)
+        return 0;
+    int free_inodes = 0;
+    int free_blocks = 0;
+    int gfree[ngroups][2];
+    for (int g = 0; g < ngroups; g++)
+    {
+        gfree[g][0] = __atomic_load_n(&groups[g].free_inodes, __ATOMIC_RELAXED);
+        gfree[g][1] = __atomic_load_n(&groups[g].free_blocks, __ATOMIC_RELAXED);
+        free_inodes += gfree[g][0];
+        free_blocks += gfree[g][1];
+    }
+
+    int best = -1;
+    for (int n = 1; n <= ngroups; n++)
+    {
+        int g = (start + n) % ngroups;
+        if (gfree[g][0] == 0 || gfree[g][0] * ngroups < free_inodes || gfree[g][1] * ngroups < free_blocks)
+            continue;
+        if (best == -1 || groups[g].dirs < groups[best].dirs)
+            best = g;
+    }
+    // nothing has the average of both: any room for an inode will do
+    return best == -1 ? start : best;
+}
+
+int batch_depth = 0;
+
+// classic data blocks freed since the last commit. once the commit has made
+// that durable they are punched out of the image file, so they take no
+// space until they are used again. frees past PUNCH_MAX in one commit keep
+// their space
+unsigned int punch_list[PUNCH_MAX];
+int npunch = 0;
+unsigned long long blocks_punched = 0;
+
+void punch_queue(unsigned int block)
+{
+    if (npunch < PUNCH_MAX)
+        punch_list[npunch++] = block;
+}
+
+// punch the queued blocks that are still free, a run of neighbours at once.
+// only once freeing them is durable: until then the image may need them
+void punch_flush()
+{
+    unsigned int start = 0;
+    int len = 0;
+    for (int i = 0; i <= npunch; i++)
+    {
+        unsigned int block = i < npunch ? punch_list[i] : 0;
+        // reused, or held by a snapshot, since it was freed
+        if (i < npunch && (get_bit(dataMap, block - SUPERBLOCK->data_region_addr) || snap_holds(block)))
+            continue;
+        if (i < npunch && len > 0 && block == start + len)
+        {
+            len++;
+            continue;
+        }
+        if (len > 0 && fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)start * UFS_BLOCK_SIZE,
+                                 (off_t)len * UFS_BLOCK_SIZE) == 0)
+            blocks_punched += len;
+        start = block;
+        len = 1;
+    }
+    npunch = 0;
+}
+
+// make everything written so far durable, unless we are inside a compound
+// request that commits once at its end
+void commit()
+{
+    if (batch_depth == 0)
+    {
+        if (log_layout)
+        {
+            lfs_commit();
+            return;
+        }
+        unsigned long long start = stats_now_ns();
+        TRACE_BEGIN(TRACE_FSYNC, 0);
+        fsync(fd);
+        TRACE_END(TRACE_FSYNC, 0);
+        hist_record(&thread_stats.fsync, stats_now_ns() - start);
+        if (npunch > 0)
+            punch_flush();
+    }
+}
+
+// point the globals into the mapping
+void map_pointers()
+{
+    SUPERBLOCK = (super_t *)image;
+    if (!log_layout)
+    {
+        inodeMap = image + SUPERBLOCK->inode_bitmap_addr * UFS_BLOCK_SIZE;
+        inode_table = image + SUPERBLOCK->inode_region_addr * UFS_BLOCK_SIZE;
+        dataMap = image + SUPERBLOCK->data_bitmap_addr * UFS_BLOCK_SIZE;
+    }
+    data_table = image + SUPERBLOCK->data_region_addr * UFS_BLOCK_SIZE;
+}
+
+// make the image file, and its mapping, blocks long
+int image_resize(long blocks)
+{
+    long size = blocks * UFS_BLOCK_SIZE;
+    if (size == image_size)
+        return 0;
+    if (size > image_size && ftruncate(fd, size) != 0)
+        return -1;
+    void *moved = mremap(image, image_size, size, MREMAP_MAYMOVE);
+    if (moved == MAP_FAILED)
+        return -1;
+    if (size < image_size && ftruncate(fd, size) != 0)
+        perror("image_resize");
+    image = moved;
+    image_size = size;
+    map_pointers();
+    dedup_map();
+    if (root_inode != NULL)
+    {
+        root_inode = inode_table;
+        root_dir = (dir_ent_t *)block_data(root_inode->direct[0]);
+    }
+    return 0;
+}
+
+// open and map the image at path, read-only or not
+int map_image(char *path, int readonly)
+{
+    fd = open(path, readonly ? O_RDONLY : O_RDWR);
+    if (fd < 0)
+        return -1;
+
+    struct stat sbuf;
+    int rc = fstat(fd, &sbuf);
+    assert(rc > -1);
+
+    image_size = (long)sbuf.st_size;
+
+    image = mmap(NULL, image_size, readonly ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+
+    SUPERBLOCK = (super_t *)image;
+    log_layout = SUPERBLOCK->layout == UFS_LAYOUT_LOG;
+    map_pointers();
+    npunch = 0;
+    groups_Open();
+    pack_Open();
+    dedup_Open();
+    return 0;
+}
+
+/**
+ * open and map the image at path and point the globals into it,
+ * return -1 if failed, 0 otherwise
+ */
+int engine_Open(char *path)
+{
+    if (map_image(path, 0) != 0)
+        return -1;
+    if ((log_layout ? lfs_Open() : snap_Open()) != 0)
+    {
+        munmap(image, image_size);
+        close(fd);
+        return -1;
+    }
+
+    root_inode = inode_table;
+    root_dir = (dir_ent_t *)block_data(root_inode->direct[0]);
+    return 0;
+}
+
+/**
+ * open the image at path read-only, serving snapshot id of it,
+ * return -1 if failed, 0 otherwise
+ */
+int engine_OpenSnapshot(char *path, int id)
+{
+    if (map_image(path, 1) != 0)
+        return -1;
+    if (log_layout || snap_Mount(id) != 0)
+    {
+        munmap(image, image_size);
+        close(fd);
+        return -1;
+    }
+    root_inode = NULL;
+    root_dir = NULL;
+    return 0;
+}
+
+void engine_Close()
+{
+    if (log_layout)
+        lfs_Close();
+    else
+        snap_Close();
+    munmap(image, image_size);
+    close(fd);
+    fd = -1;
+}
+
+// called by the server when it has had nothing to do for a while
+void engine_Idle()
+{
+    if (log_layout)
+        lfs_Clean(0);
+}
+
+// inode inum, NULL if it is out of range or not in use
+inode_t *inode_get(int inum)
+{
+    if (snapshot_view != -1)
+        return snap_inode_get(inum);
+    if (inum > SUPERBLOCK->num_inodes - 1 || inum < 0)
+        return NULL;
+    if (get_bit(inodeMap, inum) == 0)
+        return NULL;
+    return &inode_table[inum];
+}
+
+// inum was changed through inode_get and goes to disk with the next commit.
+// the classic layout's inode table is the mapped image itself, which the
+// commit's fsync writes back. changes must come after a block_write,
+// inode_alloc or inode_free of inum, which let snapshots copy it first
+void inode_dirty(int inum)
+{
+    if (log_layout)
+        lfs_inode_dirty(inum);
+}
+
+/**
+ * allocate an empty inode of type to go in directory pinum (-1 for the
+ * root), in pinum's group or, for a directory, the group dir_group picks,
+ * else the first group after that with one free. return -1 if failed,
+ * inode number otherwise
+ */
+int inode_alloc(int type, int pinum)
+{
+    if (snapshot_view != -1)
+        return -1;
+    TRACE_BEGIN(TRACE_ALLOC, 0);
+    int inum = -1;
+    int start = pinum < 0 ? 0 : type == UFS_DIRECTORY ? dir_group(pinum) : pinum / group_inodes;
+    for (int n = 0; n < ngroups && inum == -1; n++)
+    {
+        int g = (start + n) % ngroups;
+        if (!log_layout && __atomic_load_n(&groups[g].free_inodes, __ATOMIC_RELAXED) == 0)
+            continue;
+        int from, to;
+        group_inode_range(g, &from, &to);
+        inum = bitmap_claim(inodeMap, NULL, from, to);
+        if (inum != -1 && !log_layout)
+            __atomic_fetch_sub(&groups[g].free_inodes, 1, __ATOMIC_RELAXED);
+    }
+    TRACE_END(TRACE_ALLOC, 0);
+    if (inum == -1)
+    {
+        thread_stats.inode_alloc_failures++;
+        return -1;
+    }
+
+    if (!log_layout && snap_inode_cow(inum) == -1)
+    {
+        set_bit_zero(inodeMap, inum);
+        __atomic_fetch_add(&groups[inum / group_inodes].free_inodes, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    inode_t *inode = &inode_table[inum];
+    inode->type = type;
+    inode->size = 0;
+    for (int i = 0; i < DIRECT_PTRS; i++)
+        inode->direct[i] = -1;
+    inode_dirty(inum);
+    if (!log_layout && type == UFS_DIRECTORY)
+        __atomic_fetch_add(&groups[inum / group_inodes].dirs, 1, __ATOMIC_RELAXED);
+    return inum;
+}
+
+// free inum and every block it has. return -1 if failed, 0 otherwise
+int inode_free(int inum)
+{
+    if (log_layout)
+    {
+        lfs_inode_free(inum);
+        return 0;
+    }
+    if (snap_inode_cow(inum) == -1)
+        return -1;
+    if (inode_table[inum].type == UFS_DIRECTORY)
+        __atomic_fetch_sub(&groups[inum / group_inodes].dirs, 1, __ATOMIC_RELAXED);
+    inode_t *inode = &inode_table[inum];
+    for (int i = 0; i < DIRECT_PTRS; i++)
+    {
+        if ((int)inode->direct[i] != -1)
+            data_free(inode->direct[i]);
+    }
+    set_bit_zero(inodeMap, inum);
+    __atomic_fetch_add(&groups[inum / group_inodes].free_inodes, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+char *block_data(unsigned int block)
+{
+    return (char *)image + (long)block * UFS_BLOCK_SIZE;
+}
+
+// what block pointer ptr of a file holds: the block itself, or the
+// fragment it names decompressed (compress.c). NULL if that is corrupt
+char *file_block(unsigned int ptr)
+{
+    return is_packed(ptr) ? pack_read(ptr) : block_data(ptr);
+}
+
+// a classic file no longer points at ptr
+void data_free(unsigned int ptr)
+{
+    if (is_packed(ptr))
+        pack_release(ptr);
+    else if (dedup_refs != NULL && dedup_refs[ptr - SUPERBLOCK->data_region_addr] != 0)
+        dedup_release(ptr);
+    else
+    {
+        data_release(ptr);
+        punch_queue(ptr);
+    }
+}
+
+// clear block in the data bitmap, freeing it, or giving back a block
+// data_alloc returned that was not used after all
+void data_release(unsigned int block)
+{
+    int b = block - SUPERBLOCK->data_region_addr;
+    set_bit_zero(dataMap, b);
+    __atomic_fetch_add(&groups[b / group_blocks].free_blocks, 1, __ATOMIC_RELAXED);
+}
+
+// drop block index of inum, which then reads as zeros. the caller marks
+// inum dirty. return -1 if failed, 0 otherwise
+int block_free(int inum, int index)
+{
+    if (log_layout)
+    {
+        lfs_block_free(inum, index);
+        return 0;
+    }
+    if (snap_inode_cow(inum) == -1)
+        return -1;
+    inode_t *inode = &inode_table[inum];
+    if ((int)inode->direct[index] == -1)
+        return 0;
+    data_free(inode->direct[index]);
+    inode->direct[index] = -1;
+    return 0;
+}
+
+/**
+ * a free block of the classic data region, -1 if there is none: the first
+ * from goal to the end of its group, else the first of the groups after it.
+ * goal is -1 for the first free block. blocks snapshots hold are not free
+ */
+int data_alloc(int goal)
+{
+    int block = -1;
+    TRACE_BEGIN(TRACE_ALLOC, 0);
+    int start = goal - SUPERBLOCK->data_region_addr;
+    if (goal == -1 || start < 0 || start >= SUPERBLOCK->num_data)
+        start = 0;
+    int g = start / group_blocks;
+    // one past the last group is the goal's group again, up to the goal
+    for (int n = 0; n <= ngroups && block == -1; n++)
+    {
+        int from = n == 0 ? start : (g + n) % ngroups * group_blocks;
+        int to = n == ngroups ? start : from - from % group_blocks + group_blocks;
+        if (to > SUPERBLOCK->num_data)
+            to = SUPERBLOCK->num_data;
+        group_t *group = &groups[from / group_blocks];
+        if (__atomic_load_n(&group->free_blocks, __ATOMIC_RELAXED) == 0)
+            continue;
+        int i = bitmap_claim(dataMap, snapshot_count == 0 ? NULL : snap_busy, from, to);
+        if (i != -1)
+        {
+            __atomic_fetch_sub(&group->free_blocks, 1, __ATOMIC_RELAXED);
+            block = SUPERBLOCK->data_region_addr + i;
+        }
+    }
+    TRACE_END(TRACE_ALLOC, 0);
+    return block;
+}
+
+// the first block of the data region at or after goal that starts a run of
+// 32 free ones, in goal's group; goal if there is none
+static int free_run(int goal)
+{
+    int b = goal - SUPERBLOCK->data_region_addr;
+    if (b < 0 || b >= SUPERBLOCK->num_data)
+        return goal;
+    int end = b - b % group_blocks + group_blocks;
+    if (end > SUPERBLOCK->num_data)
+        end = SUPERBLOCK->num_data;
+    for (int w = (b + 31) / 32; w < end / 32; w++)
+    {
+        if ((dataMap[w] | (snapshot_count == 0 ? 0 : snap_busy[w])) == 0)
+            return SUPERBLOCK->data_region_addr + w * 32;
+    }
+    return goal;
+}
+
+// where block index of inum had best go: right after the block before it,
+// else right before the block after it, else at the start of the group
+// inum is in. when the block a file would carry on in is taken, as when
+// files are written to at once, it carries on in free space with room to,
+// not in the first hole after it
+int block_goal(int inum, int index)
+{
+    inode_t *inode = &inode_table[inum];
+    int goal = -1;
+    for (int i = index - 1; i >= 0 && goal == -1; i--)
+    {
+        if ((int)inode->direct[i] != -1)
+            goal = pack_block(inode->direct[i]) + index - i;
+    }
+    for (int i = index + 1; i < DIRECT_PTRS && goal == -1; i++)
+    {
+        if ((int)inode->direct[i] != -1)
+            goal = pack_block(inode->direct[i]) - (i - index);
+    }
+    if (goal == -1)
+        return SUPERBLOCK->data_region_addr + inum / group_inodes * group_blocks;
+    int b = goal - SUPERBLOCK->data_region_addr;
+    if (b >= 0 && b < SUPERBLOCK->num_data &&
+        (get_bit(dataMap, b) || (snapshot_count > 0 && get_bit(snap_busy, b))))
+        return free_run(goal);
+    return goal;
+}
+
+/**
+ * write nbytes of buffer at offset into block index of inum, giving it a
+ * block if it has none, or a copy of its block if a snapshot holds that;
+ * what a new block's write does not cover reads as zeros. the caller marks
+ * inum dirty. return -1 if failed, 0 otherwise
+ */
+int block_write(int inum, int index, const char *buffer, int offset, int nbytes)
+{
+    if (log_layout)
+        return lfs_block_write(inum, index, buffer, offset, nbytes);
+    if (snapshot_view != -1)
+        return -1;
+
+    if (snap_inode_cow(inum) == -1)
+        return -1;
+    if (SUPERBLOCK->compress && inode_table[inum].type == UFS_REGULAR_FILE)
+        return pack_block_write(inum, index, buffer, offset, nbytes);
+    if (SUPERBLOCK->dedup && inode_table[inum].type == UFS_REGULAR_FILE)
+        return dedup_block_write(inum, index, buffer, offset, nbytes);
+    return raw_block_write(inum, index, buffer, offset, nbytes);
+}
+
+// block_write of the classic layout, in place unless a snapshot holds the
+// block. index must not hold a fragment
+int raw_block_write(int inum, int index, const char *buffer, int offset, int nbytes)
+{
+    inode_t *inode = &inode_table[inum];
+    int old = inode->direct[index];
+    int fresh = old == -1 || snap_holds(old);
+    if (fresh)
+    {
+        int block = data_alloc(block_goal(inum, index));
+        if (block == -1)
+        {
+            thread_stats.data_alloc_failures++;
+            return -1;
+        }
+        inode->direct[index] = block;
+    }
+
+    int rc;
+    TRACE_BEGIN(TRACE_DATA, inum);
+    if (fresh && nbytes < UFS_BLOCK_SIZE)
+    {
+        char block[UFS_BLOCK_SIZE];
+        if (old == -1)
+            memset(block, 0, UFS_BLOCK_SIZE);
+        else
+            memcpy(block, block_data(old), UFS_BLOCK_SIZE);
+        memcpy(block + offset, buffer, nbytes);
+        rc = pwrite(fd, block, UFS_BLOCK_SIZE, (off_t)inode->direct[index] * UFS_BLOCK_SIZE) == UFS_BLOCK_SIZE;
+    }
+    else
+        rc = pwrite(fd, buffer, nbytes, (off_t)inode->direct[index] * UFS_BLOCK_SIZE + offset) == nbytes;
+    TRACE_END(TRACE_DATA, inum);
+
+    if (!rc)
+    {
+        if (fresh)
+        {
+            data_release(inode->direct[index]);
+            inode->direct[index] = old;
+        }
+        return -1;
+    }
+    // the snapshot keeps the old block
+    if (fresh && old != -1)
+        data_release(old);
+    return 0;
+}
+
+// copy block from to block to of the image, in the kernel where it can
+int copy_block(unsigned int from, unsigned int to)
+{
+    off_t in = (off_t)from * UFS_BLOCK_SIZE;
+    off_t out = (off_t)to * UFS_BLOCK_SIZE;
+    int done = 0;
+    while (done < UFS_BLOCK_SIZE)
+    {
+        ssize_t n = copy_file_range(fd, &in, fd, &out, UFS_BLOCK_SIZE - done, 0);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    // e.g. a kernel without copy_file_range
+    if (done < UFS_BLOCK_SIZE &&
+        pwrite(fd, block_data(from) + done, UFS_BLOCK_SIZE - done, (off_t)to * UFS_BLOCK_SIZE + done) != UFS_BLOCK_SIZE - done)
+        return -1;
+    return 0;
+}
+
+/**
+ * make block index of inum a copy of ptr, a block of another regular file:
+ * on deduplicated images the same block, for a fragment its compressed
+ * bytes, for a raw block a copy made without reading it in. the caller
+ * marks inum dirty. return -1 if failed, 0 otherwise
+ */
+int block_copy(int inum, int index, unsigned int ptr)
+{
+    if (log_layout || snapshot_view != -1)
+    {
+        char block[UFS_BLOCK_SIZE];
+        memcpy(block, block_data(ptr), UFS_BLOCK_SIZE);
+        return block_write(inum, index, block, 0, UFS_BLOCK_SIZE);
+    }
+
+    if (snap_inode_cow(inum) == -1)
+        return -1;
+    if (is_packed(ptr))
+        return pack_block_copy(inum, index, ptr);
+    if (dedup_refs != NULL && dedup_refs[ptr - SUPERBLOCK->data_region_addr] != 0)
+        return dedup_block_share(inum, index, ptr);
+
+    // over the old block, as raw_block_write would, if nothing else needs it
+    unsigned int old = inode_table[inum].direct[index];
+    int fresh = (int)old == -1 || is_packed(old) || snap_holds(old) || dedup_refs != NULL;
+    int block = fresh ? data_alloc(block_goal(inum, index)) : (int)old;
+    if (block == -1)
+    {
+        thread_stats.data_alloc_failures++;
+        return -1;
+    }
+    TRACE_BEGIN(TRACE_DATA, inum);
+    int rc = copy_block(ptr, block);
+    TRACE_END(TRACE_DATA, inum);
+    if (rc == -1)
+    {
+        if (fresh)
+            data_release(block);
+        return -1;
+    }
+    inode_table[inum].direct[index] = block;
+    if (fresh && (int)old != -1)
+        data_free(old);
+    return 0;
+}
+
+// sharded namespaces (server -K). clients know an inode by the image's
+// shard in the bits from MFS_SHARD_SHIFT up and its number in the image
+// below; the handlers know inodes of other shards by that with UFS_REMOTE
+// set, which is what directory entries naming them hold. such a number is
+// never an inode of this image, so the handlers refuse to work on it
+
+// the number clients know inum by
+int shard_global(int inum)
+{
+    if (inum < 0)
+        return inum;
+    if (inum & UFS_REMOTE)
+        return inum & ~UFS_REMOTE;
+    return SUPERBLOCK->shard << MFS_SHARD_SHIFT | inum;
+}
+
+// the number the handlers know a client's inum by
+int shard_local(int inum)
+{
+    if (inum < 0)
+        return inum;
+    if (inum >> MFS_SHARD_SHIFT == SUPERBLOCK->shard)
+        return inum & ((1 << MFS_SHARD_SHIFT) - 1);
+    return inum | UFS_REMOTE;
+}
+
+/**
+ * look for name in directory dir, return its inode number and where its
+ * entry is (direct[] slot and entry in the block), or -1 if it is not there
+ */
+int dir_find(inode_t *dir, char *name, int *slot, int *entry)
+{
+    for (int i = 0; i < DIRECT_PTRS; i++)
+    {
+        if ((int)dir->direct[i] == -1)
+            continue;
+        dir_block_t *block = (dir_block_t *)block_data(dir->direct[i]);
+        for (int j = 0; j < 128; j++)
+        {
+            if (block->entries[j].inum == -1)
+                continue;
+            if (strcmp(name, block->entries[j].name) == 0)
+            {
+                if (slot != NULL)
+                {
+                    *slot = i;
+                    *entry = j;
+                }
+                return block->entries[j].inum;
+            }
+        }
+    }
+    return -1;
+}
+
+/**
+ * find the first free entry of directory dir: in one of its blocks, or the
+ * first slot without one (entry is then -1, the slot needs a new block).
+ * return -1 if dir is full, 0 otherwise
+ */
+int dir_free_entry(inode_t *dir, int *slot, int *entry)
+{
+    for (int i = 0; i < DIRECT_PTRS; i++)
+    {
+        *slot = i;
+        *entry = -1;
+        if ((int)dir->direct[i] == -1)
+            return 0;
+        dir_block_t *block = (dir_block_t *)block_data(dir->direct[i]);
+        for (int j = 0; j < 128; j++)
+        {
+            if (block->entries[j].inum == -1)
+            {
+                *entry = j;
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+// write the entry name -> inum into the free entry of pinum dir_free_entry found
+int dir_add(int pinum, int slot, int entry, char *name, int inum)
+{
+    if (entry == -1)
+    {
+        dir_block_t block;
+        strcpy(block.entries[0].name, name);
+        block.entries[0].inum = inum;
+        for (int m = 1; m < 128; m++)
+        {
+            block.entries[m].inum = -1;
+        }
+        return block_write(pinum, slot, (char *)&block, 0, UFS_BLOCK_SIZE);
+    }
+    dir_ent_t newEntry;
+    memset(&newEntry, 0, sizeof(newEntry));
+    strcpy(newEntry.name, name);
+    newEntry.inum = inum;
+    return block_write(pinum, slot, (char *)&newEntry, entry * sizeof(dir_ent_t), sizeof(dir_ent_t));
+}
+
+// point the entry at slot/entry of pinum at inum, -1 to remove it
+int dir_set(int pinum, int slot, int entry, int inum)
+{
+    dir_ent_t e = ((dir_block_t *)block_data(inode_get(pinum)->direct[slot]))->entries[entry];
+    e.inum = inum;
+    return block_write(pinum, slot, (char *)&e, entry * sizeof(dir_ent_t), sizeof(dir_ent_t));
+}
+
+// a directory with nothing in it but . and ..
+int dir_empty(inode_t *dir)
+{
+    dir_block_t *block = (dir_block_t *)block_data(dir->direct[0]);
+    for (int j = 2; j < 128; j++)
+    {
+        if (block->entries[j].inum != -1)
+            return 0;
+    }
+
+    for (int i = 1; i < DIRECT_PTRS; i++)
+    {
+        if ((int)dir->direct[i] != -1)
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * lookup in directory of pinum for file with name, return -1 if failed,
+ * return inode number otherwise
+ */
+int server_Lookup(int pinum, char *name)
+{
+    inode_t *pinode = inode_get(pinum);
+    if (pinode == NULL || pinode->type != UFS_DIRECTORY)
+        return -1;
+
+    TRACE_BEGIN(TRACE_DIRSCAN, pinum);
+    int inum = dir_find(pinode, name, NULL, NULL);
+    TRACE_END(TRACE_DIRSCAN, pinum);
+    return inum;
+}
+
+int server_Stat(const int inum, MFS_Stat_t *m)
+{
+    inode_t *target = inode_get(inum);
+    if (target == NULL)
+        return -1;
+
+    m->type = target->type;
+    m->size = target->size;
+    return 0;
+}
+
+int server_Write(int inum, char *buffer, int offset, int nbytes)
+{
+    if (nbytes > 4096 || nbytes < 0 || offset < 0)
+        return -1;
+    inode_t *target = inode_get(inum);
+    if (target == NULL || target->type != UFS_REGULAR_FILE)
+        return -1;
+
+    int directNum = offset / UFS_BLOCK_SIZE;
+    int inBlockOffset = offset % UFS_BLOCK_SIZE;
+
+    if (directNum > 29)
+        return -1;
+    if (directNum == 29 && (inBlockOffset + nbytes) > UFS_BLOCK_SIZE)
+        return -1;
+
+    // the part in the first block, then whatever straddles into the next
+    int first = UFS_BLOCK_SIZE - inBlockOffset;
+    if (first > nbytes)
+        first = nbytes;
+    if (block_write(inum, directNum, buffer, inBlockOffset, first) == -1)
+        return -1;
+    if (nbytes > first && block_write(inum, directNum + 1, buffer + first, 0, nbytes - first) == -1)
+        return -1;
+
+    if (offset + nbytes > target->size)
+        target->size = offset + nbytes;
+    inode_dirty(inum);
+    commit();
+    return 0;
+}
+
+/**
+ * cut inum down, or extend it, to size bytes. blocks wholly past size are
+ * freed and the rest of the last one is zeroed, so whatever the file grows
+ * back into reads as zeros. return -1 if failed, 0 otherwise
+ */
+int server_Truncate(int inum, int size)
+{
+    if (size < 0 || size > DIRECT_PTRS * UFS_BLOCK_SIZE || snapshot_view != -1)
+        return -1;
+    inode_t *target = inode_get(inum);
+    if (target == NULL || target->type != UFS_REGULAR_FILE)
+        return -1;
+
+    if (snap_inode_cow(inum) == -1)
+        return -1;
+    int last = size / UFS_BLOCK_SIZE;
+    int tail = size % UFS_BLOCK_SIZE;
+    if (tail != 0 && size < target->size && (int)target->direct[last] != -1)
+    {
+        char zeros[UFS_BLOCK_SIZE];
+        memset(zeros, 0, UFS_BLOCK_SIZE - tail);
+        if (block_write(inum, last, zeros, tail, UFS_BLOCK_SIZE - tail) == -1)
+            return -1;
+    }
+    for (int i = (size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE; i < DIRECT_PTRS; i++)
+    {
+        if (block_free(inum, i) == -1)
+            return -1;
+    }
+
+    target->size = size;
+    inode_dirty(inum);
+    commit();
+    return 0;
+}
+
+// what a hole in a file reads as
+static char zero_block[UFS_BLOCK_SIZE];
+
+/**
+ * resolve a read of nbytes at offset in inum to at most two iovecs pointing
+ * straight into the mapped image (two when the range straddles a block),
+ * return -1 if failed, 0 otherwise. blocks a regular file does not have
+ * read as zeros
+ */
+int server_ReadMap(const int inum, int offset, int nbytes, struct iovec *iov, int *iovcnt)
+{
+    if (nbytes > 4096 || nbytes < 0 || offset < 0)
+        return -1;
+    inode_t *target = inode_get(inum);
+    if (target == NULL || target->type == UFS_STRIPED)
+        return -1;
+
+    int directNum = offset / UFS_BLOCK_SIZE;
+    int inBlockOffset = offset % UFS_BLOCK_SIZE;
+
+    if (directNum > 29)
+    {
+        return -1;
+    }
+
+    int targetBlock = target->direct[directNum];
+
+    if (target->type == UFS_DIRECTORY)
+    {
+        if (inBlockOffset % sizeof(dir_ent_t) != 0 || nbytes != sizeof(dir_ent_t))
+        {
+            return -1;
+        }
+    }
+
+    int sparse = target->type == UFS_REGULAR_FILE;
+
+    if (inBlockOffset + nbytes <= UFS_BLOCK_SIZE)
+    {
+        if (targetBlock == -1 && !sparse)
+        {
+            return -1;
+        }
+
+        char *data = targetBlock == -1 ? zero_block : file_block(targetBlock);
+        if (data == NULL)
+            return -1;
+        iov[0].iov_base = data + inBlockOffset;
+        iov[0].iov_len = nbytes;
+        *iovcnt = 1;
+    }
+    else
+    {
+        if (directNum == 29)
+        {
+            return -1;
+        }
+
+        int nextBlock = target->direct[directNum + 1];
+
+        if ((targetBlock == -1 || nextBlock == -1) && !sparse)
+        {
+            return -1;
+        }
+
+        char *first = targetBlock == -1 ? zero_block : file_block(targetBlock);
+        char *second = nextBlock == -1 ? zero_block : file_block(nextBlock);
+        if (first == NULL || second == NULL)
+            return -1;
+        iov[0].iov_base = first + inBlockOffset;
+        iov[0].iov_len = UFS_BLOCK_SIZE - inBlockOffset;
+        iov[1].iov_base = second;
+        iov[1].iov_len = inBlockOffset + nbytes - UFS_BLOCK_SIZE;
+        *iovcnt = 2;
+    }
+    return 0;
+}
+
+int server_Read(const int inum, char *buffer, int offset, int nbytes)
+{
+    struct iovec iov[2];
+    int iovcnt;
+    if (server_ReadMap(inum, offset, nbytes, iov, &iovcnt) != 0)
+        return -1;
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        memcpy(buffer, iov[i].iov_base, iov[i].iov_len);
+        buffer += iov[i].iov_len;
+    }
+    return 0;
+}
+
+// give new directory inum its first block, with . and .. (pinum) in it
+int dir_init(int inum, int pinum)
+{
+    dir_block_t block;
+    block.entries[0].inum = inum;
+    strcpy(block.entries[0].name, ".");
+    block.entries[1].inum = pinum;
+    strcpy(block.entries[1].name, "..");
+    for (int a = 2; a < 128; a++)
+    {
+        block.entries[a].inum = -1;
+    }
+    if (block_write(inum, 0, (char *)&block, 0, UFS_BLOCK_SIZE) == -1)
+        return -1;
+    inode_table[inum].size = 2 * sizeof(dir_ent_t);
+    return 0;
+}
+
+/**
+ * server_Create under pinum of another shard: an inode with no entry here,
+ * which the client then names there with MFS_LINK, or gives back with
+ * server_Release if that fails. return -1 if failed, inode number otherwise
+ */
+static int create_remote(int pinum, int type)
+{
+    int inum = inode_alloc(type, 0);
+    if (inum == -1)
+        return -1;
+    if (type == MFS_DIRECTORY && dir_init(inum, pinum) == -1)
+    {
+        inode_free(inum);
+        return -1;
+    }
+    inode_dirty(inum);
+    commit();
+    return inum;
+}
+
+int server_Create(int pinum, int type, char *name)
+{
+    if (pinum >= 0 && (pinum & UFS_REMOTE))
+        return create_remote(pinum, type);
+    inode_t *pinode = inode_get(pinum);
+    if (pinode == NULL || pinode->type != UFS_DIRECTORY)
+        return -1;
+    if (strlen(name) > 28 || strlen(name) < 1)
+        return -1;
+
+    TRACE_BEGIN(TRACE_DIRSCAN, pinum);
+    int existing = dir_find(pinode, name, NULL, NULL);
+    int slot = -1;
+    int entry = -1;
+    if (existing == -1 && dir_free_entry(pinode, &slot, &entry) == -1)
+        slot = -1;
+    TRACE_END(TRACE_DIRSCAN, pinum);
+    if (existing != -1)
+        return existing;
+    if (slot == -1)
+        return -1;
+
+    int inum = inode_alloc(type, pinum);
+    if (inum == -1)
+        return -1;
+
+    if (type == MFS_DIRECTORY && dir_init(inum, pinum) == -1)
+    {
+        inode_free(inum);
+        return -1;
+    }
+
+    if (dir_add(pinum, slot, entry, name, inum) == -1)
+    {
+        inode_free(inum);
+        return -1;
+    }
+
+    pinode->size += sizeof(dir_ent_t);
+    inode_dirty(pinum);
+    inode_dirty(inum);
+    commit();
+    return inum;
+}
+
+int server_Unlink(int pinum, char *name)
+{
+    inode_t *pinode = inode_get(pinum);
+    if (pinode == NULL)
+        return -1;
+    if (strlen(name) > 28 || strlen(name) < 1)
+        return 0;
+    if (pinode->type != UFS_DIRECTORY)
+        return -1;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return -1;
+
+    int slot;
+    int entry;
+    TRACE_BEGIN(TRACE_DIRSCAN, pinum);
+    int inum = dir_find(pinode, name, &slot, &entry);
+    TRACE_END(TRACE_DIRSCAN, pinum);
+    if (inum == -1)
+        return 0;
+
+    inode_t *target = inode_get(inum);
+    if (target != NULL && target->type == UFS_DIRECTORY && !dir_empty(target))
+        return -1;
+    // saved for snapshots now, so freeing it below cannot fail
+    if (target != NULL && snap_inode_cow(inum) == -1)
+        return -1;
+
+    if (dir_set(pinum, slot, entry, -1) == -1)
+        return -1;
+    if (target != NULL)
+        inode_free(inum);
+
+    pinode->size -= sizeof(dir_ent_t);
+    inode_dirty(pinum);
+    commit();
+    return 0;
+}
+
+/**
+ * copy nbytes at offset of inum to doffset of dinum, both regular files.
+ * blocks that line up whole are copied with block_copy, holes stay holes,
+ * and only the bytes at the edges go through a buffer, all in one commit.
+ * a range past the end of inum is cut short there, as is one at a block
+ * that cannot be written: what was copied before it stays, committed.
+ * return -1 if failed with nothing copied, the bytes copied otherwise
+ */
+int server_Copy(int inum, int offset, int dinum, int doffset, int nbytes)
+{
+    inode_t *src = inode_get(inum);
+    inode_t *dst = inode_get(dinum);
+    if (src == NULL || dst == NULL || src->type != UFS_REGULAR_FILE || dst->type != UFS_REGULAR_FILE)
+        return -1;
+    if (offset < 0 || doffset < 0 || nbytes < 0 || snapshot_view != -1)
+        return -1;
+    if (nbytes > src->size - offset)
+        nbytes = src->size > offset ? src->size - offset : 0;
+    if (doffset > DIRECT_PTRS * UFS_BLOCK_SIZE - nbytes)
+        return -1;
+    if (inum == dinum && nbytes > 0 && offset < doffset + nbytes && doffset < offset + nbytes)
+        return -1;
+
+    if (snap_inode_cow(dinum) == -1)
+        return -1;
+    int done = 0;
+    int failed = 0;
+    while (done < nbytes)
+    {
+        int from = offset + done;
+        int to = doffset + done;
+        int inBlockOffset = to % UFS_BLOCK_SIZE;
+        int len = UFS_BLOCK_SIZE - inBlockOffset < nbytes - done ? UFS_BLOCK_SIZE - inBlockOffset : nbytes - done;
+        int rc = 0;
+        if (len == UFS_BLOCK_SIZE && from % UFS_BLOCK_SIZE == 0)
+        {
+            unsigned int ptr = src->direct[from / UFS_BLOCK_SIZE];
+            if ((int)ptr == -1)
+                rc = block_free(dinum, to / UFS_BLOCK_SIZE);
+            else
+                rc = block_copy(dinum, to / UFS_BLOCK_SIZE, ptr);
+        }
+        else
+        {
+            char buffer[UFS_BLOCK_SIZE];
+            rc = server_Read(inum, buffer, from, len);
+            if (rc == 0)
+                rc = block_write(dinum, to / UFS_BLOCK_SIZE, buffer, inBlockOffset, len);
+        }
+        if (rc == -1)
+        {
+            failed = 1;
+            break;
+        }
+        done += len;
+    }
+
+    if ((!failed || done > 0) && doffset + done > dst->size)
+        dst->size = doffset + done;
+    inode_dirty(dinum);
+    commit();
+    return failed && done == 0 ? -1 : done;
+}
+
+/**
+ * move name in pinum to newname in newpinum, replacing what is there unless
+ * that is a directory with something in it, or a file where name is a
+ * directory, or the other way round. only the directory entries change,
+ * with a single commit, so it costs the same for any file size. return -1
+ * if failed, 0 otherwise
+ */
+int server_Rename(int pinum, char *name, int newpinum, char *newname)
+{
+    inode_t *pinode = inode_get(pinum);
+    inode_t *newpinode = inode_get(newpinum);
+    if (pinode == NULL || pinode->type != UFS_DIRECTORY || newpinode == NULL || newpinode->type != UFS_DIRECTORY)
+        return -1;
+    if (strlen(name) > 28 || strlen(name) < 1 || strlen(newname) > 28 || strlen(newname) < 1)
+        return -1;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strcmp(newname, ".") == 0 || strcmp(newname, "..") == 0)
+        return -1;
+
+    int slot, entry, newslot, newentry;
+    TRACE_BEGIN(TRACE_DIRSCAN, pinum);
+    int inum = dir_find(pinode, name, &slot, &entry);
+    int victim = dir_find(newpinode, newname, &newslot, &newentry);
+    TRACE_END(TRACE_DIRSCAN, pinum);
+    if (inum == -1)
+        return -1;
+    if (victim == inum)
+        return 0;
+
+    // an entry for another shard's inode is only renamed in its directory,
+    // and never over one: what it is, and its .., are on the other shard
+    inode_t *target = inode_get(inum);
+    if (target == NULL && (newpinum != pinum || victim != -1))
+        return -1;
+    if (victim != -1)
+    {
+        inode_t *old = inode_get(victim);
+        if (old == NULL || old->type != target->type || (old->type == UFS_DIRECTORY && !dir_empty(old)))
+            return -1;
+    }
+    // a directory can not move into itself or below, as far as this shard
+    // can tell
+    if (target != NULL && target->type == UFS_DIRECTORY && newpinum != pinum)
+    {
+        for (int up = newpinum, n = 0; up != 0 && !(up & UFS_REMOTE); n++)
+        {
+            if (up == inum || n == SUPERBLOCK->num_inodes)
+                return -1;
+            up = dir_find(inode_get(up), "..", NULL, NULL);
+        }
+    }
+
+    // the victim is saved for snapshots now, so freeing it cannot fail once
+    // the entries have moved
+    if (victim != -1 && snap_inode_cow(victim) == -1)
+        return -1;
+
+    // newname first, so a failure part way leaves name where it was
+    batch_depth++;
+    int moved = target != NULL && target->type == UFS_DIRECTORY && newpinum != pinum;
+    int added = 0;
+    int rc;
+    if (victim != -1)
+        rc = dir_set(newpinum, newslot, newentry, inum);
+    else
+    {
+        rc = dir_free_entry(newpinode, &newslot, &newentry);
+        if (rc == 0)
+            rc = dir_add(newpinum, newslot, newentry, newname, inum);
+        if (newentry == -1)
+            newentry = 0;
+        added = rc == 0;
+    }
+    int linked = rc == 0;
+    if (rc == 0 && moved)
+        rc = dir_set(inum, 0, 1, newpinum);
+    int reparented = rc == 0 && moved;
+    if (rc == 0)
+        rc = dir_set(pinum, slot, entry, -1);
+
+    if (rc == -1)
+    {
+        if (reparented)
+            dir_set(inum, 0, 1, pinum);
+        if (linked)
+            dir_set(newpinum, newslot, newentry, victim);
+    }
+    else
+    {
+        if (added)
+        {
+            newpinode->size += sizeof(dir_ent_t);
+            inode_dirty(newpinum);
+        }
+        pinode->size -= sizeof(dir_ent_t);
+        inode_dirty(pinum);
+        if (victim != -1)
+            inode_free(victim);
+    }
+    batch_depth--;
+
+    commit();
+    return rc;
+}
+
+/**
+ * name inum, an inode of another shard that create_remote made there, name
+ * in pinum. return -1 if failed (name is taken by anything else), 0 otherwise
+ */
+int server_Link(int pinum, char *name, int inum)
+{
+    inode_t *pinode = inode_get(pinum);
+    if (pinode == NULL || pinode->type != UFS_DIRECTORY || inum < 0 || !(inum & UFS_REMOTE))
+        return -1;
+    if (strlen(name) > 28 || strlen(name) < 1)
+        return -1;
+
+    int slot = 0, entry = -1;
+    TRACE_BEGIN(TRACE_DIRSCAN, pinum);
+    int existing = dir_find(pinode, name, NULL, NULL);
+    if (existing == -1 && dir_free_entry(pinode, &slot, &entry) == -1)
+        existing = -2;
+    TRACE_END(TRACE_DIRSCAN, pinum);
+    // a retransmitted link finds itself done
+    if (existing != -1)
+        return existing == inum ? 0 : -1;
+
+    if (dir_add(pinum, slot, entry, name, inum) == -1)
+        return -1;
+    pinode->size += sizeof(dir_ent_t);
+    inode_dirty(pinum);
+    commit();
+    return 0;
+}
+
+/**
+ * free inum, whose entry is in a directory of another shard, unless it is a
+ * directory with something in it. nothing here checks that no directory of
+ * this shard names it. return -1 if failed, 0 otherwise, also if inum is
+ * already free
+ */
+int server_Release(int inum)
+{
+    if (inum == 0 || snapshot_view != -1)
+        return -1;
+    inode_t *target = inode_get(inum);
+    if (target == NULL)
+        return 0;
+    if (target->type == UFS_DIRECTORY && !dir_empty(target))
+        return -1;
+    if (inode_free(inum) == -1)
+        return -1;
+    commit();
+    return 0;
+}
+
+/**
+ * make inum, an empty regular file, striped as layout says, size bytes long;
+ * if it already is, with the same layout, only raise its size to size. the
+ * layout goes in its block 0, which a striped file has for nothing else.
+ * return -1 if failed, 0 otherwise
+ */
+int server_Stripe(int inum, int size, stripe_layout_t *layout)
+{
+    if (size < 0 || snapshot_view != -1)
+        return -1;
+    if (layout->unit < UFS_BLOCK_SIZE || layout->unit % UFS_BLOCK_SIZE != 0 || layout->count < 1 ||
+        layout->count > UFS_MAX_STRIPES)
+        return -1;
+    inode_t *target = inode_get(inum);
+    if (target == NULL)
+        return -1;
+
+    int len = offsetof(stripe_layout_t, inums) + layout->count * sizeof(int);
+    if (target->type == UFS_STRIPED)
+    {
+        if (memcmp(block_data(target->direct[0]), layout, len) != 0)
+            return -1;
+        if (size <= target->size)
+            return 0;
+        if (snap_inode_cow(inum) == -1)
+            return -1;
+        target->size = size;
+        inode_dirty(inum);
+        commit();
+        return 0;
+    }
+
+    if (target->type != UFS_REGULAR_FILE || target->size != 0)
+        return -1;
+    for (int i = 0; i < DIRECT_PTRS; i++)
+    {
+        if ((int)target->direct[i] != -1)
+            return -1;
+    }
+    // the type changes first, so the block is not compressed or shared
+    if (snap_inode_cow(inum) == -1)
+        return -1;
+    target->type = UFS_STRIPED;
+    if (block_write(inum, 0, (char *)layout, 0, len) == -1)
+    {
+        target->type = UFS_REGULAR_FILE;
+        return -1;
+    }
+    target->size = size;
+    inode_dirty(inum);
+    commit();
+    return 0;
+}
+
+// the layout and stat of striped file inum, return -1 if it is not one
+int server_Layout(int inum, stripe_layout_t *layout, MFS_Stat_t *m)
+{
+    inode_t *target = inode_get(inum);
+    if (target == NULL || target->type != UFS_STRIPED)
+        return -1;
+    stripe_layout_t *have = (stripe_layout_t *)block_data(target->direct[0]);
+    if (have->count < 1 || have->count > UFS_MAX_STRIPES)
+        return -1;
+    memcpy(layout, have, offsetof(stripe_layout_t, inums) + have->count * sizeof(int));
+    m->type = target->type;
+    m->size = target->size;
+    return 0;
+}
+
+/**
+ * create name in pinum (or find it, like server_Create) and write its first
+ * nbytes, with a single commit for both. a file this call created is removed
+ * again if the write fails. return -1 if failed, inode number otherwise
+ */
+int server_CreateWrite(int pinum, int type, char *name, char *buffer, int nbytes)
+{
+    if (nbytes < 0 || nbytes > UFS_BLOCK_SIZE || (type != UFS_REGULAR_FILE && nbytes > 0))
+        return -1;
+    int existed = server_Lookup(pinum, name) != -1;
+
+    batch_depth++;
+    int inum = server_Create(pinum, type, name);
+    if (inum != -1 && nbytes > 0 && server_Write(inum, buffer, 0, nbytes) == -1)
+    {
+        // under another shard's directory there is no name here to unlink,
+        // only the inode create_remote made for it
+        if (pinum >= 0 && (pinum & UFS_REMOTE))
+            inode_free(inum);
+        else if (!existed)
+            server_Unlink(pinum, name);
+        inum = -1;
+    }
+    batch_depth--;
+
+    commit();
+    return inum;
+}
+
+// move the len blocks at from, everything the image has after its data
+// region, to to, and point the super block at them there. the copy is
+// durable before the super block changes, so a crash leaves the image
+// using one copy or the other, as long as the two do not overlap
+static int tail_move(int from, int to, int len)
+{
+    if (to + len > image_size / UFS_BLOCK_SIZE && image_resize(to + len) != 0)
+        return -1;
+    memcpy(block_data(to), block_data(from), (long)len * UFS_BLOCK_SIZE);
+    if (fsync(fd) != 0)
+        return -1;
+    int delta = to - from;
+    SUPERBLOCK->snapshot_addr += delta;
+    if (SUPERBLOCK->dedup)
+    {
+        SUPERBLOCK->dedup_refs_addr += delta;
+        SUPERBLOCK->dedup_index_addr += delta;
+    }
+    if (fsync(fd) != 0)
+        return -1;
+    dedup_map();
+    return 0;
+}
+
+/**
+ * grow the image to num_inodes inodes and num_data data blocks while it is
+ * served, within the room mkfs -I and -M left for the bitmaps and the
+ * inode table. the data region takes the place of the snapshot slots and
+ * dedup tables after it, which move up; nothing in the image is rewritten
+ * but those and the super block, and the new blocks and inodes are free
+ * already, being past the end of the bitmaps. images with groups gain
+ * groups, with at most group_inodes inodes each. a server serving a
+ * snapshot of the image has to be restarted after. return -1 if failed,
+ * 0 otherwise
+ */
+int server_Grow(int num_inodes, int num_data)
+{
+    if (log_layout || snapshot_view != -1)
+        return -1;
+    super_t *s = SUPERBLOCK;
+    int bits_per_block = 8 * UFS_BLOCK_SIZE;
+    if (num_inodes < s->num_inodes || num_data < s->num_data ||
+        num_inodes > s->inode_bitmap_len * bits_per_block ||
+        num_inodes > s->inode_region_len * (int)(UFS_BLOCK_SIZE / sizeof(inode_t)) ||
+        num_data > s->data_bitmap_len * bits_per_block)
+        return -1;
+    if (s->dedup && (num_data > s->dedup_refs_len * (int)(UFS_BLOCK_SIZE / sizeof(unsigned int)) ||
+                     num_data > s->dedup_index_slots / 2))
+        return -1;
+    int old_inodes = s->num_inodes;
+    int old_data = s->num_data;
+    int tail = s->data_region_addr + old_data;
+    int tail_len = image_size / UFS_BLOCK_SIZE - tail;
+    int added = num_data - old_data;
+    if (s->compress && tail + tail_len + added > PACK_MAX_BLOCK)
+        return -1;
+    int new_groups = s->groups;
+    if (s->groups > 0)
+    {
+        new_groups = (num_data + s->group_blocks - 1) / s->group_blocks;
+        if (num_inodes > new_groups * s->group_inodes)
+            return -1;
+    }
+
+    int end = s->data_region_addr + num_data;
+    if (added > 0 && tail_len > 0)
+    {
+        // where the new place overlaps the old, by way of a place past both
+        if (added < tail_len)
+        {
+            if (tail_move(tail, tail + added + tail_len, tail_len) != 0)
+                return -1;
+            tail += added + tail_len;
+        }
+        if (tail_move(tail, end, tail_len) != 0)
+            return -1;
+    }
+    if (image_resize(end + tail_len) != 0)
+        return -1;
+    // the new data blocks still hold what the tail left there
+    if (added > 0)
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)(end - added) * UFS_BLOCK_SIZE,
+                  (off_t)added * UFS_BLOCK_SIZE);
+
+    s = SUPERBLOCK;
+    s->num_inodes = num_inodes;
+    s->num_data = num_data;
+    s->data_region_len = num_data;
+    s->groups = new_groups;
+    if (fsync(fd) != 0)
+        return -1;
+    groups_grow(old_inodes, old_data);
+    return 0;
+}
+
+int server_Shutdown()
+{
+    if (snapshot_view != -1)
+    {
+        close(fd);
+        return 0;
+    }
+    if (log_layout)
+    {
+        int rc = lfs_Close();
+        close(fd);
+        return rc;
+    }
+
+    bitmap_t *inodeBitMap = (bitmap_t *)(image + SUPERBLOCK->inode_bitmap_addr * UFS_BLOCK_SIZE);
+    int rc = pwrite(fd, inodeBitMap, SUPERBLOCK->inode_bitmap_len * UFS_BLOCK_SIZE, SUPERBLOCK->inode_bitmap_addr * UFS_BLOCK_SIZE);
+    assert(rc == SUPERBLOCK->inode_bitmap_len * UFS_BLOCK_SIZE);
+
+    bitmap_t *dataBitMap = (bitmap_t *)(image + SUPERBLOCK->data_bitmap_addr * UFS_BLOCK_SIZE);
+    rc = pwrite(fd, dataBitMap, SUPERBLOCK->data_bitmap_len * UFS_BLOCK_SIZE, SUPERBLOCK->data_bitmap_addr * UFS_BLOCK_SIZE);
+    assert(rc == SUPERBLOCK->data_bitmap_len * UFS_BLOCK_SIZE);
+    int ret = fsync(fd);
+    close(fd);
+
+    if (ret < 0)
+    {
+        return -1;
+    }
+    else
+    {
+        return 0;
+    }
+}
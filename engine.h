@@ -0,0 +1,210 @@
+#ifndef __engine_h__
+#define __engine_h__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "ufs.h"
+#include "mfs.h"
+
+// the storage engine: the server_* handlers over an image file that is
+// both mmap'd and accessed through fd. engine_Open sets up the globals
+// below, so the server and the benchmarks can call the handlers directly
+
+typedef struct
+{
+    dir_ent_t entries[128];
+} dir_block_t;
+
+typedef struct
+{
+    inode_t inodes[UFS_BLOCK_SIZE / sizeof(inode_t)];
+} inode_block;
+
+typedef struct
+{
+    unsigned int bits[UFS_BLOCK_SIZE / sizeof(unsigned int)];
+} bitmap_t;
+
+extern void *image;
+extern long image_size;
+extern int fd;
+extern super_t *SUPERBLOCK;
+extern inode_t *root_inode;
+extern dir_ent_t *root_dir;
+extern unsigned int *inodeMap;
+extern unsigned int *dataMap;
+extern inode_t *inode_table;
+extern int *data_table;
+
+// while > 0, commit() does nothing: a compound request commits once at its end
+extern int batch_depth;
+
+// the image is in the log layout (mkfs -l): inode_table and inodeMap are
+// then in memory, built from the log by lfs_Open, and dataMap is unused
+extern int log_layout;
+
+#ifdef ENGINE_COUNT_SYSCALLS
+// lseek/read/write/pwrite/fsync/fallocate/copy_file_range calls made by the
+// engine so far
+extern unsigned long long engine_syscalls;
+
+#ifdef ENGINE_INTERNAL
+// engine.c, lfs.c and snapshot.c route their I/O through the counters
+off_t counted_lseek(int fd, off_t offset, int whence);
+ssize_t counted_read(int fd, void *buf, size_t count);
+ssize_t counted_write(int fd, const void *buf, size_t count);
+ssize_t counted_pwrite(int fd, const void *buf, size_t count, off_t offset);
+int counted_fsync(int fd);
+int counted_fallocate(int fd, int mode, off_t offset, off_t len);
+ssize_t counted_copy_file_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags);
+
+#define lseek(fd, offset, whence) counted_lseek(fd, offset, whence)
+#define read(fd, buf, count) counted_read(fd, buf, count)
+#define write(fd, buf, count) counted_write(fd, buf, count)
+#define pwrite(fd, buf, count, offset) counted_pwrite(fd, buf, count, offset)
+#define fsync(fd) counted_fsync(fd)
+#define fallocate(fd, mode, offset, len) counted_fallocate(fd, mode, offset, len)
+#define copy_file_range(fd_in, off_in, fd_out, off_out, len, flags) \
+    counted_copy_file_range(fd_in, off_in, fd_out, off_out, len, flags)
+#endif
+#endif
+
+int engine_Open(char *path);
+int engine_OpenSnapshot(char *path, int id);
+void engine_Close();
+void engine_Idle();
+void commit();
+
+// classic data blocks freed for good are queued, and punched out of the
+// image file by the commit that makes freeing them durable
+#define PUNCH_MAX (256)
+extern unsigned long long blocks_punched;
+void punch_queue(unsigned int block);
+void punch_flush();
+
+// allocation groups: slices of the inodes and data blocks that new inodes
+// and blocks are kept together in. log images have one
+extern int ngroups;
+extern int group_inodes;
+extern int group_blocks;
+
+unsigned int get_bit(unsigned int *bitmap, int position);
+void set_bit(unsigned int *bitmap, int position);
+void set_bit_zero(unsigned int *bitmap, int position);
+int bit_claim(unsigned int *bitmap, int position);
+
+// the handlers get at inodes and blocks only through these, which either
+// update in place (classic layout) or append to the log (lfs.c)
+inode_t *inode_get(int inum);
+void inode_dirty(int inum);
+int inode_alloc(int type, int pinum);
+int inode_free(int inum);
+char *block_data(unsigned int block);
+int block_write(int inum, int index, const char *buffer, int offset, int nbytes);
+int block_free(int inum, int index);
+int block_copy(int inum, int index, unsigned int ptr);
+
+// classic layout blocks of files, which on compressed images may be
+// fragments of pack blocks and on deduplicated ones shared between files
+char *file_block(unsigned int ptr);
+void data_free(unsigned int ptr);
+int data_alloc(int goal);
+void data_release(unsigned int block);
+int block_goal(int inum, int index);
+int raw_block_write(int inum, int index, const char *buffer, int offset, int nbytes);
+
+// log layout, lfs.c
+typedef struct
+{
+    unsigned long long commits;
+    unsigned long long blocks_written; // summaries and inode blocks included
+    unsigned long long checkpoints;
+    unsigned long long segments_cleaned;
+    unsigned long long blocks_copied;  // live blocks the cleaner moved
+    unsigned long long rolled_forward; // commits recovered past the checkpoint
+} lfs_stats_t;
+
+extern lfs_stats_t lfs_stats;
+
+int lfs_Open();
+int lfs_Close();
+void lfs_inode_dirty(int inum);
+void lfs_inode_free(int inum);
+void lfs_block_free(int inum, int index);
+int lfs_block_write(int inum, int index, const char *buffer, int offset, int nbytes);
+void lfs_commit();
+int lfs_Clean(int segments);
+
+// snapshots of classic images, snapshot.c
+extern int snapshot_count;
+extern unsigned int *snap_busy;
+extern int snapshot_view;
+
+int snap_Open();
+void snap_Close();
+int snap_Mount(int id);
+int snap_holds(unsigned int block);
+int snap_inode_cow(int inum);
+inode_t *snap_inode_get(int inum);
+
+// compressed images, compress.c
+typedef struct
+{
+    unsigned long long packed;       // blocks written compressed
+    unsigned long long bypassed;     // blocks written raw, as they did not compress
+    unsigned long long packed_bytes; // what the compressed ones came to
+} pack_stats_t;
+
+extern pack_stats_t pack_stats;
+
+void pack_Open();
+char *pack_read(unsigned int ptr);
+void pack_release(unsigned int ptr);
+int pack_block_write(int inum, int index, const char *buffer, int offset, int nbytes);
+int pack_block_copy(int inum, int index, unsigned int ptr);
+
+// deduplicated images, dedup.c
+typedef struct
+{
+    unsigned long long shared;      // block writes that found their contents already there
+    unsigned long long written;     // ... and ones that did not
+    unsigned long long file_blocks; // blocks of files pointing into the data region
+    unsigned long long data_blocks; // data blocks they point at
+} dedup_stats_t;
+
+extern dedup_stats_t dedup_stats;
+extern unsigned int *dedup_refs;
+
+void dedup_Open();
+void dedup_map();
+unsigned int block_fingerprint(const char *data);
+void dedup_release(unsigned int block);
+int dedup_block_write(int inum, int index, const char *buffer, int offset, int nbytes);
+int dedup_block_share(int inum, int index, unsigned int ptr);
+
+int server_Snapshot();
+int server_SnapshotDelete(int id);
+
+int shard_global(int inum);
+int shard_local(int inum);
+
+int server_Lookup(int pinum, char *name);
+int server_Stat(const int inum, MFS_Stat_t *m);
+int server_Write(int inum, char *buffer, int offset, int nbytes);
+int server_Truncate(int inum, int size);
+int server_Copy(int inum, int offset, int dinum, int doffset, int nbytes);
+int server_Create(int pinum, int type, char *name);
+int server_CreateWrite(int pinum, int type, char *name, char *buffer, int nbytes);
+int server_Grow(int num_inodes, int num_data);
+int server_Shutdown();
+int server_Unlink(int pinum, char *name);
+int server_Rename(int pinum, char *name, int newpinum, char *newname);
+int server_Link(int pinum, char *name, int inum);
+int server_Release(int inum);
+int server_Stripe(int inum, int size, stripe_layout_t *layout);
+int server_Layout(int inum, stripe_layout_t *layout, MFS_Stat_t *m);
+int server_Read(const int inum, char *buffer, int offset, int nbytes);
+int server_ReadMap(const int inum, int offset, int nbytes, struct iovec *iov, int *iovcnt);
+
+#endif // __engine_h__
@@ -0,0 +1,985 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+#include "engine.h"
+#include "hist.h"
+#include "lz4.h"
+
+#define TMPFS_MAGIC (0x01021994)
+
+char *dir = "/dev/shm";
+char *mkfs = "./mkfs";
+int ops = 100000;
+int fanout = 3000;
+int json = 0;
+int printed = 0;
+
+char image_path[256];
+char names[DIRECT_PTRS * 128][32];
+char buffer[2 * UFS_BLOCK_SIZE];
+int big_dir;
+int file_inum;
+
+void usage()
+{
+    fprintf(stderr, "usage: enginebench [-d <dir>] [-m <mkfs>] [-n <ops>] [-F <entries>] [-J] [lookup|alloc|straddle|log|snapshot|compress|dedup|truncate|copy|aging|parallel|grow ...]\n"
+                    "  calls the server_* handlers in-process on fresh images made by <mkfs> (default ./mkfs)\n"
+                    "  in <dir> (default /dev/shm, which should be tmpfs), <ops> times each (default 100000),\n"
+                    "  and reports ns/op, p50/p99 and syscalls/op. without names every suite runs\n"
+                    "  lookup    server_Lookup hits and misses in a directory of <entries> (default 3000),\n"
+                    "            and server_Stat\n"
+                    "  alloc     server_Create, first-block server_Write and server_Unlink with the inode\n"
+                    "            and data bitmaps full up to their last few bits\n"
+                    "  straddle  server_Read and server_Write of a block, aligned and straddling two\n"
+                    "  log       small server_Writes at random offsets of random files, on a classic\n"
+                    "            image and on a log image (mkfs -l) small enough that the cleaner runs\n"
+                    "  snapshot  server_Snapshot and server_SnapshotDelete, and the small writes with no\n"
+                    "            snapshot, the first to each file after one is taken, and the rest\n"
+                    "  compress  lz4.c on JSON-like log lines and on random bytes, and server_Write and\n"
+                    "            server_Read of them on a plain and a compressed (mkfs -c) image, with\n"
+                    "            the data blocks each image used\n"
+                    "  dedup     server_Write and server_Read of a file written four times over and of\n"
+                    "            random bytes, on a plain and a deduplicated (mkfs -D) image\n"
+                    "  truncate  a file written to its last block and truncated to nothing, as in log\n"
+                    "            rotation, and how much of the image is on disk before and after\n"
+                    "  copy      a file of JSON-like log lines copied with server_Copy, and a block at a\n"
+                    "            time with server_Read and server_Write as a client would, on a plain, a\n"
+                    "            compressed and a deduplicated image\n"
+                    "  aging     creates, writes and unlinks of files in 32 directories until the image\n"
+                    "            has been written several times over, then every file read directory by\n"
+                    "            directory, and how far that jumps around the image, with one allocation\n"
+                    "            group (mkfs -g 1) and with eight. reads see seeks only if <dir> is on a disk\n"
+                    "  parallel  files created and given blocks by 1, 2, 4 and 8 threads at once, each in a\n"
+                    "            directory of its own, with one allocation group and with eight\n"
+                    "  grow      server_Grow by 4096 data blocks at a time on an image made with room to\n"
+                    "            (mkfs -I, -M), empty and with its data region full, and whether what\n"
+                    "            the files held is still there after\n"
+                    "  -J prints one JSON object instead of the table\n");
+    exit(1);
+}
+
+unsigned long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// make a fresh image, with extra mkfs flags, and open the engine on it
+void image_open(int inodes, int data, const char *flags)
+{
+    char cmd[512];
+    snprintf(image_path, sizeof(image_path), "%s/enginebench.%d.img", dir, getpid());
+    snprintf(cmd, sizeof(cmd), "%s -f %s -i %d -d %d %s > /dev/null", mkfs, image_path, inodes, data, flags);
+    if (system(cmd) != 0 || engine_Open(image_path) != 0)
+    {
+        fprintf(stderr, "enginebench: unable to create %s with %s\n", image_path, mkfs);
+        exit(1);
+    }
+}
+
+void image_close()
+{
+    engine_Close();
+    unlink(image_path);
+}
+
+void report(const char *name, hist_t *h, unsigned long long syscalls)
+{
+    if (json)
+    {
+        printf("%s\"%s\":{\"ops\":%llu,\"ns_per_op\":%.1f,\"p50_ns\":%llu,\"p99_ns\":%llu,\"syscalls_per_op\":%.2f}",
+               printed ? "," : "", name, h->total, (double)h->sum / h->total,
+               hist_percentile(h, 50), hist_percentile(h, 99), (double)syscalls / h->total);
+    }
+    else
+    {
+        if (!printed)
+            printf("%-26s %10s %10s %10s %12s\n", "benchmark", "ns/op", "p50", "p99", "syscalls/op");
+        printf("%-26s %10.1f %10llu %10llu %12.2f\n", name, (double)h->sum / h->total,
+               hist_percentile(h, 50), hist_percentile(h, 99), (double)syscalls / h->total);
+    }
+    printed = 1;
+}
+
+// time op(i) for i in 0..n-1, failing loudly if it does, return ns/op
+double run(const char *name, int n, int (*op)(int))
+{
+    hist_t h;
+    hist_init(&h);
+    unsigned long long syscalls = engine_syscalls;
+    for (int i = 0; i < n; i++)
+    {
+        unsigned long long start = now_ns();
+        int rc = op(i);
+        hist_record(&h, now_ns() - start);
+        if (rc < 0)
+        {
+            fprintf(stderr, "enginebench: %s failed at op %d\n", name, i);
+            exit(1);
+        }
+    }
+    report(name, &h, engine_syscalls - syscalls);
+    return (double)h.sum / h.total;
+}
+
+int lookup_last(int i)
+{
+    return server_Lookup(big_dir, names[fanout - 1]);
+}
+
+int lookup_random(int i)
+{
+    return server_Lookup(big_dir, names[(i * 7919) % fanout]);
+}
+
+int lookup_miss(int i)
+{
+    return server_Lookup(big_dir, "no-such-entry") == -1 ? 0 : -1;
+}
+
+int stat_file(int i)
+{
+    MFS_Stat_t m;
+    return server_Stat(file_inum, &m);
+}
+
+void bench_lookup()
+{
+    image_open(8192, 8192, "");
+    big_dir = server_Create(0, UFS_DIRECTORY, "big");
+    for (int i = 0; i < fanout; i++)
+    {
+        sprintf(names[i], "entry%d", i);
+        if (server_Create(big_dir, UFS_REGULAR_FILE, names[i]) < 0)
+        {
+            fprintf(stderr, "enginebench: unable to create %d entries\n", fanout);
+            exit(1);
+        }
+    }
+    file_inum = server_Lookup(big_dir, names[0]);
+
+    run("lookup last entry", ops, lookup_last);
+    run("lookup random entry", ops, lookup_random);
+    run("lookup miss", ops, lookup_miss);
+    run("stat", ops, stat_file);
+    image_close();
+}
+
+int alloc_create(int i)
+{
+    file_inum = server_Create(0, UFS_REGULAR_FILE, "victim");
+    return file_inum;
+}
+
+int alloc_write(int i)
+{
+    return server_Write(file_inum, buffer, 0, UFS_BLOCK_SIZE);
+}
+
+int alloc_unlink(int i)
+{
+    return server_Unlink(0, "victim");
+}
+
+// fill a bitmap of n bits up to its last slack ones
+void fill_bitmap(unsigned int *bitmap, int n, int slack)
+{
+    for (int i = 0; i < n - slack; i++)
+        set_bit(bitmap, i);
+}
+
+void bench_alloc()
+{
+    // one bitmap block each, so the scans cover 32768 bits
+    int bits = 8 * UFS_BLOCK_SIZE;
+    image_open(bits, bits, "");
+    fill_bitmap(inodeMap, bits, 4);
+    fill_bitmap(dataMap, bits, 4);
+
+    // the three steps are timed separately but have to run in turn
+    hist_t h[3];
+    unsigned long long syscalls[3] = {0, 0, 0};
+    int (*steps[3])(int) = {alloc_create, alloc_write, alloc_unlink};
+    for (int s = 0; s < 3; s++)
+        hist_init(&h[s]);
+    int n = ops / 10 > 0 ? ops / 10 : 1;
+    for (int i = 0; i < n; i++)
+    {
+        for (int s = 0; s < 3; s++)
+        {
+            unsigned long long before = engine_syscalls;
+            unsigned long long start = now_ns();
+            int rc = steps[s](i);
+            hist_record(&h[s], now_ns() - start);
+            syscalls[s] += engine_syscalls - before;
+            if (rc < 0)
+            {
+                fprintf(stderr, "enginebench: allocation step %d failed at op %d\n", s, i);
+                exit(1);
+            }
+        }
+    }
+    report("create, full inode bitmap", &h[0], syscalls[0]);
+    report("write, full data bitmap", &h[1], syscalls[1]);
+    report("unlink", &h[2], syscalls[2]);
+    image_close();
+}
+
+int read_aligned(int i)
+{
+    return server_Read(file_inum, buffer, UFS_BLOCK_SIZE, UFS_BLOCK_SIZE);
+}
+
+int read_straddle(int i)
+{
+    return server_Read(file_inum, buffer, UFS_BLOCK_SIZE / 2, UFS_BLOCK_SIZE);
+}
+
+// both keep the file at two blocks, since a write sets the size to its end
+int write_aligned(int i)
+{
+    return server_Write(file_inum, buffer, UFS_BLOCK_SIZE, UFS_BLOCK_SIZE);
+}
+
+int write_straddle(int i)
+{
+    return server_Write(file_inum, buffer, UFS_BLOCK_SIZE / 2, UFS_BLOCK_SIZE);
+}
+
+void bench_straddle()
+{
+    image_open(64, 64, "");
+    memset(buffer, 'x', sizeof(buffer));
+    file_inum = server_Create(0, UFS_REGULAR_FILE, "file");
+    if (server_Write(file_inum, buffer, 0, UFS_BLOCK_SIZE) != 0 ||
+        server_Write(file_inum, buffer, UFS_BLOCK_SIZE, UFS_BLOCK_SIZE) != 0)
+    {
+        fprintf(stderr, "enginebench: unable to set up the straddle file\n");
+        exit(1);
+    }
+
+    run("read aligned", ops, read_aligned);
+    run("read straddling", ops, read_straddle);
+    run("write aligned", ops, write_aligned);
+    run("write straddling", ops, write_straddle);
+    image_close();
+}
+
+#define LOG_FILES (256)
+
+int log_inums[LOG_FILES];
+
+// 512 bytes somewhere in the first block of some file
+int small_write(int i)
+{
+    unsigned int r = (unsigned int)i * 2654435761u;
+    return server_Write(log_inums[r % LOG_FILES], buffer, (r >> 12) % 8 * 512, 512);
+}
+
+// LOG_FILES files of one block each
+void make_files(const char *name)
+{
+    memset(buffer, 'x', sizeof(buffer));
+    for (int i = 0; i < LOG_FILES; i++)
+    {
+        char file[32];
+        sprintf(file, "file%d", i);
+        log_inums[i] = server_Create(0, UFS_REGULAR_FILE, file);
+        if (log_inums[i] < 0 || server_Write(log_inums[i], buffer, 0, UFS_BLOCK_SIZE) != 0)
+        {
+            fprintf(stderr, "enginebench: unable to set up %s\n", name);
+            exit(1);
+        }
+    }
+}
+
+void bench_layout(const char *name, const char *flags)
+{
+    // 256 live blocks in 2048: the log has to clean to keep going
+    image_open(512, 2048, flags);
+    make_files(name);
+    memset(&lfs_stats, 0, sizeof(lfs_stats));
+    int n = ops / 10 > 0 ? ops / 10 : 1;
+    run(name, n, small_write);
+    if (log_layout)
+    {
+        if (json)
+            printf(",\"log cleaner\":{\"blocks_per_write\":%.2f,\"checkpoints\":%llu,\"segments_cleaned\":%llu,\"blocks_copied\":%llu}",
+                   (double)lfs_stats.blocks_written / n, lfs_stats.checkpoints, lfs_stats.segments_cleaned, lfs_stats.blocks_copied);
+        else
+            printf("  %.2f blocks appended per write, %llu checkpoints, %llu segments cleaned, %llu live blocks copied\n",
+                   (double)lfs_stats.blocks_written / n, lfs_stats.checkpoints, lfs_stats.segments_cleaned, lfs_stats.blocks_copied);
+    }
+    image_close();
+}
+
+void bench_log()
+{
+    bench_layout("small write, classic", "");
+    bench_layout("small write, log", "-l");
+}
+
+int snapshot_take_drop(int i)
+{
+    int id = server_Snapshot();
+    return id < 0 ? -1 : server_SnapshotDelete(id);
+}
+
+// file i's one block and inode block are still shared with the snapshot
+int first_write(int i)
+{
+    return server_Write(log_inums[i], buffer, 0, 512);
+}
+
+void bench_snapshot()
+{
+    image_open(512, 2048, "");
+    make_files("snapshot");
+    int n = ops / 10 > 0 ? ops / 10 : 1;
+    run("snapshot take and delete", n, snapshot_take_drop);
+    run("small write, no snapshot", n, small_write);
+    int id = server_Snapshot();
+    if (id < 0)
+    {
+        fprintf(stderr, "enginebench: unable to take a snapshot\n");
+        exit(1);
+    }
+    run("small write, first after", LOG_FILES, first_write);
+    run("small write, snapshot held", n, small_write);
+    server_SnapshotDelete(id);
+    image_close();
+}
+
+#define DATASET_BLOCKS (256)
+#define DATASET_FILE_BLOCKS (16)
+
+char dataset[DATASET_BLOCKS][UFS_BLOCK_SIZE];
+char packed[DATASET_BLOCKS][UFS_BLOCK_SIZE + UFS_BLOCK_SIZE / 255 + 16];
+int packed_len[DATASET_BLOCKS];
+int dataset_inums[DATASET_BLOCKS / DATASET_FILE_BLOCKS];
+
+// log lines of a made-up service, which is what most stored data looks like
+void make_json()
+{
+    char *out = (char *)dataset;
+    int n = 0;
+    unsigned int r = 1;
+    const char *levels[] = {"info", "info", "info", "warn", "error"};
+    const char *paths[] = {"/api/v1/items", "/api/v1/users", "/api/v1/orders", "/healthz"};
+    while (n < (int)sizeof(dataset))
+    {
+        char line[256];
+        r = r * 1103515245 + 12345;
+        int len = snprintf(line, sizeof(line),
+                           "{\"ts\":%u,\"level\":\"%s\",\"path\":\"%s/%u\",\"user\":%u,\"status\":%d,\"ms\":%u}\n",
+                           1700000000 + n / 64, levels[(r >> 8) % 5], paths[(r >> 12) % 4], (r >> 4) % 10000,
+                           (r >> 16) % 5000, (r >> 20) % 8 ? 200 : 404, (r >> 24) % 300);
+        if (len > (int)sizeof(dataset) - n)
+            len = sizeof(dataset) - n;
+        memcpy(out + n, line, len);
+        n += len;
+    }
+}
+
+void make_random()
+{
+    unsigned int r = 1;
+    for (int i = 0; i < DATASET_BLOCKS; i++)
+    {
+        for (int j = 0; j < UFS_BLOCK_SIZE; j++)
+        {
+            r = r * 1103515245 + 12345;
+            dataset[i][j] = r >> 16;
+        }
+    }
+}
+
+int lz4_block(int i)
+{
+    int b = i % DATASET_BLOCKS;
+    packed_len[b] = lz4_compress(dataset[b], UFS_BLOCK_SIZE, packed[b], sizeof(packed[b]));
+    return packed_len[b] > 0 ? 0 : -1;
+}
+
+int unlz4_block(int i)
+{
+    char out[UFS_BLOCK_SIZE];
+    int b = i % DATASET_BLOCKS;
+    return lz4_decompress(packed[b], packed_len[b], out, UFS_BLOCK_SIZE) == UFS_BLOCK_SIZE ? 0 : -1;
+}
+
+int dataset_write(int i)
+{
+    int b = i % DATASET_BLOCKS;
+    return server_Write(dataset_inums[b / DATASET_FILE_BLOCKS], dataset[b], b % DATASET_FILE_BLOCKS * UFS_BLOCK_SIZE,
+                        UFS_BLOCK_SIZE);
+}
+
+int dataset_read(int i)
+{
+    int b = (i * 7) % DATASET_BLOCKS;
+    return server_Read(dataset_inums[b / DATASET_FILE_BLOCKS], buffer, b % DATASET_FILE_BLOCKS * UFS_BLOCK_SIZE,
+                       UFS_BLOCK_SIZE);
+}
+
+int data_blocks_used()
+{
+    int used = 0;
+    for (int i = 0; i < SUPERBLOCK->num_data; i++)
+        used += get_bit(dataMap, i);
+    return used;
+}
+
+// the codec on its own for compressed images, then the dataset written to
+// files of an image made with flags and read back
+void bench_dataset(const char *data, const char *flags, const char *image)
+{
+    char name[64];
+    if (strcmp(flags, "-c") == 0)
+    {
+        unsigned long long bytes = 0;
+        for (int i = 0; i < DATASET_BLOCKS; i++)
+        {
+            lz4_block(i);
+            bytes += packed_len[i];
+        }
+        snprintf(name, sizeof(name), "lz4 compress, %s", data);
+        double in = run(name, ops, lz4_block);
+        snprintf(name, sizeof(name), "lz4 decompress, %s", data);
+        double out = run(name, ops, unlz4_block);
+        double ratio = (double)DATASET_BLOCKS * UFS_BLOCK_SIZE / bytes;
+        if (json)
+            printf(",\"lz4 %s\":{\"ratio\":%.2f,\"compress_mb_s\":%.0f,\"decompress_mb_s\":%.0f}", data, ratio,
+                   UFS_BLOCK_SIZE * 1000 / in, UFS_BLOCK_SIZE * 1000 / out);
+        else
+            printf("  %.2fx smaller, compressing at %.0f MB/s and decompressing at %.0f MB/s\n", ratio,
+                   UFS_BLOCK_SIZE * 1000 / in, UFS_BLOCK_SIZE * 1000 / out);
+    }
+
+    image_open(64, 2 * DATASET_BLOCKS, flags);
+    for (int i = 0; i < DATASET_BLOCKS / DATASET_FILE_BLOCKS; i++)
+    {
+        char file[32];
+        sprintf(file, "file%d", i);
+        dataset_inums[i] = server_Create(0, UFS_REGULAR_FILE, file);
+    }
+    int before = data_blocks_used();
+    snprintf(name, sizeof(name), "write %s, %s", data, image);
+    run(name, DATASET_BLOCKS, dataset_write);
+    int used = data_blocks_used() - before;
+    snprintf(name, sizeof(name), "read %s, %s", data, image);
+    run(name, ops, dataset_read);
+    if (json)
+        printf(",\"blocks %s, %s\":{\"written\":%d,\"used\":%d,\"shared\":%llu}", data, image, DATASET_BLOCKS, used,
+               dedup_stats.shared);
+    else if (dedup_refs != NULL)
+        printf("  %d data blocks for %d written, %llu writes shared a block, dedup ratio %.2fx\n", used,
+               DATASET_BLOCKS, dedup_stats.shared, (double)dedup_stats.file_blocks / dedup_stats.data_blocks);
+    else
+        printf("  %d data blocks for %d written\n", used, DATASET_BLOCKS);
+    image_close();
+}
+
+void bench_compress()
+{
+    make_json();
+    bench_dataset("json", "", "plain");
+    bench_dataset("json", "-c", "compressed");
+    make_random();
+    bench_dataset("random", "-c", "compressed");
+}
+
+// a file of a quarter of the blocks, inserted four times
+void make_repeated()
+{
+    make_json();
+    for (int i = DATASET_BLOCKS / 4; i < DATASET_BLOCKS; i++)
+        memcpy(dataset[i], dataset[i % (DATASET_BLOCKS / 4)], UFS_BLOCK_SIZE);
+}
+
+void bench_dedup()
+{
+    make_repeated();
+    bench_dataset("repeated", "", "plain");
+    bench_dataset("repeated", "-D", "dedup");
+    make_random();
+    bench_dataset("random", "", "plain");
+    bench_dataset("random", "-D", "dedup");
+}
+
+// a file of DIRECT_PTRS full blocks emptied again, as a rotated log is
+int rotate(int i)
+{
+    for (int b = 0; b < DIRECT_PTRS; b++)
+    {
+        if (server_Write(file_inum, buffer, b * UFS_BLOCK_SIZE, UFS_BLOCK_SIZE) == -1)
+            return -1;
+    }
+    return server_Truncate(file_inum, 0);
+}
+
+// KiB of the image file that take up space
+long long image_disk_kb()
+{
+    struct stat st;
+    return stat(image_path, &st) == 0 ? (long long)st.st_blocks * 512 / 1024 : -1;
+}
+
+void bench_truncate()
+{
+    image_open(64, 4 * DIRECT_PTRS, "");
+    file_inum = server_Create(0, UFS_REGULAR_FILE, "rotated");
+    memset(buffer, 'x', sizeof(buffer));
+    int n = ops / 100 > 0 ? ops / 100 : 1;
+    run("write 30 blocks, truncate", n, rotate);
+
+    long long empty = image_disk_kb();
+    for (int b = 0; b < DIRECT_PTRS; b++)
+        server_Write(file_inum, buffer, b * UFS_BLOCK_SIZE, UFS_BLOCK_SIZE);
+    long long full = image_disk_kb();
+    server_Truncate(file_inum, 0);
+    long long truncated = image_disk_kb();
+    if (json)
+        printf(",\"image on disk\":{\"full_kb\":%lld,\"truncated_kb\":%lld,\"empty_kb\":%lld}", full, truncated, empty);
+    else
+        printf("  image takes %lld KiB on disk with the file full, %lld KiB truncated (%lld KiB before)\n", full,
+               truncated, empty);
+    image_close();
+}
+
+int copy_inums[2];
+
+int copy_server(int i)
+{
+    return server_Copy(copy_inums[0], 0, copy_inums[1], 0, DIRECT_PTRS * UFS_BLOCK_SIZE) == -1 ? -1 : 0;
+}
+
+int copy_blocks(int i)
+{
+    for (int b = 0; b < DIRECT_PTRS; b++)
+    {
+        if (server_Read(copy_inums[0], buffer, b * UFS_BLOCK_SIZE, UFS_BLOCK_SIZE) == -1 ||
+            server_Write(copy_inums[1], buffer, b * UFS_BLOCK_SIZE, UFS_BLOCK_SIZE) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+void bench_copy_on(const char *flags, const char *image)
+{
+    char name[64];
+    image_open(64, 8 * DIRECT_PTRS, flags);
+    copy_inums[0] = server_Create(0, UFS_REGULAR_FILE, "original");
+    copy_inums[1] = server_Create(0, UFS_REGULAR_FILE, "copy");
+    for (int b = 0; b < DIRECT_PTRS; b++)
+        server_Write(copy_inums[0], dataset[b], b * UFS_BLOCK_SIZE, UFS_BLOCK_SIZE);
+    int before = data_blocks_used();
+    int n = ops / 100 > 0 ? ops / 100 : 1;
+    snprintf(name, sizeof(name), "copy by block, %s", image);
+    double by_block = run(name, n, copy_blocks);
+    snprintf(name, sizeof(name), "server_Copy, %s", image);
+    double copied = run(name, n, copy_server);
+    int used = data_blocks_used() - before;
+    if (json)
+        printf(",\"copy %s\":{\"mb_s\":%.0f,\"by_block_mb_s\":%.0f,\"blocks_used\":%d}", image,
+               DIRECT_PTRS * UFS_BLOCK_SIZE * 1000 / copied, DIRECT_PTRS * UFS_BLOCK_SIZE * 1000 / by_block, used);
+    else
+        printf("  %.0f MB/s by block, %.0f MB/s with server_Copy, the copy using %d data blocks\n",
+               DIRECT_PTRS * UFS_BLOCK_SIZE * 1000 / by_block, DIRECT_PTRS * UFS_BLOCK_SIZE * 1000 / copied, used);
+    image_close();
+}
+
+void bench_copy()
+{
+    make_json();
+    bench_copy_on("", "plain");
+    bench_copy_on("-c", "compressed");
+    bench_copy_on("-D", "dedup");
+}
+
+// aging: AGING_WRITERS new files at a time in random directories, written a
+// block at a time in turn as concurrent writers would, with files unlinked
+// at random to keep the image three quarters full; then every file read
+// through directory by directory
+#define AGING_DIRS (32)
+#define AGING_FILES (4096)
+#define AGING_WRITERS (4)
+
+int aging_dirs[AGING_DIRS];
+struct
+{
+    int inum;
+    int dir;
+    int blocks;
+    char name[16];
+} aging_files[AGING_FILES];
+int aging_count;
+int aging_blocks;
+int aging_next;
+unsigned int aging_seed;
+int aging_order[AGING_FILES];
+
+unsigned int aging_rand()
+{
+    aging_seed = aging_seed * 1103515245 + 12345;
+    return aging_seed >> 8;
+}
+
+int age(int i)
+{
+    int writers[AGING_WRITERS];
+    int n = 0;
+    for (; n < AGING_WRITERS && aging_count < AGING_FILES; n++)
+    {
+        int f = aging_count++;
+        aging_files[f].dir = aging_rand() % AGING_DIRS;
+        // mostly small files, a few up to the largest there can be
+        aging_files[f].blocks = aging_rand() % 4 == 0 ? 1 + aging_rand() % DIRECT_PTRS : 1 + aging_rand() % 4;
+        sprintf(aging_files[f].name, "f%d", aging_next++);
+        aging_files[f].inum = server_Create(aging_dirs[aging_files[f].dir], UFS_REGULAR_FILE, aging_files[f].name);
+        if (aging_files[f].inum < 0)
+            return -1;
+        aging_blocks += aging_files[f].blocks;
+        writers[n] = f;
+    }
+    for (int b = 0; b < DIRECT_PTRS; b++)
+    {
+        for (int k = 0; k < n; k++)
+        {
+            int f = writers[k];
+            if (b < aging_files[f].blocks &&
+                server_Write(aging_files[f].inum, buffer, b * UFS_BLOCK_SIZE, UFS_BLOCK_SIZE) == -1)
+                return -1;
+        }
+    }
+    while (aging_blocks > SUPERBLOCK->num_data * 3 / 4)
+    {
+        int f = aging_rand() % aging_count;
+        if (server_Unlink(aging_dirs[aging_files[f].dir], aging_files[f].name) == -1)
+            return -1;
+        aging_blocks -= aging_files[f].blocks;
+        aging_files[f] = aging_files[--aging_count];
+    }
+    return 0;
+}
+
+int aging_read(int i)
+{
+    int f = aging_order[i];
+    for (int b = 0; b < aging_files[f].blocks; b++)
+    {
+        if (server_Read(aging_files[f].inum, buffer, b * UFS_BLOCK_SIZE, UFS_BLOCK_SIZE) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+void bench_aging_on(const char *flags, const char *image)
+{
+    char name[64];
+    image_open(2 * AGING_FILES, 16384, flags);
+    aging_seed = 1;
+    aging_count = aging_blocks = aging_next = 0;
+    for (int d = 0; d < AGING_DIRS; d++)
+    {
+        sprintf(name, "d%d", d);
+        aging_dirs[d] = server_Create(0, UFS_DIRECTORY, name);
+    }
+    memset(buffer, 'x', sizeof(buffer));
+    snprintf(name, sizeof(name), "churn, %s", image);
+    run(name, ops / 25 > 0 ? ops / 25 : 1, age);
+
+    // files in directory order
+    int n = 0;
+    for (int d = 0; d < AGING_DIRS; d++)
+    {
+        for (int f = 0; f < aging_count; f++)
+        {
+            if (aging_files[f].dir == d)
+                aging_order[n++] = f;
+        }
+    }
+
+    // from a cold page cache, which on tmpfs there is no such thing as
+    engine_Close();
+    int cold = open(image_path, O_RDONLY);
+    if (cold >= 0)
+    {
+        posix_fadvise(cold, 0, 0, POSIX_FADV_DONTNEED);
+        close(cold);
+    }
+    if (engine_Open(image_path) != 0)
+    {
+        fprintf(stderr, "enginebench: unable to reopen %s\n", image_path);
+        exit(1);
+    }
+    snprintf(name, sizeof(name), "read after churn, %s", image);
+    double per_file = run(name, n, aging_read);
+
+    // how far reading them that way jumps around the image
+    long long jumps = 0;
+    long long distance = 0;
+    int inode_blocks = 0;
+    unsigned int last = 0;
+    int last_inode_block = -1;
+    for (int i = 0; i < n; i++)
+    {
+        int f = aging_order[i];
+        inode_t *inode = inode_get(aging_files[f].inum);
+        int inode_block = aging_files[f].inum * sizeof(inode_t) / UFS_BLOCK_SIZE;
+        if (inode_block != last_inode_block)
+            inode_blocks++;
+        last_inode_block = inode_block;
+        for (int b = 0; b < aging_files[f].blocks; b++)
+        {
+            if (inode->direct[b] != last + 1)
+            {
+                jumps++;
+                distance += inode->direct[b] > last ? inode->direct[b] - last : last - inode->direct[b];
+            }
+            last = inode->direct[b];
+        }
+    }
+    double mb_s = (double)aging_blocks * UFS_BLOCK_SIZE * 1000 / (per_file * n);
+    if (json)
+        printf(",\"aging %s\":{\"read_mb_s\":%.0f,\"files\":%d,\"blocks\":%d,\"jumps\":%lld,\"mean_jump\":%.0f,"
+               "\"inode_blocks\":%d}",
+               image, mb_s, n, aging_blocks, jumps, jumps ? (double)distance / jumps : 0.0, inode_blocks);
+    else
+        printf("  %.0f MB/s reading %d files of %d blocks: %lld jumps of %.0f blocks on average, %d runs of inode blocks\n",
+               mb_s, n, aging_blocks, jumps, jumps ? (double)distance / jumps : 0.0, inode_blocks);
+    image_close();
+}
+
+void bench_aging()
+{
+    bench_aging_on("-g 1", "one group");
+    bench_aging_on("-g 8", "8 groups");
+}
+
+// parallel: threads each creating files in a directory of their own and
+// giving each PARALLEL_BLOCKS blocks, through inode_alloc and data_alloc
+// alone, as the handlers do not yet take being called at once
+#define PARALLEL_THREADS (8)
+#define PARALLEL_FILES (8192) // split between the threads
+#define PARALLEL_BLOCKS (4)
+
+int parallel_dirs[PARALLEL_THREADS];
+int parallel_inums[PARALLEL_FILES];
+int parallel_nthreads;
+
+void *parallel_worker(void *arg)
+{
+    int t = (long)arg;
+    int per = PARALLEL_FILES / parallel_nthreads;
+    for (int i = t * per; i < (t + 1) * per; i++)
+    {
+        int inum = inode_alloc(UFS_REGULAR_FILE, parallel_dirs[t]);
+        parallel_inums[i] = inum;
+        if (inum == -1)
+            return (void *)-1L;
+        for (int b = 0; b < PARALLEL_BLOCKS; b++)
+        {
+            int block = data_alloc(block_goal(inum, b));
+            if (block == -1)
+                return (void *)-1L;
+            inode_get(inum)->direct[b] = block;
+        }
+    }
+    return NULL;
+}
+
+void bench_parallel_on(const char *flags, const char *image)
+{
+    image_open(2 * PARALLEL_FILES, 40960, flags);
+    for (int t = 0; t < PARALLEL_THREADS; t++)
+    {
+        char name[16];
+        sprintf(name, "d%d", t);
+        parallel_dirs[t] = server_Create(0, UFS_DIRECTORY, name);
+    }
+    for (parallel_nthreads = 1; parallel_nthreads <= PARALLEL_THREADS; parallel_nthreads *= 2)
+    {
+        pthread_t threads[PARALLEL_THREADS];
+        int failed = 0;
+        unsigned long long start = now_ns();
+        for (long t = 0; t < parallel_nthreads; t++)
+            pthread_create(&threads[t], NULL, parallel_worker, (void *)t);
+        for (int t = 0; t < parallel_nthreads; t++)
+        {
+            void *rc;
+            pthread_join(threads[t], &rc);
+            failed |= rc != NULL;
+        }
+        double ns = now_ns() - start;
+        if (failed)
+        {
+            fprintf(stderr, "enginebench: parallel allocation failed, %s\n", image);
+            exit(1);
+        }
+        double per_sec = PARALLEL_FILES * (1 + PARALLEL_BLOCKS) * 1e9 / ns;
+        if (json)
+            printf(",\"parallel %s, %d threads\":{\"allocs_per_s\":%.0f}", image, parallel_nthreads, per_sec);
+        else
+            printf("  %s, %d threads: %.0f allocations/s\n", image, parallel_nthreads, per_sec);
+        for (int i = 0; i < PARALLEL_FILES; i++)
+            inode_free(parallel_inums[i]);
+    }
+    image_close();
+}
+
+void bench_parallel()
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (!json && cores < PARALLEL_THREADS)
+        fprintf(stderr, "enginebench: %ld cores, allocation cannot scale to %d threads\n", cores, PARALLEL_THREADS);
+    bench_parallel_on("-n 0 -g 1", "one group");
+    bench_parallel_on("-n 0 -g 8", "8 groups");
+}
+
+// grow: an image with GROW_DATA data blocks, empty or full, grown
+// GROW_STEP blocks at a time. what it costs should not depend on the data
+#define GROW_DATA (4096)
+#define GROW_STEP (4096)
+#define GROW_STEPS (24)
+
+int grow_step(int i)
+{
+    return server_Grow(SUPERBLOCK->num_inodes, SUPERBLOCK->num_data + GROW_STEP);
+}
+
+void bench_grow_on(int full, const char *image)
+{
+    char name[64];
+    char flags[64];
+    snprintf(flags, sizeof(flags), "-I %d -M %d", 4096, GROW_DATA + GROW_STEPS * GROW_STEP);
+    image_open(1024, GROW_DATA, flags);
+    int files = full ? (GROW_DATA - 1) / DIRECT_PTRS : 0;
+    for (int f = 0; f < files; f++)
+    {
+        sprintf(name, "f%d", f);
+        int inum = server_Create(0, UFS_REGULAR_FILE, name);
+        for (int b = 0; b < DIRECT_PTRS; b++)
+        {
+            memset(buffer, f + b, sizeof(buffer));
+            server_Write(inum, buffer, b * UFS_BLOCK_SIZE, UFS_BLOCK_SIZE);
+        }
+    }
+    snprintf(name, sizeof(name), "grow 4096 blocks, %s", image);
+    run(name, GROW_STEPS, grow_step);
+
+    int intact = 0;
+    for (int f = 0; f < files; f++)
+    {
+        char check[UFS_BLOCK_SIZE];
+        sprintf(name, "f%d", f);
+        int inum = server_Lookup(0, name);
+        int b = f % DIRECT_PTRS;
+        memset(check, f + b, sizeof(check));
+        intact += server_Read(inum, buffer, b * UFS_BLOCK_SIZE, UFS_BLOCK_SIZE) == 0 &&
+                  memcmp(buffer, check, UFS_BLOCK_SIZE) == 0;
+    }
+    if (intact != files)
+    {
+        fprintf(stderr, "enginebench: %d of %d files changed by growing, %s\n", files - intact, files, image);
+        exit(1);
+    }
+    image_close();
+}
+
+void bench_grow()
+{
+    bench_grow_on(0, "empty");
+    bench_grow_on(1, "full");
+}
+
+int main(int argc, char *argv[])
+{
+    int ch;
+    while ((ch = getopt(argc, argv, "d:m:n:F:J")) != -1)
+    {
+        switch (ch)
+        {
+        case 'd':
+            dir = optarg;
+            break;
+        case 'm':
+            mkfs = optarg;
+            break;
+        case 'n':
+            ops = atoi(optarg);
+            break;
+        case 'F':
+            fanout = atoi(optarg);
+            break;
+        case 'J':
+            json = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    // two entries of the first block are . and ..
+    if (ops <= 0 || fanout <= 0 || fanout > DIRECT_PTRS * 128 - 2)
+        usage();
+    argc -= optind;
+    argv += optind;
+
+    struct statfs fs;
+    if (!json && statfs(dir, &fs) == 0 && fs.f_type != TMPFS_MAGIC)
+        fprintf(stderr, "enginebench: %s is not tmpfs, device latency will be included\n", dir);
+
+    if (json)
+        printf("{\"time\":%ld,\"ops\":%d,\"fanout\":%d,\"results\":{", (long)time(NULL), ops, fanout);
+    int all = argc == 0;
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "lookup") != 0 && strcmp(argv[i], "alloc") != 0 && strcmp(argv[i], "straddle") != 0 &&
+            strcmp(argv[i], "log") != 0 && strcmp(argv[i], "snapshot") != 0 &&
+            strcmp(argv[i], "compress") != 0 &&
+            strcmp(argv[i], "dedup") != 0 && strcmp(argv[i], "truncate") != 0 && strcmp(argv[i], "copy") != 0 &&
+            strcmp(argv[i], "aging") != 0 && strcmp(argv[i], "parallel") != 0 &&
+            strcmp(argv[i], "grow") != 0)
+            usage();
+    }
+    for (int i = 0; i < (all ? 12 : argc); i++)
+    {
+        char *name = all ? (char *[]){"lookup", "alloc", "straddle", "log", "snapshot", "compress", "dedup", "truncate", "copy", "aging", "parallel", "grow"}[i]
+                         : argv[i];
+        if (strcmp(name, "lookup") == 0)
+            bench_lookup();
+        else if (strcmp(name, "alloc") == 0)
+            bench_alloc();
+        else if (strcmp(name, "straddle") == 0)
+            bench_straddle();
+        else if (strcmp(name, "log") == 0)
+            bench_log();
+        else if (strcmp(name, "snapshot") == 0)
+            bench_snapshot();
+        else if (strcmp(name, "compress") == 0)
+            bench_compress();
+        else if (strcmp(name, "dedup") == 0)
+            bench_dedup();
+        else if (strcmp(name, "truncate") == 0)
+            bench_truncate();
+        else if (strcmp(name, "copy") == 0)
+            bench_copy();
+        else if (strcmp(name, "aging") == 0)
+            bench_aging();
+        else if (strcmp(name, "parallel") == 0)
+            bench_parallel();
+        else
+            bench_grow();
+    }
+    if (json)
+        printf("}}\n");
+    return 0;
+}
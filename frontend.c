@@ -0,0 +1,296 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "frontend.h"
+#include "stats.h"
+
+// see frontend.h. each queue has one writer, its loop, and one reader, the
+// engine thread, so head and tail are all the synchronisation there is
+
+#define FRONTEND_MAX_LOOPS (64)
+#define FRONTEND_QUEUE (256)  // datagrams waiting for the engine per loop, power of two
+#define FRONTEND_BATCH (32)   // datagrams taken off a socket per recvmmsg
+#define BUSY_POLL_US (50)     // SO_BUSY_POLL with -P
+#define BUSY_WAIT_MS (100)    // a spinning engine still returns this often
+
+typedef struct
+{
+    struct sockaddr_in addr;
+    int len;
+    unsigned long long arrival; // CLOCK_REALTIME ns the loop took it off the socket
+    client_message_t message;
+} frontend_slot_t;
+
+typedef struct
+{
+    int fd;
+    int core;
+    int room_fd; // eventfd the engine kicks a loop waiting for room with
+    pthread_t thread;
+    unsigned long long head __attribute__((aligned(64))); // next slot the loop fills
+    unsigned long long tail __attribute__((aligned(64))); // next slot the engine takes
+    int waiting __attribute__((aligned(64)));             // the loop sleeps on room_fd
+    // the loop's own counters, printed on shutdown
+    unsigned long long packets __attribute__((aligned(64)));
+    unsigned long long batches;
+    unsigned long long full; // times it found its queue full and waited
+    frontend_slot_t slots[FRONTEND_QUEUE];
+} frontend_loop_t;
+
+frontend_loop_t *frontend_loops[FRONTEND_MAX_LOOPS];
+int frontend_nloops = 0;
+int busy_poll = 0;
+int next_loop = 0;     // the engine takes from this queue first
+int wake_fd;           // eventfd the loops kick a sleeping engine with
+int engine_sleeping = 0;
+
+/**
+ * open n sockets on port, spinning instead of sleeping if busy.
+ * return -1 if failed, 0 otherwise
+ */
+int frontend_Open(int port, int n, int busy)
+{
+    if (n < 1 || n > FRONTEND_MAX_LOOPS)
+        return -1;
+    wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (wake_fd < 0)
+        return -1;
+    int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (busy && ncpus < n + 1)
+    {
+        // spinners sharing a core wait out each other's time slices
+        fprintf(stderr, "frontend: busy polling wants a core per loop and one for the engine, %d online; sleeping instead\n", ncpus);
+        busy = 0;
+    }
+    busy_poll = busy;
+    for (int i = 0; i < n; i++)
+    {
+        frontend_loop_t *l = aligned_alloc(64, sizeof(frontend_loop_t));
+        if (l == NULL)
+            return -1;
+        memset(l, 0, sizeof(frontend_loop_t));
+        l->fd = UDP_OpenShared(port);
+        l->room_fd = eventfd(0, EFD_NONBLOCK);
+        if (l->fd < 0 || l->room_fd < 0)
+            return -1;
+        l->core = ncpus > 0 ? i % ncpus : 0;
+        if (busy && UDP_EnableBusyPoll(l->fd, BUSY_POLL_US) != 0)
+            perror("SO_BUSY_POLL");
+        frontend_loops[frontend_nloops++] = l;
+    }
+    return 0;
+}
+
+int frontend_socket(int i)
+{
+    return frontend_loops[i]->fd;
+}
+
+// wait until the engine has taken a batch off l's full queue, rather than
+// waking for every slot. the socket's buffer holds what comes in meanwhile
+void wait_room(frontend_loop_t *l)
+{
+    if (!busy_poll)
+        // pairs with the engine advancing tail before it looks
+        __atomic_store_n(&l->waiting, 1, __ATOMIC_SEQ_CST);
+    while (l->head - __atomic_load_n(&l->tail, __ATOMIC_SEQ_CST) > FRONTEND_QUEUE - FRONTEND_BATCH)
+    {
+        if (busy_poll)
+            continue;
+        struct pollfd p = {l->room_fd, POLLIN, 0};
+        if (poll(&p, 1, -1) > 0)
+        {
+            unsigned long long count;
+            (void)read(l->room_fd, &count, sizeof(count));
+        }
+    }
+    __atomic_store_n(&l->waiting, 0, __ATOMIC_SEQ_CST);
+}
+
+void *frontend_loop(void *arg)
+{
+    frontend_loop_t *l = (frontend_loop_t *)arg;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(l->core, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+        fprintf(stderr, "frontend: could not pin loop to core %d\n", l->core);
+
+    // edge triggered: zerocopy completions waiting on the socket's error
+    // queue for the engine would otherwise wake the loop until reaped
+    int ep = epoll_create1(0);
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = l->fd;
+    epoll_ctl(ep, EPOLL_CTL_ADD, l->fd, &ev);
+
+    struct mmsghdr msgs[FRONTEND_BATCH];
+    struct iovec iov[FRONTEND_BATCH];
+    int more = 0; // the socket may hold more than the last batch took
+    while (1)
+    {
+        if (!busy_poll && !more && epoll_wait(ep, &ev, 1, -1) < 0)
+            continue;
+        more = 1;
+
+        unsigned long long head = l->head;
+        int room = FRONTEND_QUEUE - (int)(head - __atomic_load_n(&l->tail, __ATOMIC_ACQUIRE));
+        if (room == 0)
+        {
+            l->full++;
+            wait_room(l);
+            continue;
+        }
+        int n = room < FRONTEND_BATCH ? room : FRONTEND_BATCH;
+        memset(msgs, 0, n * sizeof(struct mmsghdr));
+        for (int i = 0; i < n; i++)
+        {
+            frontend_slot_t *slot = &l->slots[(head + i) & (FRONTEND_QUEUE - 1)];
+            iov[i].iov_base = &slot->message;
+            iov[i].iov_len = sizeof(client_message_t);
+            msgs[i].msg_hdr.msg_name = &slot->addr;
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int got = recvmmsg(l->fd, msgs, n, MSG_DONTWAIT, NULL);
+        if (got <= 0)
+        {
+            more = 0;
+            continue;
+        }
+        more = got == n;
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        unsigned long long arrival = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        for (int i = 0; i < got; i++)
+        {
+            frontend_slot_t *slot = &l->slots[(head + i) & (FRONTEND_QUEUE - 1)];
+            slot->len = msgs[i].msg_len;
+            slot->arrival = arrival;
+        }
+        l->packets += got;
+        l->batches++;
+        // pairs with the engine setting engine_sleeping before it looks again
+        __atomic_store_n(&l->head, head + got, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&engine_sleeping, __ATOMIC_SEQ_CST))
+        {
+            unsigned long long one = 1;
+            (void)write(wake_fd, &one, sizeof(one));
+        }
+    }
+    return NULL;
+}
+
+// start the loops, return -1 if failed, 0 otherwise
+int frontend_Start()
+{
+    // signals are for the engine thread, whose reads they interrupt
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int rc = 0;
+    for (int i = 0; i < frontend_nloops && rc == 0; i++)
+    {
+        if (pthread_create(&frontend_loops[i]->thread, NULL, frontend_loop, frontend_loops[i]) != 0)
+            rc = -1;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return rc;
+}
+
+int frontend_waiting()
+{
+    for (int i = 0; i < frontend_nloops; i++)
+    {
+        if (__atomic_load_n(&frontend_loops[i]->head, __ATOMIC_SEQ_CST) != frontend_loops[i]->tail)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * UDP_ReadStamped for the engine thread: the next datagram from the loops'
+ * queues, taking from each in turn, and the socket it came in on in fd.
+ * return its length, or -1 with errno EAGAIN if none came within wait_ms
+ * (0 is forever) or EINTR if a signal came first
+ */
+int frontend_Next(struct sockaddr_in *addr, client_message_t *message, unsigned long long *arrival, int *fd, int wait_ms)
+{
+    long long deadline = stats_now_ns() / 1000000 + (wait_ms > 0 ? wait_ms : BUSY_WAIT_MS);
+    while (1)
+    {
+        for (int k = 0; k < frontend_nloops; k++)
+        {
+            int i = (next_loop + k) % frontend_nloops;
+            frontend_loop_t *l = frontend_loops[i];
+            unsigned long long tail = l->tail;
+            if (__atomic_load_n(&l->head, __ATOMIC_ACQUIRE) == tail)
+                continue;
+            frontend_slot_t *slot = &l->slots[tail & (FRONTEND_QUEUE - 1)];
+            int len = slot->len;
+            memcpy(message, &slot->message, len);
+            *addr = slot->addr;
+            *arrival = slot->arrival;
+            *fd = l->fd;
+            __atomic_store_n(&l->tail, tail + 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&l->waiting, __ATOMIC_SEQ_CST) &&
+                __atomic_load_n(&l->head, __ATOMIC_ACQUIRE) - (tail + 1) <= FRONTEND_QUEUE - FRONTEND_BATCH)
+            {
+                unsigned long long one = 1;
+                (void)write(l->room_fd, &one, sizeof(one));
+            }
+            next_loop = (i + 1) % frontend_nloops;
+            return len;
+        }
+
+        if (busy_poll)
+        {
+            if ((long long)(stats_now_ns() / 1000000) < deadline)
+                continue;
+            errno = EAGAIN;
+            return -1;
+        }
+
+        __atomic_store_n(&engine_sleeping, 1, __ATOMIC_SEQ_CST);
+        if (frontend_waiting())
+        {
+            __atomic_store_n(&engine_sleeping, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        struct pollfd p = {wake_fd, POLLIN, 0};
+        int rc = poll(&p, 1, wait_ms > 0 ? wait_ms : -1);
+        __atomic_store_n(&engine_sleeping, 0, __ATOMIC_SEQ_CST);
+        if (rc > 0)
+        {
+            unsigned long long count;
+            (void)read(wake_fd, &count, sizeof(count));
+            continue;
+        }
+        if (rc == 0)
+            errno = EAGAIN;
+        return -1;
+    }
+}
+
+void frontend_print()
+{
+    for (int i = 0; i < frontend_nloops; i++)
+    {
+        frontend_loop_t *l = frontend_loops[i];
+        printf("loop %d (core %d): %llu datagrams in %llu batches (%.1f per batch), queue full %llu times\n", i, l->core,
+               l->packets, l->batches, l->batches ? (double)l->packets / l->batches : 0.0, l->full);
+    }
+    fflush(stdout);
+}
@@ -0,0 +1,21 @@
+#ifndef __frontend_h__
+#define __frontend_h__
+
+#include "message.h"
+#include "udp.h"
+
+// the server's receive side spread over cores (server -N). loops sockets
+// share the port with SO_REUSEPORT, so the kernel steers each client, by
+// its address and port, to one of them. every socket is read by its own
+// thread, pinned to a core and waiting in epoll, which takes datagrams off
+// in batches and queues them for the one thread that runs the engine; it
+// takes them in turn from each queue and replies on the socket they came in
+// on. with busy polling, the loops and the engine spin instead of sleeping
+
+int frontend_Open(int port, int loops, int busy);
+int frontend_socket(int i);
+int frontend_Start();
+int frontend_Next(struct sockaddr_in *addr, client_message_t *message, unsigned long long *arrival, int *fd, int wait_ms);
+void frontend_print();
+
+#endif // __frontend_h__
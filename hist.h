@@ -0,0 +1,84 @@
+#ifndef __hist_h__
+#define __hist_h__
+
+#include <string.h>
+
+// HDR-style latency histogram: values below HIST_SUB are counted exactly,
+// larger ones in HIST_SUB buckets per power of two, so any recorded value
+// is reported within 1/HIST_SUB (~3%) of what was measured
+#define HIST_SUB_BITS (5)
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct
+{
+    unsigned long long counts[HIST_BUCKETS];
+    unsigned long long total;
+    unsigned long long sum;
+    unsigned long long max;
+} hist_t;
+
+static inline int hist_index(unsigned long long v)
+{
+    if (v < HIST_SUB)
+        return (int)v;
+    int e = 63 - __builtin_clzll(v);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + (int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+// midpoint of the values that land in bucket i
+static inline unsigned long long hist_value(int i)
+{
+    if (i < HIST_SUB)
+        return i;
+    int e = i / HIST_SUB + HIST_SUB_BITS - 1;
+    unsigned long long width = 1ULL << (e - HIST_SUB_BITS);
+    return (unsigned long long)(HIST_SUB + i % HIST_SUB) * width + width / 2;
+}
+
+static inline void hist_init(hist_t *h)
+{
+    memset(h, 0, sizeof(hist_t));
+}
+
+static inline void hist_record(hist_t *h, unsigned long long v)
+{
+    h->counts[hist_index(v)]++;
+    h->total++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+static inline void hist_merge(hist_t *into, const hist_t *from)
+{
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        into->counts[i] += from->counts[i];
+    into->total += from->total;
+    into->sum += from->sum;
+    if (from->max > into->max)
+        into->max = from->max;
+}
+
+// value at percentile p (0..100); 0 for an empty histogram
+static inline unsigned long long hist_percentile(const hist_t *h, double p)
+{
+    if (h->total == 0)
+        return 0;
+    unsigned long long rank = (unsigned long long)(p / 100.0 * h->total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    unsigned long long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->counts[i];
+        if (seen >= rank)
+        {
+            unsigned long long v = hist_value(i);
+            return v > h->max ? h->max : v;
+        }
+    }
+    return h->max;
+}
+
+#endif // __hist_h__
@@ -0,0 +1,642 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ENGINE_INTERNAL
+#include "engine.h"
+#include "stats.h"
+#include "trace.h"
+
+// the log layout (mkfs -l). the data region is cut into segments, and every
+// commit appends one partial segment at the head of the log: a summary
+// block, the data blocks written since the last commit, and blocks holding
+// the inodes that changed. nothing is updated in place, so a burst of small
+// writes to scattered files turns into one sequential run plus an fsync.
+//
+// the inode map (where each inode's latest copy is) lives in memory and in
+// two checkpoint regions, written alternately every LOG_CHECKPOINT_COMMITS
+// commits. opening the image takes the newer valid checkpoint and rolls
+// forward through the partials committed after it. segments whose blocks
+// are all dead become free at the next checkpoint; the cleaner makes more of
+// them by copying the live blocks out of the segments that give the most
+// space for the least copying
+
+#define LOG_COMMIT_MAX (8)          // blocks most requests commit, at most, summary included
+#define LOG_RESERVE (2)             // free segments new blocks may not take
+#define LOG_CHECKPOINT_COMMITS (256)
+#define LOG_IDLE_UTILIZATION (0.75) // idle cleaning leaves fuller segments alone
+
+#define SEG_FREE (0)
+#define SEG_USED (1)
+
+lfs_stats_t lfs_stats;
+
+int nsegs;
+unsigned int *imap;        // per inode, block * 32 + slot of its latest copy, 0 if free
+unsigned int *seg_age;     // per segment, low bits of the seq of the last commit into it
+int *seg_live_data;        // per segment, blocks some inode points at
+int *seg_live_inodes;      // per segment, inode copies the map points at
+char *seg_state;
+int free_segments;
+int next_region;           // checkpoint region the next checkpoint goes to
+int since_checkpoint;
+
+unsigned long long seq;    // of the last commit
+unsigned int head;         // where the next partial segment starts, 0 if the log is full
+int cleaning;
+
+// the open partial segment
+int partial_open;
+unsigned int partial_start;
+unsigned int partial_sum;
+log_summary_t summary;
+
+char *dirty;
+int *dirty_list;
+int ndirty;
+
+int checkpoint();
+int clean_room(int limit);
+
+int seg_of(unsigned int block)
+{
+    return (block - SUPERBLOCK->data_region_addr) / SUPERBLOCK->segment_blocks;
+}
+
+unsigned int seg_start(int seg)
+{
+    return SUPERBLOCK->data_region_addr + seg * SUPERBLOCK->segment_blocks;
+}
+
+unsigned int seg_end(unsigned int block)
+{
+    return seg_start(seg_of(block) + 1);
+}
+
+int region_bytes()
+{
+    return sizeof(log_checkpoint_t) + (SUPERBLOCK->num_inodes + nsegs) * sizeof(unsigned int);
+}
+
+void lfs_inode_dirty(int inum)
+{
+    if (dirty[inum])
+        return;
+    dirty[inum] = 1;
+    dirty_list[ndirty++] = inum;
+}
+
+void lfs_inode_free(int inum)
+{
+    inode_t *inode = &inode_table[inum];
+    for (int i = 0; i < DIRECT_PTRS; i++)
+    {
+        if ((int)inode->direct[i] != -1)
+            seg_live_data[seg_of(inode->direct[i])]--;
+        inode->direct[i] = -1;
+    }
+    set_bit_zero(inodeMap, inum);
+    lfs_inode_dirty(inum);
+}
+
+// drop block index of inum; the segment it was in has one less live block
+void lfs_block_free(int inum, int index)
+{
+    inode_t *inode = &inode_table[inum];
+    if ((int)inode->direct[index] == -1)
+        return;
+    seg_live_data[seg_of(inode->direct[index])]--;
+    inode->direct[index] = -1;
+}
+
+// claim a free segment for the log to continue in, 0 if there is none
+unsigned int next_segment()
+{
+    int seg = head == 0 ? 0 : seg_of(head);
+    for (int i = 1; i <= nsegs; i++)
+    {
+        int s = (seg + i) % nsegs;
+        if (seg_state[s] == SEG_FREE)
+        {
+            seg_state[s] = SEG_USED;
+            free_segments--;
+            return seg_start(s);
+        }
+    }
+    return 0;
+}
+
+/**
+ * start a partial segment at head. return -1 if failed, 0 otherwise
+ */
+int open_partial()
+{
+    if (head == 0)
+    {
+        // the log filled up; the last summary could not say where it goes
+        // on, so a checkpoint has to
+        head = next_segment();
+        if (head == 0 || checkpoint() != 0)
+            return -1;
+    }
+    partial_open = 1;
+    partial_start = head;
+    partial_sum = 0;
+    memset(&summary, 0, sizeof(summary));
+    return 0;
+}
+
+// blocks the open partial can still take
+int partial_room()
+{
+    int room = LOG_SUMMARY_ENTRIES - summary.nblocks;
+    int left = seg_end(partial_start) - (partial_start + 1 + summary.nblocks);
+    return left < room ? left : room;
+}
+
+/**
+ * append a block owned by (inum, index) to the open partial segment,
+ * opening one if needed. return -1 if failed, its block number otherwise
+ */
+int log_append(const void *block, int inum, int index)
+{
+    if (!partial_open)
+    {
+        TRACE_BEGIN(TRACE_ALLOC, 0);
+        int rc = open_partial();
+        TRACE_END(TRACE_ALLOC, 0);
+        if (rc != 0)
+            return -1;
+    }
+    if (partial_room() < 1)
+        return -1;
+
+    unsigned int addr = partial_start + 1 + summary.nblocks;
+    if (pwrite(fd, block, UFS_BLOCK_SIZE, (off_t)addr * UFS_BLOCK_SIZE) != UFS_BLOCK_SIZE)
+        return -1;
+    summary.entries[summary.nblocks].inum = inum;
+    summary.entries[summary.nblocks].index = index;
+    summary.nblocks++;
+    partial_sum = log_checksum(partial_sum, block, UFS_BLOCK_SIZE);
+    lfs_stats.blocks_written++;
+    return addr;
+}
+
+/**
+ * write nbytes of buffer at offset into block index of inum: always to a
+ * new block at the head of the log, merged with what the old one held.
+ * return -1 if failed, 0 otherwise
+ */
+int lfs_block_write(int inum, int index, const char *buffer, int offset, int nbytes)
+{
+    inode_t *inode = &inode_table[inum];
+    int old = inode->direct[index];
+    // the last LOG_RESERVE free segments are for the cleaner to copy into;
+    // rewriting a block still goes, or a full log could not be unlinked from
+    if (old == -1 && !cleaning && free_segments < LOG_RESERVE)
+    {
+        thread_stats.data_alloc_failures++;
+        return -1;
+    }
+    // a request writing more than fits, like a server_Copy, is committed in
+    // pieces
+    if (partial_open && !cleaning && clean_room(ndirty + 1) != 0)
+    {
+        thread_stats.data_alloc_failures++;
+        return -1;
+    }
+    char block[UFS_BLOCK_SIZE];
+    if (offset != 0 || nbytes != UFS_BLOCK_SIZE)
+    {
+        if (old == -1)
+            memset(block, 0, UFS_BLOCK_SIZE);
+        else
+            memcpy(block, block_data(old), UFS_BLOCK_SIZE);
+        memcpy(block + offset, buffer, nbytes);
+        buffer = block;
+    }
+
+    TRACE_BEGIN(TRACE_DATA, inum);
+    int addr = log_append(buffer, inum, index);
+    TRACE_END(TRACE_DATA, inum);
+    if (addr == -1)
+    {
+        thread_stats.data_alloc_failures++;
+        return -1;
+    }
+
+    if (old != -1)
+        seg_live_data[seg_of(old)]--;
+    seg_live_data[seg_of(addr)]++;
+    inode->direct[index] = addr;
+    return 0;
+}
+
+// the inode map now says inum's latest copy is at loc
+void imap_set(int inum, unsigned int loc)
+{
+    if (imap[inum] != 0)
+        seg_live_inodes[seg_of(imap[inum] / 32)]--;
+    imap[inum] = loc;
+    if (loc != 0)
+        seg_live_inodes[seg_of(loc / 32)]++;
+}
+
+/**
+ * append the dirty inodes and close the open partial segment with its
+ * summary, then fsync. return -1 if failed, 0 otherwise
+ */
+int write_partial()
+{
+    if (!partial_open && ndirty == 0)
+        return 0;
+
+    TRACE_BEGIN(TRACE_INODE, ndirty);
+    for (int i = 0; i < ndirty; i += LOG_INODES_PER_BLOCK)
+    {
+        log_inode_block_t block;
+        memset(&block, 0, sizeof(block));
+        for (int j = i; j < ndirty && block.count < LOG_INODES_PER_BLOCK; j++)
+        {
+            int inum = dirty_list[j];
+            block.inums[block.count] = inum;
+            block.inodes[block.count] = inode_table[inum];
+            // freed: the copy just records that, for roll forward
+            if (get_bit(inodeMap, inum) == 0)
+                block.inodes[block.count].type = LOG_FREED;
+            block.count++;
+        }
+        int addr = log_append(&block, -1, LOG_INODE_BLOCK);
+        if (addr == -1)
+        {
+            TRACE_END(TRACE_INODE, ndirty);
+            fprintf(stderr, "lfs: no room to commit inodes\n");
+            return -1;
+        }
+        for (int j = 0; j < block.count; j++)
+            imap_set(block.inums[j], block.inodes[j].type == LOG_FREED ? 0 : addr * 32 + j);
+    }
+    TRACE_END(TRACE_INODE, ndirty);
+    for (int i = 0; i < ndirty; i++)
+        dirty[dirty_list[i]] = 0;
+    ndirty = 0;
+
+    // the next partial goes right after this one, or if a whole request
+    // might not fit there, at the start of another segment
+    summary.magic = LOG_MAGIC;
+    summary.seq = seq + 1;
+    head = partial_start + 1 + summary.nblocks;
+    if (seg_end(partial_start) - head < LOG_COMMIT_MAX)
+        head = next_segment();
+    summary.next = head;
+    summary.checksum = log_checksum(partial_sum ^ (unsigned int)summary.seq, summary.entries, summary.nblocks * sizeof(log_entry_t));
+    int rc = pwrite(fd, &summary, UFS_BLOCK_SIZE, (off_t)partial_start * UFS_BLOCK_SIZE) == UFS_BLOCK_SIZE ? 0 : -1;
+    partial_open = 0;
+    seq++;
+    seg_age[seg_of(partial_start)] = (unsigned int)seq;
+    lfs_stats.blocks_written++;
+
+    unsigned long long start = stats_now_ns();
+    TRACE_BEGIN(TRACE_FSYNC, 0);
+    if (fsync(fd) != 0)
+        rc = -1;
+    TRACE_END(TRACE_FSYNC, 0);
+    hist_record(&thread_stats.fsync, stats_now_ns() - start);
+    lfs_stats.commits++;
+    since_checkpoint++;
+    return rc;
+}
+
+/**
+ * write the inode map, segment ages and head to the older checkpoint region,
+ * then free the segments that have nothing live left. return -1 if failed,
+ * 0 otherwise
+ */
+int checkpoint()
+{
+    int len = SUPERBLOCK->checkpoint_len * UFS_BLOCK_SIZE;
+    char *region = calloc(len, 1);
+    if (region == NULL)
+        return -1;
+    log_checkpoint_t *c = (log_checkpoint_t *)region;
+    unsigned int *map = (unsigned int *)(region + sizeof(log_checkpoint_t));
+    memcpy(map, imap, SUPERBLOCK->num_inodes * sizeof(unsigned int));
+    memcpy(map + SUPERBLOCK->num_inodes, seg_age, nsegs * sizeof(unsigned int));
+    c->magic = LOG_MAGIC;
+    c->seq = seq;
+    c->head = head;
+    c->checksum = log_checksum((unsigned int)seq, map, region_bytes() - sizeof(log_checkpoint_t));
+
+    off_t at = (off_t)(SUPERBLOCK->checkpoint_addr + next_region * SUPERBLOCK->checkpoint_len) * UFS_BLOCK_SIZE;
+    int rc = pwrite(fd, region, len, at) == len && fsync(fd) == 0 ? 0 : -1;
+    free(region);
+    if (rc != 0)
+        return -1;
+    next_region ^= 1;
+    since_checkpoint = 0;
+    lfs_stats.checkpoints++;
+
+    // nothing from before the head is needed to recover any more
+    int current = head == 0 ? -1 : seg_of(head);
+    for (int s = 0; s < nsegs; s++)
+    {
+        if (seg_state[s] == SEG_USED && s != current && seg_live_data[s] == 0 && seg_live_inodes[s] == 0)
+        {
+            seg_state[s] = SEG_FREE;
+            free_segments++;
+        }
+    }
+    return 0;
+}
+
+/**
+ * make sure the open partial has room for one more block and the inode
+ * blocks of limit dirty inodes, committing first if it has not.
+ * return -1 if failed, 0 otherwise
+ */
+int clean_room(int limit)
+{
+    if (partial_open && partial_room() >= 1 + (limit + LOG_INODES_PER_BLOCK - 1) / LOG_INODES_PER_BLOCK)
+        return 0;
+    if (write_partial() != 0)
+        return -1;
+    return open_partial();
+}
+
+/**
+ * move every live block of segment seg to the head of the log.
+ * return -1 if failed, 0 otherwise
+ */
+int clean_segment(int seg)
+{
+    unsigned int at = seg_start(seg);
+    unsigned int end = seg_start(seg + 1);
+    unsigned long long last = 0;
+    // walk the partials this segment holds from its start, until one is not
+    // valid or is left over from before the segment was last reused
+    while (at < end)
+    {
+        log_summary_t *s = (log_summary_t *)block_data(at);
+        if (s->magic != LOG_MAGIC || s->seq <= last || s->nblocks > LOG_SUMMARY_ENTRIES || at + 1 + s->nblocks > end)
+            break;
+        last = s->seq;
+        for (unsigned int i = 0; i < s->nblocks; i++)
+        {
+            unsigned int addr = at + 1 + i;
+            log_entry_t *e = &s->entries[i];
+            if (e->index == LOG_INODE_BLOCK)
+            {
+                log_inode_block_t *block = (log_inode_block_t *)block_data(addr);
+                for (int j = 0; j < block->count && j < LOG_INODES_PER_BLOCK; j++)
+                {
+                    int inum = block->inums[j];
+                    if (inum < 0 || inum >= SUPERBLOCK->num_inodes || imap[inum] != addr * 32 + j)
+                        continue;
+                    // rewritten at the head by the next commit
+                    if (!dirty[inum] && clean_room(ndirty + 1) != 0)
+                        return -1;
+                    lfs_inode_dirty(inum);
+                }
+                continue;
+            }
+            if (e->inum < 0 || e->inum >= SUPERBLOCK->num_inodes || e->index < 0 || e->index >= DIRECT_PTRS)
+                continue;
+            inode_t *inode = inode_get(e->inum);
+            if (inode == NULL || inode->direct[e->index] != addr)
+                continue;
+
+            if (clean_room(ndirty + 1) != 0)
+                return -1;
+            char block[UFS_BLOCK_SIZE];
+            memcpy(block, block_data(addr), UFS_BLOCK_SIZE);
+            if (lfs_block_write(e->inum, e->index, block, 0, UFS_BLOCK_SIZE) != 0)
+                return -1;
+            lfs_inode_dirty(e->inum);
+            lfs_stats.blocks_copied++;
+        }
+        if (s->next <= at || s->next >= end)
+            break;
+        at = s->next;
+    }
+    lfs_stats.segments_cleaned++;
+    return 0;
+}
+
+/**
+ * the segment cleaning frees the most space for the least copying, by
+ * (1 - u) * age / (1 + u) with u the live fraction: young segments are left
+ * to die some more on their own. -1 if there is none worth it
+ */
+int pick_victim(double max_utilization)
+{
+    int current = head == 0 ? -1 : seg_of(head);
+    int victim = -1;
+    double best = 0;
+    for (int s = 0; s < nsegs; s++)
+    {
+        if (seg_state[s] != SEG_USED || s == current)
+            continue;
+        double u = (seg_live_data[s] + (seg_live_inodes[s] + LOG_INODES_PER_BLOCK - 1) / LOG_INODES_PER_BLOCK) /
+                   (double)SUPERBLOCK->segment_blocks;
+        if (u >= max_utilization)
+            continue;
+        double benefit = (1 - u) * ((unsigned int)seq - seg_age[s] + 1) / (1 + u);
+        if (benefit > best)
+        {
+            best = benefit;
+            victim = s;
+        }
+    }
+    return victim;
+}
+
+/**
+ * clean up to segments segments, or when 0, until a quarter of them are
+ * free; any uncommitted changes are committed along the way. return the
+ * number of segments cleaned
+ */
+int lfs_Clean(int segments)
+{
+    if (cleaning)
+        return 0;
+    int want = segments > 0 ? segments : nsegs;
+    double max_utilization = segments > 0 ? 1.0 : LOG_IDLE_UTILIZATION;
+    int cleaned = 0;
+    cleaning = 1;
+    while (cleaned < want && (segments > 0 || free_segments < nsegs / 4))
+    {
+        int victim = pick_victim(max_utilization);
+        if (victim == -1)
+            break;
+        if (clean_segment(victim) != 0 || write_partial() != 0 || checkpoint() != 0)
+            break;
+        cleaned++;
+    }
+    cleaning = 0;
+    return cleaned;
+}
+
+// commit() in the log layout
+void lfs_commit()
+{
+    if (write_partial() != 0)
+        return;
+    if (since_checkpoint >= LOG_CHECKPOINT_COMMITS)
+        checkpoint();
+    // keep what a request needs beyond the cleaner's reserve
+    if (free_segments <= LOG_RESERVE + 1 && !cleaning)
+        lfs_Clean(1);
+}
+
+// the checkpoint in region r, NULL if it is not a valid one
+log_checkpoint_t *read_checkpoint(int r)
+{
+    log_checkpoint_t *c = (log_checkpoint_t *)block_data(SUPERBLOCK->checkpoint_addr + r * SUPERBLOCK->checkpoint_len);
+    if (c->magic != LOG_MAGIC)
+        return NULL;
+    if (log_checksum((unsigned int)c->seq, c + 1, region_bytes() - sizeof(log_checkpoint_t)) != c->checksum)
+        return NULL;
+    return c;
+}
+
+// the partial segment at block at, if it is the commit after seq and intact
+log_summary_t *valid_partial(unsigned int at)
+{
+    if (at < SUPERBLOCK->data_region_addr || at >= seg_start(nsegs))
+        return NULL;
+    log_summary_t *s = (log_summary_t *)block_data(at);
+    if (s->magic != LOG_MAGIC || s->seq != seq + 1 || s->nblocks > LOG_SUMMARY_ENTRIES || at + 1 + s->nblocks > seg_end(at))
+        return NULL;
+    unsigned int sum = 0;
+    for (unsigned int i = 0; i < s->nblocks; i++)
+        sum = log_checksum(sum, block_data(at + 1 + i), UFS_BLOCK_SIZE);
+    if (log_checksum(sum ^ (unsigned int)s->seq, s->entries, s->nblocks * sizeof(log_entry_t)) != s->checksum)
+        return NULL;
+    return s;
+}
+
+/**
+ * load the newer checkpoint, roll forward through the commits after it and
+ * build the in-memory inode table and segment usage from the inode map.
+ * return -1 if failed, 0 otherwise
+ */
+int lfs_Open()
+{
+    int num_inodes = SUPERBLOCK->num_inodes;
+    if (SUPERBLOCK->segment_blocks < LOG_COMMIT_MAX)
+        return -1;
+    nsegs = SUPERBLOCK->data_region_len / SUPERBLOCK->segment_blocks;
+    memset(&lfs_stats, 0, sizeof(lfs_stats));
+
+    log_checkpoint_t *c0 = read_checkpoint(0);
+    log_checkpoint_t *c1 = read_checkpoint(1);
+    log_checkpoint_t *c = c0;
+    next_region = 1;
+    if (c == NULL || (c1 != NULL && c1->seq > c0->seq))
+    {
+        c = c1;
+        next_region = 0;
+    }
+    if (c == NULL)
+        return -1;
+
+    imap = malloc(num_inodes * sizeof(unsigned int));
+    seg_age = malloc(nsegs * sizeof(unsigned int));
+    seg_live_data = calloc(nsegs, sizeof(int));
+    seg_live_inodes = calloc(nsegs, sizeof(int));
+    seg_state = calloc(nsegs, 1);
+    inode_table = calloc(num_inodes, sizeof(inode_t));
+    inodeMap = calloc((num_inodes + 31) / 32, sizeof(unsigned int));
+    dirty = calloc(num_inodes, 1);
+    dirty_list = malloc(num_inodes * sizeof(int));
+    if (imap == NULL || seg_age == NULL || seg_live_data == NULL || seg_live_inodes == NULL || seg_state == NULL ||
+        inode_table == NULL || inodeMap == NULL || dirty == NULL || dirty_list == NULL)
+        return -1;
+    dataMap = NULL;
+
+    unsigned int *map = (unsigned int *)(c + 1);
+    memcpy(imap, map, num_inodes * sizeof(unsigned int));
+    memcpy(seg_age, map + num_inodes, nsegs * sizeof(unsigned int));
+    seq = c->seq;
+    head = c->head;
+
+    // commits made after the checkpoint, each fsync'd before the next began
+    log_summary_t *s;
+    while (head != 0 && (s = valid_partial(head)) != NULL)
+    {
+        for (unsigned int i = 0; i < s->nblocks; i++)
+        {
+            if (s->entries[i].index != LOG_INODE_BLOCK)
+                continue;
+            unsigned int addr = head + 1 + i;
+            log_inode_block_t *block = (log_inode_block_t *)block_data(addr);
+            for (int j = 0; j < block->count && j < LOG_INODES_PER_BLOCK; j++)
+            {
+                if (block->inums[j] >= 0 && block->inums[j] < num_inodes)
+                    imap[block->inums[j]] = block->inodes[j].type == LOG_FREED ? 0 : addr * 32 + j;
+            }
+        }
+        seq = s->seq;
+        seg_age[seg_of(head)] = (unsigned int)seq;
+        head = s->next;
+        lfs_stats.rolled_forward++;
+    }
+
+    for (int inum = 0; inum < num_inodes; inum++)
+    {
+        if (imap[inum] == 0)
+            continue;
+        log_inode_block_t *block = (log_inode_block_t *)block_data(imap[inum] / 32);
+        inode_table[inum] = block->inodes[imap[inum] % 32];
+        set_bit(inodeMap, inum);
+        seg_live_inodes[seg_of(imap[inum] / 32)]++;
+        for (int i = 0; i < DIRECT_PTRS; i++)
+        {
+            if ((int)inode_table[inum].direct[i] != -1)
+                seg_live_data[seg_of(inode_table[inum].direct[i])]++;
+        }
+    }
+
+    int current = head == 0 ? -1 : seg_of(head);
+    free_segments = 0;
+    for (int seg = 0; seg < nsegs; seg++)
+    {
+        if (seg == current || seg_live_data[seg] > 0 || seg_live_inodes[seg] > 0)
+            seg_state[seg] = SEG_USED;
+        else
+            free_segments++;
+    }
+    if (get_bit(inodeMap, 0) == 0)
+        return -1;
+    // so what was rolled forward is not walked again
+    if (lfs_stats.rolled_forward > 0 && checkpoint() != 0)
+        return -1;
+    return 0;
+}
+
+/**
+ * commit, checkpoint and release the in-memory state.
+ * return -1 if failed, 0 otherwise
+ */
+int lfs_Close()
+{
+    if (imap == NULL)
+        return 0;
+    int rc = write_partial();
+    if (checkpoint() != 0)
+        rc = -1;
+    free(imap);
+    free(seg_age);
+    free(seg_live_data);
+    free(seg_live_inodes);
+    free(seg_state);
+    free(inode_table);
+    free(inodeMap);
+    free(dirty);
+    free(dirty_list);
+    imap = NULL;
+    inode_table = NULL;
+    inodeMap = NULL;
+    return rc;
+}
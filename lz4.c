@@ -0,0 +1,195 @@
+#include <string.h>
+
+#include "lz4.h"
+
+#define HASH_BITS (12)
+#define MIN_MATCH (4)
+#define LAST_LITERALS (5) // the format ends with at least this many literals
+#define MATCH_LIMIT (12)  // and no match starts in this many last bytes
+
+static unsigned int read32(const unsigned char *p)
+{
+    unsigned int v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned long long read64(const unsigned char *p)
+{
+    unsigned long long v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static int hash4(unsigned int v)
+{
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// a length that did not fit in its token nibble: 255s, then the rest
+static unsigned char *put_length(unsigned char *op, int len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+// a sequence: literals from anchor, then a match at offset back if mlen >= MIN_MATCH
+static unsigned char *put_sequence(unsigned char *op, const unsigned char *anchor, int lit, int offset, int mlen)
+{
+    unsigned char *token = op++;
+    *token = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15)
+        op = put_length(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    if (mlen < MIN_MATCH)
+        return op;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    mlen -= MIN_MATCH;
+    *token |= mlen >= 15 ? 15 : mlen;
+    if (mlen >= 15)
+        op = put_length(op, mlen - 15);
+    return op;
+}
+
+int lz4_compress(const char *source, int n, char *dest, int cap)
+{
+    const unsigned char *src = (const unsigned char *)source;
+    unsigned char *op = (unsigned char *)dest;
+    unsigned char *oend = op + cap;
+    const unsigned char *anchor = src;
+    unsigned short table[1 << HASH_BITS];
+
+    if (n > 65535)
+        return 0;
+    if (n > MATCH_LIMIT)
+    {
+        const unsigned char *ip = src + 1;
+        const unsigned char *mflimit = src + n - MATCH_LIMIT;
+        const unsigned char *matchlimit = src + n - LAST_LITERALS;
+        // the longer nothing matches, the further each miss skips ahead,
+        // so incompressible input is given up on quickly
+        int misses = 1 << 6;
+        memset(table, 0, sizeof(table));
+        while (ip < mflimit)
+        {
+            unsigned int v = read32(ip);
+            int h = hash4(v);
+            const unsigned char *ref = src + table[h];
+            table[h] = ip - src;
+            if (read32(ref) != v)
+            {
+                ip += misses++ >> 6;
+                continue;
+            }
+            misses = 1 << 6;
+            while (ip > anchor && ref > src && ip[-1] == ref[-1])
+            {
+                ip--;
+                ref--;
+            }
+            const unsigned char *end = ip + MIN_MATCH;
+            while (end + 8 <= matchlimit)
+            {
+                unsigned long long diff = read64(end) ^ read64(ref + (end - ip));
+                if (diff != 0)
+                {
+                    end += __builtin_ctzll(diff) / 8;
+                    goto matched;
+                }
+                end += 8;
+            }
+            while (end < matchlimit && *end == ref[end - ip])
+                end++;
+        matched:;
+
+            int lit = ip - anchor;
+            int mlen = end - ip;
+            if (oend - op < lit + lit / 255 + mlen / 255 + 5)
+                return 0;
+            op = put_sequence(op, anchor, lit, ip - ref, mlen);
+            ip = anchor = end;
+            if (ip < mflimit)
+                table[hash4(read32(ip - 2))] = ip - 2 - src;
+        }
+    }
+    int lit = src + n - anchor;
+    if (oend - op < lit + lit / 255 + 2)
+        return 0;
+    op = put_sequence(op, anchor, lit, 0, 0);
+    return op - (unsigned char *)dest;
+}
+
+// a length continued past its nibble, -1 if src runs out first
+static int get_length(const unsigned char **ip, const unsigned char *iend, int len)
+{
+    int b;
+    do
+    {
+        if (*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+int lz4_decompress(const char *source, int n, char *dest, int cap)
+{
+    const unsigned char *ip = (const unsigned char *)source;
+    const unsigned char *iend = ip + n;
+    unsigned char *op = (unsigned char *)dest;
+    unsigned char *oend = op + cap;
+
+    while (ip < iend)
+    {
+        int token = *ip++;
+        int lit = token >> 4;
+        if (lit == 15 && (lit = get_length(&ip, iend, lit)) < 0)
+            return -1;
+        if (lit > iend - ip || lit > oend - op)
+            return -1;
+        if (oend - op >= lit + 8 && iend - ip >= lit + 8)
+        {
+            for (int i = 0; i < lit; i += 8)
+                memcpy(op + i, ip + i, 8);
+        }
+        else
+            memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        // the last sequence has no match
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        int offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        int mlen = token & 15;
+        if (mlen == 15 && (mlen = get_length(&ip, iend, mlen)) < 0)
+            return -1;
+        mlen += MIN_MATCH;
+        if (offset == 0 || offset > op - (unsigned char *)dest || mlen > oend - op)
+            return -1;
+        const unsigned char *ref = op - offset;
+        if (offset >= 8 && oend - op >= mlen + 8)
+        {
+            // 8 bytes at a time, running up to 7 past the match into what
+            // the next sequence writes anyway
+            for (int i = 0; i < mlen; i += 8)
+                memcpy(op + i, ref + i, 8);
+        }
+        else
+        {
+            // overlapping: the match repeats the last offset bytes
+            for (int i = 0; i < mlen; i++)
+                op[i] = ref[i];
+        }
+        op += mlen;
+    }
+    return op - (unsigned char *)dest;
+}
@@ -0,0 +1,20 @@
+#ifndef __lz4_h__
+#define __lz4_h__
+
+// a small implementation of the LZ4 block format (no frames): greedy
+// matching with one hash table, so it is fast rather than thorough. inputs
+// are at most 64 KiB, which every offset then reaches
+
+/**
+ * compress n bytes of src into dst, return the compressed size, or 0 if
+ * that would be more than cap bytes
+ */
+int lz4_compress(const char *src, int n, char *dst, int cap);
+
+/**
+ * decompress n bytes of src into dst, return the decompressed size, or -1
+ * if src is not a valid block or decompresses to more than cap bytes
+ */
+int lz4_decompress(const char *src, int n, char *dst, int cap);
+
+#endif // __lz4_h__
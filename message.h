@@ -12,11 +12,47 @@
 #define MFS_UNLINK (7)
 #define MFS_SHUTDOWN (8)
 
+// server to client notification (seq 0): drop whatever is cached for inum,
+// it has been changed and is now at version
+#define MFS_REVOKE (9)
+
+#define MFS_CRET_WRITE (10) // create and write the first bytes, one commit
+#define MFS_STATS (11)      // reply buffer holds an MFS_ServerStats_t
+#define MFS_TRACE_DUMP (12) // write the trace rings to the server's -T file
+#define MFS_SNAPSHOT (13)        // rc is the new snapshot's id
+#define MFS_SNAPSHOT_DELETE (14)
+#define MFS_TRUNCATE (15)
+#define MFS_RENAME (16)
+#define MFS_COPY (17) // rc is the bytes copied
+#define MFS_GROW (18)
+
+// sharded namespaces, see MFS_SHARD_SHIFT. MFS_SHARDS also tells sessions
+// where to fail over to: rc is how many shards, reply buffer the server's
+// -K list and, after its '\0', its -B list
+#define MFS_SHARDS (19)
+#define MFS_LINK (20)    // name in pinum for inum of another shard
+#define MFS_RELEASE (21) // free inum, whose directory entry is on another shard
+
+// striped files, see MFS_SCreatStriped
+#define MFS_STRIPE (22) // make empty inum striped, or grow a striped one to size
+#define MFS_LAYOUT (23) // reply buffer holds inum's stripe_layout_t, stat its size
+
+// primary-backup replication (server -B, -F). the primary sends backups
+// every request that changed its image, in order, and they answer with the
+// last one they applied; neither gets a reply
+#define MFS_REPLICATE (24) // a logged request, or with lsn 0 a heartbeat
+#define MFS_REPL_ACK (25)  // every request of epoch up to lsn is applied
+
+// room for any request in a replicate: its header and the biggest method
+#define REPL_REQUEST_MAX (64 + MFS_BLOCK_SIZE)
+
 #include "mfs.h"
+#include "ufs.h"
 
 typedef struct _client_message
 {
     int mtype; // message type from above
+    int seq;   // request id, echoed back so sessions can match replies
 
     union
     {
@@ -53,12 +89,88 @@ typedef struct _client_message
         {
             int inum;
         } stat;
+        struct
+        {
+            int pinum;
+            int type;
+            char name[MAX_NAME_LEN];
+            int nbytes;
+            char buffer[4096];
+        } create_write;
+        struct
+        {
+            int id;
+        } snapshot;
+        struct
+        {
+            int inum;
+            int size;
+        } truncate;
+        struct
+        {
+            int pinum;
+            char name[MAX_NAME_LEN];
+            int newpinum;
+            char newname[MAX_NAME_LEN];
+        } rename;
+        struct
+        {
+            int inum;
+            int offset;
+            int dinum;
+            int doffset;
+            int nbytes;
+        } copy;
+        struct
+        {
+            int num_inodes;
+            int num_data;
+        } grow;
+        struct
+        {
+            int pinum;
+            int inum;
+            char name[MAX_NAME_LEN];
+        } link;
+        struct
+        {
+            int inum;
+        } release;
+        struct
+        {
+            int inum;
+            int size;
+            stripe_layout_t layout;
+        } stripe;
+        struct
+        {
+            int inum;
+        } layout;
+        struct
+        {
+            unsigned long long epoch; // which run of the primary the stream is from
+            unsigned long long lsn;   // 1, 2, .. in the order the primary applied them
+            int rc;                   // what the primary answered, as clients know it
+            int len;                  // of request
+            unsigned int addr;        // the client that sent it, network order,
+            unsigned short port;      // ... answered again if it resends
+            char request[REPL_REQUEST_MAX]; // a client_message_t as the handlers saw it
+        } replicate;
+        struct
+        {
+            unsigned long long epoch;
+            unsigned long long lsn;
+        } ack;
     } method;
 } client_message_t;
 
 typedef struct _server_message
 {
     int rc;    // return code
+    int seq;   // seq of the request this answers
+    int inum;  // inode the lease and version below refer to, -1 if none
+    int lease; // ms the answer may be cached for, 0 means do not cache
+    unsigned int version; // bumped every time inum changes
     char buffer[4096];
     MFS_Stat_t stat;
     MFS_DirEnt_t dir;
@@ -1,220 +1,1938 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/random.h>
 #include "mfs.h"
 #include "udp.h"
 #include "message.h"
+#include "ufs.h"
+#include "trace.h"
 
-int fd;
-struct sockaddr_in server_addr;
+#define MAX_INFLIGHT (256) // outstanding requests per session, power of two
+#define RETRY_MS (1000)    // resend a request nobody answered after this long
+#define MAX_TRIES (5)      // ... and give up with -1 after this many sends
+#define SOCKET_BUFFER (1 << 20)
+#define NAME_CACHE_SIZE (1024) // (pinum, name) -> inum, direct mapped
+#define STAT_CACHE_SIZE (1024) // inum -> MFS_Stat_t, direct mapped
+#define FILE_CACHE_SIZE (16)   // files with cached data, direct mapped
+#define DIRTY_LIMIT (32)       // dirty blocks per session before write-back
+#define FLUSH_WINDOW (8)       // write-back RPCs in flight per file
+#define LAYOUT_CACHE_SIZE (16) // striped files' layouts, direct mapped
+#define STRIPE_WINDOW (64)     // RPCs in flight per striped read or write
+#define MAX_REPLICAS (9)       // the server and its -B backups
+#define FAILOVER_MS (2000)     // silence before requests move to the next replica
 
-int retry()
+// trace id of an RPC, seq alone repeats across sessions
+#define RPC_TRACE_ID(s, seq) (((unsigned int)(s)->fd << 24) ^ (unsigned int)(seq))
+
+typedef struct
+{
+    int valid;
+    int pinum;
+    char name[MAX_NAME_LEN];
+    int inum;         // -1 caches a negative lookup
+    long long expiry; // ms, end of the lease on pinum
+} name_entry_t;
+
+typedef struct
+{
+    int valid;
+    int inum;
+    MFS_Stat_t stat;
+    long long expiry; // ms, end of the lease on inum
+} stat_entry_t;
+
+typedef struct
+{
+    int valid;
+    int inum;
+    int size;
+    stripe_layout_t layout;
+    long long expiry; // ms, end of the lease on inum
+} layout_entry_t;
+
+typedef struct
+{
+    int inum;             // -1 if the slot is unused
+    int nocache;          // the server won't hand out whole blocks (directories)
+    int regular;          // a stat found inum to be a regular file in use
+    unsigned int version; // version of inum the clean blocks were read at
+    long long expiry;     // ms, end of the newest read lease
+    char *blocks[DIRECT_PTRS];
+    char valid[DIRECT_PTRS]; // block holds the server's contents
+    short lo[DIRECT_PTRS];   // dirty byte range [lo, hi) of the block,
+    short hi[DIRECT_PTRS];   // empty when lo == hi
+} file_cache_t;
+
+struct __MFS_Future_t
+{
+    MFS_Session_t *session;
+    client_message_t message; // kept for retransmission
+    char *buffer;             // MFS_READ (or MFS_STATS) destination
+    MFS_Stat_t *stat;         // MFS_STAT destination
+    int rc;
+    int lease;                // lease and version from the reply
+    unsigned int version;
+    int done;
+    int tries;
+    long long deadline;       // ms, CLOCK_MONOTONIC
+    pthread_cond_t cond;      // waited on by MFS_Wait, under session->lock
+    MFS_Callback_t cb;        // set by MFS_Then, run on the event loop
+    void *arg;
+    int shard;                // shard to send to, -1 for that of the inode it is about
+};
+
+struct __MFS_Session_t
+{
+    int fd;
+    struct sockaddr_in server_addr;
+    // the shards of a sharded server, from MFS_SHARDS; nshards is 0 and
+    // everything goes to server_addr if it is not
+    int nshards;
+    struct sockaddr_in shards[MFS_MAX_SHARDS];
+    // a replicated server and its backups, from MFS_SHARDS too: server_addr
+    // moves on to the next of them when the one in use goes quiet
+    int nreplicas;
+    struct sockaddr_in replicas[MAX_REPLICAS];
+    int replica;              // the one server_addr is
+    long long heard_ms;       // last datagram from any server
+    long long switched_ms;    // last move to another replica
+    int wake[2];              // pipe used to kick the event loop out of poll
+    pthread_t loop;
+    pthread_mutex_t lock;
+    pthread_cond_t window;    // signalled whenever a pending slot frees up
+    int seq;
+    int closing;
+    MFS_Future_t *pending[MAX_INFLIGHT]; // indexed by seq % MAX_INFLIGHT
+
+    // metadata cache, all under lock
+    int caching;
+    name_entry_t names[NAME_CACHE_SIZE];
+    stat_entry_t stats[STAT_CACHE_SIZE];
+    // highest version revoked per inum % STAT_CACHE_SIZE: replies older than
+    // that raced with a revocation and must not be cached
+    unsigned int revoked[STAT_CACHE_SIZE];
+    layout_entry_t layouts[LAYOUT_CACHE_SIZE];
+    MFS_CacheStats_t cstats;
+
+    // data cache, under data_lock. the event loop never takes data_lock, it
+    // only raises revoked[] which the data cache checks before trusting a block
+    pthread_mutex_t data_lock;
+    file_cache_t files[FILE_CACHE_SIZE];
+    int dirty_blocks;
+};
+
+MFS_Session_t *default_session = NULL;
+
+// what MFS_SHARDS last told a session and the server it asked, so sessions
+// opened to that server later (mfsbench's clients, mfscli's transfers)
+// start out knowing it instead of asking again
+struct
 {
-    struct timeval time;
-    fd_set set;
-    time.tv_sec = 5;
-    time.tv_usec = 0;
-    FD_ZERO(&set);
-    FD_SET(fd, &set);
-    return select(fd + 1, &set, NULL, NULL, &time);
+    pthread_mutex_t lock;
+    int known;
+    struct sockaddr_in server;
+    int nshards;
+    struct sockaddr_in shards[MFS_MAX_SHARDS];
+    int nreplicas;
+    struct sockaddr_in replicas[MAX_REPLICAS];
+} topology = {PTHREAD_MUTEX_INITIALIZER};
+
+int files_flush(MFS_Session_t *s);
+int files_cached(MFS_Session_t *s);
+int file_forget(MFS_Session_t *s, int inum, int keep);
+int topology_fetch(MFS_Session_t *s);
+
+long long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
 }
 
-int MFS_Init(char *hostname, int port)
+// bytes of m worth putting on the wire: only writes and stripes carry a
+// payload, and renames are the one other request bigger than a create
+int message_len(client_message_t *m)
 {
-    int rc = UDP_FillSockAddr(&server_addr, hostname, port);
-    if (rc != 0)
+    switch (m->mtype)
     {
-        printf("Failed to set up server address");
-        return rc;
+    case MFS_WRITE:
+        return offsetof(client_message_t, method.write.buffer) + m->method.write.nbytes;
+    case MFS_CRET_WRITE:
+        return offsetof(client_message_t, method.create_write.buffer) + m->method.create_write.nbytes;
+    case MFS_RENAME:
+        return offsetof(client_message_t, method) + sizeof(m->method.rename);
+    case MFS_STRIPE:
+        return offsetof(client_message_t, method.stripe.layout.inums) + m->method.stripe.layout.count * sizeof(int);
+    default:
+        return offsetof(client_message_t, method) + sizeof(m->method.create);
     }
+}
 
-    fd = UDP_Open(3473);
-    return 0;
+unsigned int name_key(int pinum, const char *name)
+{
+    unsigned int h = 5381 + pinum * 31;
+    for (; *name != '\0'; name++)
+        h = h * 33 + (unsigned char)*name;
+    return h;
 }
 
-int MFS_Lookup(int pinum, char *name)
+unsigned int name_hash(int pinum, const char *name)
 {
-    client_message_t message;
-    message.mtype = MFS_LOOKUP;
-    message.method.lookup.pinum = pinum;
-    strcpy(message.method.lookup.name, name);
+    return name_key(pinum, name) % NAME_CACHE_SIZE;
+}
 
-    int rc = UDP_Write(fd, &server_addr, (char*)&message, sizeof(message));
-    rc = retry();
+// the shard inode inum is on, -1 for none
+int inum_shard(int inum)
+{
+    return inum < 0 ? -1 : inum >> MFS_SHARD_SHIFT;
+}
 
-    if(rc >= 0)
+// the inode request m is about, -1 if it is about the whole server
+int message_inum(client_message_t *m)
+{
+    switch (m->mtype)
     {
-        server_message_t response;
-        struct sockaddr_in ret_addr;
+    case MFS_LOOKUP:
+        return m->method.lookup.pinum;
+    case MFS_STAT:
+        return m->method.stat.inum;
+    case MFS_WRITE:
+        return m->method.write.inum;
+    case MFS_READ:
+        return m->method.read.inum;
+    case MFS_CRET:
+        return m->method.create.pinum;
+    case MFS_CRET_WRITE:
+        return m->method.create_write.pinum;
+    case MFS_UNLINK:
+        return m->method.unlink.pinum;
+    case MFS_TRUNCATE:
+        return m->method.truncate.inum;
+    case MFS_RENAME:
+        return m->method.rename.pinum;
+    case MFS_COPY:
+        return m->method.copy.inum;
+    case MFS_LINK:
+        return m->method.link.pinum;
+    case MFS_RELEASE:
+        return m->method.release.inum;
+    case MFS_STRIPE:
+        return m->method.stripe.inum;
+    case MFS_LAYOUT:
+        return m->method.layout.inum;
+    default:
+        return -1;
+    }
+}
 
-        rc = UDP_Read(fd, &ret_addr, (char*)&response, sizeof(response));
+// where f goes: the shard of the inode it is about, or the server the
+// session was opened with
+struct sockaddr_in *route(MFS_Session_t *s, MFS_Future_t *f)
+{
+    int shard = f->shard >= 0 ? f->shard : inum_shard(message_inum(&f->message));
+    if (shard < 0 || shard >= s->nshards)
+        return &s->server_addr;
+    return &s->shards[shard];
+}
 
-        return response.rc;
+// the cache functions below are called with s->lock held
+
+int cache_lookup(MFS_Session_t *s, int pinum, char *name, int *inum)
+{
+    name_entry_t *e = &s->names[name_hash(pinum, name)];
+    if (s->caching && e->valid && e->pinum == pinum && strcmp(e->name, name) == 0 && e->expiry > now_ms())
+    {
+        s->cstats.lookup_hits++;
+        *inum = e->inum;
+        return 1;
     }
-    else
+    s->cstats.lookup_misses++;
+    return 0;
+}
+
+int cache_stat(MFS_Session_t *s, int inum, MFS_Stat_t *m)
+{
+    stat_entry_t *e = &s->stats[(unsigned int)inum % STAT_CACHE_SIZE];
+    if (s->caching && e->valid && e->inum == inum && e->expiry > now_ms())
     {
-        return -1;
+        s->cstats.stat_hits++;
+        *m = e->stat;
+        return 1;
     }
+    s->cstats.stat_misses++;
+    return 0;
 }
 
-int MFS_Stat(int inum, MFS_Stat_t *m)
+// remember the answer to f if the server leased it to us
+void cache_fill(MFS_Session_t *s, MFS_Future_t *f, server_message_t *response)
 {
-    client_message_t message;
-    message.mtype = MFS_STAT;
-    message.method.stat.inum = inum;
+    if (!s->caching || response->lease <= 0 || response->inum < 0)
+        return;
+    if (response->version < s->revoked[(unsigned int)response->inum % STAT_CACHE_SIZE])
+        return;
 
-    int rc = UDP_Write(fd, &server_addr, (char*)&message, sizeof(message));
-    rc = retry();
+    long long expiry = now_ms() + response->lease;
+    if (f->message.mtype == MFS_LOOKUP)
+    {
+        name_entry_t *e = &s->names[name_hash(f->message.method.lookup.pinum, f->message.method.lookup.name)];
+        e->valid = 1;
+        e->pinum = f->message.method.lookup.pinum;
+        strcpy(e->name, f->message.method.lookup.name);
+        e->inum = response->rc;
+        e->expiry = expiry;
+    }
+    else if (f->message.mtype == MFS_STAT && response->rc == 0)
+    {
+        stat_entry_t *e = &s->stats[(unsigned int)response->inum % STAT_CACHE_SIZE];
+        e->valid = 1;
+        e->inum = response->inum;
+        e->stat = response->stat;
+        e->expiry = expiry;
+    }
+}
 
-    if(rc >= 0)
+// forget everything learned about inum, both its stat and, if it is a
+// directory, the names looked up in it
+void cache_invalidate(MFS_Session_t *s, int inum)
+{
+    stat_entry_t *e = &s->stats[(unsigned int)inum % STAT_CACHE_SIZE];
+    if (e->inum == inum)
+        e->valid = 0;
+    layout_entry_t *l = &s->layouts[(unsigned int)inum % LAYOUT_CACHE_SIZE];
+    if (l->inum == inum)
+        l->valid = 0;
+    for (int i = 0; i < NAME_CACHE_SIZE; i++)
     {
-        server_message_t response;
-        struct sockaddr_in ret_addr;
-    
-        rc = UDP_Read(fd, &ret_addr, (char*)&response, sizeof(response));
+        if (s->names[i].pinum == inum)
+            s->names[i].valid = 0;
+    }
+}
 
-        if(response.rc >= 0)
-        {
-            m->size = response.stat.size;
-            m->type = response.stat.type;
-            printf("%d,%d\n",m->size,m->type);
-        }
+// nothing cached about inum from before version may be used any more
+void cache_raise(MFS_Session_t *s, int inum, unsigned int version)
+{
+    unsigned int *floor = &s->revoked[(unsigned int)inum % STAT_CACHE_SIZE];
+    if (version > *floor)
+        *floor = version;
+}
 
-        return response.rc;
-    }
+void cache_revoke(MFS_Session_t *s, int inum, unsigned int version)
+{
+    cache_raise(s, inum, version);
+    cache_invalidate(s, inum);
+    s->cstats.revokes++;
+}
+
+void future_free(MFS_Future_t *f)
+{
+    pthread_cond_destroy(&f->cond);
+    free(f);
+}
+
+// mark f finished, called with session->lock held. futures with a callback
+// are chained onto *ready so the caller can run them once the lock is dropped
+void future_complete(MFS_Future_t *f, int rc, MFS_Future_t **ready, int *nready)
+{
+    f->rc = rc;
+    f->done = 1;
+    if (f->cb != NULL)
+        ready[(*nready)++] = f;
     else
+        pthread_cond_signal(&f->cond);
+}
+
+void run_callbacks(MFS_Future_t **ready, int nready)
+{
+    for (int i = 0; i < nready; i++)
     {
-        return -1;
+        ready[i]->cb(ready[i]->rc, ready[i]->arg);
+        future_free(ready[i]);
     }
 }
 
-int MFS_Write(int inum, char *buffer, int offset, int nbytes)
+void *event_loop(void *arg)
+{
+    MFS_Session_t *s = (MFS_Session_t *)arg;
+    MFS_Future_t *ready[MAX_INFLIGHT];
+
+    while (1)
+    {
+        pthread_mutex_lock(&s->lock);
+        if (s->closing)
+        {
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+        long long now = now_ms();
+        long long next = now + RETRY_MS;
+        for (int i = 0; i < MAX_INFLIGHT; i++)
+        {
+            if (s->pending[i] != NULL && s->pending[i]->deadline < next)
+                next = s->pending[i]->deadline;
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        struct pollfd fds[2];
+        fds[0].fd = s->fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = s->wake[0];
+        fds[1].events = POLLIN;
+        int timeout = next > now ? (int)(next - now) : 0;
+        if (poll(fds, 2, timeout) < 0)
+            continue;
+
+        if (fds[1].revents & POLLIN)
+        {
+            char drain[64];
+            (void)read(s->wake[0], drain, sizeof(drain));
+        }
+
+        int nready = 0;
+        if (fds[0].revents & POLLIN)
+        {
+            server_message_t response;
+            int rc;
+            while ((rc = recvfrom(s->fd, &response, sizeof(response), MSG_DONTWAIT, NULL, NULL)) > 0)
+            {
+                if (rc < (int)offsetof(server_message_t, buffer))
+                    continue;
+
+                pthread_mutex_lock(&s->lock);
+                s->heard_ms = now_ms();
+                if (response.seq == 0)
+                {
+                    if (response.rc == MFS_REVOKE)
+                        cache_revoke(s, response.inum, response.version);
+                    pthread_mutex_unlock(&s->lock);
+                    continue;
+                }
+                int slot = response.seq & (MAX_INFLIGHT - 1);
+                MFS_Future_t *f = s->pending[slot];
+                if (f != NULL && f->message.seq == response.seq)
+                {
+                    TRACE_ASYNC_END(TRACE_RPC, RPC_TRACE_ID(s, response.seq));
+                    s->pending[slot] = NULL;
+                    pthread_cond_signal(&s->window);
+                    if (response.rc >= 0 && f->buffer != NULL)
+                        memcpy(f->buffer, response.buffer, f->message.mtype == MFS_STATS ? sizeof(MFS_ServerStats_t) :
+                                                           f->message.mtype == MFS_SHARDS ? MFS_BLOCK_SIZE :
+                                                           f->message.mtype == MFS_LAYOUT ? sizeof(stripe_layout_t) :
+                                                           f->message.method.read.nbytes);
+                    if (response.rc >= 0 && f->stat != NULL)
+                        *f->stat = response.stat;
+                    f->lease = response.lease;
+                    f->version = response.version;
+                    cache_fill(s, f, &response);
+                    if ((f->message.mtype == MFS_WRITE || f->message.mtype == MFS_TRUNCATE || f->message.mtype == MFS_COPY ||
+                         f->message.mtype == MFS_STRIPE) &&
+                        response.rc >= 0 && response.inum >= 0)
+                        cache_raise(s, response.inum, response.version);
+                    future_complete(f, response.rc, ready, &nready);
+                }
+                pthread_mutex_unlock(&s->lock);
+
+                if (nready > MAX_INFLIGHT / 2)
+                {
+                    run_callbacks(ready, nready);
+                    nready = 0;
+                }
+            }
+        }
+
+        // resend whatever timed out, fail what has been resent too often
+        pthread_mutex_lock(&s->lock);
+        now = now_ms();
+        for (int i = 0; i < MAX_INFLIGHT; i++)
+        {
+            MFS_Future_t *f = s->pending[i];
+            if (f == NULL || f->deadline > now)
+                continue;
+            if (f->tries >= MAX_TRIES)
+            {
+                TRACE_ASYNC_END(TRACE_RPC, RPC_TRACE_ID(s, f->message.seq));
+                s->pending[i] = NULL;
+                pthread_cond_signal(&s->window);
+                future_complete(f, -1, ready, &nready);
+                continue;
+            }
+            // nothing from the server for a while: the backup has taken over
+            if (s->nreplicas > 1 && f->tries >= 3 && now - s->heard_ms >= FAILOVER_MS && now - s->switched_ms >= FAILOVER_MS)
+            {
+                s->replica = (s->replica + 1) % s->nreplicas;
+                s->server_addr = s->replicas[s->replica];
+                s->switched_ms = now;
+            }
+            f->tries++;
+            f->deadline = now + RETRY_MS;
+            TRACE_INSTANT(TRACE_RETRY, f->message.seq);
+            UDP_Write(s->fd, route(s, f), (char *)&f->message, message_len(&f->message));
+        }
+        pthread_mutex_unlock(&s->lock);
+        run_callbacks(ready, nready);
+    }
+    return NULL;
+}
+
+#ifdef MFS_TRACE
+// with MFS_TRACE_FILE set, the client's rings are written there at exit
+void dump_client_trace()
+{
+    char *path = getenv("MFS_TRACE_FILE");
+    if (path != NULL && trace_dump(path) != 0)
+        perror(path);
+}
+
+void register_client_trace()
+{
+    atexit(dump_client_trace);
+}
+#endif
+
+MFS_Session_t *MFS_Open(char *hostname, int port)
 {
-    client_message_t message;
-    message.mtype = MFS_WRITE;
-    message.method.write.inum = inum;
-    message.method.write.offset = offset;
-    message.method.write.nbytes = nbytes;
-    memcpy(message.method.write.buffer, buffer,4096);
+#ifdef MFS_TRACE
+    static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+    pthread_once(&trace_once, register_client_trace);
+#endif
+    MFS_Session_t *s = calloc(1, sizeof(MFS_Session_t));
+    if (s == NULL)
+        return NULL;
 
-    int rc = UDP_Write(fd, &server_addr, (char*)&message, sizeof(message));
-    rc = retry();
+    if (UDP_FillSockAddr(&s->server_addr, hostname, port) != 0)
+    {
+        free(s);
+        return NULL;
+    }
 
-    if(rc >= 0)
+    // port 0: let the kernel pick, so any number of clients fit on a host
+    s->fd = UDP_Open(0);
+    if (s->fd <= 0)
     {
-        server_message_t response;
-        struct sockaddr_in ret_addr;
-    
-        rc = UDP_Read(fd, &ret_addr, (char*)&response, sizeof(response));
+        free(s);
+        return NULL;
+    }
+    int size = SOCKET_BUFFER;
+    setsockopt(s->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    if (pipe(s->wake) != 0)
+    {
+        UDP_Close(s->fd);
+        free(s);
+        return NULL;
+    }
 
-        return response.rc;
+    s->caching = 1;
+    // the server answers a resend from its cache by address and seq, so a
+    // session on a port another just used must not repeat its seqs
+    unsigned int start;
+    if (getrandom(&start, sizeof(start), 0) != sizeof(start))
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        start = ts.tv_nsec ^ ts.tv_sec ^ (getpid() << 16);
     }
-    else
+    s->seq = start & 0x7fffffff;
+    for (int i = 0; i < FILE_CACHE_SIZE; i++)
+        s->files[i].inum = -1;
+    pthread_mutex_init(&s->data_lock, NULL);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->window, NULL);
+    if (pthread_create(&s->loop, NULL, event_loop, s) != 0)
     {
-        return -1;
+        close(s->wake[0]);
+        close(s->wake[1]);
+        UDP_Close(s->fd);
+        free(s);
+        return NULL;
+    }
+    s->heard_ms = now_ms();
+    if (topology_fetch(s) != 0)
+    {
+        // nobody there
+        MFS_Close(s);
+        return NULL;
     }
+    return s;
 }
 
-int MFS_Read(int inum, char *buffer, int offset, int nbytes)
+// stop the event loop and fail anything still in flight with -1. callers
+// must not close a session other threads are still issuing calls on
+int MFS_Close(MFS_Session_t *s)
 {
-    client_message_t message;
-    message.mtype = MFS_READ;
-    message.method.read.inum = inum;
-    message.method.read.offset = offset;
-    message.method.read.nbytes = nbytes;
+    if (s == NULL)
+        return -1;
 
-    int rc = UDP_Write(fd, &server_addr, (char*)&message, sizeof(message));
-    rc = retry();
+    // close is a write-back point for everything still dirty
+    pthread_mutex_lock(&s->data_lock);
+    int rc = files_flush(s);
+    pthread_mutex_unlock(&s->data_lock);
 
-    if(rc >= 0)
+    pthread_mutex_lock(&s->lock);
+    s->closing = 1;
+    pthread_cond_broadcast(&s->window);
+    pthread_mutex_unlock(&s->lock);
+    (void)write(s->wake[1], "x", 1);
+    pthread_join(s->loop, NULL);
+
+    MFS_Future_t *ready[MAX_INFLIGHT];
+    int nready = 0;
+    pthread_mutex_lock(&s->lock);
+    for (int i = 0; i < MAX_INFLIGHT; i++)
     {
-        server_message_t response;
-        struct sockaddr_in ret_addr;
-    
-        rc = UDP_Read(fd, &ret_addr, (char*)&response, sizeof(response));
+        if (s->pending[i] != NULL)
+            future_complete(s->pending[i], -1, ready, &nready);
+        s->pending[i] = NULL;
+    }
+    pthread_mutex_unlock(&s->lock);
+    run_callbacks(ready, nready);
 
-        if(response.rc >= 0)
-        {
-            memcpy(buffer, response.buffer,nbytes);
-        }
-        return response.rc;
+    close(s->wake[0]);
+    close(s->wake[1]);
+    UDP_Close(s->fd);
+    for (int i = 0; i < FILE_CACHE_SIZE; i++)
+    {
+        for (int b = 0; b < DIRECT_PTRS; b++)
+            free(s->files[i].blocks[b]);
     }
-    else
+    pthread_cond_destroy(&s->window);
+    pthread_mutex_destroy(&s->lock);
+    pthread_mutex_destroy(&s->data_lock);
+    free(s);
+    return rc;
+}
+
+MFS_Future_t *future_new(MFS_Session_t *s, int mtype)
+{
+    if (s == NULL)
+        return NULL;
+    MFS_Future_t *f = calloc(1, sizeof(MFS_Future_t));
+    if (f == NULL)
+        return NULL;
+    f->session = s;
+    f->message.mtype = mtype;
+    f->shard = -1;
+    pthread_cond_init(&f->cond, NULL);
+    return f;
+}
+
+// a request that never makes it onto the wire completes right away
+MFS_Future_t *future_done(MFS_Future_t *f, int rc)
+{
+    f->rc = rc;
+    f->done = 1;
+    return f;
+}
+
+MFS_Future_t *future_fail(MFS_Future_t *f)
+{
+    return future_done(f, -1);
+}
+
+// assign a seq, park f in its pending slot (waiting for the window if
+// MAX_INFLIGHT requests are already out) and send it
+MFS_Future_t *submit(MFS_Future_t *f)
+{
+    if (f == NULL)
+        return NULL;
+    MFS_Session_t *s = f->session;
+
+    pthread_mutex_lock(&s->lock);
+    while (!s->closing && s->pending[(s->seq + 1) & (MAX_INFLIGHT - 1)] != NULL)
+        pthread_cond_wait(&s->window, &s->lock);
+    if (s->closing)
     {
-        return -1;
+        pthread_mutex_unlock(&s->lock);
+        return future_fail(f);
+    }
+    // seq 0 is never used for requests
+    s->seq = (s->seq + 1) & 0x7fffffff;
+    if (s->seq == 0)
+        s->seq = MAX_INFLIGHT;
+    f->message.seq = s->seq;
+    f->tries = 1;
+    s->cstats.rpcs++;
+    // our own changes must not be answered from the cache, even before the
+    // server's revocation arrives
+    if (f->message.mtype == MFS_CRET)
+        cache_invalidate(s, f->message.method.create.pinum);
+    else if (f->message.mtype == MFS_CRET_WRITE)
+        cache_invalidate(s, f->message.method.create_write.pinum);
+    else if (f->message.mtype == MFS_UNLINK)
+        cache_invalidate(s, f->message.method.unlink.pinum);
+    else if (f->message.mtype == MFS_WRITE)
+        cache_invalidate(s, f->message.method.write.inum);
+    else if (f->message.mtype == MFS_TRUNCATE)
+        cache_invalidate(s, f->message.method.truncate.inum);
+    else if (f->message.mtype == MFS_RENAME)
+    {
+        cache_invalidate(s, f->message.method.rename.pinum);
+        cache_invalidate(s, f->message.method.rename.newpinum);
     }
+    else if (f->message.mtype == MFS_COPY)
+        cache_invalidate(s, f->message.method.copy.dinum);
+    else if (f->message.mtype == MFS_LINK)
+        cache_invalidate(s, f->message.method.link.pinum);
+    else if (f->message.mtype == MFS_RELEASE)
+        cache_invalidate(s, f->message.method.release.inum);
+    else if (f->message.mtype == MFS_STRIPE)
+        cache_invalidate(s, f->message.method.stripe.inum);
+    f->deadline = now_ms() + RETRY_MS;
+    TRACE_ASYNC_BEGIN(TRACE_RPC, RPC_TRACE_ID(s, f->message.seq));
+    s->pending[s->seq & (MAX_INFLIGHT - 1)] = f;
+    // server_addr moves when the session fails over
+    struct sockaddr_in to = *route(s, f);
+    pthread_mutex_unlock(&s->lock);
+
+    // a lost send is covered by the event loop's retransmission
+    TRACE_BEGIN(TRACE_SEND, f->message.mtype);
+    UDP_Write(s->fd, &to, (char *)&f->message, message_len(&f->message));
+    TRACE_END(TRACE_SEND, f->message.mtype);
+    return f;
 }
 
-int MFS_Creat(int pinum, int type, char *name)
+// MFS_Wait, also handing back the lease and version the reply carried
+int future_wait(MFS_Future_t *f, int *lease, unsigned int *version)
+{
+    if (f == NULL)
+        return -1;
+    MFS_Session_t *s = f->session;
+
+    TRACE_BEGIN(TRACE_WAIT, 0);
+    pthread_mutex_lock(&s->lock);
+    while (!f->done)
+        pthread_cond_wait(&f->cond, &s->lock);
+    int rc = f->rc;
+    if (lease != NULL)
+        *lease = f->lease;
+    if (version != NULL)
+        *version = f->version;
+    pthread_mutex_unlock(&s->lock);
+    TRACE_END(TRACE_WAIT, 0);
+
+    future_free(f);
+    return rc;
+}
+
+int MFS_Wait(MFS_Future_t *f)
 {
-    client_message_t message;
-    message.mtype = MFS_CRET;
-    message.method.create.pinum = pinum;
-    message.method.create.type = type;
-    strcpy(message.method.create.name, name);
+    return future_wait(f, NULL, NULL);
+}
 
-    int rc = UDP_Write(fd, &server_addr, (char*)&message, sizeof(message));
-    rc = retry();
+// run cb(rc, arg) once f completes, on the session's event loop thread (or
+// right here if it already has). f belongs to the library afterwards
+int MFS_Then(MFS_Future_t *f, MFS_Callback_t cb, void *arg)
+{
+    if (f == NULL)
+    {
+        cb(-1, arg);
+        return -1;
+    }
+    MFS_Session_t *s = f->session;
 
-    if(rc >= 0)
+    pthread_mutex_lock(&s->lock);
+    if (!f->done)
     {
-        server_message_t response;
-        struct sockaddr_in ret_addr;
-    
-        rc = UDP_Read(fd, &ret_addr, (char*)&response, sizeof(response));
+        f->cb = cb;
+        f->arg = arg;
+        pthread_mutex_unlock(&s->lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    cb(f->rc, arg);
+    future_free(f);
+    return 0;
+}
+
+/*
+ * sharded servers. the calls above send each request to the shard of the
+ * inode it is about; the ones below are what a directory on another shard
+ * than its parent takes. each waits for its replies, so the async calls
+ * that need them block
+ */
 
-        return response.rc;
+// fill addrs from a comma separated host:port list, at most max of them.
+// return how many, -1 if it does not parse
+int hosts_parse(char *list, struct sockaddr_in *addrs, int max)
+{
+    char *save;
+    int n = 0;
+    for (char *item = strtok_r(list, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save))
+    {
+        char *colon = strrchr(item, ':');
+        if (n == max || colon == NULL)
+            return -1;
+        *colon = '\0';
+        if (UDP_FillSockAddr(&addrs[n], item, atoi(colon + 1)) != 0)
+            return -1;
+        n++;
     }
-    else
+    return n;
+}
+
+/**
+ * ask the server, in one round trip, which shards it is one of and which
+ * backups (server -B) it has. a sharded session sends each request to its
+ * shard; otherwise it starts on the server it was opened with and fails
+ * over to the backups in the order listed.
+ * return -1 if the server did not answer, 0 otherwise
+ */
+int topology_fetch(MFS_Session_t *s)
+{
+    pthread_mutex_lock(&topology.lock);
+    int known = topology.known && topology.server.sin_addr.s_addr == s->server_addr.sin_addr.s_addr &&
+                topology.server.sin_port == s->server_addr.sin_port;
+    if (known)
     {
+        pthread_mutex_lock(&s->lock);
+        s->nshards = topology.nshards;
+        memcpy(s->shards, topology.shards, sizeof(topology.shards));
+        s->nreplicas = topology.nreplicas;
+        memcpy(s->replicas, topology.replicas, sizeof(topology.replicas));
+        pthread_mutex_unlock(&s->lock);
+    }
+    pthread_mutex_unlock(&topology.lock);
+    if (known)
+        return 0;
+
+    char lists[MFS_BLOCK_SIZE];
+    MFS_Future_t *f = future_new(s, MFS_SHARDS);
+    if (f == NULL)
         return -1;
+    f->buffer = lists;
+    int n = MFS_Wait(submit(f));
+    if (n < 0)
+        return -1;
+    lists[MFS_BLOCK_SIZE - 1] = '\0';
+    char *backups = lists + strlen(lists) + 1;
+    if (backups >= lists + MFS_BLOCK_SIZE)
+        backups = "";
+
+    struct sockaddr_in shards[MFS_MAX_SHARDS];
+    struct sockaddr_in replicas[MAX_REPLICAS];
+    int nshards = 0;
+    int nreplicas = 0;
+    if (n > 1 && n <= MFS_MAX_SHARDS && hosts_parse(lists, shards, MFS_MAX_SHARDS) == n)
+        nshards = n;
+    else if (n <= 1)
+    {
+        int nbackups = hosts_parse(backups, replicas + 1, MAX_REPLICAS - 1);
+        if (nbackups > 0)
+        {
+            replicas[0] = s->server_addr;
+            nreplicas = nbackups + 1;
+        }
     }
+
+    pthread_mutex_lock(&topology.lock);
+    pthread_mutex_lock(&s->lock);
+    s->nshards = nshards;
+    memcpy(s->shards, shards, nshards * sizeof(struct sockaddr_in));
+    s->nreplicas = nreplicas;
+    memcpy(s->replicas, replicas, nreplicas * sizeof(struct sockaddr_in));
+    topology.known = 1;
+    topology.server = s->server_addr;
+    topology.nshards = nshards;
+    memcpy(topology.shards, s->shards, sizeof(topology.shards));
+    topology.nreplicas = nreplicas;
+    memcpy(topology.replicas, s->replicas, sizeof(topology.replicas));
+    pthread_mutex_unlock(&s->lock);
+    pthread_mutex_unlock(&topology.lock);
+    return 0;
 }
 
-int MFS_Unlink(int pinum, char *name)
+// MFS_LOOKUP that the cache does not answer. m, unless NULL, gets the type
+// of what name is for, -1 if that is on another shard
+int lookup_uncached(MFS_Session_t *s, int pinum, char *name, MFS_Stat_t *m)
+{
+    MFS_Future_t *f = future_new(s, MFS_LOOKUP);
+    if (f == NULL)
+        return -1;
+    f->stat = m;
+    f->message.method.lookup.pinum = pinum;
+    strncpy(f->message.method.lookup.name, name, MAX_NAME_LEN);
+    f->message.method.lookup.name[MAX_NAME_LEN - 1] = '\0';
+    return MFS_Wait(submit(f));
+}
+
+// free inum, named in a directory of another shard
+int release(MFS_Session_t *s, int inum)
+{
+    MFS_Future_t *f = future_new(s, MFS_RELEASE);
+    if (f == NULL)
+        return -1;
+    f->message.method.release.inum = inum;
+    return MFS_Wait(submit(f));
+}
+
+/**
+ * MFS_CRET of directory name in pinum on shard, not pinum's: it is made
+ * there and then named in pinum with MFS_LINK. if something took the name
+ * in the meantime the new directory is freed again and that returned, as
+ * MFS_CRET would. return -1 if failed, the inode number otherwise
+ */
+int create_remote(MFS_Session_t *s, int pinum, char *name, int shard)
 {
-    client_message_t message;
-    message.mtype = MFS_UNLINK;
-    message.method.unlink.pinum = pinum;
-    strcpy(message.method.unlink.name, name);
+    int inum = lookup_uncached(s, pinum, name, NULL);
+    if (inum != -1)
+        return inum;
 
-    int rc = UDP_Write(fd, &server_addr, (char*)&message, sizeof(message));
-    rc = retry();
+    MFS_Future_t *f = future_new(s, MFS_CRET);
+    if (f == NULL)
+        return -1;
+    f->shard = shard;
+    f->message.method.create.pinum = pinum;
+    f->message.method.create.type = MFS_DIRECTORY;
+    strncpy(f->message.method.create.name, name, MAX_NAME_LEN - 1);
+    inum = MFS_Wait(submit(f));
+    if (inum == -1)
+        return -1;
 
-    if(rc >= 0)
+    f = future_new(s, MFS_LINK);
+    if (f != NULL)
     {
-        server_message_t response;
-        struct sockaddr_in ret_addr;
-    
-        rc = UDP_Read(fd, &ret_addr, (char*)&response, sizeof(response));
+        f->message.method.link.pinum = pinum;
+        f->message.method.link.inum = inum;
+        strncpy(f->message.method.link.name, name, MAX_NAME_LEN - 1);
+    }
+    if (MFS_Wait(submit(f)) == 0)
+        return inum;
+    release(s, inum);
+    return lookup_uncached(s, pinum, name, NULL);
+}
 
-        return response.rc;
-    } 
-    else
+/**
+ * the layout and size of striped file inum, from the cache if a lease on it
+ * is still good, or else from the server. return -1 if failed (it is not a
+ * striped file), 0 otherwise
+ */
+int layout_get(MFS_Session_t *s, int inum, layout_entry_t *l)
+{
+    layout_entry_t *e = &s->layouts[(unsigned int)inum % LAYOUT_CACHE_SIZE];
+    pthread_mutex_lock(&s->lock);
+    int hit = s->caching && e->valid && e->inum == inum && e->expiry > now_ms();
+    if (hit)
+        *l = *e;
+    pthread_mutex_unlock(&s->lock);
+    if (hit)
+        return 0;
+
+    MFS_Future_t *f = future_new(s, MFS_LAYOUT);
+    if (f == NULL)
+        return -1;
+    MFS_Stat_t m;
+    f->message.method.layout.inum = inum;
+    f->buffer = (char *)&l->layout;
+    f->stat = &m;
+    int lease;
+    unsigned int version;
+    if (future_wait(submit(f), &lease, &version) == -1)
+        return -1;
+    l->valid = 1;
+    l->inum = inum;
+    l->size = m.size;
+    l->expiry = now_ms() + lease;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->caching && lease > 0 && version >= s->revoked[(unsigned int)inum % STAT_CACHE_SIZE])
+        *e = *l;
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+// MFS_RELEASE of every stripe of l at once
+void stripes_release(MFS_Session_t *s, stripe_layout_t *l)
+{
+    MFS_Future_t *inflight[MFS_MAX_STRIPES];
+    for (int i = 0; i < l->count; i++)
     {
+        MFS_Future_t *f = l->inums[i] == -1 ? NULL : future_new(s, MFS_RELEASE);
+        if (f != NULL)
+            f->message.method.release.inum = l->inums[i];
+        inflight[i] = submit(f);
+    }
+    for (int i = 0; i < l->count; i++)
+        MFS_Wait(inflight[i]);
+}
+
+// MFS_UNLINK m of striped file inum, then its stripes, which are left
+// behind if this client goes away in between
+int unlink_striped(MFS_Session_t *s, client_message_t *m, int inum)
+{
+    layout_entry_t l;
+    if (layout_get(s, inum, &l) == -1)
         return -1;
+    MFS_Future_t *f = future_new(s, MFS_UNLINK);
+    if (f != NULL)
+        f->message.method.unlink = m->method.unlink;
+    int rc = MFS_Wait(submit(f));
+    if (rc == 0)
+        stripes_release(s, &l.layout);
+    return rc;
+}
+
+MFS_Future_t *MFS_ALookup(MFS_Session_t *s, int pinum, char *name)
+{
+    MFS_Future_t *f = future_new(s, MFS_LOOKUP);
+    if (f == NULL)
+        return NULL;
+    f->message.method.lookup.pinum = pinum;
+    strncpy(f->message.method.lookup.name, name, MAX_NAME_LEN - 1);
+
+    int inum;
+    pthread_mutex_lock(&s->lock);
+    int hit = cache_lookup(s, pinum, f->message.method.lookup.name, &inum);
+    pthread_mutex_unlock(&s->lock);
+    if (hit)
+        return future_done(f, inum);
+    return submit(f);
+}
+
+MFS_Future_t *MFS_AStat(MFS_Session_t *s, int inum, MFS_Stat_t *m)
+{
+    MFS_Future_t *f = future_new(s, MFS_STAT);
+    if (f == NULL)
+        return NULL;
+    f->message.method.stat.inum = inum;
+    f->stat = m;
+
+    pthread_mutex_lock(&s->lock);
+    int hit = cache_stat(s, inum, m);
+    pthread_mutex_unlock(&s->lock);
+    if (hit)
+        return future_done(f, 0);
+    return submit(f);
+}
+
+MFS_Future_t *MFS_AWrite(MFS_Session_t *s, int inum, char *buffer, int offset, int nbytes)
+{
+    MFS_Future_t *f = future_new(s, MFS_WRITE);
+    if (f == NULL)
+        return NULL;
+    if (nbytes < 0 || nbytes > MFS_BLOCK_SIZE)
+        return future_fail(f);
+    f->message.method.write.inum = inum;
+    f->message.method.write.offset = offset;
+    f->message.method.write.nbytes = nbytes;
+    memcpy(f->message.method.write.buffer, buffer, nbytes);
+    return submit(f);
+}
+
+MFS_Future_t *MFS_ARead(MFS_Session_t *s, int inum, char *buffer, int offset, int nbytes)
+{
+    MFS_Future_t *f = future_new(s, MFS_READ);
+    if (f == NULL)
+        return NULL;
+    if (nbytes < 0 || nbytes > MFS_BLOCK_SIZE)
+        return future_fail(f);
+    f->message.method.read.inum = inum;
+    f->message.method.read.offset = offset;
+    f->message.method.read.nbytes = nbytes;
+    f->buffer = buffer;
+    return submit(f);
+}
+
+MFS_Future_t *MFS_ACreat(MFS_Session_t *s, int pinum, int type, char *name)
+{
+    MFS_Future_t *f = future_new(s, MFS_CRET);
+    if (f == NULL)
+        return NULL;
+    f->message.method.create.pinum = pinum;
+    f->message.method.create.type = type;
+    strncpy(f->message.method.create.name, name, MAX_NAME_LEN - 1);
+    if (type == MFS_DIRECTORY && s->nshards > 1)
+    {
+        int shard = name_key(pinum, f->message.method.create.name) % s->nshards;
+        if (shard != inum_shard(pinum))
+            return future_done(f, create_remote(s, pinum, f->message.method.create.name, shard));
     }
+    return submit(f);
 }
 
-int MFS_Shutdown()
+MFS_Future_t *MFS_ACreatWrite(MFS_Session_t *s, int pinum, int type, char *name, char *buffer, int nbytes)
+{
+    // a directory may go to another shard
+    if (s != NULL && s->nshards > 1 && type == MFS_DIRECTORY && nbytes == 0)
+        return MFS_ACreat(s, pinum, type, name);
+    MFS_Future_t *f = future_new(s, MFS_CRET_WRITE);
+    if (f == NULL)
+        return NULL;
+    if (nbytes < 0 || nbytes > MFS_BLOCK_SIZE)
+        return future_fail(f);
+    f->message.method.create_write.pinum = pinum;
+    f->message.method.create_write.type = type;
+    strncpy(f->message.method.create_write.name, name, MAX_NAME_LEN - 1);
+    f->message.method.create_write.nbytes = nbytes;
+    memcpy(f->message.method.create_write.buffer, buffer, nbytes);
+    return submit(f);
+}
+
+MFS_Future_t *MFS_AUnlink(MFS_Session_t *s, int pinum, char *name)
 {
-    client_message_t message;
-    message.mtype = MFS_SHUTDOWN;
+    MFS_Future_t *f = future_new(s, MFS_UNLINK);
+    if (f == NULL)
+        return NULL;
+    f->message.method.unlink.pinum = pinum;
+    strncpy(f->message.method.unlink.name, name, MAX_NAME_LEN - 1);
+    if (files_cached(s))
+        file_forget(s, MFS_SLookup(s, pinum, f->message.method.unlink.name), 0);
+    // what the name is for is freed on its own shard first, which refuses
+    // a directory with something in it
+    if (s->nshards > 1)
+    {
+        MFS_Stat_t m;
+        int inum = lookup_uncached(s, pinum, f->message.method.unlink.name, &m);
+        if (inum >= 0 && inum_shard(inum) != inum_shard(pinum) && release(s, inum) == -1)
+            return future_fail(f);
+        if (inum >= 0 && m.type == MFS_STRIPED_FILE)
+            return future_done(f, unlink_striped(s, &f->message, inum));
+    }
+    return submit(f);
+}
 
-    int rc = UDP_Write(fd, &server_addr, (char*)&message, sizeof(message));
-    // rc = retry();
+MFS_Future_t *MFS_ATruncate(MFS_Session_t *s, int inum, int size)
+{
+    MFS_Future_t *f = future_new(s, MFS_TRUNCATE);
+    if (f == NULL)
+        return NULL;
+    f->message.method.truncate.inum = inum;
+    f->message.method.truncate.size = size;
+    return submit(f);
+}
 
-    if(rc >= 0)
+MFS_Future_t *MFS_ARename(MFS_Session_t *s, int pinum, char *name, int newpinum, char *newname)
+{
+    MFS_Future_t *f = future_new(s, MFS_RENAME);
+    if (f == NULL)
+        return NULL;
+    f->message.method.rename.pinum = pinum;
+    strncpy(f->message.method.rename.name, name, MAX_NAME_LEN - 1);
+    f->message.method.rename.newpinum = newpinum;
+    strncpy(f->message.method.rename.newname, newname, MAX_NAME_LEN - 1);
+    if (inum_shard(pinum) != inum_shard(newpinum))
+        return future_fail(f);
+    // what newname is for goes away, unless it is name already
+    if (files_cached(s))
     {
-        server_message_t response;
-        struct sockaddr_in ret_addr;
-    
-        rc = UDP_Read(fd, &ret_addr, (char*)&response, sizeof(response));
-        UDP_Close(fd);
-        return response.rc;
+        int victim = MFS_SLookup(s, newpinum, f->message.method.rename.newname);
+        if (victim >= 0 && victim != MFS_SLookup(s, pinum, f->message.method.rename.name) &&
+            file_forget(s, victim, 1) == -1)
+            return future_fail(f);
     }
-    else
+    return submit(f);
+}
+
+MFS_Future_t *MFS_ACopy(MFS_Session_t *s, int inum, int offset, int dinum, int doffset, int nbytes)
+{
+    MFS_Future_t *f = future_new(s, MFS_COPY);
+    if (f == NULL)
+        return NULL;
+    f->message.method.copy.inum = inum;
+    f->message.method.copy.offset = offset;
+    f->message.method.copy.dinum = dinum;
+    f->message.method.copy.doffset = doffset;
+    f->message.method.copy.nbytes = nbytes;
+    if (inum_shard(inum) != inum_shard(dinum))
+        return future_fail(f);
+    return submit(f);
+}
+
+MFS_Future_t *MFS_AStats(MFS_Session_t *s, MFS_ServerStats_t *stats)
+{
+    MFS_Future_t *f = future_new(s, MFS_STATS);
+    if (f == NULL)
+        return NULL;
+    f->buffer = (char *)stats;
+    return submit(f);
+}
+
+MFS_Future_t *MFS_ADumpTrace(MFS_Session_t *s)
+{
+    return submit(future_new(s, MFS_TRACE_DUMP));
+}
+
+MFS_Future_t *MFS_ASnapshot(MFS_Session_t *s)
+{
+    return submit(future_new(s, MFS_SNAPSHOT));
+}
+
+MFS_Future_t *MFS_ASnapshotDelete(MFS_Session_t *s, int id)
+{
+    MFS_Future_t *f = future_new(s, MFS_SNAPSHOT_DELETE);
+    if (f == NULL)
+        return NULL;
+    f->message.method.snapshot.id = id;
+    return submit(f);
+}
+
+MFS_Future_t *MFS_AGrow(MFS_Session_t *s, int num_inodes, int num_data)
+{
+    MFS_Future_t *f = future_new(s, MFS_GROW);
+    if (f == NULL)
+        return NULL;
+    f->message.method.grow.num_inodes = num_inodes;
+    f->message.method.grow.num_data = num_data;
+    return submit(f);
+}
+
+/*
+ * client data cache. reads are served from whole blocks fetched under a
+ * read lease; writes are buffered as one dirty byte range per block and
+ * written back, one RPC per block, on MFS_Fsync, MFS_Stat, MFS_Close or
+ * once DIRTY_LIMIT blocks are dirty. clean blocks are trusted only while
+ * they are at the version the server last told us about, which gives
+ * close-to-open consistency: after a writer's fsync/close, readers see
+ * its data no later than the revocation (or lease end) reaches them.
+ * everything below runs under s->data_lock, never on the event loop
+ */
+
+void file_drop_clean(file_cache_t *e)
+{
+    memset(e->valid, 0, sizeof(e->valid));
+}
+
+// stop trusting blocks of e that were revoked or whose lease ran out
+void file_check(MFS_Session_t *s, file_cache_t *e)
+{
+    pthread_mutex_lock(&s->lock);
+    unsigned int floor = s->revoked[(unsigned int)e->inum % STAT_CACHE_SIZE];
+    pthread_mutex_unlock(&s->lock);
+    if (e->version < floor || e->expiry <= now_ms())
+        file_drop_clean(e);
+}
+
+// write back every dirty range of e. a range the server did not take stays
+// dirty, for the next flush of e to try again and report
+int file_flush(MFS_Session_t *s, file_cache_t *e)
+{
+    int dirty[DIRECT_PTRS];
+    int n = 0;
+    for (int b = 0; b < DIRECT_PTRS; b++)
     {
-        return -1;
+        if (e->lo[b] < e->hi[b])
+            dirty[n++] = b;
+    }
+    if (n == 0)
+        return 0;
+
+    // up to FLUSH_WINDOW writes go out at once. the server only ever grows
+    // the file size, so they may be applied in any order
+    MFS_Future_t *inflight[DIRECT_PTRS];
+    int rc = 0;
+    int written = 0;
+    unsigned int newest = 0;
+    int waited = 0;
+    for (int i = 0; i <= n; i++)
+    {
+        for (; waited < (i == n ? n : i - FLUSH_WINDOW + 1); waited++)
+        {
+            unsigned int version;
+            if (future_wait(inflight[waited], NULL, &version) == -1)
+            {
+                rc = -1;
+                continue;
+            }
+            e->lo[dirty[waited]] = e->hi[dirty[waited]] = 0;
+            written++;
+            if (version > newest)
+                newest = version;
+        }
+        if (i == n)
+            break;
+        int b = dirty[i];
+        inflight[i] = MFS_AWrite(s, e->inum, e->blocks[b] + e->lo[b], b * MFS_BLOCK_SIZE + e->lo[b], e->hi[b] - e->lo[b]);
     }
+    s->dirty_blocks -= written;
+
+    // our writes took the version from e->version to newest unless someone
+    // else wrote in between, in which case the clean blocks are stale
+    if (rc != 0 || e->version + written != newest)
+        file_drop_clean(e);
+    e->version = newest;
+    return rc;
+}
+
+int files_flush(MFS_Session_t *s)
+{
+    int rc = 0;
+    for (int i = 0; i < FILE_CACHE_SIZE; i++)
+    {
+        if (s->files[i].inum != -1 && file_flush(s, &s->files[i]) == -1)
+            rc = -1;
+    }
+    return rc;
+}
+
+// the cache slot of inum, taking it over from another file if create is set.
+// NULL if that file's dirty data could not be written back; it keeps the
+// slot, and its own fsync or the session's close reports the failure
+file_cache_t *file_get(MFS_Session_t *s, int inum, int create)
+{
+    file_cache_t *e = &s->files[(unsigned int)inum % FILE_CACHE_SIZE];
+    if (e->inum == inum)
+        return e;
+    if (!create)
+        return NULL;
+    if (e->inum != -1 && file_flush(s, e) == -1)
+        return NULL;
+
+    e->inum = inum;
+    e->nocache = 0;
+    e->regular = 0;
+    e->version = 0;
+    e->expiry = 0;
+    file_drop_clean(e);
+    return e;
+}
+
+// whether any file has a cache slot, so unlink and rename need to look up
+// what they remove
+int files_cached(MFS_Session_t *s)
+{
+    int cached = 0;
+    pthread_mutex_lock(&s->data_lock);
+    for (int i = 0; i < FILE_CACHE_SIZE; i++)
+        cached |= s->files[i].inum != -1;
+    pthread_mutex_unlock(&s->data_lock);
+    return cached;
+}
+
+/**
+ * inum is about to be unlinked or renamed over: give up its cache slot, so
+ * its dirty ranges do not end up in the next file the server hands the
+ * number to. keep writes them back first, for a rename the server may
+ * still refuse. return -1 if that failed, 0 otherwise
+ */
+int file_forget(MFS_Session_t *s, int inum, int keep)
+{
+    if (inum < 0)
+        return 0;
+    int rc = 0;
+    pthread_mutex_lock(&s->data_lock);
+    file_cache_t *e = file_get(s, inum, 0);
+    if (e != NULL && keep)
+        rc = file_flush(s, e);
+    if (e != NULL && rc == 0)
+    {
+        for (int b = 0; b < DIRECT_PTRS; b++)
+        {
+            if (e->lo[b] < e->hi[b])
+                s->dirty_blocks--;
+            e->lo[b] = e->hi[b] = 0;
+        }
+        file_drop_clean(e);
+        e->inum = -1;
+    }
+    pthread_mutex_unlock(&s->data_lock);
+    return rc;
+}
+
+// read block b of e from the server. returns 0 if it may be cached, 1 if
+// it is only good for the current read, -1 if the server refused
+int file_fetch(MFS_Session_t *s, file_cache_t *e, int b)
+{
+    if (e->blocks[b] == NULL && (e->blocks[b] = malloc(MFS_BLOCK_SIZE)) == NULL)
+        return -1;
+
+    int lease;
+    unsigned int version;
+    if (future_wait(MFS_ARead(s, e->inum, e->blocks[b], b * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE), &lease, &version) == -1)
+        return -1;
+    if (lease <= 0)
+        return 1;
+
+    pthread_mutex_lock(&s->lock);
+    unsigned int floor = s->revoked[(unsigned int)e->inum % STAT_CACHE_SIZE];
+    pthread_mutex_unlock(&s->lock);
+    if (version < floor)
+        return 1;
+
+    if (version != e->version)
+    {
+        file_drop_clean(e);
+        e->version = version;
+    }
+    e->valid[b] = 1;
+    e->expiry = now_ms() + lease;
+    return 0;
+}
+
+int file_write(MFS_Session_t *s, int inum, char *buffer, int offset, int nbytes)
+{
+    // anything the cache can't hold goes straight to the server
+    if (nbytes <= 0 || nbytes > MFS_BLOCK_SIZE || offset < 0 || offset + nbytes > DIRECT_PTRS * MFS_BLOCK_SIZE)
+        return MFS_Wait(MFS_AWrite(s, inum, buffer, offset, nbytes));
+
+    pthread_mutex_lock(&s->data_lock);
+    file_cache_t *e = file_get(s, inum, 0);
+    if (e == NULL || !e->regular)
+    {
+        // a write the server would refuse must fail here, not at the flush
+        MFS_Stat_t st;
+        if (MFS_Wait(MFS_AStat(s, inum, &st)) == -1 || st.type != MFS_REGULAR_FILE)
+        {
+            pthread_mutex_unlock(&s->data_lock);
+            return -1;
+        }
+        e = file_get(s, inum, 1);
+        if (e == NULL)
+        {
+            pthread_mutex_unlock(&s->data_lock);
+            return MFS_Wait(MFS_AWrite(s, inum, buffer, offset, nbytes));
+        }
+        e->regular = 1;
+    }
+    file_check(s, e);
+    e->nocache = 0;
+
+    int rc = 0;
+    while (nbytes > 0)
+    {
+        int b = offset / MFS_BLOCK_SIZE;
+        int lo = offset % MFS_BLOCK_SIZE;
+        int len = nbytes < MFS_BLOCK_SIZE - lo ? nbytes : MFS_BLOCK_SIZE - lo;
+        int hi = lo + len;
+
+        // one dirty range per block: a disjoint second one can only be
+        // merged if the gap is known, otherwise write the first one back
+        if (e->lo[b] < e->hi[b] && !e->valid[b] && (hi < e->lo[b] || lo > e->hi[b]))
+        {
+            if ((rc = file_flush(s, e)) == -1)
+                break;
+        }
+        if (e->blocks[b] == NULL && (e->blocks[b] = malloc(MFS_BLOCK_SIZE)) == NULL)
+        {
+            rc = -1;
+            break;
+        }
+
+        memcpy(e->blocks[b] + lo, buffer, len);
+        if (e->lo[b] == e->hi[b])
+        {
+            e->lo[b] = lo;
+            e->hi[b] = hi;
+            s->dirty_blocks++;
+        }
+        else
+        {
+            if (lo < e->lo[b])
+                e->lo[b] = lo;
+            if (hi > e->hi[b])
+                e->hi[b] = hi;
+        }
+
+        buffer += len;
+        offset += len;
+        nbytes -= len;
+    }
+
+    if (rc == 0 && s->dirty_blocks >= DIRTY_LIMIT)
+    {
+        // only inum's failures are this write's; the others stay dirty
+        for (int i = 0; i < FILE_CACHE_SIZE; i++)
+        {
+            if (s->files[i].inum != -1 && &s->files[i] != e)
+                file_flush(s, &s->files[i]);
+        }
+        rc = file_flush(s, e);
+    }
+    pthread_mutex_unlock(&s->data_lock);
+    return rc;
+}
+
+int file_read(MFS_Session_t *s, int inum, char *buffer, int offset, int nbytes)
+{
+    if (nbytes <= 0 || nbytes > MFS_BLOCK_SIZE || offset < 0 || offset + nbytes > DIRECT_PTRS * MFS_BLOCK_SIZE)
+        return MFS_Wait(MFS_ARead(s, inum, buffer, offset, nbytes));
+
+    pthread_mutex_lock(&s->data_lock);
+    file_cache_t *e = file_get(s, inum, 1);
+    if (e == NULL || e->nocache)
+    {
+        pthread_mutex_unlock(&s->data_lock);
+        return MFS_Wait(MFS_ARead(s, inum, buffer, offset, nbytes));
+    }
+    file_check(s, e);
+
+    int rc = 0;
+    while (nbytes > 0)
+    {
+        int b = offset / MFS_BLOCK_SIZE;
+        int lo = offset % MFS_BLOCK_SIZE;
+        int len = nbytes < MFS_BLOCK_SIZE - lo ? nbytes : MFS_BLOCK_SIZE - lo;
+        int hi = lo + len;
+
+        if (!e->valid[b] && !(e->lo[b] <= lo && hi <= e->hi[b]))
+        {
+            if (e->lo[b] < e->hi[b] && (rc = file_flush(s, e)) == -1)
+                break;
+            if (file_fetch(s, e, b) == -1)
+            {
+                // e.g. a directory, which is only readable an entry at a time
+                e->nocache = 1;
+                pthread_mutex_unlock(&s->data_lock);
+                return MFS_Wait(MFS_ARead(s, inum, buffer, offset, nbytes));
+            }
+        }
+        memcpy(buffer, e->blocks[b] + lo, len);
+
+        buffer += len;
+        offset += len;
+        nbytes -= len;
+    }
+    pthread_mutex_unlock(&s->data_lock);
+    return rc;
+}
+
+int MFS_SFsync(MFS_Session_t *s, int inum)
+{
+    if (s == NULL)
+        return -1;
+
+    pthread_mutex_lock(&s->data_lock);
+    file_cache_t *e = file_get(s, inum, 0);
+    int rc = e != NULL ? file_flush(s, e) : 0;
+    pthread_mutex_unlock(&s->data_lock);
+    return rc;
+}
+
+int MFS_SLookup(MFS_Session_t *s, int pinum, char *name)
+{
+    return MFS_Wait(MFS_ALookup(s, pinum, name));
+}
+
+int MFS_SStat(MFS_Session_t *s, int inum, MFS_Stat_t *m)
+{
+    // the size has to include whatever we still have buffered
+    if (MFS_SFsync(s, inum) == -1)
+        return -1;
+    return MFS_Wait(MFS_AStat(s, inum, m));
+}
+
+int MFS_SWrite(MFS_Session_t *s, int inum, char *buffer, int offset, int nbytes)
+{
+    if (s != NULL && s->caching)
+        return file_write(s, inum, buffer, offset, nbytes);
+    return MFS_Wait(MFS_AWrite(s, inum, buffer, offset, nbytes));
+}
+
+int MFS_STruncate(MFS_Session_t *s, int inum, int size)
+{
+    if (s == NULL)
+        return -1;
+
+    // what we still have buffered goes out first, and what we have cached
+    // of the file is not worth keeping
+    pthread_mutex_lock(&s->data_lock);
+    file_cache_t *e = file_get(s, inum, 0);
+    int rc = e != NULL ? file_flush(s, e) : 0;
+    if (e != NULL)
+        file_drop_clean(e);
+    if (rc == 0)
+        rc = MFS_Wait(MFS_ATruncate(s, inum, size));
+    pthread_mutex_unlock(&s->data_lock);
+    return rc;
+}
+
+int MFS_SCopy(MFS_Session_t *s, int inum, int offset, int dinum, int doffset, int nbytes)
+{
+    if (s == NULL)
+        return -1;
+
+    // the server copies what it has, so what we buffered for either file
+    // goes out first, and what we cached of dinum is about to be stale
+    pthread_mutex_lock(&s->data_lock);
+    file_cache_t *e = file_get(s, inum, 0);
+    int rc = e != NULL ? file_flush(s, e) : 0;
+    file_cache_t *d = file_get(s, dinum, 0);
+    if (d != NULL && rc == 0)
+        rc = file_flush(s, d);
+    if (d != NULL)
+        file_drop_clean(d);
+    if (rc == 0)
+        rc = MFS_Wait(MFS_ACopy(s, inum, offset, dinum, doffset, nbytes));
+    pthread_mutex_unlock(&s->data_lock);
+    return rc;
+}
+
+int MFS_SRead(MFS_Session_t *s, int inum, char *buffer, int offset, int nbytes)
+{
+    if (s != NULL && s->caching)
+        return file_read(s, inum, buffer, offset, nbytes);
+    return MFS_Wait(MFS_ARead(s, inum, buffer, offset, nbytes));
+}
+
+int MFS_SCreat(MFS_Session_t *s, int pinum, int type, char *name)
+{
+    return MFS_Wait(MFS_ACreat(s, pinum, type, name));
+}
+
+int MFS_SCreatWrite(MFS_Session_t *s, int pinum, int type, char *name, char *buffer, int nbytes)
+{
+    return MFS_Wait(MFS_ACreatWrite(s, pinum, type, name, buffer, nbytes));
+}
+
+int MFS_SUnlink(MFS_Session_t *s, int pinum, char *name)
+{
+    return MFS_Wait(MFS_AUnlink(s, pinum, name));
+}
+
+int MFS_SRename(MFS_Session_t *s, int pinum, char *name, int newpinum, char *newname)
+{
+    return MFS_Wait(MFS_ARename(s, pinum, name, newpinum, newname));
+}
+
+int MFS_SStats(MFS_Session_t *s, MFS_ServerStats_t *stats)
+{
+    return MFS_Wait(MFS_AStats(s, stats));
+}
+
+int MFS_SDumpTrace(MFS_Session_t *s)
+{
+    return MFS_Wait(MFS_ADumpTrace(s));
+}
+
+int MFS_SSnapshot(MFS_Session_t *s)
+{
+    return MFS_Wait(MFS_ASnapshot(s));
+}
+
+int MFS_SSnapshotDelete(MFS_Session_t *s, int id)
+{
+    return MFS_Wait(MFS_ASnapshotDelete(s, id));
+}
+
+int MFS_SGrow(MFS_Session_t *s, int num_inodes, int num_data)
+{
+    return MFS_Wait(MFS_AGrow(s, num_inodes, num_data));
+}
+
+/*
+ * striped files. their bytes are in the stripes, and the file itself only
+ * has their layout and its size (see stripe_layout_t). a read or write is
+ * cut at block boundaries, which units never straddle, and up to
+ * STRIPE_WINDOW of the pieces are in flight at once, each to the shard of
+ * its stripe. none of it goes through the data cache
+ */
+
+// where byte offset of the file l is the layout of is: which stripe, and
+// where in it
+void stripe_map(stripe_layout_t *l, int offset, int *stripe, int *at)
+{
+    int unit = offset / l->unit;
+    *stripe = unit % l->count;
+    *at = unit / l->count * l->unit + offset % l->unit;
+}
+
+// the most a file laid out like l can hold: whole units that fit in each stripe
+long long stripe_max(stripe_layout_t *l)
+{
+    return (long long)l->count * (DIRECT_PTRS * MFS_BLOCK_SIZE / l->unit) * l->unit;
+}
+
+// read (or write) nbytes at offset of the file l is the layout of
+int stripe_io(MFS_Session_t *s, stripe_layout_t *l, char *buffer, int offset, int nbytes, int write)
+{
+    MFS_Future_t *inflight[STRIPE_WINDOW];
+    int rc = 0;
+    int pieces = 0;
+    for (int done = 0; done < nbytes; pieces++)
+    {
+        int len = MFS_BLOCK_SIZE - (offset + done) % MFS_BLOCK_SIZE;
+        if (len > nbytes - done)
+            len = nbytes - done;
+        int stripe, at;
+        stripe_map(l, offset + done, &stripe, &at);
+
+        int slot = pieces % STRIPE_WINDOW;
+        if (pieces >= STRIPE_WINDOW && MFS_Wait(inflight[slot]) == -1)
+            rc = -1;
+        if (write)
+            inflight[slot] = MFS_AWrite(s, l->inums[stripe], buffer + done, at, len);
+        else
+            inflight[slot] = MFS_ARead(s, l->inums[stripe], buffer + done, at, len);
+        done += len;
+    }
+    for (int i = pieces > STRIPE_WINDOW ? pieces - STRIPE_WINDOW : 0; i < pieces; i++)
+    {
+        if (MFS_Wait(inflight[i % STRIPE_WINDOW]) == -1)
+            rc = -1;
+    }
+    return rc;
+}
+
+int MFS_SCreatStriped(MFS_Session_t *s, int pinum, char *name, int unit, int count)
+{
+    if (s == NULL || s->nshards < 2 || unit < MFS_BLOCK_SIZE || unit % MFS_BLOCK_SIZE != 0 ||
+        unit > DIRECT_PTRS * MFS_BLOCK_SIZE || count < 1 || count > MFS_MAX_STRIPES)
+        return -1;
+    MFS_Stat_t m;
+    int inum = MFS_SCreat(s, pinum, MFS_REGULAR_FILE, name);
+    if (inum == -1 || MFS_SStat(s, inum, &m) == -1)
+        return -1;
+    if (m.type == MFS_STRIPED_FILE)
+        return inum;
+    if (m.type != MFS_REGULAR_FILE || m.size != 0)
+        return -1;
+
+    // a create under a parent of another shard makes an inode and no
+    // entry, which is all a stripe is; the file itself is never a directory
+    // on the stripe's shard, so it is sent as one of another shard even there
+    stripe_layout_t layout;
+    layout.unit = unit;
+    layout.count = count;
+    MFS_Future_t *inflight[MFS_MAX_STRIPES];
+    for (int i = 0; i < count; i++)
+    {
+        MFS_Future_t *f = future_new(s, MFS_CRET);
+        if (f != NULL)
+        {
+            f->shard = (inum_shard(inum) + i) % s->nshards;
+            f->message.method.create.pinum = inum | UFS_REMOTE;
+            f->message.method.create.type = MFS_REGULAR_FILE;
+        }
+        inflight[i] = submit(f);
+    }
+    int rc = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if ((layout.inums[i] = MFS_Wait(inflight[i])) == -1)
+            rc = -1;
+    }
+
+    MFS_Future_t *f = rc == 0 ? future_new(s, MFS_STRIPE) : NULL;
+    if (f != NULL)
+    {
+        f->message.method.stripe.inum = inum;
+        f->message.method.stripe.size = 0;
+        f->message.method.stripe.layout = layout;
+    }
+    if (MFS_Wait(submit(f)) == 0)
+        return inum;
+
+    // someone else may have striped it first
+    stripes_release(s, &layout);
+    if (MFS_SStat(s, inum, &m) == 0 && m.type == MFS_STRIPED_FILE)
+        return inum;
+    return -1;
+}
+
+int MFS_SWriteStriped(MFS_Session_t *s, int inum, char *buffer, int offset, int nbytes)
+{
+    layout_entry_t l;
+    if (s == NULL || offset < 0 || nbytes < 0 || layout_get(s, inum, &l) == -1)
+        return -1;
+    if ((long long)offset + nbytes > stripe_max(&l.layout))
+        return -1;
+    if (stripe_io(s, &l.layout, buffer, offset, nbytes, 1) == -1)
+        return -1;
+    if (offset + nbytes <= l.size)
+        return 0;
+
+    // the size only ever grows, so writers racing to raise it agree
+    MFS_Future_t *f = future_new(s, MFS_STRIPE);
+    if (f == NULL)
+        return -1;
+    f->message.method.stripe.inum = inum;
+    f->message.method.stripe.size = offset + nbytes;
+    f->message.method.stripe.layout = l.layout;
+    return MFS_Wait(submit(f));
+}
+
+int MFS_SReadStriped(MFS_Session_t *s, int inum, char *buffer, int offset, int nbytes)
+{
+    layout_entry_t l;
+    if (s == NULL || offset < 0 || nbytes < 0 || layout_get(s, inum, &l) == -1)
+        return -1;
+    if (offset >= l.size)
+        return 0;
+    if (nbytes > l.size - offset)
+        nbytes = l.size - offset;
+    if (stripe_io(s, &l.layout, buffer, offset, nbytes, 0) == -1)
+        return -1;
+    return nbytes;
+}
+
+int MFS_SShutdown(MFS_Session_t *s)
+{
+    if (s != NULL)
+    {
+        pthread_mutex_lock(&s->data_lock);
+        files_flush(s);
+        pthread_mutex_unlock(&s->data_lock);
+    }
+    return MFS_Wait(submit(future_new(s, MFS_SHUTDOWN)));
+}
+
+int MFS_SetCaching(MFS_Session_t *s, int enabled)
+{
+    if (s == NULL)
+        s = default_session;
+    if (s == NULL)
+        return -1;
+
+    pthread_mutex_lock(&s->data_lock);
+    int rc = files_flush(s);
+    for (int i = 0; i < FILE_CACHE_SIZE; i++)
+        s->files[i].inum = -1;
+
+    pthread_mutex_lock(&s->lock);
+    s->caching = enabled;
+    memset(s->names, 0, sizeof(s->names));
+    memset(s->stats, 0, sizeof(s->stats));
+    pthread_mutex_unlock(&s->lock);
+    pthread_mutex_unlock(&s->data_lock);
+    return rc;
+}
+
+int MFS_GetCacheStats(MFS_Session_t *s, MFS_CacheStats_t *stats)
+{
+    if (s == NULL)
+        s = default_session;
+    if (s == NULL)
+        return -1;
+
+    pthread_mutex_lock(&s->lock);
+    *stats = s->cstats;
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+// programs written against the write-through API never call MFS_Fsync,
+// so buffered writes of the default session are flushed at exit
+void flush_default_session()
+{
+    if (default_session == NULL)
+        return;
+    pthread_mutex_lock(&default_session->data_lock);
+    files_flush(default_session);
+    pthread_mutex_unlock(&default_session->data_lock);
+}
+
+int MFS_Init(char *hostname, int port)
+{
+    static int registered = 0;
+    if (!registered)
+    {
+        atexit(flush_default_session);
+        registered = 1;
+    }
+
+    if (default_session != NULL)
+        MFS_Close(default_session);
+
+    default_session = MFS_Open(hostname, port);
+    if (default_session == NULL)
+    {
+        printf("Failed to set up server address");
+        return -1;
+    }
+    return 0;
+}
+
+int MFS_Lookup(int pinum, char *name)
+{
+    return MFS_SLookup(default_session, pinum, name);
+}
+
+int MFS_Stat(int inum, MFS_Stat_t *m)
+{
+    return MFS_SStat(default_session, inum, m);
+}
+
+int MFS_Write(int inum, char *buffer, int offset, int nbytes)
+{
+    return MFS_SWrite(default_session, inum, buffer, offset, nbytes);
+}
+
+int MFS_Read(int inum, char *buffer, int offset, int nbytes)
+{
+    return MFS_SRead(default_session, inum, buffer, offset, nbytes);
+}
+
+int MFS_Truncate(int inum, int size)
+{
+    return MFS_STruncate(default_session, inum, size);
+}
+
+int MFS_Creat(int pinum, int type, char *name)
+{
+    return MFS_SCreat(default_session, pinum, type, name);
+}
+
+int MFS_CreatWrite(int pinum, int type, char *name, char *buffer, int nbytes)
+{
+    return MFS_SCreatWrite(default_session, pinum, type, name, buffer, nbytes);
+}
+
+int MFS_Unlink(int pinum, char *name)
+{
+    return MFS_SUnlink(default_session, pinum, name);
+}
+
+int MFS_Rename(int pinum, char *name, int newpinum, char *newname)
+{
+    return MFS_SRename(default_session, pinum, name, newpinum, newname);
+}
+
+int MFS_Copy(int inum, int offset, int dinum, int doffset, int nbytes)
+{
+    return MFS_SCopy(default_session, inum, offset, dinum, doffset, nbytes);
+}
+
+int MFS_CreatStriped(int pinum, char *name, int unit, int count)
+{
+    return MFS_SCreatStriped(default_session, pinum, name, unit, count);
+}
+
+int MFS_WriteStriped(int inum, char *buffer, int offset, int nbytes)
+{
+    return MFS_SWriteStriped(default_session, inum, buffer, offset, nbytes);
+}
+
+int MFS_ReadStriped(int inum, char *buffer, int offset, int nbytes)
+{
+    return MFS_SReadStriped(default_session, inum, buffer, offset, nbytes);
+}
+
+int MFS_Fsync(int inum)
+{
+    return MFS_SFsync(default_session, inum);
+}
+
+int MFS_Stats(MFS_ServerStats_t *stats)
+{
+    return MFS_SStats(default_session, stats);
+}
+
+int MFS_DumpTrace()
+{
+    return MFS_SDumpTrace(default_session);
+}
+
+int MFS_Snapshot()
+{
+    return MFS_SSnapshot(default_session);
+}
+
+int MFS_SnapshotDelete(int id)
+{
+    return MFS_SSnapshotDelete(default_session, id);
+}
+
+int MFS_Grow(int num_inodes, int num_data)
+{
+    return MFS_SGrow(default_session, num_inodes, num_data);
+}
+
+int MFS_Shutdown()
+{
+    int rc = MFS_SShutdown(default_session);
+    MFS_Close(default_session);
+    default_session = NULL;
+    return rc;
 }
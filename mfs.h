@@ -3,6 +3,7 @@
 
 #define MFS_DIRECTORY    (0)
 #define MFS_REGULAR_FILE (1)
+#define MFS_STRIPED_FILE (2) // see MFS_SCreatStriped
 
 #define MFS_BLOCK_SIZE   (4096)
 
@@ -18,13 +19,177 @@ typedef struct __MFS_DirEnt_t {
 } MFS_DirEnt_t;
 
 
+// a sharded namespace is served by several servers, each with an image of
+// its own (mkfs -k, server -K). inode numbers carry the shard in the bits
+// from MFS_SHARD_SHIFT up, and sessions send each call to the shard of the
+// inode it is about. new directories are spread over the shards, files go
+// where their directory is
+#define MFS_SHARD_SHIFT (24)
+#define MFS_MAX_SHARDS (64)
+
+// a session is one socket (on an ephemeral port) talking to one server, or
+// to every shard of a sharded one, with its own event loop thread. sessions are safe to share between threads
+typedef struct __MFS_Session_t MFS_Session_t;
+
+// result of an asynchronous call: either MFS_Wait for it or hand it to
+// MFS_Then, exactly once
+typedef struct __MFS_Future_t MFS_Future_t;
+typedef void (*MFS_Callback_t)(int rc, void *arg);
+
+MFS_Session_t *MFS_Open(char *hostname, int port);
+int MFS_Close(MFS_Session_t *s);
+
+int MFS_Wait(MFS_Future_t *f);
+int MFS_Then(MFS_Future_t *f, MFS_Callback_t cb, void *arg);
+
+MFS_Future_t *MFS_ALookup(MFS_Session_t *s, int pinum, char *name);
+MFS_Future_t *MFS_AStat(MFS_Session_t *s, int inum, MFS_Stat_t *m);
+MFS_Future_t *MFS_AWrite(MFS_Session_t *s, int inum, char *buffer, int offset, int nbytes);
+MFS_Future_t *MFS_ARead(MFS_Session_t *s, int inum, char *buffer, int offset, int nbytes);
+MFS_Future_t *MFS_ACreat(MFS_Session_t *s, int pinum, int type, char *name);
+MFS_Future_t *MFS_ACreatWrite(MFS_Session_t *s, int pinum, int type, char *name, char *buffer, int nbytes);
+MFS_Future_t *MFS_AUnlink(MFS_Session_t *s, int pinum, char *name);
+MFS_Future_t *MFS_ATruncate(MFS_Session_t *s, int inum, int size);
+MFS_Future_t *MFS_ARename(MFS_Session_t *s, int pinum, char *name, int newpinum, char *newname);
+MFS_Future_t *MFS_ACopy(MFS_Session_t *s, int inum, int offset, int dinum, int doffset, int nbytes);
+
+int MFS_SLookup(MFS_Session_t *s, int pinum, char *name);
+int MFS_SStat(MFS_Session_t *s, int inum, MFS_Stat_t *m);
+int MFS_SWrite(MFS_Session_t *s, int inum, char *buffer, int offset, int nbytes);
+int MFS_SRead(MFS_Session_t *s, int inum, char *buffer, int offset, int nbytes);
+int MFS_SCreat(MFS_Session_t *s, int pinum, int type, char *name);
+int MFS_SCreatWrite(MFS_Session_t *s, int pinum, int type, char *name, char *buffer, int nbytes);
+int MFS_SUnlink(MFS_Session_t *s, int pinum, char *name);
+// MFS_STruncate sets the size of regular file inum, freeing the blocks past
+// it; what it grows back into reads as zeros, as do blocks never written
+int MFS_STruncate(MFS_Session_t *s, int inum, int size);
+// MFS_SRename moves name in pinum to newname in newpinum in one commit,
+// replacing what newname was unless that is a non-empty directory or not
+// the same type as name
+int MFS_SRename(MFS_Session_t *s, int pinum, char *name, int newpinum, char *newname);
+// MFS_SCopy copies nbytes at offset of regular file inum to doffset of
+// dinum on the server, cut short at the end of inum or at a block the server
+// cannot write, and returns the bytes copied. whole blocks are shared or
+// copied inside the server's image
+int MFS_SCopy(MFS_Session_t *s, int inum, int offset, int dinum, int doffset, int nbytes);
+int MFS_SShutdown(MFS_Session_t *s);
+
+// striped files, on a sharded server only. MFS_SCreatStriped makes name in
+// pinum a file whose bytes go round-robin, unit bytes (a multiple of
+// MFS_BLOCK_SIZE) at a time, to count stripes on its own shard and the
+// ones after it, each as big as a file can be. it returns the inode number,
+// of the file already there if that is striped. such a file stats as
+// MFS_STRIPED_FILE and is read and written only with the two calls below,
+// any nbytes at a time, with the RPCs to the stripes going out together.
+// MFS_SReadStriped returns the bytes read, cut short at the end of the file
+#define MFS_MAX_STRIPES (64)
+
+int MFS_SCreatStriped(MFS_Session_t *s, int pinum, char *name, int unit, int count);
+int MFS_SWriteStriped(MFS_Session_t *s, int inum, char *buffer, int offset, int nbytes);
+int MFS_SReadStriped(MFS_Session_t *s, int inum, char *buffer, int offset, int nbytes);
+
+// MFS_SWrite/MFS_SRead (and the classic calls) go through a per-session data
+// cache: writes are buffered and written back on MFS_SFsync, MFS_SStat,
+// MFS_Close or once enough are dirty. the async calls bypass it
+int MFS_SFsync(MFS_Session_t *s, int inum);
+
+// per-session lookup/stat cache, on by default. entries live as long as the
+// lease the server granted with them, and are dropped early when the server
+// revokes them because the inode changed. s == NULL means the default session
+typedef struct __MFS_CacheStats_t {
+    long long lookup_hits;
+    long long lookup_misses;
+    long long stat_hits;
+    long long stat_misses;
+    long long revokes; // invalidations received from the server
+    long long rpcs;    // requests sent, not counting retransmissions
+} MFS_CacheStats_t;
+
+int MFS_SetCaching(MFS_Session_t *s, int enabled);
+int MFS_GetCacheStats(MFS_Session_t *s, MFS_CacheStats_t *stats);
+
+// server statistics since it started. ops[] is indexed by message type
+// (MFS_LOOKUP etc. in message.h), times are in ns
+#define MFS_STATS_TYPES (32)
+
+typedef struct __MFS_OpStats_t {
+    unsigned long long count;
+    unsigned long long errors; // answered with rc < 0
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    unsigned long long ns_total;
+    unsigned long long ns_p50;
+    unsigned long long ns_p90;
+    unsigned long long ns_p99;
+    unsigned long long ns_p999;
+    unsigned long long ns_max;
+} MFS_OpStats_t;
+
+typedef struct __MFS_ServerStats_t {
+    unsigned long long uptime_ms;
+    unsigned long long fsyncs;
+    unsigned long long fsync_ns;
+    unsigned long long fsync_ns_p99;
+    unsigned long long fsync_ns_max;
+    unsigned long long inode_alloc_failures;
+    unsigned long long data_alloc_failures;
+    unsigned long long lease_grants;  // answers clients were allowed to cache
+    unsigned long long lease_denials; // ... and ones they weren't, all holder slots taken
+    unsigned long long revokes;       // invalidations sent to clients
+    unsigned long long dedup_file_blocks; // deduplicated images: blocks files point at
+    unsigned long long dedup_data_blocks; // ... and the data blocks holding them
+    unsigned long long repl_lsn;     // replicated servers: last request shipped, or applied by a backup
+    unsigned long long repl_acked;   // ... the newest a backup has applied, on the primary
+    unsigned long long repl_unacked; // ... sync replies that went out without a backup's ack
+    MFS_OpStats_t ops[MFS_STATS_TYPES];
+} MFS_ServerStats_t;
+
+MFS_Future_t *MFS_AStats(MFS_Session_t *s, MFS_ServerStats_t *stats);
+int MFS_SStats(MFS_Session_t *s, MFS_ServerStats_t *stats);
+
+// have the server write its request trace to the file it was started with
+// (-T), return -1 if it was built without tracing (make TRACE=1)
+MFS_Future_t *MFS_ADumpTrace(MFS_Session_t *s);
+int MFS_SDumpTrace(MFS_Session_t *s);
+
+// take a snapshot of the server's image, return -1 if failed (the image has
+// no free snapshot slot, or is not a classic one), its id otherwise. a second
+// server started with -M <id> on the same image serves it read-only
+MFS_Future_t *MFS_ASnapshot(MFS_Session_t *s);
+MFS_Future_t *MFS_ASnapshotDelete(MFS_Session_t *s, int id);
+int MFS_SSnapshot(MFS_Session_t *s);
+int MFS_SSnapshotDelete(MFS_Session_t *s, int id);
+
+// grow the server's image to num_inodes inodes and num_data data blocks
+// while it serves it, return -1 if failed (it is a log image, or was not
+// made with room for that much, see mkfs -I and -M), 0 otherwise
+MFS_Future_t *MFS_AGrow(MFS_Session_t *s, int num_inodes, int num_data);
+int MFS_SGrow(MFS_Session_t *s, int num_inodes, int num_data);
+
+// the classic interface, running on a default session set up by MFS_Init
 int MFS_Init(char *hostname, int port);
 int MFS_Lookup(int pinum, char *name);
 int MFS_Stat(int inum, MFS_Stat_t *m);
 int MFS_Write(int inum, char *buffer, int offset, int nbytes);
 int MFS_Read(int inum, char *buffer, int offset, int nbytes);
+// MFS_Creat returns the inode number of name, newly created or already there.
+// MFS_CreatWrite also writes its first nbytes (at most MFS_BLOCK_SIZE), both
+// in one round trip and one commit on the server
 int MFS_Creat(int pinum, int type, char *name);
+int MFS_CreatWrite(int pinum, int type, char *name, char *buffer, int nbytes);
 int MFS_Unlink(int pinum, char *name);
+int MFS_Truncate(int inum, int size);
+int MFS_Rename(int pinum, char *name, int newpinum, char *newname);
+int MFS_Copy(int inum, int offset, int dinum, int doffset, int nbytes);
+int MFS_CreatStriped(int pinum, char *name, int unit, int count);
+int MFS_WriteStriped(int inum, char *buffer, int offset, int nbytes);
+int MFS_ReadStriped(int inum, char *buffer, int offset, int nbytes);
+int MFS_Fsync(int inum);
+int MFS_Stats(MFS_ServerStats_t *stats);
+int MFS_DumpTrace();
+int MFS_Snapshot();
+int MFS_SnapshotDelete(int id);
+int MFS_Grow(int num_inodes, int num_data);
 int MFS_Shutdown();
 
 #endif // __MFS_h__
@@ -0,0 +1,1219 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <math.h>
+
+#include "mfs.h"
+#include "cycles.h"
+#include "hist.h"
+
+#define BENCH_FILE "mfsbench.dat"
+
+char *host;
+int port;
+
+void usage()
+{
+    fprintf(stderr, "usage: mfsbench <host> <port> read [-n <reads>] [-s <bytes>] [-o <offset>] [-S]\n"
+                    "       mfsbench <host> <port> threads [-t <max threads>] [-n <ops/thread>] [-d <depth>] [-p]\n"
+                    "       mfsbench <host> <port> meta [-l <levels>] [-f <files>] [-n <passes>]\n"
+                    "       mfsbench <host> <port> append [-s <bytes>] [-f <files>]\n"
+                    "       mfsbench <host> <port> ingest [-s <bytes>] [-f <files>]\n"
+                    "       mfsbench <host> <port> load [-m <mix>] [-c <clients>] [-t <secs>] [-r <ops/sec>]\n"
+                    "                [-s <size dist>] [-i <io bytes>] [-D <dirs>] [-F <files/dir>] [-C] [-J]\n"
+                    "       mfsbench <host> <port> shards [-c <clients>] [-t <secs>] [-D <dirs/client>]\n"
+                    "       mfsbench <host> <port> stripe [-c <max stripes>] [-u <unit>] [-s <bytes>] [-n <passes>]\n"
+                    "  read     issue <reads> MFS_Read calls of <bytes> at <offset> (default 10000 x 4096 at 2048,\n"
+                    "           i.e. every read straddles a block) and report reads/sec and client cycles/read.\n"
+                    "           -S shuts the server down afterwards so it prints its copies/byte and cycles/read\n"
+                    "  threads  run MFS_Stat(0) from 1, 2, 4 .. <max threads> threads (default 8 x 10000) and\n"
+                    "           report aggregate ops/sec. each thread keeps <depth> async calls in flight\n"
+                    "           (default 1); -p gives every thread its own session instead of sharing one\n"
+                    "  meta     resolve /mfsbench/l1/../l<levels>/f<i> and stat it for <files> files, <passes>\n"
+                    "           times (default 4 levels, 32 files, 20 passes), once without and once with the\n"
+                    "           client metadata cache, and report round trips per resolve and hit rates\n"
+                    "  append   fill <files> files (default 8) with appends of <bytes> (default 64) up to the\n"
+                    "           maximum file size, once write-through and once through the write-back\n"
+                    "           cache, and report appends/sec and round trips per append\n"
+                    "  ingest   create <files> files (default 100) of <bytes> (default 1000) three ways:\n"
+                    "           creat+lookup+write, creat+write using the inum MFS_Creat returns, and a\n"
+                    "           single MFS_CreatWrite, and report files/sec and round trips per file\n"
+                    "  load     drive the server from <clients> threads (default 4), each with its own session,\n"
+                    "           for <secs> (default 5) with a weighted <mix> of operations, by default\n"
+                    "           lookup=30,stat=30,read=20,write=10,creat=5,unlink=5. the working set is\n"
+                    "           <dirs> directories (default 8) of <files/dir> files (default 32) sized by\n"
+                    "           <size dist>: fixed:N, uniform:MIN:MAX or exp:MEAN (default uniform:1:16384).\n"
+                    "           reads and writes move up to <io bytes> (default 4096). closed loop unless\n"
+                    "           -r gives an open-loop Poisson arrival rate, whose latencies are measured\n"
+                    "           from the intended send time. -C keeps the client cache on, -J prints one\n"
+                    "           JSON object instead of the table\n"
+                    "  shards   create <dirs/client> directories (default 4) under /mfsbench.shards from each of\n"
+                    "           <clients> threads (default 4), each with its own session, then have every\n"
+                    "           thread creat, stat and unlink files in its directories for <secs> (default\n"
+                    "           5). reports metadata ops/sec and how the directories fell across the shards;\n"
+                    "           run it against one server and against a sharded one to compare\n"
+                    "  stripe   on a sharded server, for 1, 2, 4 .. <max stripes> stripes (default 4) of <unit>\n"
+                    "           bytes (default 4096), write a striped file of <bytes> (default 122880) in one\n"
+                    "           call and read it back in one, <passes> times (default 50), and report MB/s\n");
+    exit(1);
+}
+
+double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// create (or reuse) the benchmark file in the root directory and make sure
+// it holds at least size bytes
+int bench_file(int size)
+{
+    int inum = MFS_Creat(0, MFS_REGULAR_FILE, BENCH_FILE);
+    if (inum == -1)
+        return -1;
+
+    char buffer[MFS_BLOCK_SIZE];
+    for (int offset = 0; offset < size; offset += MFS_BLOCK_SIZE)
+    {
+        for (int i = 0; i < MFS_BLOCK_SIZE; i++)
+            buffer[i] = 'a' + (offset / MFS_BLOCK_SIZE + i) % 26;
+        if (MFS_Write(inum, buffer, offset, MFS_BLOCK_SIZE) == -1)
+            return -1;
+    }
+    return inum;
+}
+
+int bench_read(int argc, char *argv[])
+{
+    int count = 10000;
+    int nbytes = MFS_BLOCK_SIZE;
+    int offset = MFS_BLOCK_SIZE / 2;
+    int shutdown = 0;
+
+    int ch;
+    while ((ch = getopt(argc, argv, "n:s:o:S")) != -1)
+    {
+        switch (ch)
+        {
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 's':
+            nbytes = atoi(optarg);
+            break;
+        case 'o':
+            offset = atoi(optarg);
+            break;
+        case 'S':
+            shutdown = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (count <= 0 || nbytes <= 0 || nbytes > MFS_BLOCK_SIZE || offset < 0)
+        usage();
+
+    // measure the server's read path, not the client cache
+    MFS_SetCaching(NULL, 0);
+    int inum = bench_file(offset + nbytes);
+    if (inum == -1)
+    {
+        fprintf(stderr, "mfsbench: unable to set up %s\n", BENCH_FILE);
+        return 1;
+    }
+
+    char buffer[MFS_BLOCK_SIZE];
+    double start = now_sec();
+    unsigned long long cycles = cycles_now();
+    for (int i = 0; i < count; i++)
+    {
+        if (MFS_Read(inum, buffer, offset, nbytes) == -1)
+        {
+            fprintf(stderr, "mfsbench: MFS_Read failed at iteration %d\n", i);
+            return 1;
+        }
+    }
+    cycles = cycles_now() - cycles;
+    double elapsed = now_sec() - start;
+
+    printf("read: %d x %d bytes at offset %d\n", count, nbytes, offset);
+    printf("  %.0f reads/sec, %.2f MB/s, %.2f us/read, %llu client cycles/read\n",
+           count / elapsed, (double)count * nbytes / elapsed / 1e6,
+           elapsed * 1e6 / count, cycles / count);
+
+    if (shutdown)
+        MFS_Shutdown();
+    return 0;
+}
+
+struct thread_args
+{
+    MFS_Session_t *session;
+    int ops;
+    int depth;
+    int failed;
+};
+
+void *stat_worker(void *arg)
+{
+    struct thread_args *a = (struct thread_args *)arg;
+    MFS_Stat_t stats[a->depth];
+    MFS_Future_t *inflight[a->depth];
+
+    for (int i = 0; i < a->depth && i < a->ops; i++)
+        inflight[i] = MFS_AStat(a->session, 0, &stats[i]);
+    for (int i = 0; i < a->ops; i++)
+    {
+        int slot = i % a->depth;
+        if (MFS_Wait(inflight[slot]) == -1)
+            a->failed++;
+        if (i + a->depth < a->ops)
+            inflight[slot] = MFS_AStat(a->session, 0, &stats[slot]);
+    }
+    return NULL;
+}
+
+int bench_threads(int argc, char *argv[])
+{
+    int maxThreads = 8;
+    int ops = 10000;
+    int depth = 1;
+    int private = 0;
+
+    int ch;
+    while ((ch = getopt(argc, argv, "t:n:d:p")) != -1)
+    {
+        switch (ch)
+        {
+        case 't':
+            maxThreads = atoi(optarg);
+            break;
+        case 'n':
+            ops = atoi(optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 'p':
+            private = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (maxThreads <= 0 || ops <= 0 || depth <= 0)
+        usage();
+
+    MFS_Session_t *shared = MFS_Open(host, port);
+    if (shared == NULL)
+    {
+        fprintf(stderr, "mfsbench: MFS_Open failed\n");
+        return 1;
+    }
+    MFS_SetCaching(shared, 0);
+
+    printf("threads: %d ops/thread, depth %d, %s sessions\n", ops, depth, private ? "private" : "shared");
+    for (int n = 1; n <= maxThreads; n *= 2)
+    {
+        pthread_t threads[n];
+        struct thread_args args[n];
+        for (int i = 0; i < n; i++)
+        {
+            args[i].session = private ? MFS_Open(host, port) : shared;
+            if (private)
+                MFS_SetCaching(args[i].session, 0);
+            args[i].ops = ops;
+            args[i].depth = depth;
+            args[i].failed = 0;
+        }
+
+        double start = now_sec();
+        for (int i = 0; i < n; i++)
+            pthread_create(&threads[i], NULL, stat_worker, &args[i]);
+        int failed = 0;
+        for (int i = 0; i < n; i++)
+        {
+            pthread_join(threads[i], NULL);
+            failed += args[i].failed;
+        }
+        double elapsed = now_sec() - start;
+
+        printf("  %3d threads: %10.0f ops/sec (%d failed)\n", n, (double)n * ops / elapsed, failed);
+        if (private)
+        {
+            for (int i = 0; i < n; i++)
+                MFS_Close(args[i].session);
+        }
+    }
+    MFS_Close(shared);
+    return 0;
+}
+
+// mkdir -p /mfsbench/l1/../l<levels> and create files f0..f<files-1> in it
+int meta_tree(int levels, int files)
+{
+    char name[32];
+    int dir = 0;
+    for (int i = 0; i <= levels; i++)
+    {
+        if (i == 0)
+            strcpy(name, "mfsbench");
+        else
+            sprintf(name, "l%d", i);
+        dir = MFS_Creat(dir, MFS_DIRECTORY, name);
+        if (dir == -1)
+            return -1;
+    }
+    for (int i = 0; i < files; i++)
+    {
+        sprintf(name, "f%d", i);
+        if (MFS_Creat(dir, MFS_REGULAR_FILE, name) == -1)
+            return -1;
+    }
+    return dir;
+}
+
+// one pass: walk the path from the root for every file, like mfscli does
+int meta_pass(int levels, int files)
+{
+    char name[32];
+    for (int f = 0; f < files; f++)
+    {
+        int inum = MFS_Lookup(0, "mfsbench");
+        for (int i = 1; i <= levels && inum != -1; i++)
+        {
+            sprintf(name, "l%d", i);
+            inum = MFS_Lookup(inum, name);
+        }
+        sprintf(name, "f%d", f);
+        if (inum != -1)
+            inum = MFS_Lookup(inum, name);
+
+        MFS_Stat_t stat;
+        if (inum == -1 || MFS_Stat(inum, &stat) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+int bench_meta(int argc, char *argv[])
+{
+    int levels = 4;
+    int files = 32;
+    int passes = 20;
+
+    int ch;
+    while ((ch = getopt(argc, argv, "l:f:n:")) != -1)
+    {
+        switch (ch)
+        {
+        case 'l':
+            levels = atoi(optarg);
+            break;
+        case 'f':
+            files = atoi(optarg);
+            break;
+        case 'n':
+            passes = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (levels < 0 || files <= 0 || passes <= 0)
+        usage();
+
+    if (meta_tree(levels, files) == -1)
+    {
+        fprintf(stderr, "mfsbench: unable to set up /mfsbench\n");
+        return 1;
+    }
+
+    printf("meta: %d levels, %d files, %d passes\n", levels, files, passes);
+    for (int caching = 0; caching <= 1; caching++)
+    {
+        MFS_SetCaching(NULL, caching);
+        MFS_CacheStats_t before, after;
+        MFS_GetCacheStats(NULL, &before);
+
+        double start = now_sec();
+        for (int p = 0; p < passes; p++)
+        {
+            if (meta_pass(levels, files) == -1)
+            {
+                fprintf(stderr, "mfsbench: resolve failed\n");
+                return 1;
+            }
+        }
+        double elapsed = now_sec() - start;
+        MFS_GetCacheStats(NULL, &after);
+
+        long long resolves = (long long)passes * files;
+        long long hits = after.lookup_hits - before.lookup_hits + after.stat_hits - before.stat_hits;
+        long long misses = after.lookup_misses - before.lookup_misses + after.stat_misses - before.stat_misses;
+        printf("  cache %-3s: %8.0f resolves/sec, %.2f round trips/resolve, hit rate %.1f%%, %lld revokes\n",
+               caching ? "on" : "off", resolves / elapsed,
+               (double)(after.rpcs - before.rpcs) / resolves,
+               hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+               after.revokes - before.revokes);
+    }
+    return 0;
+}
+
+// fill files f0..f<files-1> in a fresh directory with appends of nbytes,
+// finishing with MFS_Fsync so buffered data is counted
+int append_pass(char *dirname, int files, int nbytes, long long *appends)
+{
+    int dir = MFS_Creat(0, MFS_DIRECTORY, dirname);
+    if (dir == -1)
+        return -1;
+
+    char buffer[MFS_BLOCK_SIZE];
+    memset(buffer, 'x', sizeof(buffer));
+    int count = 30 * MFS_BLOCK_SIZE / nbytes;
+    for (int f = 0; f < files; f++)
+    {
+        char name[32];
+        sprintf(name, "f%d", f);
+        int inum = MFS_Creat(dir, MFS_REGULAR_FILE, name);
+        if (inum == -1)
+            return -1;
+
+        for (int i = 0; i < count; i++)
+        {
+            if (MFS_Write(inum, buffer, i * nbytes, nbytes) == -1)
+                return -1;
+        }
+        if (MFS_Fsync(inum) == -1)
+            return -1;
+        *appends += count;
+    }
+    return 0;
+}
+
+int bench_append(int argc, char *argv[])
+{
+    int nbytes = 64;
+    int files = 8;
+
+    int ch;
+    while ((ch = getopt(argc, argv, "s:f:")) != -1)
+    {
+        switch (ch)
+        {
+        case 's':
+            nbytes = atoi(optarg);
+            break;
+        case 'f':
+            files = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (nbytes <= 0 || nbytes > MFS_BLOCK_SIZE || files <= 0)
+        usage();
+
+    printf("append: %d files, %d byte appends\n", files, nbytes);
+    double rate[2];
+    for (int caching = 0; caching <= 1; caching++)
+    {
+        char dirname[32];
+        sprintf(dirname, "append%d.%d", caching, getpid());
+        MFS_SetCaching(NULL, caching);
+        MFS_CacheStats_t before, after;
+        MFS_GetCacheStats(NULL, &before);
+
+        long long appends = 0;
+        double start = now_sec();
+        if (append_pass(dirname, files, nbytes, &appends) == -1)
+        {
+            fprintf(stderr, "mfsbench: append failed\n");
+            return 1;
+        }
+        double elapsed = now_sec() - start;
+        MFS_GetCacheStats(NULL, &after);
+
+        rate[caching] = appends / elapsed;
+        printf("  %-13s: %9.0f appends/sec, %.2f MB/s, %.3f round trips/append\n",
+               caching ? "write-back" : "write-through", rate[caching],
+               appends * nbytes / elapsed / 1e6, (double)(after.rpcs - before.rpcs) / appends);
+    }
+    printf("  speedup: %.1fx\n", rate[1] / rate[0]);
+    return 0;
+}
+
+int bench_ingest(int argc, char *argv[])
+{
+    int nbytes = 1000;
+    int files = 100;
+
+    int ch;
+    while ((ch = getopt(argc, argv, "s:f:")) != -1)
+    {
+        switch (ch)
+        {
+        case 's':
+            nbytes = atoi(optarg);
+            break;
+        case 'f':
+            files = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (nbytes < 0 || nbytes > MFS_BLOCK_SIZE || files <= 0)
+        usage();
+
+    // count every round trip the way an uncached client pays for it
+    MFS_SetCaching(NULL, 0);
+
+    char buffer[MFS_BLOCK_SIZE];
+    memset(buffer, 'x', sizeof(buffer));
+    const char *ways[] = {"creat+lookup+write", "creat+write", "creatwrite"};
+    printf("ingest: %d files of %d bytes\n", files, nbytes);
+    for (int way = 0; way < 3; way++)
+    {
+        char name[32];
+        sprintf(name, "ingest%d.%d", way, getpid());
+        int dir = MFS_Creat(0, MFS_DIRECTORY, name);
+        if (dir == -1)
+        {
+            fprintf(stderr, "mfsbench: unable to create /%s\n", name);
+            return 1;
+        }
+
+        MFS_CacheStats_t before, after;
+        MFS_GetCacheStats(NULL, &before);
+        double start = now_sec();
+        for (int f = 0; f < files; f++)
+        {
+            sprintf(name, "f%d", f);
+            int inum;
+            if (way == 2)
+            {
+                inum = MFS_CreatWrite(dir, MFS_REGULAR_FILE, name, buffer, nbytes);
+            }
+            else
+            {
+                inum = MFS_Creat(dir, MFS_REGULAR_FILE, name);
+                if (way == 0 && inum != -1)
+                    inum = MFS_Lookup(dir, name);
+                if (inum != -1 && nbytes > 0 && MFS_Write(inum, buffer, 0, nbytes) == -1)
+                    inum = -1;
+            }
+            if (inum == -1)
+            {
+                fprintf(stderr, "mfsbench: %s failed for file %d\n", ways[way], f);
+                return 1;
+            }
+        }
+        double elapsed = now_sec() - start;
+        MFS_GetCacheStats(NULL, &after);
+
+        printf("  %-18s: %8.0f files/sec, %.2f round trips/file\n", ways[way],
+               files / elapsed, (double)(after.rpcs - before.rpcs) / files);
+    }
+    return 0;
+}
+
+/*
+ * load generator. the working set is /mfsbench.load/d<i>/f<j>; lookup,
+ * stat, read and write pick one of its files at random, creat adds
+ * t<client>.<n> to a random directory and unlink removes the newest file
+ * the same client created (or creates one if it has none left).
+ */
+enum
+{
+    LOAD_LOOKUP,
+    LOAD_STAT,
+    LOAD_READ,
+    LOAD_WRITE,
+    LOAD_CREAT,
+    LOAD_UNLINK,
+    LOAD_OPS
+};
+
+const char *load_names[LOAD_OPS] = {"lookup", "stat", "read", "write", "creat", "unlink"};
+
+#define LOAD_MAX_SIZE (30 * MFS_BLOCK_SIZE)
+
+struct load_config
+{
+    int weights[LOAD_OPS];
+    int clients;
+    double seconds;
+    double rate; // ops/sec over all clients, 0 for closed loop
+    char dist[16];
+    int size_a;
+    int size_b;
+    int io;
+    int dirs;
+    int fanout;
+    int caching;
+};
+
+struct load_config load;
+int *load_dirs;
+int *load_inums;
+int *load_sizes;
+
+struct load_client
+{
+    int id;
+    MFS_Session_t *session;
+    unsigned int seed;
+    hist_t hist[LOAD_OPS];
+    long long errors[LOAD_OPS];
+    int *created; // creat names not yet unlinked, as dir << 20 | n
+    int ncreated;
+    int next_name;
+};
+
+double load_random(unsigned int *seed)
+{
+    return (rand_r(seed) + 0.5) / ((double)RAND_MAX + 1.0);
+}
+
+int load_size(unsigned int *seed)
+{
+    double size;
+    if (strcmp(load.dist, "fixed") == 0)
+        size = load.size_a;
+    else if (strcmp(load.dist, "uniform") == 0)
+        size = load.size_a + load_random(seed) * (load.size_b - load.size_a + 1);
+    else
+        size = -log(load_random(seed)) * load.size_a;
+    if (size < 1)
+        size = 1;
+    if (size > LOAD_MAX_SIZE)
+        size = LOAD_MAX_SIZE;
+    return (int)size;
+}
+
+int load_parse_mix(char *mix)
+{
+    memset(load.weights, 0, sizeof(load.weights));
+    char *save;
+    for (char *item = strtok_r(mix, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save))
+    {
+        char *eq = strchr(item, '=');
+        if (eq == NULL)
+            return -1;
+        *eq = '\0';
+        int op;
+        for (op = 0; op < LOAD_OPS; op++)
+        {
+            if (strcmp(item, load_names[op]) == 0)
+                break;
+        }
+        if (op == LOAD_OPS || atoi(eq + 1) < 0)
+            return -1;
+        load.weights[op] = atoi(eq + 1);
+    }
+    int total = 0;
+    for (int op = 0; op < LOAD_OPS; op++)
+        total += load.weights[op];
+    return total > 0 ? 0 : -1;
+}
+
+int load_parse_dist(char *dist)
+{
+    load.size_b = 0;
+    if (sscanf(dist, "fixed:%d", &load.size_a) == 1)
+        strcpy(load.dist, "fixed");
+    else if (sscanf(dist, "uniform:%d:%d", &load.size_a, &load.size_b) == 2)
+        strcpy(load.dist, "uniform");
+    else if (sscanf(dist, "exp:%d", &load.size_a) == 1)
+        strcpy(load.dist, "exp");
+    else
+        return -1;
+    if (load.size_a < 0 || (strcmp(load.dist, "uniform") == 0 && load.size_b < load.size_a))
+        return -1;
+    return 0;
+}
+
+// create the working set, reusing whatever a previous run left behind
+int load_setup()
+{
+    int root = MFS_Creat(0, MFS_DIRECTORY, "mfsbench.load");
+    if (root == -1)
+        return -1;
+
+    int nfiles = load.dirs * load.fanout;
+    load_dirs = calloc(load.dirs, sizeof(int));
+    load_inums = calloc(nfiles, sizeof(int));
+    load_sizes = calloc(nfiles, sizeof(int));
+    if (load_dirs == NULL || load_inums == NULL || load_sizes == NULL)
+        return -1;
+
+    unsigned int seed = 1;
+    char buffer[MFS_BLOCK_SIZE];
+    char name[32];
+    for (int d = 0; d < load.dirs; d++)
+    {
+        sprintf(name, "d%d", d);
+        load_dirs[d] = MFS_Creat(root, MFS_DIRECTORY, name);
+        if (load_dirs[d] == -1)
+            return -1;
+        for (int f = 0; f < load.fanout; f++)
+        {
+            int i = d * load.fanout + f;
+            int size = load_size(&seed);
+            sprintf(name, "f%d", f);
+            memset(buffer, 'a' + i % 26, sizeof(buffer));
+            int first = size < MFS_BLOCK_SIZE ? size : MFS_BLOCK_SIZE;
+            load_inums[i] = MFS_CreatWrite(load_dirs[d], MFS_REGULAR_FILE, name, buffer, first);
+            if (load_inums[i] == -1)
+                return -1;
+            for (int offset = first; offset < size; offset += MFS_BLOCK_SIZE)
+            {
+                int nbytes = size - offset < MFS_BLOCK_SIZE ? size - offset : MFS_BLOCK_SIZE;
+                if (MFS_Write(load_inums[i], buffer, offset, nbytes) == -1)
+                    return -1;
+            }
+            if (MFS_Fsync(load_inums[i]) == -1)
+                return -1;
+            load_sizes[i] = size;
+        }
+    }
+    return 0;
+}
+
+int load_op(struct load_client *c, int op, char *buffer)
+{
+    MFS_Session_t *s = c->session;
+    int f = rand_r(&c->seed) % (load.dirs * load.fanout);
+    int size = load_sizes[f];
+    char name[32];
+    MFS_Stat_t stat;
+
+    switch (op)
+    {
+    case LOAD_LOOKUP:
+        sprintf(name, "f%d", f % load.fanout);
+        return MFS_SLookup(s, load_dirs[f / load.fanout], name) == load_inums[f] ? 0 : -1;
+    case LOAD_STAT:
+        return MFS_SStat(s, load_inums[f], &stat);
+    case LOAD_READ:
+    {
+        int nbytes = size < load.io ? size : load.io;
+        int offset = rand_r(&c->seed) % (size - nbytes + 1);
+        return MFS_SRead(s, load_inums[f], buffer, offset, nbytes);
+    }
+    case LOAD_WRITE:
+    {
+        // a write sets the file size to its end, so rewriting the tail
+        // keeps the working set the size it was created with
+        int nbytes = size < load.io ? size : load.io;
+        int rc = MFS_SWrite(s, load_inums[f], buffer, size - nbytes, nbytes);
+        if (rc == 0 && load.caching)
+            rc = MFS_SFsync(s, load_inums[f]);
+        return rc;
+    }
+    case LOAD_CREAT:
+    case LOAD_UNLINK:
+        if (op == LOAD_UNLINK && c->ncreated > 0)
+        {
+            int entry = c->created[--c->ncreated];
+            sprintf(name, "t%d.%d", c->id, entry & 0xfffff);
+            return MFS_SUnlink(s, load_dirs[entry >> 20], name);
+        }
+        else
+        {
+            int d = rand_r(&c->seed) % load.dirs;
+            int n = c->next_name++ & 0xfffff;
+            sprintf(name, "t%d.%d", c->id, n);
+            if (MFS_SCreat(s, load_dirs[d], MFS_REGULAR_FILE, name) == -1)
+                return -1;
+            if (c->ncreated < 4096)
+                c->created[c->ncreated++] = d << 20 | n;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void *load_worker(void *arg)
+{
+    struct load_client *c = (struct load_client *)arg;
+    char buffer[MFS_BLOCK_SIZE];
+    memset(buffer, 'w', sizeof(buffer));
+
+    int total = 0;
+    for (int op = 0; op < LOAD_OPS; op++)
+        total += load.weights[op];
+
+    double start = now_sec();
+    double end = start + load.seconds;
+    double intended = start;
+    double mean_gap = load.rate > 0 ? load.clients / load.rate : 0;
+    while (1)
+    {
+        if (load.rate > 0)
+        {
+            // Poisson arrivals; a late request is still charged from when
+            // it should have gone out, so a stalled server is not hidden
+            intended += -log(load_random(&c->seed)) * mean_gap;
+            double now = now_sec();
+            if (intended > now)
+            {
+                struct timespec ts;
+                double wait = intended - now;
+                ts.tv_sec = (time_t)wait;
+                ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+                nanosleep(&ts, NULL);
+            }
+        }
+        else
+        {
+            intended = now_sec();
+        }
+        if (intended >= end)
+            break;
+
+        int pick = rand_r(&c->seed) % total;
+        int op = 0;
+        while (pick >= load.weights[op])
+            pick -= load.weights[op++];
+        // the unlink fallback is really a creat
+        if (op == LOAD_UNLINK && c->ncreated == 0)
+            op = LOAD_CREAT;
+
+        if (load_op(c, op, buffer) == -1)
+            c->errors[op]++;
+        else
+            hist_record(&c->hist[op], (unsigned long long)((now_sec() - intended) * 1e9));
+    }
+    return NULL;
+}
+
+void load_report(hist_t *hist, long long *errors, double elapsed, int json)
+{
+    const double pcts[] = {50, 90, 99, 99.9, 99.99};
+    const char *pct_names[] = {"p50", "p90", "p99", "p99.9", "p99.99"};
+    int npcts = sizeof(pcts) / sizeof(pcts[0]);
+
+    hist_t all;
+    hist_init(&all);
+    long long all_errors = 0;
+    for (int op = 0; op < LOAD_OPS; op++)
+    {
+        hist_merge(&all, &hist[op]);
+        all_errors += errors[op];
+    }
+
+    if (json)
+    {
+        printf("{\"time\":%ld,\"clients\":%d,\"seconds\":%.3f,\"rate\":%.0f,\"dist\":\"%s:%d:%d\","
+               "\"io\":%d,\"dirs\":%d,\"fanout\":%d,\"caching\":%d,\"ops\":{",
+               (long)time(NULL), load.clients, elapsed, load.rate, load.dist, load.size_a, load.size_b,
+               load.io, load.dirs, load.fanout, load.caching);
+        for (int op = 0; op <= LOAD_OPS; op++)
+        {
+            hist_t *h = op < LOAD_OPS ? &hist[op] : &all;
+            printf("%s\"%s\":{\"count\":%llu,\"errors\":%lld,\"ops_per_sec\":%.1f,\"mean_us\":%.2f",
+                   op ? "," : "", op < LOAD_OPS ? load_names[op] : "all", h->total,
+                   op < LOAD_OPS ? errors[op] : all_errors, h->total / elapsed,
+                   h->total ? h->sum / 1e3 / h->total : 0.0);
+            for (int p = 0; p < npcts; p++)
+                printf(",\"%s_us\":%.2f", pct_names[p], hist_percentile(h, pcts[p]) / 1e3);
+            printf(",\"max_us\":%.2f}", h->max / 1e3);
+        }
+        printf("}}\n");
+        return;
+    }
+
+    printf("load: %d clients, %s, %.1f s, sizes %s:%d:%d, io %d, %d dirs x %d files, cache %s\n",
+           load.clients, load.rate > 0 ? "open loop" : "closed loop", elapsed, load.dist,
+           load.size_a, load.size_b, load.io, load.dirs, load.fanout, load.caching ? "on" : "off");
+    printf("  %-7s %9s %7s %10s %9s", "op", "count", "errors", "ops/sec", "mean");
+    for (int p = 0; p < npcts; p++)
+        printf(" %9s", pct_names[p]);
+    printf(" %9s   (us)\n", "max");
+    for (int op = 0; op <= LOAD_OPS; op++)
+    {
+        hist_t *h = op < LOAD_OPS ? &hist[op] : &all;
+        long long e = op < LOAD_OPS ? errors[op] : all_errors;
+        if (h->total == 0 && e == 0)
+            continue;
+        printf("  %-7s %9llu %7lld %10.0f %9.1f", op < LOAD_OPS ? load_names[op] : "all",
+               h->total, e, h->total / elapsed, h->total ? h->sum / 1e3 / h->total : 0.0);
+        for (int p = 0; p < npcts; p++)
+            printf(" %9.1f", hist_percentile(h, pcts[p]) / 1e3);
+        printf(" %9.1f\n", h->max / 1e3);
+    }
+}
+
+int bench_load(int argc, char *argv[])
+{
+    char mix[256] = "lookup=30,stat=30,read=20,write=10,creat=5,unlink=5";
+    char dist[64] = "uniform:1:16384";
+    int json = 0;
+    load.clients = 4;
+    load.seconds = 5;
+    load.rate = 0;
+    load.io = MFS_BLOCK_SIZE;
+    load.dirs = 8;
+    load.fanout = 32;
+    load.caching = 0;
+
+    int ch;
+    while ((ch = getopt(argc, argv, "m:c:t:r:s:i:D:F:CJ")) != -1)
+    {
+        switch (ch)
+        {
+        case 'm':
+            snprintf(mix, sizeof(mix), "%s", optarg);
+            break;
+        case 'c':
+            load.clients = atoi(optarg);
+            break;
+        case 't':
+            load.seconds = atof(optarg);
+            break;
+        case 'r':
+            load.rate = atof(optarg);
+            break;
+        case 's':
+            snprintf(dist, sizeof(dist), "%s", optarg);
+            break;
+        case 'i':
+            load.io = atoi(optarg);
+            break;
+        case 'D':
+            load.dirs = atoi(optarg);
+            break;
+        case 'F':
+            load.fanout = atoi(optarg);
+            break;
+        case 'C':
+            load.caching = 1;
+            break;
+        case 'J':
+            json = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (load_parse_mix(mix) == -1 || load_parse_dist(dist) == -1 || load.clients <= 0 ||
+        load.seconds <= 0 || load.rate < 0 || load.io <= 0 || load.io > MFS_BLOCK_SIZE ||
+        load.dirs <= 0 || load.dirs >= 1 << 11 || load.fanout <= 0)
+        usage();
+
+    MFS_SetCaching(NULL, 0);
+    if (load_setup() == -1)
+    {
+        fprintf(stderr, "mfsbench: unable to set up /mfsbench.load\n");
+        return 1;
+    }
+
+    struct load_client *clients = calloc(load.clients, sizeof(struct load_client));
+    pthread_t threads[load.clients];
+    for (int i = 0; i < load.clients; i++)
+    {
+        clients[i].id = i;
+        clients[i].seed = getpid() * 31 + i;
+        clients[i].created = calloc(4096, sizeof(int));
+        clients[i].session = MFS_Open(host, port);
+        if (clients[i].session == NULL || clients[i].created == NULL)
+        {
+            fprintf(stderr, "mfsbench: unable to open session %d\n", i);
+            return 1;
+        }
+        MFS_SetCaching(clients[i].session, load.caching);
+        for (int op = 0; op < LOAD_OPS; op++)
+            hist_init(&clients[i].hist[op]);
+    }
+
+    double start = now_sec();
+    for (int i = 0; i < load.clients; i++)
+        pthread_create(&threads[i], NULL, load_worker, &clients[i]);
+    for (int i = 0; i < load.clients; i++)
+        pthread_join(threads[i], NULL);
+    double elapsed = now_sec() - start;
+
+    hist_t hist[LOAD_OPS];
+    long long errors[LOAD_OPS] = {0};
+    for (int op = 0; op < LOAD_OPS; op++)
+        hist_init(&hist[op]);
+    for (int i = 0; i < load.clients; i++)
+    {
+        // leave the directories as we found them for the next run
+        struct load_client *c = &clients[i];
+        while (c->ncreated > 0)
+        {
+            int entry = c->created[--c->ncreated];
+            char name[32];
+            sprintf(name, "t%d.%d", c->id, entry & 0xfffff);
+            MFS_SUnlink(c->session, load_dirs[entry >> 20], name);
+        }
+        for (int op = 0; op < LOAD_OPS; op++)
+        {
+            hist_merge(&hist[op], &c->hist[op]);
+            errors[op] += c->errors[op];
+        }
+        MFS_Close(c->session);
+        free(c->created);
+    }
+    free(clients);
+
+    load_report(hist, errors, elapsed, json);
+    return 0;
+}
+
+struct shard_client
+{
+    MFS_Session_t *session;
+    int *dirs;
+    int ndirs;
+    double until;
+    long long ops;
+    long long errors;
+};
+
+void *shard_worker(void *arg)
+{
+    struct shard_client *c = (struct shard_client *)arg;
+    char name[32];
+    MFS_Stat_t stat;
+    for (long long i = 0; now_sec() < c->until; i++)
+    {
+        int dir = c->dirs[i % c->ndirs];
+        sprintf(name, "f%lld", i);
+        int inum = MFS_SCreat(c->session, dir, MFS_REGULAR_FILE, name);
+        if (inum == -1 || MFS_SStat(c->session, inum, &stat) == -1 || MFS_SUnlink(c->session, dir, name) == -1)
+            c->errors++;
+        c->ops += 3;
+    }
+    return NULL;
+}
+
+int bench_shards(int argc, char *argv[])
+{
+    int nclients = 4;
+    double secs = 5;
+    int ndirs = 4;
+
+    int ch;
+    while ((ch = getopt(argc, argv, "c:t:D:")) != -1)
+    {
+        switch (ch)
+        {
+        case 'c':
+            nclients = atoi(optarg);
+            break;
+        case 't':
+            secs = atof(optarg);
+            break;
+        case 'D':
+            ndirs = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (nclients <= 0 || secs <= 0 || ndirs <= 0)
+        usage();
+
+    int root = MFS_Creat(0, MFS_DIRECTORY, "mfsbench.shards");
+    if (root == -1)
+    {
+        fprintf(stderr, "mfsbench: unable to set up /mfsbench.shards\n");
+        return 1;
+    }
+
+    // directories are placed by name, so spread them and count where they went
+    int per_shard[MFS_MAX_SHARDS] = {0};
+    int shards = 1;
+    struct shard_client clients[nclients];
+    pthread_t threads[nclients];
+    for (int i = 0; i < nclients; i++)
+    {
+        clients[i].session = MFS_Open(host, port);
+        if (clients[i].session == NULL)
+        {
+            fprintf(stderr, "mfsbench: MFS_Open failed\n");
+            return 1;
+        }
+        MFS_SetCaching(clients[i].session, 0);
+        clients[i].dirs = malloc(ndirs * sizeof(int));
+        clients[i].ndirs = ndirs;
+        clients[i].ops = clients[i].errors = 0;
+        for (int d = 0; d < ndirs; d++)
+        {
+            char name[32];
+            sprintf(name, "c%d.%d", i, d);
+            int dir = MFS_SCreat(clients[i].session, root, MFS_DIRECTORY, name);
+            if (dir == -1)
+            {
+                fprintf(stderr, "mfsbench: unable to create /mfsbench.shards/%s\n", name);
+                return 1;
+            }
+            clients[i].dirs[d] = dir;
+            int shard = dir >> MFS_SHARD_SHIFT;
+            per_shard[shard]++;
+            if (shard + 1 > shards)
+                shards = shard + 1;
+        }
+    }
+
+    double start = now_sec();
+    for (int i = 0; i < nclients; i++)
+    {
+        clients[i].until = start + secs;
+        pthread_create(&threads[i], NULL, shard_worker, &clients[i]);
+    }
+    long long ops = 0, errors = 0;
+    for (int i = 0; i < nclients; i++)
+    {
+        pthread_join(threads[i], NULL);
+        ops += clients[i].ops;
+        errors += clients[i].errors;
+    }
+    double elapsed = now_sec() - start;
+
+    printf("shards: %d clients, %d dirs/client\n", nclients, ndirs);
+    printf("  dirs per shard:");
+    for (int s = 0; s < shards; s++)
+        printf(" %d", per_shard[s]);
+    printf("\n  %10.0f metadata ops/sec (%lld errors)\n", ops / elapsed, errors);
+
+    for (int i = 0; i < nclients; i++)
+    {
+        for (int d = 0; d < ndirs; d++)
+        {
+            char name[32];
+            sprintf(name, "c%d.%d", i, d);
+            MFS_SUnlink(clients[i].session, root, name);
+        }
+        MFS_Close(clients[i].session);
+        free(clients[i].dirs);
+    }
+    MFS_Unlink(0, "mfsbench.shards");
+    return 0;
+}
+
+int bench_stripe(int argc, char *argv[])
+{
+    int maxStripes = 4;
+    int unit = MFS_BLOCK_SIZE;
+    int size = 30 * MFS_BLOCK_SIZE;
+    int passes = 50;
+
+    int ch;
+    while ((ch = getopt(argc, argv, "c:u:s:n:")) != -1)
+    {
+        switch (ch)
+        {
+        case 'c':
+            maxStripes = atoi(optarg);
+            break;
+        case 'u':
+            unit = atoi(optarg);
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        case 'n':
+            passes = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (maxStripes <= 0 || maxStripes > MFS_MAX_STRIPES || unit <= 0 || size <= 0 || passes <= 0)
+        usage();
+
+    char *data = malloc(size);
+    char *back = malloc(size);
+    if (data == NULL || back == NULL)
+        return 1;
+    for (int i = 0; i < size; i++)
+        data[i] = (char)(i * 7 + i / 4096);
+
+    printf("stripe: %d bytes, unit %d, %d passes\n", size, unit, passes);
+    for (int n = 1; n <= maxStripes; n *= 2)
+    {
+        char name[32];
+        sprintf(name, "mfsbench.stripe%d", n);
+        int inum = MFS_CreatStriped(0, name, unit, n);
+        if (inum == -1)
+        {
+            fprintf(stderr, "mfsbench: unable to create a file of %d stripes (is the server sharded?)\n", n);
+            return 1;
+        }
+
+        double start = now_sec();
+        for (int p = 0; p < passes; p++)
+        {
+            if (MFS_WriteStriped(inum, data, 0, size) == -1)
+            {
+                fprintf(stderr, "mfsbench: striped write failed\n");
+                return 1;
+            }
+        }
+        double wrote = now_sec() - start;
+
+        start = now_sec();
+        for (int p = 0; p < passes; p++)
+        {
+            if (MFS_ReadStriped(inum, back, 0, size) != size || memcmp(back, data, size) != 0)
+            {
+                fprintf(stderr, "mfsbench: striped read failed\n");
+                return 1;
+            }
+        }
+        double read = now_sec() - start;
+
+        printf("  %3d stripes: write %8.2f MB/s, read %8.2f MB/s\n", n, (double)size * passes / wrote / 1e6,
+               (double)size * passes / read / 1e6);
+        MFS_Unlink(0, name);
+    }
+    free(data);
+    free(back);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4)
+        usage();
+
+    host = argv[1];
+    port = atoi(argv[2]);
+    if (MFS_Init(argv[1], atoi(argv[2])) != 0)
+    {
+        fprintf(stderr, "mfsbench: MFS_Init failed for %s:%s\n", argv[1], argv[2]);
+        return 1;
+    }
+
+    char *mode = argv[3];
+    argc -= 3;
+    argv += 3;
+    if (strcmp(mode, "read") == 0)
+        return bench_read(argc, argv);
+    if (strcmp(mode, "threads") == 0)
+        return bench_threads(argc, argv);
+    if (strcmp(mode, "meta") == 0)
+        return bench_meta(argc, argv);
+    if (strcmp(mode, "append") == 0)
+        return bench_append(argc, argv);
+    if (strcmp(mode, "ingest") == 0)
+        return bench_ingest(argc, argv);
+    if (strcmp(mode, "load") == 0)
+        return bench_load(argc, argv);
+    if (strcmp(mode, "shards") == 0)
+        return bench_shards(argc, argv);
+    if (strcmp(mode, "stripe") == 0)
+        return bench_stripe(argc, argv);
+    usage();
+    return 1;
+}
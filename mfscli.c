@@ -7,13 +7,20 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/time.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include "mfs.h"
 #include "ufs.h"
+#include "message.h"
 
 #define MFS_RW_BUFFER_SIZE 4096
 #define LOG_SIZE 4096
+#define MFS_NAME_SIZE 28 // MFS_DirEnt_t.name, including \0
+#define DEFAULT_JOBS 8
 
 char logBuffer[LOG_SIZE];
 int verboseMode = 0;
@@ -138,23 +145,42 @@ int perform_insert(const char *fromPath, char *toPath) {
 
     int dirInode = _traverseToDirectory(dirPath);
 
-    sprintf(logBuffer, "Trying to create new file %s in %s", fileName, dirPath); VERBOSE();
+    char buffer[MFS_RW_BUFFER_SIZE];
+    memset(buffer, 0, MFS_RW_BUFFER_SIZE);
 
-    int rc = MFS_Creat(dirInode, UFS_REGULAR_FILE, fileName);
-    if (rc == -1) {
-        sprintf(logBuffer, "Unable to create new file %s in %s", fileName, dirPath); ERR();
+    struct stat fromStat;
+    if (fstat(toCopyFd, &fromStat) == -1) {
+        sprintf(logBuffer, "Unable to stat provided file %s", fromPath); ERR();
+    }
+
+    // a file that fits in one message is created and written in one round trip
+    if (fromStat.st_size <= MFS_RW_BUFFER_SIZE) {
+        sprintf(logBuffer, "Trying to create new file %s in %s with its contents", fileName, dirPath); VERBOSE();
+
+        int readBytes = read(toCopyFd, buffer, MFS_RW_BUFFER_SIZE);
+        if (readBytes == -1) {
+            sprintf(logBuffer, "Error while reading input file"); ERR();
+        }
+
+        int newInode = MFS_CreatWrite(dirInode, UFS_REGULAR_FILE, fileName, buffer, readBytes);
+        if (newInode == -1) {
+            sprintf(logBuffer, "Unable to create new file %s in %s", fileName, dirPath); ERR();
+        }
+
+        sprintf(logBuffer, "Created new file with inode number %d and written %d bytes", newInode, readBytes); INFO();
+        free(dirPath);
+        return 0;
     }
 
-    int newInode = MFS_Lookup(dirInode, fileName);
+    sprintf(logBuffer, "Trying to create new file %s in %s", fileName, dirPath); VERBOSE();
+
+    int newInode = MFS_Creat(dirInode, UFS_REGULAR_FILE, fileName);
     if (newInode == -1) {
-        sprintf(logBuffer, "Unable to fetch newly created inode number even though MFS_Creat was successful"); ERR();
+        sprintf(logBuffer, "Unable to create new file %s in %s", fileName, dirPath); ERR();
     }
 
     sprintf(logBuffer, "Created new file with inode number %d", newInode); INFO();
 
-    char buffer[MFS_RW_BUFFER_SIZE];
-    memset(buffer, 0, MFS_RW_BUFFER_SIZE);
-
     int readBytes = read(toCopyFd, buffer, MFS_RW_BUFFER_SIZE);
     int offset = 0;
     while (readBytes > 0) {
@@ -173,6 +199,11 @@ int perform_insert(const char *fromPath, char *toPath) {
         sprintf(logBuffer, "Error while reading input file"); ERR();
     }
 
+    // writes are buffered by the client library until here
+    if (MFS_Fsync(newInode) == -1) {
+        sprintf(logBuffer, "MFS_Fsync failed"); ERR();
+    }
+
     sprintf(logBuffer, "Completed all write operations. Written a total of %d bytes", offset); INFO();
 
     free(dirPath);
@@ -200,37 +231,36 @@ int perform_cat(char *path) {
     }
 
     int sz = stat.size;
-    
-    char *output = (char *) malloc(sz * sizeof(char));
-    memset(output, 0, sz);
-    
+    char buffer[MFS_RW_BUFFER_SIZE];
+
     sprintf(logBuffer, "Filesize=%d. Starting read", sz); INFO();
+    sprintf(logBuffer, "File contents (from next line): "); INFO();
 
+    // printed a block at a time rather than collected into logBuffer first
     int offset = 0;
     while (offset < sz) {
         int count = sz - offset;
         if (count > MFS_RW_BUFFER_SIZE) count = MFS_RW_BUFFER_SIZE;
 
         sprintf(logBuffer, "Trying to read %d bytes from offset %d foi inum=%d", count, offset, fileInode); VERBOSE();
-        int rc = MFS_Read(fileInode, output + offset, offset, count);
+        int rc = MFS_Read(fileInode, buffer, offset, count);
         if (rc == -1) {
             sprintf(logBuffer, "MFS_Read failed for inum=%d offset=%d count=%d", fileInode, offset, count); ERR();
         }
+        fwrite(buffer, 1, count, stdout);
 
         offset += count;
     }
+    printf("\n");
 
-    sprintf(logBuffer, "File contents (from next line): \n%s\n", output);
-    INFO();
-
-    free(output);
     free(dirPath);
     return 0;
 }
 
 // similar to mkdir -p. Just bulldoze through and call MFS_Creat for all
 // subdirectories. If name already exists, should not overwrite.
-int perform_mkdir(char *path) {
+// returns the inode of the last directory
+int _makeDirectories(char *path) {
     assert(strlen(path) > 0);
     assert(path[0] == '/');
 
@@ -246,28 +276,422 @@ int perform_mkdir(char *path) {
         }
 
         sprintf(logBuffer, "calling MFS_Creat for %s in parent directory (inode=%d)", dirname, dirInode); VERBOSE();
-        int rc = MFS_Creat(dirInode, UFS_DIRECTORY, dirname);
-        if (rc == -1) {
+        // MFS_Creat hands back the inode of the new or already existing directory
+        dirInode = MFS_Creat(dirInode, UFS_DIRECTORY, dirname);
+        if (dirInode == -1) {
             sprintf(logBuffer, "Unable to create directory %s", dirname); ERR();
         }
 
-        int newInode = MFS_Lookup(dirInode, dirname);
-        if (newInode == -1) {
-            sprintf(logBuffer, "Unable to fetch newly created directory inode even though MFS_Creat was successful"); ERR();
+        dirname = strtok(NULL, "/");
+    }
+    free(path);
+    return dirInode;
+}
+
+int perform_mkdir(char *path) {
+    _makeDirectories(path);
+    sprintf(logBuffer, "mkdir completed successfully"); INFO();
+    return 0;
+}
+
+/*
+ * import/export. The tree is walked (and its directories created) by the
+ * calling thread, which queues up one transfer per regular file. <jobs>
+ * worker threads then copy files concurrently over a single session, so
+ * up to <jobs> transfers are in flight at once. Workers cannot use
+ * logBuffer, they report failures themselves and carry on.
+ */
+typedef struct {
+    char *localPath;
+    char name[MFS_NAME_SIZE];
+    int pinum;       // import: MFS directory to create the file in
+    int inum;        // export: MFS file to copy out
+    int size;
+} transfer_t;
+
+MFS_Session_t *transferSession;
+transfer_t *transfers;
+int transferCount = 0;
+int transferCapacity = 0;
+int nextTransfer = 0;
+int transferFailures = 0; // including files skipped during the walk
+int transferFiles = 0;
+long long transferBytes = 0;
+pthread_mutex_t transferLock = PTHREAD_MUTEX_INITIALIZER;
+
+double now_sec() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+char *_joinPath(const char *dir, const char *name) {
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+transfer_t *_queueTransfer(char *localPath, char *name, int size) {
+    if (transferCount == transferCapacity) {
+        transferCapacity = transferCapacity ? transferCapacity * 2 : 64;
+        transfers = realloc(transfers, transferCapacity * sizeof(transfer_t));
+        assert(transfers != NULL);
+    }
+    transfer_t *t = &transfers[transferCount++];
+    memset(t, 0, sizeof(transfer_t));
+    t->localPath = localPath;
+    strcpy(t->name, name);
+    t->size = size;
+    return t;
+}
+
+// returns the number of bytes copied, or -1
+int _importFile(transfer_t *t) {
+    int fd = open(t->localPath, O_RDONLY);
+    if (fd == -1) return -1;
+
+    char buffer[MFS_RW_BUFFER_SIZE];
+    int readBytes = read(fd, buffer, MFS_RW_BUFFER_SIZE);
+    int offset = 0;
+    int inum = -1;
+
+    if (readBytes != -1 && t->size <= MFS_RW_BUFFER_SIZE) {
+        inum = MFS_SCreatWrite(transferSession, t->pinum, UFS_REGULAR_FILE, t->name, buffer, readBytes);
+        offset = readBytes;
+    } else if (readBytes != -1) {
+        inum = MFS_SCreat(transferSession, t->pinum, UFS_REGULAR_FILE, t->name);
+        while (inum != -1 && readBytes > 0) {
+            if (MFS_SWrite(transferSession, inum, buffer, offset, readBytes) == -1) inum = -1;
+            offset += readBytes;
+            readBytes = read(fd, buffer, MFS_RW_BUFFER_SIZE);
         }
+        if (readBytes == -1) inum = -1;
+        // writes are buffered by the client library until here
+        if (inum != -1 && MFS_SFsync(transferSession, inum) == -1) inum = -1;
+    }
+    close(fd);
+    return inum == -1 ? -1 : offset;
+}
 
-        dirInode = newInode;
-        
-        if (dirInode == -1) {
-            sprintf(logBuffer, "Unable to enter %s", dirname); ERR();
-            exit(1);
-        };
-        dirname = strtok(NULL, "/");
+int _exportFile(transfer_t *t) {
+    int fd = open(t->localPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) return -1;
 
-        MFS_Unlink(dirInode,dirname);
+    char buffer[MFS_RW_BUFFER_SIZE];
+    int offset = 0;
+    while (offset < t->size) {
+        int count = t->size - offset;
+        if (count > MFS_RW_BUFFER_SIZE) count = MFS_RW_BUFFER_SIZE;
+        if (MFS_SRead(transferSession, t->inum, buffer, offset, count) == -1 ||
+            write(fd, buffer, count) != count) {
+            close(fd);
+            return -1;
+        }
+        offset += count;
     }
-    sprintf(logBuffer, "mkdir completed successfully"); INFO();
-    free(path);
+    close(fd);
+    return offset;
+}
+
+void *_transferWorker(void *arg) {
+    int (*copy)(transfer_t *) = arg;
+    while (1) {
+        pthread_mutex_lock(&transferLock);
+        int i = nextTransfer++;
+        pthread_mutex_unlock(&transferLock);
+        if (i >= transferCount) break;
+
+        int copied = copy(&transfers[i]);
+
+        pthread_mutex_lock(&transferLock);
+        if (copied == -1) {
+            printf("[ERR] Unable to copy %s\n", transfers[i].localPath);
+            transferFailures++;
+        } else {
+            transferFiles++;
+            transferBytes += copied;
+        }
+        pthread_mutex_unlock(&transferLock);
+    }
+    return NULL;
+}
+
+// runs the queued transfers on <jobs> threads and prints the summary
+int _runTransfers(int (*copy)(transfer_t *), int jobs, const char *what, double start) {
+    pthread_t workers[jobs];
+    for (int i = 0; i < jobs; i++)
+        pthread_create(&workers[i], NULL, _transferWorker, copy);
+    for (int i = 0; i < jobs; i++)
+        pthread_join(workers[i], NULL);
+
+    double elapsed = now_sec() - start;
+    sprintf(logBuffer, "%s %d files (%lld bytes) in %.3f s: %.0f files/sec, %.2f MB/s",
+            what, transferFiles, transferBytes, elapsed, transferFiles / elapsed, transferBytes / elapsed / (1 << 20));
+    INFO();
+    if (transferFailures > 0) {
+        sprintf(logBuffer, "%d files could not be copied", transferFailures); ERR();
+    }
+
+    for (int i = 0; i < transferCount; i++)
+        free(transfers[i].localPath);
+    free(transfers);
+    return 0;
+}
+
+void _importDirectory(const char *localDir, int dirInode) {
+    DIR *dir = opendir(localDir);
+    if (dir == NULL) {
+        sprintf(logBuffer, "Unable to open local directory %s", localDir); ERR();
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+
+        char *localPath = _joinPath(localDir, ent->d_name);
+        struct stat st;
+        if (lstat(localPath, &st) == -1 || strlen(ent->d_name) >= MFS_NAME_SIZE ||
+            !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
+            printf("[ERR] Skipping %s\n", localPath);
+            transferFailures++;
+            free(localPath);
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            sprintf(logBuffer, "Creating directory %s in (inode=%d)", ent->d_name, dirInode); VERBOSE();
+            int childInode = MFS_SCreat(transferSession, dirInode, UFS_DIRECTORY, ent->d_name);
+            if (childInode == -1) {
+                sprintf(logBuffer, "Unable to create directory for %s", localPath); ERR();
+            }
+            _importDirectory(localPath, childInode);
+            free(localPath);
+        } else {
+            transfer_t *t = _queueTransfer(localPath, ent->d_name, st.st_size);
+            t->pinum = dirInode;
+        }
+    }
+    closedir(dir);
+}
+
+// copies the contents of a local directory into mfsPath, which is
+// created like mkdir -p
+int perform_import(char *localPath, char *mfsPath, int jobs) {
+    double start = now_sec();
+    int dirInode = _makeDirectories(mfsPath);
+    _importDirectory(localPath, dirInode);
+
+    sprintf(logBuffer, "Importing %d files with %d concurrent transfers", transferCount, jobs); INFO();
+    return _runTransfers(_importFile, jobs, "Imported", start);
+}
+
+void _exportDirectory(int dirInode, const char *localDir) {
+    if (mkdir(localDir, 0755) == -1 && errno != EEXIST) {
+        sprintf(logBuffer, "Unable to create local directory %s", localDir); ERR();
+    }
+
+    MFS_Stat_t stat;
+    if (MFS_SStat(transferSession, dirInode, &stat) == -1 || stat.type != UFS_DIRECTORY) {
+        sprintf(logBuffer, "Unable to stat directory (inum=%d)", dirInode); ERR();
+    }
+
+    // the server hands out directories one entry per read, so a block's
+    // entries, and then the stats of their inodes, are requested at once.
+    // the size counts live entries, and unlinks leave free slots between
+    // them, so blocks are read until that many have turned up
+    int nlive = stat.size / sizeof(MFS_DirEnt_t);
+    MFS_DirEnt_t *entries = calloc(nlive, sizeof(MFS_DirEnt_t));
+    MFS_Stat_t *stats = calloc(nlive, sizeof(MFS_Stat_t));
+    MFS_Future_t **pending = calloc(nlive, sizeof(MFS_Future_t *));
+    assert(nlive == 0 || (entries != NULL && stats != NULL && pending != NULL));
+
+    int perBlock = MFS_BLOCK_SIZE / sizeof(MFS_DirEnt_t);
+    MFS_DirEnt_t slots[MFS_BLOCK_SIZE / sizeof(MFS_DirEnt_t)];
+    MFS_Future_t *reads[MFS_BLOCK_SIZE / sizeof(MFS_DirEnt_t)];
+    int nentries = 0;
+    for (int b = 0; nentries < nlive && b < DIRECT_PTRS; b++) {
+        for (int i = 0; i < perBlock; i++)
+            reads[i] = MFS_ARead(transferSession, dirInode, (char *)&slots[i], (b * perBlock + i) * sizeof(MFS_DirEnt_t), sizeof(MFS_DirEnt_t));
+        int failed = 0;
+        for (int i = 0; i < perBlock; i++)
+            failed |= MFS_Wait(reads[i]) == -1;
+        if (failed) break;
+        for (int i = 0; i < perBlock && nentries < nlive; i++) {
+            if (slots[i].inum < 0) continue;
+            entries[nentries] = slots[i];
+            entries[nentries++].name[MFS_NAME_SIZE - 1] = '\0';
+        }
+    }
+    if (nentries < nlive) {
+        sprintf(logBuffer, "MFS_Read failed for directory (inum=%d)", dirInode); ERR();
+    }
+
+    for (int i = 0; i < nentries; i++) {
+        pending[i] = NULL;
+        if (entries[i].inum < 0 || strcmp(entries[i].name, ".") == 0 || strcmp(entries[i].name, "..") == 0)
+            continue;
+        pending[i] = MFS_AStat(transferSession, entries[i].inum, &stats[i]);
+    }
+    for (int i = 0; i < nentries; i++) {
+        if (pending[i] == NULL) continue;
+        if (MFS_Wait(pending[i]) == -1) {
+            sprintf(logBuffer, "MFS_Stat failed for %s (inum=%d)", entries[i].name, entries[i].inum); ERR();
+        }
+
+        char *localPath = _joinPath(localDir, entries[i].name);
+        if (stats[i].type == UFS_DIRECTORY) {
+            _exportDirectory(entries[i].inum, localPath);
+            free(localPath);
+        } else {
+            transfer_t *t = _queueTransfer(localPath, entries[i].name, stats[i].size);
+            t->inum = entries[i].inum;
+        }
+    }
+
+    free(pending);
+    free(stats);
+    free(entries);
+}
+
+// copies the contents of mfsPath into a local directory, created if missing
+int perform_export(char *mfsPath, char *localPath, int jobs) {
+    double start = now_sec();
+    int dirInode = _traverseToDirectory(mfsPath);
+    _exportDirectory(dirInode, localPath);
+
+    sprintf(logBuffer, "Exporting %d files with %d concurrent transfers", transferCount, jobs); INFO();
+    return _runTransfers(_exportFile, jobs, "Exported", start);
+}
+
+// indexed by message type
+const char *messageNames[MFS_STATS_TYPES] = {
+    "other", "init", "lookup", "stat", "write", "read", "creat", "unlink",
+    "shutdown", "revoke", "creatwrite", "stats", "tracedump", "snapshot",
+    "snapdelete", "truncate", "rename", "copy", "grow", "shards", "link", "release",
+    "stripe", "layout", "replicate", "replack",
+};
+
+int perform_stats() {
+    MFS_ServerStats_t st;
+    if (MFS_Stats(&st) == -1) {
+        sprintf(logBuffer, "MFS_Stats failed"); ERR();
+    }
+
+    double uptime = st.uptime_ms / 1000.0;
+    sprintf(logBuffer, "Server up for %.1f s", uptime); INFO();
+    printf("%-10s %10s %8s %9s %12s %12s %9s %9s %9s %9s %9s\n", "request", "count", "errors", "req/s",
+           "bytes in", "bytes out", "mean us", "p50", "p90", "p99", "max");
+    for (int t = 0; t < MFS_STATS_TYPES; t++) {
+        MFS_OpStats_t *o = &st.ops[t];
+        if (o->count == 0) continue;
+        printf("%-10s %10llu %8llu %9.1f %12llu %12llu %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+               messageNames[t] ? messageNames[t] : "other", o->count, o->errors,
+               uptime > 0 ? o->count / uptime : 0.0, o->bytes_in, o->bytes_out,
+               o->ns_total / 1e3 / o->count, o->ns_p50 / 1e3, o->ns_p90 / 1e3, o->ns_p99 / 1e3, o->ns_max / 1e3);
+    }
+    printf("fsyncs: %llu, mean %.1f us, p99 %.1f us, max %.1f us\n", st.fsyncs,
+           st.fsyncs ? st.fsync_ns / 1e3 / st.fsyncs : 0.0, st.fsync_ns_p99 / 1e3, st.fsync_ns_max / 1e3);
+    printf("allocation failures: %llu inodes, %llu data blocks\n", st.inode_alloc_failures, st.data_alloc_failures);
+    unsigned long long answers = st.lease_grants + st.lease_denials;
+    printf("client caching: %llu leases granted, %llu denied (%.1f%% cacheable), %llu revocations sent\n",
+           st.lease_grants, st.lease_denials, answers ? 100.0 * st.lease_grants / answers : 0.0, st.revokes);
+    if (st.dedup_data_blocks > 0)
+        printf("dedup: %llu file blocks in %llu data blocks (%.2fx)\n", st.dedup_file_blocks, st.dedup_data_blocks,
+               (double)st.dedup_file_blocks / st.dedup_data_blocks);
+    if (st.repl_lsn > 0)
+        printf("replication: request %llu shipped or applied, %llu acked by a backup, %llu sync replies unacked\n",
+               st.repl_lsn, st.repl_acked, st.repl_unacked);
+    return 0;
+}
+
+int perform_truncate(char *path, int size) {
+    int fnameSep = rfind(path, '/');
+    char *dirPath = strndup(path, fnameSep);
+    char *fileName = path + fnameSep + 1;
+
+    int dirInode = _traverseToDirectory(dirPath);
+
+    int fileInode = MFS_Lookup(dirInode, fileName);
+    if (fileInode == -1) {
+        sprintf(logBuffer, "Unable to lookup file %s in directory (inum=%d)", fileName, dirInode); ERR();
+    }
+
+    if (MFS_Truncate(fileInode, size) == -1) {
+        sprintf(logBuffer, "MFS_Truncate failed for inum=%d size=%d", fileInode, size); ERR();
+    }
+    sprintf(logBuffer, "Truncated %s to %d bytes", path, size); INFO();
+    return 0;
+}
+
+int perform_mv(char *from, char *to) {
+    int fromSep = rfind(from, '/');
+    int fromDir = _traverseToDirectory(strndup(from, fromSep));
+    int toSep = rfind(to, '/');
+    int toDir = _traverseToDirectory(strndup(to, toSep));
+
+    if (MFS_Rename(fromDir, from + fromSep + 1, toDir, to + toSep + 1) == -1) {
+        sprintf(logBuffer, "MFS_Rename failed for %s -> %s", from, to); ERR();
+    }
+    sprintf(logBuffer, "Moved %s to %s", from, to); INFO();
+    return 0;
+}
+
+int perform_cp(char *from, char *to) {
+    int fromSep = rfind(from, '/');
+    int fromDir = _traverseToDirectory(strndup(from, fromSep));
+    int fileInode = MFS_Lookup(fromDir, from + fromSep + 1);
+    if (fileInode == -1) {
+        sprintf(logBuffer, "Unable to lookup file %s in directory (inum=%d)", from + fromSep + 1, fromDir); ERR();
+    }
+    MFS_Stat_t stat;
+    if (MFS_Stat(fileInode, &stat) == -1) {
+        sprintf(logBuffer, "Stat failed for inum=%d", fileInode); ERR();
+    }
+
+    int toSep = rfind(to, '/');
+    int toDir = _traverseToDirectory(strndup(to, toSep));
+    int copyInode = MFS_Creat(toDir, MFS_REGULAR_FILE, to + toSep + 1);
+    if (copyInode == -1 || MFS_Truncate(copyInode, 0) == -1) {
+        sprintf(logBuffer, "Unable to create %s as an empty file", to); ERR();
+    }
+    int rc = MFS_Copy(fileInode, 0, copyInode, 0, stat.size);
+    if (rc == -1) {
+        sprintf(logBuffer, "MFS_Copy failed for inum=%d -> inum=%d", fileInode, copyInode); ERR();
+    }
+    sprintf(logBuffer, "Copied %d bytes from %s to %s", rc, from, to); INFO();
+    return 0;
+}
+
+int perform_grow(int numInodes, int numData) {
+    if (MFS_Grow(numInodes, numData) == -1) {
+        sprintf(logBuffer, "MFS_Grow failed, the image is a log image, has more than that already or was not made with room for %d inodes and %d data blocks (mkfs -I, -M)", numInodes, numData); ERR();
+    }
+    sprintf(logBuffer, "Grew the image to %d inodes and %d data blocks", numInodes, numData); INFO();
+    return 0;
+}
+
+int perform_trace() {
+    if (MFS_DumpTrace() == -1) {
+        sprintf(logBuffer, "MFS_DumpTrace failed, is the server built with make TRACE=1?"); ERR();
+    }
+    sprintf(logBuffer, "Server wrote its trace, decode it with mfstrace"); INFO();
+    return 0;
+}
+
+int perform_snapshot(int deleteId) {
+    if (deleteId != -1) {
+        if (MFS_SnapshotDelete(deleteId) == -1) {
+            sprintf(logBuffer, "MFS_SnapshotDelete failed, no snapshot %d", deleteId); ERR();
+        }
+        sprintf(logBuffer, "Deleted snapshot %d", deleteId); INFO();
+        return 0;
+    }
+    int id = MFS_Snapshot();
+    if (id == -1) {
+        sprintf(logBuffer, "MFS_Snapshot failed, the image has no free snapshot slot or is a log image"); ERR();
+    }
+    sprintf(logBuffer, "Took snapshot %d", id); INFO();
+    printf("%d\n", id);
     return 0;
 }
 
@@ -302,6 +726,48 @@ const char *usage =  "mfscli usage: \n"
     "       it and so on. Existing directories would ideally remain untouched \n"
     "       because MFS_Creat doesn't do anything and returns true for existing dirs\n"
     "\n"
+    " - ./mfscli 127.0.0.1 36000 import [-j 8] /path/to/local/dir /files/dir \n"
+    "       Recursively copies a local directory into MFS, creating /files/dir \n"
+    "       like mkdir -p. Files are copied by -j concurrent transfers (default 8)\n"
+    "       and files/sec and MB/s are reported at the end.\n"
+    "\n"
+    " - ./mfscli 127.0.0.1 36000 export [-j 8] /files/dir /path/to/local/dir \n"
+    "       The reverse of import: recursively copies an MFS directory out \n"
+    "       into a local directory.\n"
+    "\n"
+    " - ./mfscli 127.0.0.1 36000 truncate /files/test1.txt 100 \n"
+    "       Sets the size of a file in MFS, like UNIX truncate -s. Blocks past \n"
+    "       the new size are freed, and whatever the file grows back into \n"
+    "       reads as zeros.\n"
+    "\n"
+    " - ./mfscli 127.0.0.1 36000 mv /files/test1.txt /other/test2.txt \n"
+    "       Similar to UNIX mv, but the second path always names the target,\n"
+    "       which is replaced if it exists. The move is one MFS_Rename, however\n"
+    "       big the file or directory.\n"
+    "\n"
+    " - ./mfscli 127.0.0.1 36000 cp /files/test1.txt /other/test2.txt \n"
+    "       Similar to UNIX cp, for one file. The server copies it with one \n"
+    "       MFS_Copy, without the bytes passing through mfscli.\n"
+    "\n"
+    " - ./mfscli 127.0.0.1 36000 grow 4096 65536 \n"
+    "       Grows the server's image to 4096 inodes and 65536 data blocks while\n"
+    "       it keeps serving. The image must have been made with room for that\n"
+    "       many (mkfs -I and -M).\n"
+    "\n"
+    " - ./mfscli 127.0.0.1 36000 stats \n"
+    "       Prints the server's request counts, error counts, bytes in/out and \n"
+    "       latency percentiles per request type, fsync times, allocation \n"
+    "       failures and how many answers clients were allowed to cache.\n"
+    "\n"
+    " - ./mfscli 127.0.0.1 36000 trace \n"
+    "       Has a server built with make TRACE=1 write its request trace to \n"
+    "       its -T file, for mfstrace to break down by phase.\n"
+    "\n"
+    " - ./mfscli 127.0.0.1 36000 snapshot [-d <id>] \n"
+    "       Takes a snapshot of the server's image and prints its id, or with \n"
+    "       -d deletes snapshot <id>. Start a second server with -M <id> on the \n"
+    "       same image to read the snapshot.\n"
+    "\n"
     ;
 
 int _assert_argc(int argc, int expected) {
@@ -340,6 +806,53 @@ int main(int argc, char *argv[]) {
     } else if (strcmp(cmd, "mkdir") == 0) {
         _assert_argc(argc, 2 + 3);
         perform_mkdir(argv[4]);
+    } else if (strcmp(cmd, "truncate") == 0) {
+        _assert_argc(argc, 3 + 3);
+        perform_truncate(argv[4], atoi(argv[5]));
+    } else if (strcmp(cmd, "mv") == 0) {
+        _assert_argc(argc, 3 + 3);
+        perform_mv(argv[4], argv[5]);
+    } else if (strcmp(cmd, "cp") == 0) {
+        _assert_argc(argc, 3 + 3);
+        perform_cp(argv[4], argv[5]);
+    } else if (strcmp(cmd, "grow") == 0) {
+        _assert_argc(argc, 3 + 3);
+        perform_grow(atoi(argv[4]), atoi(argv[5]));
+    } else if (strcmp(cmd, "stats") == 0) {
+        _assert_argc(argc, 1 + 3);
+        perform_stats();
+    } else if (strcmp(cmd, "trace") == 0) {
+        _assert_argc(argc, 1 + 3);
+        perform_trace();
+    } else if (strcmp(cmd, "snapshot") == 0) {
+        int deleteId = -1;
+        if (argc > 5 && strcmp(argv[4], "-d") == 0)
+            deleteId = atoi(argv[5]);
+        _assert_argc(argc, deleteId == -1 ? 1 + 3 : 3 + 3);
+        perform_snapshot(deleteId);
+    } else if (strcmp(cmd, "import") == 0 || strcmp(cmd, "export") == 0) {
+        int jobs = DEFAULT_JOBS;
+        int first = 4;
+        if (argc > 5 && strcmp(argv[4], "-j") == 0) {
+            jobs = atoi(argv[5]);
+            first = 6;
+        }
+        _assert_argc(argc, first + 2);
+        if (jobs <= 0) {
+            printf("-j needs a positive number of transfers\n");
+            return -1;
+        }
+
+        // a session of its own, shared by the transfer threads
+        transferSession = MFS_Open(argv[1], atoi(argv[2]));
+        if (transferSession == NULL) {
+            sprintf(logBuffer, "MFS_Open failed for %s:%s", argv[1], argv[2]); ERR();
+        }
+        if (strcmp(cmd, "import") == 0)
+            perform_import(argv[first], argv[first + 1], jobs);
+        else
+            perform_export(argv[first], argv[first + 1], jobs);
+        MFS_Close(transferSession);
     } else {
         printf("Command not found! run ./mfscli for usage help\n");
         return -1;
@@ -0,0 +1,527 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "mfs.h"
+#include "udp.h"
+#include "message.h"
+#include "record.h"
+#include "hist.h"
+
+#define MAX_CLIENTS (1024)
+#define WINDOW (256)       // requests a client has in flight, at most
+#define RETRY_MS (1000)    // resend a request nobody answered after this long
+#define MAX_TRIES (5)      // ... and count it failed after this many sends
+#define SOCKET_BUFFER (1 << 20)
+#define MAX_INODES (1 << 20)
+
+typedef struct
+{
+    record_t rec;
+    client_message_t *message;
+    int global;   // position in the recording, which is the order served
+    int after;    // this client's requests that were answered before it arrived
+    int tries;
+    int done;
+    unsigned long long due;  // ns, when it should go out
+    unsigned long long sent; // ns, latest send
+} request_t;
+
+typedef struct
+{
+    unsigned int addr;
+    unsigned short port;
+    request_t *reqs;
+    int n;
+    int size;
+    int first_after; // requests of any client answered before its first arrived
+    pthread_t thread;
+    hist_t rtt[MFS_STATS_TYPES];
+    unsigned long long failed[MFS_STATS_TYPES];
+    unsigned long long mismatched[MFS_STATS_TYPES];
+} client_t;
+
+char *host;
+int port;
+double speed = 1.0; // 0 replays as fast as possible
+int json = 0;
+
+client_t clients[MAX_CLIENTS];
+int nclients = 0;
+int nrequests = 0;
+unsigned long long skipped = 0;
+unsigned long long recorded_ns = 0;
+hist_t recorded[MFS_STATS_TYPES];
+
+// requests are answered in any order, but a client whose first request
+// arrived after others were answered waits for those, so a recording of
+// one-shot clients run one after another replays in order too
+char *answered;
+int answered_prefix = 0;
+pthread_mutex_t answered_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t answered_cond = PTHREAD_COND_INITIALIZER;
+
+// inode numbers the replay handed out differently from the recording, as
+// concurrent creates can race to a different order; -1 where they agree
+int inum_map[MAX_INODES];
+
+unsigned long long start_ns;
+
+const char *names[MFS_STATS_TYPES] = {
+    "other", "init", "lookup", "stat", "write", "read", "creat", "unlink",
+    "shutdown", "revoke", "creatwrite", "stats", "tracedump", "snapshot",
+    "snapdelete", "truncate", "rename", "copy", "grow", "shards", "link", "release",
+    "stripe", "layout", "replicate", "replack",
+};
+
+void usage()
+{
+    fprintf(stderr, "usage: mfsreplay [-x <speed> | -a] [-J] <host> <port> <record_file>\n"
+                    "  re-issues the requests server -R recorded against the server at host:port,\n"
+                    "  which should be serving a copy of the image as it was when recording began.\n"
+                    "  every recorded client becomes a thread of its own, sending its requests in\n"
+                    "  the recorded order and holding each back until the replies it could have\n"
+                    "  seen when it was first sent have come back. inode numbers that creates\n"
+                    "  hand out in a different order are translated in the requests after them.\n"
+                    "  -x replays at <speed> times the recorded pace (default 1), -a as fast as\n"
+                    "  possible. reports, per request type, replies that differ from the recorded\n"
+                    "  ones, the recorded server time against the replay server's, the replay\n"
+                    "  round trip, and the throughput of both. -J prints one JSON object instead\n");
+    exit(1);
+}
+
+unsigned long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int type_of(request_t *r)
+{
+    int t = r->message->mtype;
+    return t >= 0 && t < MFS_STATS_TYPES ? t : 0;
+}
+
+// requests whose rc is an inode number
+int returns_inum(int mtype)
+{
+    return mtype == MFS_LOOKUP || mtype == MFS_CRET || mtype == MFS_CRET_WRITE;
+}
+
+// the inode the server gave what was recorded as inum, in place
+void map_inum(int *inum)
+{
+    if (*inum >= 0 && *inum < MAX_INODES)
+    {
+        int mapped = __atomic_load_n(&inum_map[*inum], __ATOMIC_ACQUIRE);
+        if (mapped >= 0)
+            *inum = mapped;
+    }
+}
+
+// every request naming an inode names it first, so one field covers them;
+// renames and copies name a second one
+void translate(client_message_t *m)
+{
+    switch (m->mtype)
+    {
+    case MFS_LOOKUP:
+    case MFS_STAT:
+    case MFS_WRITE:
+    case MFS_READ:
+    case MFS_CRET:
+    case MFS_UNLINK:
+    case MFS_CRET_WRITE:
+    case MFS_TRUNCATE:
+    case MFS_LINK:
+    case MFS_RELEASE:
+    case MFS_STRIPE:
+    case MFS_LAYOUT:
+        map_inum(&m->method.stat.inum);
+        break;
+    case MFS_RENAME:
+        map_inum(&m->method.rename.pinum);
+        map_inum(&m->method.rename.newpinum);
+        break;
+    case MFS_COPY:
+        map_inum(&m->method.copy.inum);
+        map_inum(&m->method.copy.dinum);
+        break;
+    }
+}
+
+client_t *client_for(unsigned int addr, unsigned short port)
+{
+    for (int i = 0; i < nclients; i++)
+    {
+        if (clients[i].addr == addr && clients[i].port == port)
+            return &clients[i];
+    }
+    if (nclients == MAX_CLIENTS)
+        return NULL;
+    client_t *c = &clients[nclients++];
+    c->addr = addr;
+    c->port = port;
+    for (int t = 0; t < MFS_STATS_TYPES; t++)
+        hist_init(&c->rtt[t]);
+    return c;
+}
+
+unsigned long long answered_at(request_t *r)
+{
+    return r->rec.ns + r->rec.queued_ns + r->rec.served_ns;
+}
+
+// read the recording and split it by client, return -1 if failed
+int load(char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    record_header_t h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, RECORD_MAGIC, sizeof(h.magic)) != 0 || h.version != RECORD_VERSION)
+    {
+        fprintf(stderr, "mfsreplay: %s is not a recording\n", path);
+        fclose(f);
+        return -1;
+    }
+
+    for (int t = 0; t < MFS_STATS_TYPES; t++)
+        hist_init(&recorded[t]);
+    unsigned long long first = 0;
+    record_t rec;
+    while (fread(&rec, sizeof(rec), 1, f) == 1)
+    {
+        client_message_t *m = calloc(1, sizeof(client_message_t));
+        if (m == NULL || rec.len > sizeof(client_message_t) || fread(m, rec.len, 1, f) != 1)
+        {
+            fprintf(stderr, "mfsreplay: %s is truncated\n", path);
+            fclose(f);
+            return -1;
+        }
+        // replication between servers is not a client's to replay
+        if (m->mtype == MFS_REPLICATE || m->mtype == MFS_REPL_ACK)
+        {
+            free(m);
+            continue;
+        }
+        // a replayed shutdown would end the replay
+        if (m->mtype == MFS_SHUTDOWN)
+        {
+            free(m);
+            skipped++;
+            continue;
+        }
+        client_t *c = client_for(rec.addr, rec.port);
+        if (c == NULL)
+        {
+            fprintf(stderr, "mfsreplay: more than %d clients\n", MAX_CLIENTS);
+            fclose(f);
+            return -1;
+        }
+        if (c->n == c->size)
+        {
+            c->size = c->size ? 2 * c->size : 64;
+            c->reqs = realloc(c->reqs, c->size * sizeof(request_t));
+            if (c->reqs == NULL)
+            {
+                fprintf(stderr, "mfsreplay: out of memory\n");
+                fclose(f);
+                return -1;
+            }
+        }
+        if (nrequests == 0)
+            first = rec.ns;
+        // replay from the first request, not from when recording began
+        rec.ns -= first;
+        request_t *r = &c->reqs[c->n++];
+        memset(r, 0, sizeof(request_t));
+        r->rec = rec;
+        r->message = m;
+        r->global = nrequests++;
+        hist_record(&recorded[type_of(r)], rec.served_ns);
+        if (rec.ns + rec.queued_ns + rec.served_ns > recorded_ns)
+            recorded_ns = rec.ns + rec.queued_ns + rec.served_ns;
+    }
+    fclose(f);
+
+    answered = calloc(nrequests > 0 ? nrequests : 1, 1);
+    if (answered == NULL)
+        return -1;
+
+    // the server answers in the order it receives, so whatever was answered
+    // before a request arrived is a prefix; first over all clients, then
+    // within each
+    unsigned long long *finished = malloc((nrequests > 0 ? nrequests : 1) * sizeof(unsigned long long));
+    if (finished == NULL)
+        return -1;
+    for (int i = 0; i < nclients; i++)
+    {
+        for (int j = 0; j < clients[i].n; j++)
+            finished[clients[i].reqs[j].global] = answered_at(&clients[i].reqs[j]);
+    }
+    for (int i = 0; i < nclients; i++)
+    {
+        client_t *c = &clients[i];
+        int k = 0;
+        for (int j = 0; j < c->n; j++)
+        {
+            while (k < j && answered_at(&c->reqs[k]) <= c->reqs[j].rec.ns)
+                k++;
+            c->reqs[j].after = k;
+        }
+        int g = 0;
+        while (g < c->reqs[0].global && finished[g] <= c->reqs[0].rec.ns)
+            g++;
+        c->first_after = g;
+    }
+    free(finished);
+    return 0;
+}
+
+void mark_answered(int global)
+{
+    pthread_mutex_lock(&answered_lock);
+    answered[global] = 1;
+    while (answered_prefix < nrequests && answered[answered_prefix])
+        answered_prefix++;
+    pthread_cond_broadcast(&answered_cond);
+    pthread_mutex_unlock(&answered_lock);
+}
+
+void *replay_client(void *arg)
+{
+    client_t *c = arg;
+    struct sockaddr_in server;
+    if (UDP_FillSockAddr(&server, host, port) != 0)
+        return NULL;
+    int fd = UDP_Open(0);
+    if (fd < 0)
+        return NULL;
+    int size = SOCKET_BUFFER;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    pthread_mutex_lock(&answered_lock);
+    while (answered_prefix < c->first_after)
+        pthread_cond_wait(&answered_cond, &answered_lock);
+    pthread_mutex_unlock(&answered_lock);
+
+    int next = 0;     // next to send
+    int complete = 0; // answered (or failed) prefix
+    int inflight = 0;
+    server_message_t response;
+    while (complete < c->n)
+    {
+        unsigned long long now = now_ns();
+        int wait_ms = 10;
+        while (next < c->n && inflight < WINDOW && complete >= c->reqs[next].after)
+        {
+            request_t *r = &c->reqs[next];
+            r->due = speed > 0 ? start_ns + (unsigned long long)(r->rec.ns / speed) : now;
+            if (r->due > now)
+            {
+                unsigned long long ms = (r->due - now) / 1000000;
+                wait_ms = ms < 10 ? (int)ms : 10;
+                break;
+            }
+            // seq 0 is for notifications, which replies are not
+            r->message->seq = next + 1;
+            translate(r->message);
+            r->tries = 1;
+            r->sent = now;
+            UDP_Write(fd, &server, (char *)r->message, r->rec.len);
+            next++;
+            inflight++;
+        }
+
+        struct pollfd pfd = {fd, POLLIN, 0};
+        poll(&pfd, 1, wait_ms);
+        int rc;
+        while ((rc = recvfrom(fd, &response, sizeof(response), MSG_DONTWAIT, NULL, NULL)) > 0)
+        {
+            // stray revocations carry seq 0 and are dropped here
+            int i = response.seq - 1;
+            if (rc < (int)offsetof(server_message_t, buffer) || i < 0 || i >= next || c->reqs[i].done)
+                continue;
+            request_t *r = &c->reqs[i];
+            r->done = 1;
+            inflight--;
+            int t = type_of(r);
+            // timed replays count from when it was due, so a slow server
+            // is not hidden by requests going out late
+            hist_record(&c->rtt[t], now_ns() - (speed > 0 ? r->due : r->sent));
+            if (returns_inum(t) && r->rec.rc >= 0 && response.rc >= 0)
+            {
+                if (r->rec.rc < MAX_INODES)
+                    __atomic_store_n(&inum_map[r->rec.rc], response.rc, __ATOMIC_RELEASE);
+            }
+            else if (response.rc != r->rec.rc)
+                c->mismatched[t]++;
+            mark_answered(r->global);
+        }
+
+        // resend what timed out, give up on what was resent too often
+        now = now_ns();
+        for (int i = complete; i < next; i++)
+        {
+            request_t *r = &c->reqs[i];
+            if (r->done || now - r->sent < RETRY_MS * 1000000ULL)
+                continue;
+            if (r->tries >= MAX_TRIES)
+            {
+                r->done = 1;
+                inflight--;
+                c->failed[type_of(r)]++;
+                mark_answered(r->global);
+                continue;
+            }
+            r->tries++;
+            r->sent = now;
+            UDP_Write(fd, &server, (char *)r->message, r->rec.len);
+        }
+        while (complete < c->n && c->reqs[complete].done)
+            complete++;
+    }
+    UDP_Close(fd);
+    return NULL;
+}
+
+void report(unsigned long long replay_ns, MFS_ServerStats_t *st, int have_stats)
+{
+    hist_t rtt[MFS_STATS_TYPES];
+    unsigned long long failed[MFS_STATS_TYPES] = {0};
+    unsigned long long mismatched[MFS_STATS_TYPES] = {0};
+    for (int t = 0; t < MFS_STATS_TYPES; t++)
+    {
+        hist_init(&rtt[t]);
+        for (int i = 0; i < nclients; i++)
+        {
+            hist_merge(&rtt[t], &clients[i].rtt[t]);
+            failed[t] += clients[i].failed[t];
+            mismatched[t] += clients[i].mismatched[t];
+        }
+    }
+    double recorded_s = recorded_ns / 1e9;
+    double replay_s = replay_ns / 1e9;
+
+    if (json)
+    {
+        printf("{\"time\":%ld,\"clients\":%d,\"requests\":%d,\"skipped\":%llu,\"speed\":%g,"
+               "\"recorded_s\":%.3f,\"recorded_ops\":%.1f,\"replay_s\":%.3f,\"replay_ops\":%.1f,\"types\":{",
+               (long)time(NULL), nclients, nrequests, skipped, speed, recorded_s,
+               recorded_s > 0 ? nrequests / recorded_s : 0.0, replay_s, replay_s > 0 ? nrequests / replay_s : 0.0);
+        int printed = 0;
+        for (int t = 0; t < MFS_STATS_TYPES; t++)
+        {
+            if (recorded[t].total == 0)
+                continue;
+            printf("%s\"%s\":{\"count\":%llu,\"failed\":%llu,\"mismatched\":%llu,\"recorded_p50_ns\":%llu,\"recorded_p99_ns\":%llu,"
+                   "\"rtt_p50_ns\":%llu,\"rtt_p99_ns\":%llu",
+                   printed++ ? "," : "", names[t] ? names[t] : "other", recorded[t].total, failed[t], mismatched[t],
+                   hist_percentile(&recorded[t], 50), hist_percentile(&recorded[t], 99),
+                   hist_percentile(&rtt[t], 50), hist_percentile(&rtt[t], 99));
+            if (have_stats)
+                printf(",\"replay_p50_ns\":%llu,\"replay_p99_ns\":%llu", st->ops[t].ns_p50, st->ops[t].ns_p99);
+            printf("}");
+        }
+        printf("}}\n");
+        return;
+    }
+
+    printf("%d requests from %d clients", nrequests, nclients);
+    if (skipped > 0)
+        printf(", %llu shutdowns skipped", skipped);
+    printf("\n%-10s %9s %7s %9s %20s %20s %20s\n", "request", "count", "failed", "differing",
+           "recorded p50/p99 us", "replayed p50/p99 us", "round trip p50/p99");
+    for (int t = 0; t < MFS_STATS_TYPES; t++)
+    {
+        if (recorded[t].total == 0)
+            continue;
+        char replayed[32] = "-";
+        if (have_stats)
+            snprintf(replayed, sizeof(replayed), "%.1f / %.1f", st->ops[t].ns_p50 / 1e3, st->ops[t].ns_p99 / 1e3);
+        char recorded_us[32], rtt_us[32];
+        snprintf(recorded_us, sizeof(recorded_us), "%.1f / %.1f", hist_percentile(&recorded[t], 50) / 1e3, hist_percentile(&recorded[t], 99) / 1e3);
+        snprintf(rtt_us, sizeof(rtt_us), "%.1f / %.1f", hist_percentile(&rtt[t], 50) / 1e3, hist_percentile(&rtt[t], 99) / 1e3);
+        printf("%-10s %9llu %7llu %9llu %20s %20s %20s\n", names[t] ? names[t] : "other", recorded[t].total,
+               failed[t], mismatched[t], recorded_us, replayed, rtt_us);
+    }
+    printf("recorded: %.3f s, %.1f req/s\n", recorded_s, recorded_s > 0 ? nrequests / recorded_s : 0.0);
+    printf("replayed: %.3f s, %.1f req/s (%.2fx)\n", replay_s, replay_s > 0 ? nrequests / replay_s : 0.0,
+           replay_s > 0 ? recorded_s / replay_s : 0.0);
+    if (have_stats)
+        printf("recorded and replayed times are the server's own; the replayed ones are over its whole uptime\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int ch;
+    while ((ch = getopt(argc, argv, "x:aJ")) != -1)
+    {
+        switch (ch)
+        {
+        case 'x':
+            speed = atof(optarg);
+            if (speed <= 0)
+                usage();
+            break;
+        case 'a':
+            speed = 0;
+            break;
+        case 'J':
+            json = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc != 3)
+        usage();
+    host = argv[0];
+    memset(inum_map, -1, sizeof(inum_map));
+    port = atoi(argv[1]);
+
+    if (load(argv[2]) != 0)
+        return 1;
+    if (nrequests == 0)
+    {
+        fprintf(stderr, "mfsreplay: %s holds no requests\n", argv[2]);
+        return 1;
+    }
+
+    start_ns = now_ns();
+    for (int i = 0; i < nclients; i++)
+    {
+        if (pthread_create(&clients[i].thread, NULL, replay_client, &clients[i]) != 0)
+        {
+            fprintf(stderr, "mfsreplay: unable to start client %d\n", i);
+            return 1;
+        }
+    }
+    for (int i = 0; i < nclients; i++)
+        pthread_join(clients[i].thread, NULL);
+    unsigned long long replay_ns = now_ns() - start_ns;
+
+    // the server's own view of the same requests
+    MFS_ServerStats_t st;
+    int have_stats = 0;
+    MFS_Session_t *s = MFS_Open(host, port);
+    if (s != NULL)
+    {
+        have_stats = MFS_SStats(s, &st) == 0;
+        MFS_Close(s);
+    }
+    report(replay_ns, &st, have_stats);
+    return 0;
+}
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mfs.h"
+
+// checks of the client library against a running server, on a fresh image:
+// ./mfstest <host> <port>, or make check
+
+int failures = 0;
+
+#define CHECK(cond)                                                      \
+    do                                                                   \
+    {                                                                    \
+        if (!(cond))                                                     \
+        {                                                                \
+            printf("FAIL %s:%d: %s\n", __func__, __LINE__, #cond);      \
+            failures++;                                                  \
+            return;                                                      \
+        }                                                                \
+    } while (0)
+
+// name was just made in the root and must hold nothing yet
+void check_empty(char *name)
+{
+    int inum = MFS_Lookup(0, name);
+    CHECK(inum >= 0);
+    CHECK(MFS_Fsync(inum) == 0);
+    MFS_Stat_t st;
+    CHECK(MFS_Stat(inum, &st) == 0);
+    CHECK(st.size == 0);
+}
+
+// writes still buffered for an unlinked file must not turn up in the file
+// that gets its inode number next
+void test_unlink_reuse()
+{
+    char buffer[100];
+    memset(buffer, 'X', sizeof(buffer));
+    int a = MFS_Creat(0, MFS_REGULAR_FILE, "a");
+    CHECK(a >= 0);
+    CHECK(MFS_Write(a, buffer, 0, sizeof(buffer)) == 0);
+    CHECK(MFS_Unlink(0, "a") == 0);
+    int b = MFS_Creat(0, MFS_REGULAR_FILE, "b");
+    CHECK(b == a);
+    check_empty("b");
+    CHECK(MFS_Unlink(0, "b") == 0);
+}
+
+// ... nor those of a file a rename replaced
+void test_rename_reuse()
+{
+    char buffer[100];
+    memset(buffer, 'Y', sizeof(buffer));
+    int c = MFS_Creat(0, MFS_REGULAR_FILE, "c");
+    int d = MFS_Creat(0, MFS_REGULAR_FILE, "d");
+    CHECK(c >= 0 && d >= 0);
+    CHECK(MFS_Write(c, buffer, 0, sizeof(buffer)) == 0);
+    CHECK(MFS_Rename(0, "d", 0, "c") == 0);
+    CHECK(MFS_Lookup(0, "c") == d);
+    int e = MFS_Creat(0, MFS_REGULAR_FILE, "e");
+    CHECK(e == c);
+    check_empty("e");
+    CHECK(MFS_Unlink(0, "c") == 0);
+    CHECK(MFS_Unlink(0, "e") == 0);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: mfstest <host> <port>\n");
+        return 1;
+    }
+    if (MFS_Init(argv[1], atoi(argv[2])) != 0)
+    {
+        fprintf(stderr, "mfstest: MFS_Init failed for %s:%s\n", argv[1], argv[2]);
+        return 1;
+    }
+
+    test_unlink_reuse();
+    test_rename_reuse();
+
+    printf(failures == 0 ? "mfstest: all passed\n" : "mfstest: %d failed\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,357 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "hist.h"
+
+#define MAX_DEPTH (64)      // open spans per thread
+#define ASYNC_SLOTS (65536) // async spans open at once, power of two
+
+typedef struct
+{
+    hist_t ns;                // inclusive span times
+    unsigned long long self;  // ns not spent in nested spans
+    unsigned long long under; // self ns inside a server request
+    unsigned long long instants;
+} phase_t;
+
+typedef struct
+{
+    int event;
+    unsigned long long start;
+    unsigned long long children; // ns
+} open_t;
+
+// an async record, kept until every file is read so ends can meet begins
+// that another thread recorded
+typedef struct
+{
+    unsigned long long ts;
+    double ticks_per_us;
+    unsigned int arg;
+    unsigned short event;
+    unsigned short kind;
+} async_t;
+
+phase_t phases[TRACE_EVENTS];
+async_t *asyncs;
+int nasyncs = 0;
+int asyncs_size = 0;
+unsigned long long unmatched = 0;
+unsigned long long dropped = 0;
+
+FILE *chrome = NULL;
+int chrome_events = 0;
+unsigned long long chrome_base = 0;
+
+void usage()
+{
+    fprintf(stderr, "usage: mfstrace [-c <chrome.json>] <trace_file> ...\n"
+                    "       mfstrace -b\n"
+                    "  breaks the spans in trace files written by trace_dump (server -T, or a\n"
+                    "  client's MFS_TRACE_FILE) down by phase: count, latency percentiles, and\n"
+                    "  the share of server request time each phase takes itself\n"
+                    "  -c also writes every record as Chrome trace JSON, for chrome://tracing\n"
+                    "     or Perfetto\n"
+                    "  -b times trace_record itself\n");
+    exit(1);
+}
+
+unsigned long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+unsigned long long to_ns(unsigned long long ticks, double ticks_per_us)
+{
+    return (unsigned long long)(ticks * 1000.0 / ticks_per_us);
+}
+
+void chrome_event(trace_rec_t *rec, double ticks_per_us, int pid, int tid)
+{
+    static const char phs[] = {'B', 'E', 'i', 'b', 'e'};
+    if (chrome == NULL)
+        return;
+    double us = rec->ts > chrome_base ? (rec->ts - chrome_base) / ticks_per_us : 0.0;
+    fprintf(chrome, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"arg\":%u}",
+            chrome_events++ ? "," : "", trace_names[rec->event], phs[rec->kind], us, pid, tid, rec->arg);
+    if (rec->kind == TRACE_I)
+        fprintf(chrome, ",\"s\":\"t\"");
+    if (rec->kind == TRACE_AB || rec->kind == TRACE_AE)
+        fprintf(chrome, ",\"cat\":\"%s\",\"id\":%u", trace_names[rec->event], rec->arg);
+    fprintf(chrome, "}");
+}
+
+// pair one thread's begins and ends; the oldest ends may have lost their
+// begins to the ring wrapping, and those are skipped
+void decode_thread(trace_rec_t *recs, unsigned int count, double ticks_per_us, int pid, int tid)
+{
+    open_t stack[MAX_DEPTH];
+    int depth = 0;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        trace_rec_t *rec = &recs[i];
+        // torn by a write racing the dump
+        if (rec->event == 0 || rec->event >= TRACE_EVENTS || rec->kind > TRACE_AE)
+            continue;
+        chrome_event(rec, ticks_per_us, pid, tid);
+
+        switch (rec->kind)
+        {
+        case TRACE_B:
+            if (depth == MAX_DEPTH)
+            {
+                unmatched++;
+                break;
+            }
+            stack[depth].event = rec->event;
+            stack[depth].start = rec->ts;
+            stack[depth].children = 0;
+            depth++;
+            break;
+        case TRACE_E:
+        {
+            int d = depth - 1;
+            while (d >= 0 && stack[d].event != rec->event)
+                d--;
+            if (d < 0 || rec->ts < stack[d].start)
+            {
+                unmatched++;
+                break;
+            }
+            unmatched += depth - 1 - d;
+            unsigned long long ns = to_ns(rec->ts - stack[d].start, ticks_per_us);
+            unsigned long long self = ns > stack[d].children ? ns - stack[d].children : 0;
+            phase_t *p = &phases[rec->event];
+            hist_record(&p->ns, ns);
+            p->self += self;
+            if (stack[0].event == TRACE_REQUEST)
+                p->under += self;
+            depth = d;
+            if (depth > 0)
+                stack[depth - 1].children += ns;
+            break;
+        }
+        case TRACE_I:
+            phases[rec->event].instants++;
+            break;
+        default:
+            if (nasyncs == asyncs_size)
+            {
+                asyncs_size = asyncs_size ? 2 * asyncs_size : 4096;
+                asyncs = realloc(asyncs, asyncs_size * sizeof(async_t));
+                if (asyncs == NULL)
+                {
+                    fprintf(stderr, "mfstrace: out of memory\n");
+                    exit(1);
+                }
+            }
+            asyncs[nasyncs].ts = rec->ts;
+            asyncs[nasyncs].ticks_per_us = ticks_per_us;
+            asyncs[nasyncs].arg = rec->arg;
+            asyncs[nasyncs].event = rec->event;
+            asyncs[nasyncs].kind = rec->kind;
+            nasyncs++;
+        }
+    }
+    unmatched += depth;
+}
+
+int async_cmp(const void *a, const void *b)
+{
+    const async_t *x = a, *y = b;
+    return x->ts < y->ts ? -1 : x->ts > y->ts;
+}
+
+// async spans are keyed by (event, arg), e.g. an RPC by its sequence number
+void decode_asyncs()
+{
+    qsort(asyncs, nasyncs, sizeof(async_t), async_cmp);
+    async_t **open = calloc(ASYNC_SLOTS, sizeof(async_t *));
+    if (open == NULL)
+        return;
+    for (int i = 0; i < nasyncs; i++)
+    {
+        async_t *a = &asyncs[i];
+        unsigned int slot = (((a->arg ^ a->event) * 2654435761u) >> 16) & (ASYNC_SLOTS - 1);
+        if (a->kind == TRACE_AB)
+        {
+            if (open[slot] != NULL)
+                unmatched++;
+            open[slot] = a;
+        }
+        else if (open[slot] != NULL && open[slot]->event == a->event && open[slot]->arg == a->arg)
+        {
+            hist_record(&phases[a->event].ns, to_ns(a->ts - open[slot]->ts, a->ticks_per_us));
+            open[slot] = NULL;
+        }
+        else
+            unmatched++;
+    }
+    free(open);
+}
+
+// read a dump into memory, NULL if it is not one
+char *load(const char *path, long *size)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        perror(path);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *data = malloc(*size > 0 ? *size : 1);
+    if (data == NULL || fread(data, 1, *size, f) != (size_t)*size || *size < (long)sizeof(trace_header_t) ||
+        memcmp(((trace_header_t *)data)->magic, TRACE_MAGIC, 8) != 0 || ((trace_header_t *)data)->version != TRACE_VERSION)
+    {
+        fprintf(stderr, "mfstrace: %s is not a trace file\n", path);
+        fclose(f);
+        free(data);
+        return NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+// call fn on each thread of a loaded dump, return -1 if it is truncated
+int each_thread(char *data, long size, void (*fn)(trace_header_t *, trace_thread_t *, trace_rec_t *))
+{
+    trace_header_t *h = (trace_header_t *)data;
+    long pos = sizeof(trace_header_t);
+    for (unsigned int t = 0; t < h->nthreads; t++)
+    {
+        if (pos + (long)sizeof(trace_thread_t) > size)
+            return -1;
+        trace_thread_t *th = (trace_thread_t *)(data + pos);
+        pos += sizeof(trace_thread_t);
+        if (pos + (long)(th->count * sizeof(trace_rec_t)) > size)
+            return -1;
+        fn(h, th, (trace_rec_t *)(data + pos));
+        pos += th->count * sizeof(trace_rec_t);
+    }
+    return 0;
+}
+
+void find_base(trace_header_t *h, trace_thread_t *th, trace_rec_t *recs)
+{
+    if (th->count > 0 && (chrome_base == 0 || recs[0].ts < chrome_base))
+        chrome_base = recs[0].ts;
+}
+
+void decode(trace_header_t *h, trace_thread_t *th, trace_rec_t *recs)
+{
+    dropped += th->dropped;
+    decode_thread(recs, th->count, h->ticks_per_us, h->pid, th->tid);
+}
+
+void report()
+{
+    unsigned long long request_ns = phases[TRACE_REQUEST].ns.sum;
+    printf("%-10s %10s %10s %10s %10s %10s %10s %10s\n", "phase", "count", "total ms", "mean us", "p50 us", "p99 us", "max us", "% request");
+    for (int e = 1; e < TRACE_EVENTS; e++)
+    {
+        phase_t *p = &phases[e];
+        if (p->ns.total == 0 && p->instants == 0)
+            continue;
+        if (p->ns.total == 0)
+        {
+            printf("%-10s %10llu %10s\n", trace_names[e], p->instants, "(instant)");
+            continue;
+        }
+        printf("%-10s %10llu %10.3f %10.2f %10.2f %10.2f %10.2f", trace_names[e], p->ns.total, p->ns.sum / 1e6,
+               (double)p->ns.sum / p->ns.total / 1e3, hist_percentile(&p->ns, 50) / 1e3,
+               hist_percentile(&p->ns, 99) / 1e3, p->ns.max / 1e3);
+        if (request_ns > 0 && p->under > 0)
+            printf(" %9.1f%%", 100.0 * p->under / request_ns);
+        printf("\n");
+    }
+    if (request_ns > 0)
+        printf("%% request is the time a phase takes itself, not counting phases nested in it;\n"
+               "request's own share is everything inside a request left uninstrumented\n");
+    if (dropped > 0 || unmatched > 0)
+        printf("%llu records overwritten before the dump, %llu unmatched\n", dropped, unmatched);
+}
+
+// time trace_record against an empty loop
+void bench()
+{
+    int n = 10000000;
+    unsigned long long start = now_ns();
+    for (int i = 0; i < n; i++)
+    {
+        trace_record(TRACE_INODE, TRACE_B, i);
+        trace_record(TRACE_INODE, TRACE_E, i);
+    }
+    unsigned long long traced = now_ns() - start;
+    printf("trace_record: %.1f ns per tracepoint (%d records)\n", (double)traced / (2.0 * n), 2 * n);
+}
+
+int main(int argc, char *argv[])
+{
+    char *chrome_path = NULL;
+    int ch;
+    while ((ch = getopt(argc, argv, "c:b")) != -1)
+    {
+        switch (ch)
+        {
+        case 'c':
+            chrome_path = optarg;
+            break;
+        case 'b':
+            bench();
+            return 0;
+        default:
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc == 0)
+        usage();
+
+    char *data[argc];
+    long size[argc];
+    for (int i = 0; i < argc; i++)
+    {
+        data[i] = load(argv[i], &size[i]);
+        if (data[i] == NULL)
+            return 1;
+        if (each_thread(data[i], size[i], find_base) != 0)
+        {
+            fprintf(stderr, "mfstrace: %s is truncated\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (chrome_path != NULL)
+    {
+        chrome = fopen(chrome_path, "w");
+        if (chrome == NULL)
+        {
+            perror(chrome_path);
+            return 1;
+        }
+        fprintf(chrome, "{\"traceEvents\":[");
+    }
+    for (int i = 0; i < argc; i++)
+    {
+        each_thread(data[i], size[i], decode);
+        free(data[i]);
+    }
+    decode_asyncs();
+    if (chrome != NULL)
+    {
+        fprintf(chrome, "\n]}\n");
+        fclose(chrome);
+    }
+    report();
+    return 0;
+}
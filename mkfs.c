@@ -5,14 +5,150 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "mfs.h"
 #include "ufs.h"
 
+#define GROUP_DEFAULT_BLOCKS (8192)
+
 void usage()
 {
-    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>]\n");
+    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>] [-n <snapshots>] [-g <groups>] [-I <max_inodes>] [-M <max_data_blocks>] [-k <shard>] [-c | -D] [-l [-s <segment_blocks>]]\n"
+                    "  -g is how many allocation groups the inodes and data blocks are split\n"
+                    "     into (default one per %d data blocks, see inode_alloc in engine.c)\n"
+                    "  -I and -M reserve room for the image to grow to that many inodes and data\n"
+                    "     blocks while it is served (see server_Grow in engine.c)\n"
+                    "  -k makes the image shard <shard> of a sharded namespace, served by a\n"
+                    "     server started with -K (default 0)\n"
+                    "  -n is how many snapshots the image can hold at once (default 4)\n"
+                    "  -c compresses the blocks of regular files (see compress.c)\n"
+                    "  -D has regular files share blocks with the same contents (see dedup.c)\n"
+                    "  -l lays the image out as a log (see lfs.c) instead of in place,\n"
+                    "     without snapshots\n", GROUP_DEFAULT_BLOCKS);
     exit(1);
 }
 
+typedef struct
+{
+    dir_ent_t entries[128];
+} dir_block_t;
+
+// up to a multiple of 32, so groups start on a bitmap word
+int round32(int n)
+{
+    return (n + 31) / 32 * 32;
+}
+
+/**
+ * the log layout: the super block, two checkpoint regions, then the
+ * segments. the first segment starts with a partial segment holding the
+ * root directory, which the first checkpoint points at
+ */
+int mkfs_log(int fd, int num_inodes, int num_data, int segment_blocks, int shard)
+{
+    assert(segment_blocks >= 16);
+    // the cleaner needs a few segments to work with
+    if (num_data < 8 * segment_blocks)
+        num_data = 8 * segment_blocks;
+    int nsegs = num_data / segment_blocks;
+    num_data = nsegs * segment_blocks;
+
+    super_t s;
+    memset(&s, 0, sizeof(s));
+    s.num_inodes = num_inodes;
+    s.num_data = num_data;
+    s.layout = UFS_LAYOUT_LOG;
+    s.segment_blocks = segment_blocks;
+    s.shard = shard;
+    int region_bytes = sizeof(log_checkpoint_t) + (num_inodes + nsegs) * sizeof(unsigned int);
+    s.checkpoint_addr = 1;
+    s.checkpoint_len = (region_bytes + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+    s.data_region_addr = s.checkpoint_addr + 2 * s.checkpoint_len;
+    s.data_region_len = num_data;
+    int total_blocks = s.data_region_addr + s.data_region_len;
+
+    char *empty = calloc(UFS_BLOCK_SIZE, 1);
+    assert(empty != NULL);
+    for (int i = 0; i < total_blocks; i++)
+    {
+        int rc = pwrite(fd, empty, UFS_BLOCK_SIZE, (off_t)i * UFS_BLOCK_SIZE);
+        if (rc != UFS_BLOCK_SIZE)
+        {
+            perror("write");
+            exit(1);
+        }
+    }
+    int rc = pwrite(fd, &s, sizeof(super_t), 0);
+    assert(rc == sizeof(super_t));
+
+    // summary, root directory block, block with the root inode
+    unsigned int root_block = s.data_region_addr + 1;
+    unsigned int inode_block = s.data_region_addr + 2;
+
+    dir_block_t root;
+    strcpy(root.entries[0].name, ".");
+    root.entries[0].inum = 0;
+    strcpy(root.entries[1].name, "..");
+    root.entries[1].inum = 0;
+    for (int i = 2; i < 128; i++)
+        root.entries[i].inum = -1;
+
+    log_inode_block_t inodes;
+    memset(&inodes, 0, sizeof(inodes));
+    inodes.count = 1;
+    inodes.inums[0] = 0;
+    inodes.inodes[0].type = UFS_DIRECTORY;
+    inodes.inodes[0].size = 2 * sizeof(dir_ent_t);
+    inodes.inodes[0].direct[0] = root_block;
+    for (int i = 1; i < DIRECT_PTRS; i++)
+        inodes.inodes[0].direct[i] = -1;
+
+    log_summary_t summary;
+    memset(&summary, 0, sizeof(summary));
+    summary.magic = LOG_MAGIC;
+    summary.nblocks = 2;
+    summary.seq = 1;
+    summary.next = inode_block + 1;
+    summary.entries[0].inum = 0;
+    summary.entries[0].index = 0;
+    summary.entries[1].inum = -1;
+    summary.entries[1].index = LOG_INODE_BLOCK;
+    unsigned int sum = log_checksum(0, &root, UFS_BLOCK_SIZE);
+    sum = log_checksum(sum, &inodes, UFS_BLOCK_SIZE);
+    summary.checksum = log_checksum(sum ^ (unsigned int)summary.seq, summary.entries, summary.nblocks * sizeof(log_entry_t));
+
+    rc = pwrite(fd, &summary, UFS_BLOCK_SIZE, (off_t)s.data_region_addr * UFS_BLOCK_SIZE);
+    assert(rc == UFS_BLOCK_SIZE);
+    rc = pwrite(fd, &root, UFS_BLOCK_SIZE, (off_t)root_block * UFS_BLOCK_SIZE);
+    assert(rc == UFS_BLOCK_SIZE);
+    rc = pwrite(fd, &inodes, UFS_BLOCK_SIZE, (off_t)inode_block * UFS_BLOCK_SIZE);
+    assert(rc == UFS_BLOCK_SIZE);
+
+    // checkpoint 0 covers that commit; region 1 stays invalid until used
+    char *region = calloc(s.checkpoint_len, UFS_BLOCK_SIZE);
+    assert(region != NULL);
+    log_checkpoint_t *c = (log_checkpoint_t *)region;
+    unsigned int *map = (unsigned int *)(region + sizeof(log_checkpoint_t));
+    map[0] = inode_block * 32;
+    map[num_inodes] = 1; // segment 0's age
+    c->magic = LOG_MAGIC;
+    c->seq = 1;
+    c->head = inode_block + 1;
+    c->checksum = log_checksum(1, map, region_bytes - sizeof(log_checkpoint_t));
+    rc = pwrite(fd, region, s.checkpoint_len * UFS_BLOCK_SIZE, (off_t)s.checkpoint_addr * UFS_BLOCK_SIZE);
+    assert(rc == s.checkpoint_len * UFS_BLOCK_SIZE);
+
+    printf("total blocks        %d\n", total_blocks);
+    printf("  inodes            %d [size of each: %lu]\n", num_inodes, sizeof(inode_t));
+    printf("  data blocks       %d\n", num_data);
+    printf("log layout\n");
+    printf("  checkpoint regions address/len %d [%d] x 2\n", s.checkpoint_addr, s.checkpoint_len);
+    printf("  segments address/count         %d [%d of %d blocks]\n", s.data_region_addr, nsegs, segment_blocks);
+
+    (void)fsync(fd);
+    (void)close(fd);
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     int ch;
@@ -20,8 +156,17 @@ int main(int argc, char *argv[])
     int num_inodes = 32;
     int num_data = 32;
     int visual = 0;
-
-    while ((ch = getopt(argc, argv, "i:d:f:v")) != -1)
+    int log = 0;
+    int segment_blocks = 32;
+    int snapshots = 4;
+    int compress = 0;
+    int dedup = 0;
+    int groups = 0;
+    int max_inodes = 0;
+    int max_data = 0;
+    int shard = 0;
+
+    while ((ch = getopt(argc, argv, "i:d:f:vls:n:cDg:I:M:k:")) != -1)
     {
         switch (ch)
         {
@@ -37,6 +182,37 @@ int main(int argc, char *argv[])
         case 'v':
             visual = 1;
             break;
+        case 'l':
+            log = 1;
+            break;
+        case 's':
+            segment_blocks = atoi(optarg);
+            break;
+        case 'n':
+            snapshots = atoi(optarg);
+            break;
+        case 'c':
+            compress = 1;
+            break;
+        case 'D':
+            dedup = 1;
+            break;
+        case 'I':
+            max_inodes = atoi(optarg);
+            break;
+        case 'M':
+            max_data = atoi(optarg);
+            break;
+        case 'k':
+            shard = atoi(optarg);
+            if (shard < 0 || shard >= MFS_MAX_SHARDS)
+                usage();
+            break;
+        case 'g':
+            groups = atoi(optarg);
+            if (groups < 1)
+                usage();
+            break;
         default:
             usage();
         }
@@ -44,7 +220,7 @@ int main(int argc, char *argv[])
     argc -= optind;
     argv += optind;
 
-    if (image_file == NULL)
+    if (image_file == NULL || (log && (compress || dedup || groups || max_inodes || max_data)) || (compress && dedup))
         usage();
 
     unsigned char *empty_buffer;
@@ -64,31 +240,45 @@ int main(int argc, char *argv[])
 
     assert(num_inodes >= 32);
     assert(num_data >= 32);
+    // inode numbers have to leave room for the shard above them
+    assert(shard == 0 || (max_inodes > num_inodes ? max_inodes : num_inodes) <= 1 << MFS_SHARD_SHIFT);
+
+    if (log)
+        return mkfs_log(fd, num_inodes, num_data, segment_blocks, shard);
 
     // presumed: block 0 is the super block
     super_t s;
+    memset(&s, 0, sizeof(s));
 
     // totals
     s.num_inodes = num_inodes;
     s.num_data = num_data;
+    s.shard = shard;
+
+    // the bitmaps, the inode table and the dedup tables are sized for what
+    // the image may grow to; the data region just for what it has
+    if (max_inodes < num_inodes)
+        max_inodes = num_inodes;
+    if (max_data < num_data)
+        max_data = num_data;
 
     // inode bitmap
     int bits_per_block = (8 * UFS_BLOCK_SIZE); // remember, there are 8 bits per byte
 
     s.inode_bitmap_addr = 1;
-    s.inode_bitmap_len = num_inodes / bits_per_block;
-    if (num_inodes % bits_per_block != 0)
+    s.inode_bitmap_len = max_inodes / bits_per_block;
+    if (max_inodes % bits_per_block != 0)
         s.inode_bitmap_len++;
 
     // data bitmap
     s.data_bitmap_addr = s.inode_bitmap_addr + s.inode_bitmap_len;
-    s.data_bitmap_len = num_data / bits_per_block;
-    if (num_data % bits_per_block != 0)
+    s.data_bitmap_len = max_data / bits_per_block;
+    if (max_data % bits_per_block != 0)
         s.data_bitmap_len++;
 
     // inode table
     s.inode_region_addr = s.data_bitmap_addr + s.data_bitmap_len;
-    int total_inode_bytes = num_inodes * sizeof(inode_t);
+    int total_inode_bytes = max_inodes * sizeof(inode_t);
     s.inode_region_len = total_inode_bytes / UFS_BLOCK_SIZE;
     if (total_inode_bytes % UFS_BLOCK_SIZE != 0)
         s.inode_region_len++;
@@ -97,7 +287,45 @@ int main(int argc, char *argv[])
     s.data_region_addr = s.inode_region_addr + s.inode_region_len;
     s.data_region_len = num_data;
 
-    int total_blocks = 1 + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len + s.data_region_len;
+    // allocation groups: group g is the g-th slice of the inodes and of the
+    // data blocks. the last may be short, and have no inodes at all. an
+    // image that grows gets more groups of the same size
+    if (groups == 0)
+        s.group_blocks = GROUP_DEFAULT_BLOCKS;
+    else
+        s.group_blocks = round32((num_data + groups - 1) / groups);
+    s.groups = (num_data + s.group_blocks - 1) / s.group_blocks;
+    s.group_inodes = round32((num_inodes + s.groups - 1) / s.groups);
+    // and enough inodes per group that the groups it has once grown hold max_inodes
+    int max_groups = (max_data + s.group_blocks - 1) / s.group_blocks;
+    if (s.group_inodes < round32((max_inodes + max_groups - 1) / max_groups))
+        s.group_inodes = round32((max_inodes + max_groups - 1) / max_groups);
+
+    // snapshot slots
+    assert(snapshots >= 0);
+    s.snapshot_addr = s.data_region_addr + s.data_region_len;
+    s.snapshot_len = snap_header_blocks(s.inode_region_len) + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len;
+    s.snapshot_slots = snapshots;
+    s.snapshot_next_id = 1;
+    s.compress = compress;
+
+    // dedup reference counts and fingerprint index
+    if (dedup)
+    {
+        s.dedup = 1;
+        s.dedup_refs_addr = s.snapshot_addr + s.snapshot_slots * s.snapshot_len;
+        s.dedup_refs_len = (max_data * sizeof(unsigned int) + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+        s.dedup_index_slots = UFS_BLOCK_SIZE / sizeof(dedup_entry_t);
+        while (s.dedup_index_slots < 2 * max_data)
+            s.dedup_index_slots *= 2;
+        s.dedup_index_addr = s.dedup_refs_addr + s.dedup_refs_len;
+        s.dedup_index_len = s.dedup_index_slots * sizeof(dedup_entry_t) / UFS_BLOCK_SIZE;
+    }
+
+    int total_blocks = 1 + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len + s.data_region_len +
+                       s.snapshot_slots * s.snapshot_len + s.dedup_refs_len + s.dedup_index_len;
+    // a fragment's pointer has room for the block number below PACK_MAX_BLOCK
+    assert(!compress || total_blocks + max_data - num_data <= PACK_MAX_BLOCK);
 
     // super block is the first block
     int rc = pwrite(fd, &s, sizeof(super_t), 0);
@@ -113,6 +341,18 @@ int main(int argc, char *argv[])
     printf("layout details\n");
     printf("  inode bitmap address/len %d [%d]\n", s.inode_bitmap_addr, s.inode_bitmap_len);
     printf("  data bitmap address/len  %d [%d]\n", s.data_bitmap_addr, s.data_bitmap_len);
+    printf("  snapshot slots address/len %d [%d] x %d\n", s.snapshot_addr, s.snapshot_len, s.snapshot_slots);
+    if (max_inodes > num_inodes || max_data > num_data)
+        printf("  room to grow to          %d inodes, %d data blocks\n", max_inodes, max_data);
+    printf("  allocation groups        %d [%d inodes, %d data blocks each]\n", s.groups, s.group_inodes,
+           s.group_blocks);
+    if (shard > 0)
+        printf("  shard                    %d\n", shard);
+    if (compress)
+        printf("  blocks of regular files compressed\n");
+    if (dedup)
+        printf("  dedup refs/index address/len %d [%d] %d [%d]\n", s.dedup_refs_addr, s.dedup_refs_len,
+               s.dedup_index_addr, s.dedup_index_len);
 
     // first, zero out all the blocks
     int i;
@@ -172,10 +412,6 @@ int main(int argc, char *argv[])
     // need to write out root directory contents to first data block
     // create a root directory, with nothing in it
     //
-    typedef struct
-    {
-        dir_ent_t entries[128];
-    } dir_block_t;
     // xxx assumes 4096 block, 32 byte entries
     assert(sizeof(dir_ent_t) * 128 == UFS_BLOCK_SIZE);
 
@@ -205,6 +441,10 @@ int main(int argc, char *argv[])
             printf("I");
         for (i = 0; i < s.data_region_len; i++)
             printf("D");
+        for (i = 0; i < s.snapshot_slots * s.snapshot_len; i++)
+            printf("s");
+        for (i = 0; i < s.dedup_refs_len + s.dedup_index_len; i++)
+            printf("x");
         printf("\n\n");
     }
 
@@ -0,0 +1,30 @@
+#ifndef __record_h__
+#define __record_h__
+
+// workload recordings, written by server -R and replayed by mfsreplay. the
+// file is a record_header_t, then per request a record_t followed by the
+// len bytes of the client_message_t exactly as received (so writes carry
+// only their nbytes), in the order the server handled them
+
+#define RECORD_MAGIC "MFSREC\0\0"
+#define RECORD_VERSION (1)
+
+typedef struct
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int pad;
+} record_header_t;
+
+typedef struct
+{
+    unsigned long long ns;   // arrival in the socket, ns since the recording began
+    unsigned int queued_ns;  // time it waited behind other requests, saturating
+    unsigned int served_ns;  // time the server then took, saturating
+    unsigned int addr;       // client IPv4 address, network order
+    unsigned short port;     // ... and port, network order
+    unsigned short len;      // message bytes that follow
+    int rc;                  // what the server answered
+} record_t;
+
+#endif // __record_h__
@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "replica.h"
+#include "stats.h"
+
+// primary-backup replication, see replica.h. everything here runs on the
+// server's one thread, between requests
+
+#define REPL_RING (1024)       // shipped requests kept for resending, power of two
+#define REPL_HOLD (256)        // sync replies waiting for an ack
+#define REPL_MAX_BACKUPS (8)
+#define HEARTBEAT_MS (100)     // a quiet primary still sends this often
+#define RESEND_MS (200)        // unacked requests go out again after this long
+#define RESEND_BURST (32)      // ... this many at a time
+#define SYNC_WAIT_MS (1000)    // held replies go out unacked after this long
+#define BACKUP_UP_MS (1000)    // a backup that acked this recently is up
+
+extern int sd;
+
+typedef struct
+{
+    struct sockaddr_in addr;
+    unsigned long long acked; // every lsn up to this one is applied there
+    long long sent_ms;        // last replicate or heartbeat sent it
+    long long heard_ms;       // last ack, 0 if never
+    int behind;               // fell out of the ring, needs a fresh copy
+} backup_t;
+
+typedef struct
+{
+    struct sockaddr_in addr;
+    int len;
+    unsigned long long lsn;
+    long long since_ms;
+    server_message_t response;
+} held_t;
+
+backup_t backups[REPL_MAX_BACKUPS];
+int nbackups = 0;
+char *backup_list = NULL; // -B as given, for MFS_SHARDS
+int sync_replies = 0;     // -Y
+
+unsigned long long epoch;    // this run's stream, by when it started
+unsigned long long next_lsn; // last one shipped
+client_message_t ring[REPL_RING];
+int ring_len[REPL_RING];
+held_t held[REPL_HOLD];
+int nheld = 0;
+unsigned long long unacked_replies = 0;
+
+// the backup side
+int standby = 0;
+int takeover_ms;
+struct sockaddr_in primary;  // the only server whose stream is applied
+long long heard_ms = 0;      // last message from the primary
+unsigned long long follow_epoch = 0;
+unsigned long long applied = 0;
+
+long long repl_now_ms()
+{
+    return stats_now_ns() / 1000000;
+}
+
+unsigned long long new_epoch()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * ship every change to backups, a comma separated host:port list, waiting
+ * for one of them to apply it before replying if sync.
+ * return -1 if the list does not parse, 0 otherwise
+ */
+int replica_Init(char *backup_hosts, int sync)
+{
+    char *list = strdup(backup_hosts);
+    char *save;
+    int rc = 0;
+    for (char *item = strtok_r(list, ",", &save); item != NULL && rc == 0; item = strtok_r(NULL, ",", &save))
+    {
+        char *colon = strrchr(item, ':');
+        if (colon == NULL || nbackups == REPL_MAX_BACKUPS)
+            rc = -1;
+        else
+        {
+            *colon = '\0';
+            if (UDP_FillSockAddr(&backups[nbackups].addr, item, atoi(colon + 1)) != 0)
+                rc = -1;
+            nbackups++;
+        }
+    }
+    free(list);
+    if (rc != 0 || nbackups == 0 || strlen(backup_hosts) >= MFS_BLOCK_SIZE)
+        return -1;
+    backup_list = backup_hosts;
+    sync_replies = sync;
+    epoch = new_epoch();
+    return 0;
+}
+
+/**
+ * start as a backup of primary_host, a host:port, serving clients only once
+ * it has been silent for takeover ms. return -1 if primary_host does not
+ * parse, 0 otherwise
+ */
+int replica_Follow(char *primary_host, int takeover)
+{
+    char *host = strdup(primary_host);
+    char *colon = strrchr(host, ':');
+    int rc = -1;
+    if (colon != NULL)
+    {
+        *colon = '\0';
+        rc = UDP_FillSockAddr(&primary, host, atoi(colon + 1));
+    }
+    free(host);
+    if (rc != 0)
+        return -1;
+    standby = 1;
+    takeover_ms = takeover;
+    return 0;
+}
+
+char *replica_list()
+{
+    return backup_list;
+}
+
+int replica_standby()
+{
+    return standby;
+}
+
+void send_replicate(backup_t *b, unsigned long long lsn)
+{
+    client_message_t *m = &ring[lsn & (REPL_RING - 1)];
+    UDP_Write(sd, &b->addr, (char *)m, offsetof(client_message_t, method.replicate.request) + ring_len[lsn & (REPL_RING - 1)]);
+    b->sent_ms = repl_now_ms();
+}
+
+/**
+ * m, len bytes as the handlers saw it, was handled and client was answered
+ * rc, whatever that was: put it in the stream. return its lsn, 0 if nothing
+ * is shipped
+ */
+unsigned long long replica_ship(client_message_t *m, int len, int rc, struct sockaddr_in *client)
+{
+    if (nbackups == 0 || standby || len > REPL_REQUEST_MAX)
+        return 0;
+    unsigned long long lsn = ++next_lsn;
+    int slot = lsn & (REPL_RING - 1);
+    client_message_t *r = &ring[slot];
+    r->mtype = MFS_REPLICATE;
+    r->seq = 0;
+    r->method.replicate.epoch = epoch;
+    r->method.replicate.lsn = lsn;
+    r->method.replicate.rc = rc;
+    r->method.replicate.len = len;
+    r->method.replicate.addr = client->sin_addr.s_addr;
+    r->method.replicate.port = client->sin_port;
+    memcpy(r->method.replicate.request, m, len);
+    ring_len[slot] = len;
+
+    for (int i = 0; i < nbackups; i++)
+    {
+        backup_t *b = &backups[i];
+        if (b->behind)
+            continue;
+        if (lsn - b->acked > REPL_RING)
+        {
+            b->behind = 1;
+            fprintf(stderr, "replica: backup %d is %llu requests behind and no longer followed\n", i, lsn - b->acked);
+            continue;
+        }
+        send_replicate(b, lsn);
+    }
+    return lsn;
+}
+
+int backups_up()
+{
+    long long now = repl_now_ms();
+    for (int i = 0; i < nbackups; i++)
+    {
+        if (!backups[i].behind && backups[i].heard_ms > 0 && now - backups[i].heard_ms < BACKUP_UP_MS)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * in sync mode, keep the len byte reply to addr back until a backup has
+ * applied lsn. return 1 if it is held, 0 if it should go out now
+ */
+int replica_hold(struct sockaddr_in *addr, server_message_t *response, int len, unsigned long long lsn)
+{
+    if (!sync_replies || lsn == 0 || nheld == REPL_HOLD || !backups_up())
+        return 0;
+    held_t *h = &held[nheld++];
+    h->addr = *addr;
+    h->len = len;
+    h->lsn = lsn;
+    h->since_ms = repl_now_ms();
+    memcpy(&h->response, response, len);
+    return 1;
+}
+
+// whether the reply to lsn is still held back
+int replica_holding(unsigned long long lsn)
+{
+    for (int i = 0; i < nheld; i++)
+    {
+        if (held[i].lsn == lsn)
+            return 1;
+    }
+    return 0;
+}
+
+unsigned long long acked_max()
+{
+    unsigned long long max = 0;
+    for (int i = 0; i < nbackups; i++)
+    {
+        if (backups[i].acked > max)
+            max = backups[i].acked;
+    }
+    return max;
+}
+
+// send the held replies a backup has caught up with, or that waited too long
+void release_held()
+{
+    if (nheld == 0)
+        return;
+    unsigned long long acked = acked_max();
+    long long now = repl_now_ms();
+    int kept = 0;
+    for (int i = 0; i < nheld; i++)
+    {
+        held_t *h = &held[i];
+        if (h->lsn > acked && now - h->since_ms < SYNC_WAIT_MS)
+        {
+            if (kept != i)
+                held[kept] = *h;
+            kept++;
+            continue;
+        }
+        if (h->lsn > acked)
+        {
+            if (unacked_replies++ == 0)
+                fprintf(stderr, "replica: no backup acknowledged in %d ms, replying anyway\n", SYNC_WAIT_MS);
+        }
+        UDP_Write(sd, &h->addr, (char *)&h->response, h->len);
+    }
+    nheld = kept;
+}
+
+void replica_ack(client_message_t *m, struct sockaddr_in *from)
+{
+    if (m->method.ack.epoch != epoch)
+        return;
+    for (int i = 0; i < nbackups; i++)
+    {
+        backup_t *b = &backups[i];
+        if (b->addr.sin_addr.s_addr != from->sin_addr.s_addr || b->addr.sin_port != from->sin_port)
+            continue;
+        b->heard_ms = repl_now_ms();
+        if (m->method.ack.lsn > b->acked && m->method.ack.lsn <= next_lsn)
+            b->acked = m->method.ack.lsn;
+    }
+    release_held();
+}
+
+/**
+ * on a backup: apply m, the next request of the stream, with apply, which
+ * is given the client that sent it and what the primary answered, and
+ * returns what it would have answered itself. anything out of order
+ * waits for the primary to resend it; every replicate is acked with how
+ * far this backup got. one from anywhere but the primary is dropped
+ */
+void replica_receive(client_message_t *m, struct sockaddr_in *from, int (*apply)(client_message_t *, struct sockaddr_in *, int))
+{
+    if (!standby || from->sin_addr.s_addr != primary.sin_addr.s_addr || from->sin_port != primary.sin_port)
+        return;
+    heard_ms = repl_now_ms();
+    if (m->method.replicate.epoch != follow_epoch)
+    {
+        // a restarted primary numbers from 1 again
+        if (follow_epoch != 0)
+            fprintf(stderr, "replica: primary restarted, following its new stream\n");
+        follow_epoch = m->method.replicate.epoch;
+        applied = 0;
+    }
+    if (m->method.replicate.lsn == applied + 1 && m->method.replicate.len <= REPL_REQUEST_MAX)
+    {
+        client_message_t request;
+        memset(&request, 0, sizeof(request));
+        memcpy(&request, m->method.replicate.request, m->method.replicate.len);
+        struct sockaddr_in client;
+        memset(&client, 0, sizeof(client));
+        client.sin_family = AF_INET;
+        client.sin_addr.s_addr = m->method.replicate.addr;
+        client.sin_port = m->method.replicate.port;
+        int rc = apply(&request, &client, m->method.replicate.rc);
+        if (rc != m->method.replicate.rc)
+            fprintf(stderr, "replica: request %llu (type %d) gave %d here, %d on the primary\n",
+                    m->method.replicate.lsn, request.mtype, rc, m->method.replicate.rc);
+        applied++;
+    }
+
+    client_message_t ack;
+    ack.mtype = MFS_REPL_ACK;
+    ack.seq = 0;
+    ack.method.ack.epoch = follow_epoch;
+    ack.method.ack.lsn = applied;
+    UDP_Write(sd, from, (char *)&ack, offsetof(client_message_t, method.ack) + sizeof(ack.method.ack));
+}
+
+// heartbeats, resends and held replies on the primary; takeover on a backup
+void replica_tick()
+{
+    long long now = repl_now_ms();
+    if (standby)
+    {
+        if (heard_ms == 0 || now - heard_ms <= takeover_ms)
+            return;
+        fprintf(stderr, "replica: primary silent for %d ms, taking over after request %llu\n", takeover_ms, applied);
+        standby = 0;
+        epoch = new_epoch();
+        next_lsn = 0;
+        for (int i = 0; i < nbackups; i++)
+            backups[i].acked = 0;
+        return;
+    }
+
+    for (int i = 0; i < nbackups; i++)
+    {
+        backup_t *b = &backups[i];
+        if (b->behind)
+            continue;
+        if (b->acked < next_lsn && now - b->sent_ms >= RESEND_MS)
+        {
+            for (unsigned long long lsn = b->acked + 1; lsn <= next_lsn && lsn <= b->acked + RESEND_BURST; lsn++)
+                send_replicate(b, lsn);
+        }
+        else if (now - b->sent_ms >= HEARTBEAT_MS)
+        {
+            client_message_t beat;
+            beat.mtype = MFS_REPLICATE;
+            beat.seq = 0;
+            beat.method.replicate.epoch = epoch;
+            beat.method.replicate.lsn = 0;
+            beat.method.replicate.len = 0;
+            UDP_Write(sd, &b->addr, (char *)&beat, offsetof(client_message_t, method.replicate.request));
+            b->sent_ms = now;
+        }
+    }
+    release_held();
+}
+
+void replica_stats(MFS_ServerStats_t *st)
+{
+    st->repl_lsn = standby ? applied : next_lsn;
+    st->repl_acked = acked_max();
+    st->repl_unacked = unacked_replies;
+}
@@ -0,0 +1,31 @@
+#ifndef __replica_h__
+#define __replica_h__
+
+#include "message.h"
+#include "udp.h"
+
+// primary-backup replication. a server given backups (-B) ships every
+// request that can change its image to each of them, failed ones included,
+// numbered in the order it handled them, and resends whatever they have not
+// acknowledged; with -Y the reply to such a request waits until a backup has
+// applied it. a server started as a backup (-F) applies the stream from its
+// primary, and no one else, to its own image, which has to start out as a
+// copy of the primary's, and ignores clients until the primary has been
+// silent for its takeover time. then it serves them itself, shipping to its
+// own -B list if it has one
+
+int replica_Init(char *backups, int sync);
+int replica_Follow(char *primary_host, int takeover_ms);
+
+char *replica_list();
+int replica_standby();
+
+unsigned long long replica_ship(client_message_t *m, int len, int rc, struct sockaddr_in *client);
+int replica_hold(struct sockaddr_in *addr, server_message_t *response, int len, unsigned long long lsn);
+int replica_holding(unsigned long long lsn);
+void replica_ack(client_message_t *m, struct sockaddr_in *from);
+void replica_receive(client_message_t *m, struct sockaddr_in *from, int (*apply)(client_message_t *, struct sockaddr_in *, int));
+void replica_tick();
+void replica_stats(MFS_ServerStats_t *st);
+
+#endif // __replica_h__
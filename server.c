@@ -2,774 +2,1162 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <stddef.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
 
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-
-#include "ufs.h"
+#include "engine.h"
 #include "message.h"
-#include "mfs.h"
 #include "udp.h"
+#include "cycles.h"
+#include "stats.h"
+#include "trace.h"
+#include "record.h"
+#include "replica.h"
+#include "frontend.h"
+
+// reads at least this large go out with MSG_ZEROCOPY when -z is given
+#define ZEROCOPY_THRESHOLD (2048)
+#define ZEROCOPY_INFLIGHT (64)  // such replies per socket not yet completed, power of two
+#define ZEROCOPY_WAIT_MS (1000) // completions not in by then are given up on
+
+#define SOCKET_BUFFER (4 << 20) // room for bursts of full-block writes
+
+#define LEASE_MS (2000)   // how long clients may cache lookups and stats
+#define LEASE_HOLDERS (4) // clients tracked per inode, more get no lease
+
+#define STATS_INTERVAL (10) // seconds between dumps when -S is given
+
+#define REPLY_CACHE (1024)     // answers to changes kept for resends, power of two
+#define REPLY_CACHE_MS (10000) // longer than a client keeps resending
 
 int sd;
-void *image;
-int fd;
-super_t *SUPERBLOCK;
-inode_t *root_inode;
-dir_ent_t *root_dir;
-unsigned int *inodeMap;
-unsigned int *dataMap;
-inode_t *inode_table;
-int *data_table;
-
-int server_Lookup(int pinum, char *name);
-int server_Stat(const int inum, MFS_Stat_t *m);
-int server_Write(int inum, char *buffer, int offset, int nbytes);
-int server_Create(int pinum, int type, char *name);
-int server_Shutdown();
-int server_Unlink(int pinum, char *name);
-int server_Read(const int inum, char *buffer, int offset, int nbytes);
+int zerocopy = 0;
+int lease_ms = LEASE_MS;
+char *stats_path = NULL;
+int stats_interval = STATS_INTERVAL;
+char *trace_path = "server.trace";
+volatile sig_atomic_t trace_wanted = 0;
+FILE *record_file = NULL; // -R: every request goes in here for mfsreplay
+unsigned long long record_start;
+char *shard_map = NULL; // -K: every shard's host:port, in order
+int nshards = 0;
+client_message_t *current; // the request being handled, for reply to ship
+int current_len;
+int nloops = 0;  // -N: receive loops in front of the engine, 0 reads sd here
+int wait_ms = 0; // the loop wakes after this long without a request, 0 never
 
 typedef struct
 {
-    dir_ent_t entries[128];
-} dir_block_t;
-
+    struct sockaddr_in addr;
+    long long expiry; // ms, CLOCK_MONOTONIC
+} lease_t;
+
+// the answer to a change, for when the client did not hear it and sends
+// the request again: doing it twice would fail (an unlink) or happen twice
+// (a snapshot). a client's requests in flight have consecutive seqs, so
+// they land in different slots
 typedef struct
 {
-    inode_t inodes[UFS_BLOCK_SIZE / sizeof(inode_t)];
-} inode_block;
+    struct sockaddr_in addr;
+    int seq;
+    int mtype;
+    long long since_ms; // 0 if the slot is empty
+    unsigned long long lsn; // in sync mode the answer may still be held for it
+    int len;
+    server_message_t response;
+} replied_t;
+
+replied_t *replied; // REPLY_CACHE slots, by reply_slot
+
+unsigned int *inode_version; // per inode, bumped on every change
+lease_t *leases;             // LEASE_HOLDERS per inode
+
+// accounting for the MFS_READ reply path, printed on shutdown
+struct
+{
+    unsigned long long reads;
+    unsigned long long bytes_served;
+    unsigned long long bytes_copied;
+    unsigned long long cycles;
+} read_stats;
+
+void print_read_stats()
+{
+    if (read_stats.reads == 0)
+        return;
+    printf("read path: %llu reads, %llu bytes served, %.3f copies/byte, %llu cycles/read\n",
+           read_stats.reads, read_stats.bytes_served,
+           read_stats.bytes_served ? (double)read_stats.bytes_copied / read_stats.bytes_served : 0.0,
+           read_stats.cycles / read_stats.reads);
+    fflush(stdout);
+}
 
+// a socket's MSG_ZEROCOPY replies. the kernel numbers them 0, 1, .. and
+// sends straight from their pages until it reports them done, so the
+// header goes out of a copy kept here rather than the handler's response,
+// and nothing may change the image under them: see zerocopy_drain
 typedef struct
 {
-    unsigned int bits[UFS_BLOCK_SIZE / sizeof(unsigned int)];
-} bitmap_t;
+    int fd;
+    unsigned int next; // what the socket's next zerocopy send is numbered
+    unsigned int done; // every send before this one has completed
+    char finished[ZEROCOPY_INFLIGHT];
+    int payload[ZEROCOPY_INFLIGHT];
+    char header[ZEROCOPY_INFLIGHT][offsetof(server_message_t, buffer)];
+} zerocopy_t;
+
+zerocopy_t *zerocopy_sockets; // one per socket replies go out of
+int nzerocopy = 0;
+
+zerocopy_t *zerocopy_socket(int fd)
+{
+    for (int i = 0; i < nzerocopy; i++)
+    {
+        if (zerocopy_sockets[i].fd == fd)
+            return &zerocopy_sockets[i];
+    }
+    return NULL;
+}
+
+// UDP_ReapZeroCopy's callback: sends first to last of socket arg are done
+void zerocopy_completed(unsigned int first, unsigned int last, int copied, void *arg)
+{
+    zerocopy_t *z = (zerocopy_t *)arg;
+    for (unsigned int id = first; id != last + 1; id++)
+    {
+        // a send given up on in zerocopy_reap may still be reported
+        if (id - z->done >= z->next - z->done)
+            continue;
+        int slot = id & (ZEROCOPY_INFLIGHT - 1);
+        z->finished[slot] = 1;
+        if (copied)
+            read_stats.bytes_copied += z->payload[slot];
+    }
+    while (z->done != z->next && z->finished[z->done & (ZEROCOPY_INFLIGHT - 1)])
+        z->finished[z->done++ & (ZEROCOPY_INFLIGHT - 1)] = 0;
+}
+
+// take in z's completions, waiting until no more than left sends are out
+void zerocopy_reap(zerocopy_t *z, unsigned int left)
+{
+    long long deadline = stats_now_ns() / 1000000 + ZEROCOPY_WAIT_MS;
+    UDP_ReapZeroCopy(z->fd, zerocopy_completed, z);
+    while (z->next - z->done > left)
+    {
+        long long now = stats_now_ns() / 1000000;
+        if (now >= deadline)
+        {
+            fprintf(stderr, "zerocopy: %u replies not completed in %d ms, reusing their buffers\n", z->next - z->done,
+                    ZEROCOPY_WAIT_MS);
+            memset(z->finished, 0, sizeof(z->finished));
+            z->done = z->next;
+            break;
+        }
+        // a completion on the error queue shows as POLLERR
+        struct pollfd p = {z->fd, 0, 0};
+        poll(&p, 1, deadline - now);
+        UDP_ReapZeroCopy(z->fd, zerocopy_completed, z);
+    }
+}
+
+// the image's pages are written in place (by writes, the cleaner, growing
+// it), so wait for every reply still sending from them before changing it
+void zerocopy_drain()
+{
+    for (int i = 0; i < nzerocopy; i++)
+        zerocopy_reap(&zerocopy_sockets[i], 0);
+}
+
+// whether every buffer lies in the mapped image; copies made for the reply
+// are reused at once, so only the image is sent from without copying
+int in_image(struct iovec *iov, int iovcnt)
+{
+    for (int i = 0; i < iovcnt; i++)
+    {
+        char *base = (char *)iov[i].iov_base;
+        if (base < (char *)image || base + iov[i].iov_len > (char *)image + image_size)
+            return 0;
+    }
+    return 1;
+}
 
 void intHandler(int dummy)
 {
+    print_read_stats();
+    frontend_print();
     UDP_Close(sd);
     exit(130);
 }
 
-unsigned int get_bit(unsigned int *bitmap, int position)
+// SIGUSR2: write the trace rings out, from the loop rather than the handler
+void traceHandler(int dummy)
 {
-    int index = position / 32;
-    int offset = 31 - (position % 32);
-    return (bitmap[index] >> offset) & 0x1;
+    trace_wanted = 1;
 }
 
-void set_bit(unsigned int *bitmap, int position)
+// return -1 if failed or built without MFS_TRACE, 0 otherwise
+int dump_trace()
 {
-    int index = position / 32;
-    int offset = 31 - (position % 32);
-    bitmap[index] |= 0x1 << offset;
+#ifdef MFS_TRACE
+    if (trace_dump(trace_path) != 0)
+    {
+        perror(trace_path);
+        return -1;
+    }
+    return 0;
+#else
+    return -1;
+#endif
 }
 
-void set_bit_zero(unsigned int *bitmap, int position)
+// have the loop come round at least every ms without a request
+void wake_within(int ms)
 {
-    int index = position / 32;
-    int offset = 31 - (position % 32);
-    bitmap[index] &= ~ (0x1 << offset);
+    if (wait_ms == 0 || ms < wait_ms)
+        wait_ms = ms;
 }
 
-void set_bit_zero2(unsigned int *bitmap, int position)
+long long now_ms()
 {
-    int index = position / 32;
-    int offset = 31 - (position % 32);
-    bitmap[index] |= 0x0 << offset;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
 }
 
-int main(int argc, char *argv[])
+// the number clients know inode inum by, on a sharded server
+int global(int inum)
 {
-    signal(SIGINT, intHandler);
+    return shard_map != NULL ? shard_global(inum) : inum;
+}
 
-    if (argc != 3)
+// the inode numbers of a request to a sharded server, as the handlers know them
+void message_local(client_message_t *m)
+{
+    switch (m->mtype)
     {
-        printf("Incorrect format!");
-        exit(1);
+    case MFS_LOOKUP:
+        m->method.lookup.pinum = shard_local(m->method.lookup.pinum);
+        break;
+    case MFS_STAT:
+        m->method.stat.inum = shard_local(m->method.stat.inum);
+        break;
+    case MFS_WRITE:
+        m->method.write.inum = shard_local(m->method.write.inum);
+        break;
+    case MFS_READ:
+        m->method.read.inum = shard_local(m->method.read.inum);
+        break;
+    case MFS_CRET:
+        m->method.create.pinum = shard_local(m->method.create.pinum);
+        break;
+    case MFS_CRET_WRITE:
+        m->method.create_write.pinum = shard_local(m->method.create_write.pinum);
+        break;
+    case MFS_UNLINK:
+        m->method.unlink.pinum = shard_local(m->method.unlink.pinum);
+        break;
+    case MFS_TRUNCATE:
+        m->method.truncate.inum = shard_local(m->method.truncate.inum);
+        break;
+    case MFS_RENAME:
+        m->method.rename.pinum = shard_local(m->method.rename.pinum);
+        m->method.rename.newpinum = shard_local(m->method.rename.newpinum);
+        break;
+    case MFS_COPY:
+        m->method.copy.inum = shard_local(m->method.copy.inum);
+        m->method.copy.dinum = shard_local(m->method.copy.dinum);
+        break;
+    case MFS_LINK:
+        m->method.link.pinum = shard_local(m->method.link.pinum);
+        m->method.link.inum = shard_local(m->method.link.inum);
+        break;
+    case MFS_RELEASE:
+        m->method.release.inum = shard_local(m->method.release.inum);
+        break;
+    case MFS_STRIPE:
+        m->method.stripe.inum = shard_local(m->method.stripe.inum);
+        break;
+    case MFS_LAYOUT:
+        m->method.layout.inum = shard_local(m->method.layout.inum);
+        break;
     }
+}
 
-    int port = atoi(argv[1]);
-    char *file = argv[2];
-    fd = open(file, O_RDWR);
-    if (fd < 0)
+// the entries among nbytes read at offset of a directory, with their inode
+// numbers as clients know them; entries cut off by the range are left alone
+void dir_global(char *buffer, int offset, int nbytes)
+{
+    int size = sizeof(dir_ent_t);
+    for (int e = offset / size; e * size < offset + nbytes; e++)
     {
-        printf("image does not exist\n");
-        exit(1);
+        int at = e * size + offsetof(dir_ent_t, inum);
+        if (at < offset || at + (int)sizeof(int) > offset + nbytes)
+            continue;
+        int inum;
+        memcpy(&inum, buffer + at - offset, sizeof(inum));
+        inum = shard_global(inum);
+        memcpy(buffer + at - offset, &inum, sizeof(inum));
     }
+}
 
-    struct stat sbuf;
-    int rc = fstat(fd, &sbuf);
-    assert(rc > -1);
-
-    int image_size = (int)sbuf.st_size;
-
-    image = mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    assert(image != MAP_FAILED);
-
-    SUPERBLOCK = (super_t *)image;
-    inodeMap = image + SUPERBLOCK->inode_bitmap_addr * UFS_BLOCK_SIZE;
-    inode_table = image + SUPERBLOCK->inode_region_addr * UFS_BLOCK_SIZE;
-    dataMap = image + SUPERBLOCK->data_bitmap_addr * UFS_BLOCK_SIZE;
-    data_table = image + SUPERBLOCK->data_region_addr * UFS_BLOCK_SIZE;
-
-    root_inode = inode_table;
-    root_dir = image + (root_inode->direct[0] * UFS_BLOCK_SIZE);
+/**
+ * let the client at addr cache what it learned about inum, return the lease
+ * length in ms, or 0 if inum is not in use or all holder slots are taken
+ */
+int lease_grant(int inum, struct sockaddr_in *addr)
+{
+    if (lease_ms <= 0 || inum > SUPERBLOCK->num_inodes - 1 || inum < 0)
+        return 0;
+    if (get_bit(inodeMap, inum) == 0)
+        return 0;
 
-    sd = UDP_Open(port);
-    assert(sd > -1);
-    while (1)
+    long long now = now_ms();
+    lease_t *holders = &leases[inum * LEASE_HOLDERS];
+    lease_t *slot = NULL;
+    for (int i = 0; i < LEASE_HOLDERS; i++)
     {
-        struct sockaddr_in addr;
-        client_message_t message;
-
-        rc = UDP_Read(sd, &addr, (char *)&message, sizeof(message));
-        if (rc > 0)
-        {
-            server_message_t response;
-            switch (message.mtype)
-            {
-            case MFS_LOOKUP:
-                response.rc = server_Lookup(message.method.lookup.pinum, message.method.lookup.name);
-                UDP_Write(sd, &addr, (char *)&response, sizeof(response));
-                break;
-            case MFS_STAT:
-                response.rc = server_Stat(message.method.stat.inum, &response.stat);
-                UDP_Write(sd, &addr, (char *)&response, sizeof(response));
-                break;
-            case MFS_WRITE:
-                response.rc = server_Write(message.method.write.inum, message.method.write.buffer, message.method.write.offset, message.method.write.nbytes);
-                UDP_Write(sd, &addr, (char *)&response, sizeof(response));
-                break;
-            case MFS_READ:
-                response.rc = server_Read(message.method.read.inum, response.buffer, message.method.read.offset, message.method.read.nbytes);
-                UDP_Write(sd, &addr, (char *)&response, sizeof(response));
-                break;
-            case MFS_CRET:
-                response.rc = server_Create(message.method.create.pinum, message.method.create.type, message.method.create.name);
-                UDP_Write(sd, &addr, (char *)&response, sizeof(response));
-                break;
-            case MFS_UNLINK:
-                response.rc = server_Unlink(message.method.unlink.pinum, message.method.unlink.name);
-                UDP_Write(sd, &addr, (char *)&response, sizeof(response));
-                break;
-            case MFS_SHUTDOWN:
-                response.rc = server_Shutdown();
-                UDP_Write(sd, &addr, (char *)&response, sizeof(response));
-                UDP_Close(sd);
-                exit(0);
-                break;
-            default:
-                response.rc = -1;
-                UDP_Write(sd, &addr, (char *)&response, sizeof(response));
-                break;
-            }
-        }
-        else
+        if (holders[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr && holders[i].addr.sin_port == addr->sin_port)
         {
-            printf("Do not get message");
-            close(fd);
-            return 0;
+            slot = &holders[i];
+            break;
         }
+        if (slot == NULL && holders[i].expiry <= now)
+            slot = &holders[i];
+    }
+    if (slot == NULL)
+    {
+        thread_stats.lease_denials++;
+        return 0;
     }
 
+    thread_stats.lease_grants++;
+    slot->addr = *addr;
+    slot->expiry = now + lease_ms;
+    return lease_ms;
 }
+
 /**
- * lookup in directory of pinum for file with name, return -1 if failed,
- * return inode number otherwise
+ * inum changed: bump its version and tell every client still holding a
+ * lease on it, other than except (who made the change and learns the new
+ * version from its reply), to drop what it cached. the notification is best
+ * effort, a lost one is bounded by the lease running out
  */
-int server_Lookup(int pinum, char *name)
+void lease_revoke(int inum, struct sockaddr_in *except)
 {
-    // todo: not sure if lseek and read is neccessary for finding inode, need to check on that
-    if (pinum > SUPERBLOCK->num_inodes - 1 || pinum < 0)
-        return -1;
-    unsigned int bit = get_bit(inodeMap, pinum);
-    if ((int)bit == 0)
-        return -1;
-
-    char pBuffer[UFS_BLOCK_SIZE];
-    int pBlockOffset = (pinum * sizeof(inode_t)) / UFS_BLOCK_SIZE;
-    lseek(fd, (SUPERBLOCK->inode_region_addr + pBlockOffset) * UFS_BLOCK_SIZE, SEEK_SET);
-    read(fd, pBuffer, UFS_BLOCK_SIZE);
-    inode_block *pinodeBlockPtr = (inode_block *)pBuffer;
-    int pOffset = pinum - pBlockOffset * UFS_BLOCK_SIZE / sizeof(inode_t);
-    inode_t *pinode = &pinodeBlockPtr->inodes[pOffset];
-
-    if (pinode->type != UFS_DIRECTORY)
-        return -1;
-
-    for (int i = 0; i < DIRECT_PTRS; i++)
+    if (inum > SUPERBLOCK->num_inodes - 1 || inum < 0)
+        return;
+    inode_version[inum]++;
+
+    server_message_t note;
+    note.rc = MFS_REVOKE;
+    note.seq = 0;
+    note.inum = global(inum);
+    note.lease = 0;
+    note.version = inode_version[inum];
+
+    long long now = now_ms();
+    lease_t *holders = &leases[inum * LEASE_HOLDERS];
+    for (int i = 0; i < LEASE_HOLDERS; i++)
     {
-        // let's say it's the blcok address in block, starting from super block
-        int blockNum = pinode->direct[i];
-        if (blockNum == -1)
+        if (holders[i].expiry <= now)
             continue;
-        char buffer[UFS_BLOCK_SIZE];
-        lseek(fd, blockNum * UFS_BLOCK_SIZE, SEEK_SET);
-        read(fd, buffer, UFS_BLOCK_SIZE);
-        dir_block_t *entryblock = (dir_block_t *)buffer;
-        for (int j = 0; j < 128; j++)
-        {
-            if (entryblock->entries[j].inum == -1)
-                continue;
-            if (strcmp(name, entryblock->entries[j].name) == 0)
-            {
-                return entryblock->entries[j].inum;
-            }
-        }
+        if (except != NULL && holders[i].addr.sin_addr.s_addr == except->sin_addr.s_addr && holders[i].addr.sin_port == except->sin_port)
+            continue;
+        UDP_Write(sd, &holders[i].addr, (char *)&note, offsetof(server_message_t, buffer));
+        holders[i].expiry = 0;
+        thread_stats.revokes++;
     }
-    return -1;
 }
 
-int server_Stat(const int inum, MFS_Stat_t *m)
+// fill in the caching part of a reply about inum
+void lease_reply(server_message_t *response, int inum, struct sockaddr_in *addr)
 {
-    if (inum > SUPERBLOCK->num_inodes - 1 || inum < 0)
-        return -1;
-    unsigned int bit = get_bit(inodeMap, inum);
-    if ((int)bit == 0)
-        return -1;
-
-    char buffer[UFS_BLOCK_SIZE];
-    int blockOffset = (inum * sizeof(inode_t)) / UFS_BLOCK_SIZE;
-    lseek(fd, (SUPERBLOCK->inode_region_addr + blockOffset) * UFS_BLOCK_SIZE, SEEK_SET);
-    read(fd, buffer, UFS_BLOCK_SIZE);
-    inode_block *inodeBlockPtr = (inode_block *)buffer;
-    int offset = inum - blockOffset * UFS_BLOCK_SIZE / sizeof(inode_t);
-    inode_t *target = &inodeBlockPtr->inodes[offset];
+    response->inum = inum;
+    response->lease = lease_grant(inum, addr);
+    response->version = response->lease > 0 ? inode_version[inum] : 0;
+}
 
-    m->type = target->type;
-    m->size = target->size;
-    return 0;
+// the image grew from old_inodes: versions and leases for the new inodes
+void leases_grow(int old_inodes)
+{
+    int n = SUPERBLOCK->num_inodes;
+    unsigned int *versions = realloc(inode_version, n * sizeof(unsigned int));
+    lease_t *holders = realloc(leases, n * LEASE_HOLDERS * sizeof(lease_t));
+    assert(versions != NULL && holders != NULL);
+    memset(versions + old_inodes, 0, (n - old_inodes) * sizeof(unsigned int));
+    memset(holders + old_inodes * LEASE_HOLDERS, 0, (n - old_inodes) * LEASE_HOLDERS * sizeof(lease_t));
+    inode_version = versions;
+    leases = holders;
 }
 
-int server_Write(int inum, char *buffer, int offset, int nbytes)
+// append one handled request to the recording; the FILE buffers, and exit()
+// on SIGINT or MFS_SHUTDOWN flushes it
+void record_request(struct sockaddr_in *addr, client_message_t *message, int len, int rc, unsigned long long start,
+                    unsigned long long queued, unsigned long long served)
 {
-    if (inum > SUPERBLOCK->num_inodes - 1 || inum < 0 || nbytes > 4096 || nbytes < 0)
-        return -1;
-    unsigned int bit = get_bit(inodeMap, inum);
-    if ((int)bit == 0)
-        return -1;
+    record_t r;
+    r.ns = start - queued > record_start ? start - queued - record_start : 0;
+    r.queued_ns = queued > 0xffffffffULL ? 0xffffffff : (unsigned int)queued;
+    r.served_ns = served > 0xffffffffULL ? 0xffffffff : (unsigned int)served;
+    r.addr = addr->sin_addr.s_addr;
+    r.port = addr->sin_port;
+    r.len = len;
+    r.rc = rc;
+    fwrite(&r, sizeof(r), 1, record_file);
+    fwrite(message, len, 1, record_file);
+}
 
-    int directNum = offset / UFS_BLOCK_SIZE;
-    int inBlockOffset = offset % UFS_BLOCK_SIZE;
+// whether a request of type mtype can change the image, and so goes to backups
+int mutates(int mtype)
+{
+    switch (mtype)
+    {
+    case MFS_WRITE:
+    case MFS_TRUNCATE:
+    case MFS_CRET:
+    case MFS_CRET_WRITE:
+    case MFS_UNLINK:
+    case MFS_RENAME:
+    case MFS_COPY:
+    case MFS_LINK:
+    case MFS_RELEASE:
+    case MFS_STRIPE:
+    case MFS_SNAPSHOT:
+    case MFS_SNAPSHOT_DELETE:
+    case MFS_GROW:
+        return 1;
+    }
+    return 0;
+}
 
-    if (directNum > 29)
-        return -1;
-    if (directNum == 29 && (inBlockOffset + nbytes) > UFS_BLOCK_SIZE)
-        return -1;
+replied_t *reply_slot(struct sockaddr_in *addr, int seq)
+{
+    unsigned int h = addr->sin_addr.s_addr * 2654435761u ^ addr->sin_port * 40503u;
+    return &replied[(h + seq) & (REPLY_CACHE - 1)];
+}
 
-    char Buffer[UFS_BLOCK_SIZE];
-    int BlockOffset = (inum * sizeof(inode_t)) / UFS_BLOCK_SIZE;
-    lseek(fd, (SUPERBLOCK->inode_region_addr + BlockOffset) * UFS_BLOCK_SIZE, SEEK_SET);
-    read(fd, Buffer, UFS_BLOCK_SIZE);
-    inode_block *inodeBlockPtr = (inode_block *)Buffer;
-    int Offset = inum - BlockOffset * UFS_BLOCK_SIZE / sizeof(inode_t);
-    inode_t *target = &inodeBlockPtr->inodes[Offset];
-    int targetBlock = target->direct[directNum];
+// keep the len byte answer to request m from addr for its resends
+void reply_remember(struct sockaddr_in *addr, client_message_t *m, server_message_t *response, int len,
+                    unsigned long long lsn)
+{
+    replied_t *r = reply_slot(addr, m->seq);
+    r->addr = *addr;
+    r->seq = m->seq;
+    r->mtype = m->mtype;
+    r->since_ms = stats_now_ns() / 1000000;
+    r->lsn = lsn;
+    r->len = len;
+    memcpy(&r->response, response, len);
+}
 
-    if (target->type != UFS_REGULAR_FILE)
-        return -1;
+// answer m from addr again if it is a change already made. return 1 if
+// it was, 0 if it is to be handled
+int reply_again(struct sockaddr_in *addr, client_message_t *m)
+{
+    replied_t *r = reply_slot(addr, m->seq);
+    if (r->since_ms == 0 || r->seq != m->seq || r->mtype != m->mtype || r->addr.sin_addr.s_addr != addr->sin_addr.s_addr ||
+        r->addr.sin_port != addr->sin_port || (long long)(stats_now_ns() / 1000000) - r->since_ms > REPLY_CACHE_MS)
+        return 0;
+    // a held answer goes out once a backup has the change
+    if (r->lsn == 0 || !replica_holding(r->lsn))
+        UDP_Write(sd, addr, (char *)&r->response, r->len);
+    return 1;
+}
 
-    // No data block assigned to this offset
-    if (targetBlock == -1)
-    {   
-        int assigned = 0;
-        for (int i = 0; i < SUPERBLOCK->data_bitmap_len * UFS_BLOCK_SIZE; i++)
-        {
-            if (get_bit(dataMap, i) == 0)
-            {
-                set_bit(dataMap, i);
-                target->direct[directNum] = SUPERBLOCK->data_region_addr + i;
-                assigned = 1;
-                break;
-            }
-        }
-        if (assigned != 1)
-            return -1;
-    }
-    if (inBlockOffset + nbytes > 4096)
+// send a whole-message reply; the read path gathers its own. a change is
+// shipped to the backups first, a failed one too since a handler can fail
+// part way with some of its work committed, and in sync mode its reply
+// waits for one of them to have applied it
+void reply(struct sockaddr_in *addr, server_message_t *response, int len)
+{
+    response->inum = global(response->inum);
+    if (current != NULL && mutates(current->mtype))
     {
-        int rc = lseek(fd, target->direct[directNum] * UFS_BLOCK_SIZE + inBlockOffset, SEEK_SET);
-        if (rc == -1)
-            return -1;
-
-        rc = write(fd, buffer, UFS_BLOCK_SIZE - inBlockOffset);
-        if (rc == -1)
-            return -1;
-        unsigned int targetBlock2 = target->direct[directNum + 1];
-        if ((int)targetBlock2 == -1)
-        {
-
-            int assigned2 = 0;
-            for (int i = 0; i < SUPERBLOCK->data_bitmap_len * UFS_BLOCK_SIZE; i++)
-            {
-                if (get_bit(dataMap, i) == 0)
-                {
-                    set_bit(dataMap, i);
-                    target->direct[directNum] = SUPERBLOCK->data_region_addr + i;
-                    assigned2 = 1;
-                    break;
-                }
-            }
-            if (assigned2 != 1)
-                return -1;
-        }
-        rc = lseek(fd, target->direct[directNum + 1] * UFS_BLOCK_SIZE, SEEK_SET);
-        if (rc == -1)
-            return -1;
-        rc = write(fd, buffer + UFS_BLOCK_SIZE - inBlockOffset, inBlockOffset + nbytes - UFS_BLOCK_SIZE);
-        if (rc == -1)
-            return -1;
+        unsigned long long lsn = replica_ship(current, current_len, response->rc, addr);
+        reply_remember(addr, current, response, len, lsn);
+        if (replica_hold(addr, response, len, lsn))
+            return;
     }
-    else
-    {
-        int rc = lseek(fd, target->direct[directNum] * UFS_BLOCK_SIZE + inBlockOffset, SEEK_SET);
-        if (rc == -1)
-        {
-            target->direct[directNum] = -1;
-            return -1;
-        }
+    TRACE_BEGIN(TRACE_REPLY, len);
+    UDP_Write(sd, addr, (char *)response, len);
+    TRACE_END(TRACE_REPLY, len);
+}
 
-        rc = write(fd, buffer, nbytes);
-        if (rc == -1)
+/**
+ * a backup applying a request the primary shipped: what the handlers do
+ * for it, without the reply. leases are revoked so versions keep moving,
+ * though the clients holding them are the primary's and hear nothing.
+ * the primary told client answered, which is kept for when it resends to
+ * this server after a takeover. return what the handlers gave
+ */
+int apply(client_message_t *m, struct sockaddr_in *client, int answered)
+{
+    int rc = -1;
+    switch (m->mtype)
+    {
+    case MFS_WRITE:
+        rc = server_Write(m->method.write.inum, m->method.write.buffer, m->method.write.offset, m->method.write.nbytes);
+        if (rc == 0)
+            lease_revoke(m->method.write.inum, NULL);
+        break;
+    case MFS_TRUNCATE:
+        rc = server_Truncate(m->method.truncate.inum, m->method.truncate.size);
+        if (rc == 0)
+            lease_revoke(m->method.truncate.inum, NULL);
+        break;
+    case MFS_CRET:
+        rc = server_Create(m->method.create.pinum, m->method.create.type, m->method.create.name);
+        if (rc >= 0)
+            lease_revoke(m->method.create.pinum, NULL);
+        rc = global(rc);
+        break;
+    case MFS_CRET_WRITE:
+        rc = server_CreateWrite(m->method.create_write.pinum, m->method.create_write.type, m->method.create_write.name,
+                                m->method.create_write.buffer, m->method.create_write.nbytes);
+        if (rc >= 0)
+            lease_revoke(m->method.create_write.pinum, NULL);
+        rc = global(rc);
+        break;
+    case MFS_UNLINK:
+        rc = server_Unlink(m->method.unlink.pinum, m->method.unlink.name);
+        if (rc == 0)
+            lease_revoke(m->method.unlink.pinum, NULL);
+        break;
+    case MFS_RENAME:
+        rc = server_Rename(m->method.rename.pinum, m->method.rename.name, m->method.rename.newpinum, m->method.rename.newname);
+        if (rc == 0)
         {
-            target->direct[directNum] = -1;
-            return -1;
+            lease_revoke(m->method.rename.pinum, NULL);
+            lease_revoke(m->method.rename.newpinum, NULL);
         }
+        break;
+    case MFS_COPY:
+        rc = server_Copy(m->method.copy.inum, m->method.copy.offset, m->method.copy.dinum, m->method.copy.doffset,
+                         m->method.copy.nbytes);
+        if (rc >= 0)
+            lease_revoke(m->method.copy.dinum, NULL);
+        break;
+    case MFS_LINK:
+        rc = server_Link(m->method.link.pinum, m->method.link.name, m->method.link.inum);
+        if (rc == 0)
+            lease_revoke(m->method.link.pinum, NULL);
+        break;
+    case MFS_RELEASE:
+        rc = server_Release(m->method.release.inum);
+        break;
+    case MFS_STRIPE:
+        rc = server_Stripe(m->method.stripe.inum, m->method.stripe.size, &m->method.stripe.layout);
+        if (rc == 0)
+            lease_revoke(m->method.stripe.inum, NULL);
+        break;
+    case MFS_SNAPSHOT:
+        rc = server_Snapshot();
+        break;
+    case MFS_SNAPSHOT_DELETE:
+        rc = server_SnapshotDelete(m->method.snapshot.id);
+        break;
+    case MFS_GROW:
+    {
+        int old_inodes = SUPERBLOCK->num_inodes;
+        rc = server_Grow(m->method.grow.num_inodes, m->method.grow.num_data);
+        if (rc == 0 && SUPERBLOCK->num_inodes > old_inodes)
+            leases_grow(old_inodes);
+        break;
     }
-    target->size = offset + nbytes;
-    int rc2 = pwrite(fd, target, sizeof(inode_t),
-         (SUPERBLOCK->inode_region_addr + BlockOffset) * UFS_BLOCK_SIZE + Offset * sizeof(inode_t));
-    assert(rc2 == sizeof(inode_t));
-    fsync(fd);
-    return 0;
+    }
+
+    server_message_t response;
+    memset(&response, 0, sizeof(response));
+    response.rc = answered;
+    response.seq = m->seq;
+    response.inum = -1;
+    reply_remember(client, m, &response, sizeof(response), 0);
+    return rc;
 }
 
-int server_Read(const int inum, char *buffer, int offset, int nbytes)
+void usage()
 {
-    if (inum > SUPERBLOCK->num_inodes - 1 || inum < 0 || nbytes > 4096 || nbytes < 0)
-        return -1;
-    unsigned int bit = get_bit(inodeMap, inum);
-    if ((int)bit == 0)
-        return -1;
-
-    int directNum = offset / UFS_BLOCK_SIZE;
-    int inBlockOffset = offset % UFS_BLOCK_SIZE;
-    
-    if (directNum > 29)
-    {
-        return -1;
-    }
-
-    char Buffer[UFS_BLOCK_SIZE];
-    int blockOffset = (inum * sizeof(inode_t)) / UFS_BLOCK_SIZE;
-    lseek(fd, (SUPERBLOCK->inode_region_addr + blockOffset) * UFS_BLOCK_SIZE, SEEK_SET);
-    read(fd, Buffer, UFS_BLOCK_SIZE);
-    // inode_block* inodeBlockPtr = malloc(sizeof(inode_block));
-    inode_block *inodeBlockPtr = (inode_block *)Buffer;
-    int inumOffset = inum - blockOffset * UFS_BLOCK_SIZE / sizeof(inode_t);
-    inode_t *target = &inodeBlockPtr->inodes[inumOffset];
+    fprintf(stderr, "usage: server [-z] [-L <lease_ms>] [-S <stats_file> [-I <secs>]] [-T <trace_file>] [-R <record_file>] [-M <snapshot>] [-K <host:port,...>]\n"
+                    "              [-B <host:port,...> [-Y]] [-F <host:port>,<takeover_ms>] [-N <loops> [-P]] <port> <image_file>\n"
+                    "  -S appends the counters MFS_STATS reports to stats_file as a line of\n"
+                    "     JSON every <secs> seconds (default %d)\n"
+                    "  -T is where SIGUSR2 or MFS_TRACE_DUMP write the request trace of a\n"
+                    "     server built with make TRACE=1 (default server.trace)\n"
+                    "  -R records every request to record_file for mfsreplay; keep a copy\n"
+                    "     of image_file from before the server starts to replay against\n"
+                    "  -M serves snapshot <snapshot> of image_file read-only, alongside the\n"
+                    "     server that took it\n"
+                    "  -K serves the image as its shard (mkfs -k) of a sharded namespace,\n"
+                    "     host:port being every shard's server, in shard order, which\n"
+                    "     clients are given when they open a session\n"
+                    "  -B ships every change to the backup servers host:port, which clients\n"
+                    "     are given to fail over to; with -Y a change is only answered once\n"
+                    "     a backup has applied it\n"
+                    "  -F serves as a backup of the primary host:port, as this server sees\n"
+                    "     its address, from a copy of its image, applying changes from it\n"
+                    "     alone, and takes over once it has been silent for takeover_ms\n"
+                    "  -N receives on <loops> sockets sharing the port, each read by a thread\n"
+                    "     of its own pinned to a core, which queue requests for the engine;\n"
+                    "     with -P they and the engine busy-poll instead of sleeping\n", STATS_INTERVAL);
+    exit(1);
+}
 
-    int targetBlock = target->direct[directNum];
+int main(int argc, char *argv[])
+{
+    signal(SIGINT, intHandler);
 
-    if (inBlockOffset + nbytes <= UFS_BLOCK_SIZE)
+    // no SA_RESTART, so a blocked read returns and the loop dumps at once
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = traceHandler;
+    sigaction(SIGUSR2, &sa, NULL);
+
+    int ch;
+    int snapshot = -1;
+    char *backup_hosts = NULL;
+    int sync = 0;
+    char *primary = NULL;
+    int takeover = -1;
+    int busy = 0;
+    while ((ch = getopt(argc, argv, "zL:S:I:T:R:M:K:B:YF:N:P")) != -1)
     {
-        if (target->type == UFS_DIRECTORY)
+        switch (ch)
         {
-            if (inBlockOffset % sizeof(dir_ent_t) != 0 || nbytes != sizeof(dir_ent_t))
+        case 'z':
+            zerocopy = 1;
+            break;
+        case 'L':
+            lease_ms = atoi(optarg);
+            break;
+        case 'S':
+            stats_path = optarg;
+            break;
+        case 'I':
+            stats_interval = atoi(optarg);
+            if (stats_interval <= 0)
+                usage();
+            break;
+        case 'T':
+            trace_path = optarg;
+            break;
+        case 'R':
+            record_file = fopen(optarg, "w");
+            if (record_file == NULL)
             {
-                return -1;
+                perror(optarg);
+                exit(1);
             }
-        }
-
-        if (targetBlock == -1)
-        {
-            return -1;
-        }
-
-        int rc = lseek(fd, target->direct[directNum] * UFS_BLOCK_SIZE + inBlockOffset, SEEK_SET);
-        if (rc == -1)
+            break;
+        case 'M':
+            snapshot = atoi(optarg);
+            break;
+        case 'K':
+            shard_map = optarg;
+            break;
+        case 'B':
+            backup_hosts = optarg;
+            break;
+        case 'Y':
+            sync = 1;
+            break;
+        case 'F':
         {
-            return -1;
+            char *comma = strrchr(optarg, ',');
+            if (comma == NULL)
+                usage();
+            *comma = '\0';
+            primary = optarg;
+            takeover = atoi(comma + 1);
+            if (takeover <= 0)
+                usage();
+            break;
         }
-
-        rc = read(fd, buffer, nbytes);
-        if (rc == -1)
-        {
-            return -1;
+        case 'N':
+            nloops = atoi(optarg);
+            if (nloops <= 0)
+                usage();
+            break;
+        case 'P':
+            busy = 1;
+            break;
+        default:
+            usage();
         }
     }
-    else
-    {
-        if (directNum == 29)
-        {
-            return -1;
-        }
+    argc -= optind;
+    argv += optind;
 
-        if (target->type == UFS_DIRECTORY)
-        {
-            if (inBlockOffset % sizeof(dir_ent_t) != 0 || nbytes != sizeof(dir_ent_t))
-            {
-                return -1;
-            }
-        }
+    if (argc != 2)
+    {
+        printf("Incorrect format!");
+        exit(1);
+    }
 
-        int nextBlock = target->direct[directNum + 1];
+    int port = atoi(argv[0]);
+    char *file = argv[1];
+    if (snapshot != -1 ? engine_OpenSnapshot(file, snapshot) != 0 : engine_Open(file) != 0)
+    {
+        printf(snapshot != -1 ? "image or snapshot does not exist\n" : "image does not exist\n");
+        exit(1);
+    }
 
-        if (targetBlock == -1 || nextBlock == -1)
+    if (shard_map != NULL)
+    {
+        nshards = 1;
+        for (char *c = shard_map; *c != '\0'; c++)
+            nshards += *c == ',';
+        if (SUPERBLOCK->shard >= nshards || nshards > MFS_MAX_SHARDS || strlen(shard_map) >= MFS_BLOCK_SIZE)
         {
-            return -1;
+            printf("image is shard %d, -K names %d\n", SUPERBLOCK->shard, nshards);
+            exit(1);
         }
+    }
 
-        int rc = lseek(fd, targetBlock * UFS_BLOCK_SIZE + inBlockOffset, SEEK_SET);
-        if (rc == -1)
-        {
-            return -1;
-        }
+    if (backup_hosts != NULL && replica_Init(backup_hosts, sync) != 0)
+    {
+        printf("bad -B list %s\n", backup_hosts);
+        exit(1);
+    }
+    // MFS_SHARDS answers with both lists in one block
+    if ((shard_map != NULL ? strlen(shard_map) : 0) + (backup_hosts != NULL ? strlen(backup_hosts) : 0) + 2 > MFS_BLOCK_SIZE)
+    {
+        printf("-K and -B lists too long together\n");
+        exit(1);
+    }
+    if (primary != NULL && replica_Follow(primary, takeover) != 0)
+    {
+        printf("bad -F primary %s\n", primary);
+        exit(1);
+    }
 
-        rc = read(fd, buffer, UFS_BLOCK_SIZE - inBlockOffset);
-        if (rc == -1)
-        {
-            return -1;
-        }
+    replied = calloc(REPLY_CACHE, sizeof(replied_t));
+    inode_version = calloc(SUPERBLOCK->num_inodes, sizeof(unsigned int));
+    leases = calloc(SUPERBLOCK->num_inodes * LEASE_HOLDERS, sizeof(lease_t));
+    assert(replied != NULL && inode_version != NULL && leases != NULL);
 
-        rc = lseek(fd, nextBlock * UFS_BLOCK_SIZE, SEEK_SET);
-        if (rc == -1)
+    if (nloops > 0)
+    {
+        if (frontend_Open(port, nloops, busy) != 0)
         {
-            return -1;
+            printf("cannot open %d sockets on port %d\n", nloops, port);
+            exit(1);
         }
-
-        rc = read(fd, buffer + UFS_BLOCK_SIZE - inBlockOffset, inBlockOffset + nbytes - UFS_BLOCK_SIZE);
-        if (rc == -1)
+        // revocations and replication go out of the first
+        sd = frontend_socket(0);
+    }
+    else
+        sd = UDP_Open(port);
+    assert(sd > -1);
+    int size = SOCKET_BUFFER;
+    for (int i = 0; i < (nloops > 0 ? nloops : 1); i++)
+    {
+        int fd = nloops > 0 ? frontend_socket(i) : sd;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        if (zerocopy && UDP_EnableZeroCopy(fd) != 0)
         {
-            return -1;
+            perror("SO_ZEROCOPY");
+            zerocopy = 0;
         }
     }
-    return 0;
-}
-
-int server_Create(int pinum, int type, char *name)
-{
-
-    if (pinum > SUPERBLOCK->num_inodes - 1 || pinum < 0)
+    if (zerocopy)
     {
-        return -1;
+        nzerocopy = nloops > 0 ? nloops : 1;
+        zerocopy_sockets = calloc(nzerocopy, sizeof(zerocopy_t));
+        assert(zerocopy_sockets != NULL);
+        for (int i = 0; i < nzerocopy; i++)
+            zerocopy_sockets[i].fd = nloops > 0 ? frontend_socket(i) : sd;
     }
 
-    unsigned int bit = get_bit(inodeMap, pinum);
-
-    if ((int)bit == 0)
+    if (record_file != NULL)
     {
-        return -1;
+        static char record_buffer[1 << 20];
+        setvbuf(record_file, record_buffer, _IOFBF, sizeof(record_buffer));
+        record_header_t h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, RECORD_MAGIC, sizeof(h.magic));
+        h.version = RECORD_VERSION;
+        fwrite(&h, sizeof(h), 1, record_file);
+        record_start = stats_now_ns();
+        // replay orders requests by when they arrived, not when served; the
+        // loops of -N stamp them as they take them off their sockets
+        if (nloops == 0 && UDP_EnableTimestamps(sd) != 0)
+            perror("SO_TIMESTAMPNS");
     }
-    if (strlen(name) > 28 || strlen(name) < 1)
-        return -1;
 
-    char pBuffer[UFS_BLOCK_SIZE];
-    int pBlockOffset = (pinum * sizeof(inode_t)) / UFS_BLOCK_SIZE;
-    lseek(fd, (SUPERBLOCK->inode_region_addr + pBlockOffset) * UFS_BLOCK_SIZE, SEEK_SET);
-    read(fd, pBuffer, UFS_BLOCK_SIZE);
-    inode_block *pinodeBlockPtr = (inode_block *)pBuffer;
-    int pOffset = pinum - pBlockOffset * UFS_BLOCK_SIZE / sizeof(inode_t);
-    inode_t *pinode = &pinodeBlockPtr->inodes[pOffset];
-
-    if (pinode->type != MFS_DIRECTORY)
+    stats_register();
+    unsigned long long next_dump = 0;
+    if (stats_path != NULL)
     {
-        return -1;
+        // wake up at least once a second to see whether a dump is due
+        wake_within(1000);
+        next_dump = stats_now_ns() + stats_interval * 1000000000ULL;
+    }
+    if (log_layout)
+    {
+        // the log's cleaner runs when no request has come for a moment
+        wake_within(250);
+    }
+    if (backup_hosts != NULL || takeover > 0)
+    {
+        // heartbeats, resends and the takeover clock run between requests
+        wake_within(50);
+    }
+    if (nloops > 0 && frontend_Start() != 0)
+    {
+        printf("cannot start %d receive loops\n", nloops);
+        exit(1);
+    }
+    else if (nloops == 0 && wait_ms > 0)
+    {
+        struct timeval tv = {wait_ms / 1000, wait_ms % 1000 * 1000};
+        setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
     }
 
-    for (int i = 0; i < DIRECT_PTRS; i++)
+    while (1)
     {
-        // let's say it's the blcok address in block, starting from super block
-        int blockNum = pinode->direct[i];
+        struct sockaddr_in addr;
+        client_message_t message;
 
-        if (blockNum == -1)
-            continue;
-        char buffer[UFS_BLOCK_SIZE];
-        lseek(fd, blockNum * UFS_BLOCK_SIZE, SEEK_SET);
-        read(fd, buffer, UFS_BLOCK_SIZE);
-        dir_block_t *entryblock = (dir_block_t *)buffer;
-        for (int j = 0; j < 128; j++)
+        if (stats_path != NULL && stats_now_ns() >= next_dump)
         {
-            if (entryblock->entries[j].inum == -1)
-                continue;
-
-            if (strcmp(name, entryblock->entries[j].name) == 0)
-            {
-                return 0;
-            }
+            if (stats_dump(stats_path) != 0)
+                perror(stats_path);
+            next_dump += stats_interval * 1000000000ULL;
+        }
+        if (trace_wanted)
+        {
+            trace_wanted = 0;
+            dump_trace();
         }
-    }
-
-    int i;
-    int assigned = 0;
-    int blockOffset;
-    inode_block *inodeBlockPtr;
 
-    for (i = 0; i < SUPERBLOCK->num_inodes; i++)
-    {
-        if (get_bit(inodeMap, i) == 0)
+        unsigned long long arrival = 0;
+        int rc;
+        if (nloops > 0)
+            // replies go out of the socket the request came in on
+            rc = frontend_Next(&addr, &message, &arrival, &sd, wait_ms);
+        else if (record_file != NULL)
+            rc = UDP_ReadStamped(sd, &addr, (char *)&message, sizeof(message), &arrival);
+        else
+            rc = UDP_Read(sd, &addr, (char *)&message, sizeof(message));
+        replica_tick();
+        if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
         {
-            set_bit(inodeMap, i);
-            // write inodeMap to disk
-            char buffer[UFS_BLOCK_SIZE];
-            blockOffset = (i * sizeof(inode_t)) / UFS_BLOCK_SIZE;
-            lseek(fd, (SUPERBLOCK->inode_region_addr + blockOffset) * UFS_BLOCK_SIZE, SEEK_SET);
-            read(fd, buffer, UFS_BLOCK_SIZE);
-            inodeBlockPtr = (inode_block *)buffer;
-            int inBlockOffset = i - blockOffset * UFS_BLOCK_SIZE / sizeof(inode_t);
-            // inode_t newInode = inodeBlockPtr->inodes[inBlockOffset];
-
-            inodeBlockPtr->inodes[inBlockOffset].size = 0;
-            inodeBlockPtr->inodes[inBlockOffset].type = type;
-            for (int index = 0; index < DIRECT_PTRS; index++)
+            zerocopy_drain();
+            engine_Idle();
+            continue;
+        }
+        if (rc < 0 && errno == EINTR)
+            continue;
+        // a backup in standby leaves the clients to the primary
+        if (rc > 0 && replica_standby() && message.mtype != MFS_REPLICATE)
+            continue;
+        // a change resent because its answer was lost is answered, not redone
+        if (rc > 0 && mutates(message.mtype) && reply_again(&addr, &message))
+            continue;
+        if (rc > 0)
+        {
+            // time blocked in the read is idle, so arrival is an instant
+            TRACE_INSTANT(TRACE_RECV, rc);
+            TRACE_BEGIN(TRACE_REQUEST, message.mtype);
+            unsigned long long start_ns = stats_now_ns();
+            // a recording keeps the numbers the client sent
+            client_message_t *recorded = &message;
+            client_message_t received;
+            if (shard_map != NULL)
             {
-                inodeBlockPtr->inodes[inBlockOffset].direct[index] = -1;
+                if (record_file != NULL)
+                {
+                    memcpy(&received, &message, rc);
+                    recorded = &received;
+                }
+                message_local(&message);
             }
-
-            if (type == MFS_DIRECTORY)
+            current = &message;
+            current_len = rc;
+            if (mutates(message.mtype) || message.mtype == MFS_REPLICATE)
+                zerocopy_drain();
+            int out = sizeof(server_message_t);
+            server_message_t response;
+            response.seq = message.seq;
+            response.inum = -1;
+            response.lease = 0;
+            response.version = 0;
+            switch (message.mtype)
+            {
+            case MFS_LOOKUP:
+            {
+                // the lease is on the directory, so negative answers cache too.
+                // the type comes along for unlinks to see a striped file by
+                int inum = server_Lookup(message.method.lookup.pinum, message.method.lookup.name);
+                if (inum < 0 || server_Stat(inum, &response.stat) != 0)
+                    response.stat.type = -1;
+                response.rc = global(inum);
+                lease_reply(&response, message.method.lookup.pinum, &addr);
+                reply(&addr, &response, sizeof(response));
+                break;
+            }
+            case MFS_STAT:
+                response.rc = server_Stat(message.method.stat.inum, &response.stat);
+                if (response.rc == 0)
+                    lease_reply(&response, message.method.stat.inum, &addr);
+                reply(&addr, &response, sizeof(response));
+                break;
+            case MFS_WRITE:
+                response.rc = server_Write(message.method.write.inum, message.method.write.buffer, message.method.write.offset, message.method.write.nbytes);
+                if (response.rc == 0)
+                {
+                    lease_revoke(message.method.write.inum, &addr);
+                    response.inum = message.method.write.inum;
+                    response.version = inode_version[response.inum];
+                }
+                reply(&addr, &response, sizeof(response));
+                break;
+            case MFS_TRUNCATE:
+                response.rc = server_Truncate(message.method.truncate.inum, message.method.truncate.size);
+                if (response.rc == 0)
+                {
+                    lease_revoke(message.method.truncate.inum, &addr);
+                    response.inum = message.method.truncate.inum;
+                    response.version = inode_version[response.inum];
+                }
+                reply(&addr, &response, sizeof(response));
+                break;
+            case MFS_READ:
             {
-                inodeBlockPtr->inodes[inBlockOffset].size = 2 * sizeof(dir_ent_t);
-                // find a new datablock for this newInode, set direct[0] to this block. In this block, set two dir_t, let the first one be self, the second one be the parent, left be -1
-                // after finishing this, write this block to disk
-                for (int j = 0; j < SUPERBLOCK->num_data; j++)
+                // reply is the header followed by the file bytes, gathered
+                // straight out of the mapped image instead of response.buffer
+                unsigned long long start = cycles_now();
+                struct iovec iov[3];
+                int iovcnt = 0;
+                response.rc = server_ReadMap(message.method.read.inum, message.method.read.offset, message.method.read.nbytes, &iov[1], &iovcnt);
+                if (response.rc != 0)
+                    iovcnt = 0;
+                else
+                    lease_reply(&response, message.method.read.inum, &addr);
+                MFS_Stat_t st;
+                if (shard_map != NULL && response.rc == 0 && server_Stat(message.method.read.inum, &st) == 0 &&
+                    st.type == MFS_DIRECTORY)
                 {
-                    if (get_bit(dataMap, j) == 0)
+                    // a directory's entries are rewritten in a copy
+                    int at = 0;
+                    for (int i = 1; i <= iovcnt; i++)
                     {
-                        set_bit(dataMap, j);
-                        char buffer[UFS_BLOCK_SIZE];
-                        lseek(fd, (SUPERBLOCK->data_region_addr + j) * UFS_BLOCK_SIZE, SEEK_SET);
-                        read(fd, buffer, UFS_BLOCK_SIZE);
-                        dir_block_t *entryblock = (dir_block_t *)buffer;
-
-                        entryblock->entries[0].inum = i;
-                        strcpy(entryblock->entries[0].name, ".");
-                        entryblock->entries[1].inum = pinum;
-                        strcpy(entryblock->entries[1].name, "..");
-                        for (int a = 2; a < 128; a++)
-                        {
-                            entryblock->entries[a].inum = -1;
-                        }
-                        int rc = pwrite(fd, entryblock, UFS_BLOCK_SIZE, (SUPERBLOCK->data_region_addr + j) * UFS_BLOCK_SIZE);
-                        assert(rc == UFS_BLOCK_SIZE);
-                        inodeBlockPtr->inodes[inBlockOffset].direct[0] = j + SUPERBLOCK->data_region_addr;
-                        break;
+                        memcpy(response.buffer + at, iov[i].iov_base, iov[i].iov_len);
+                        at += iov[i].iov_len;
                     }
+                    dir_global(response.buffer, message.method.read.offset, message.method.read.nbytes);
+                    iov[1].iov_base = response.buffer;
+                    iov[1].iov_len = at;
+                    iovcnt = 1;
                 }
+                response.inum = global(response.inum);
+                iov[0].iov_base = &response;
+                iov[0].iov_len = offsetof(server_message_t, buffer);
+
+                int payload = response.rc == 0 ? message.method.read.nbytes : 0;
+                int flags = 0;
+                zerocopy_t *z = zerocopy_socket(sd);
+                if (z != NULL && payload >= ZEROCOPY_THRESHOLD && in_image(&iov[1], iovcnt))
+                {
+                    zerocopy_reap(z, ZEROCOPY_INFLIGHT - 1);
+                    int slot = z->next & (ZEROCOPY_INFLIGHT - 1);
+                    memcpy(z->header[slot], &response, iov[0].iov_len);
+                    z->payload[slot] = payload;
+                    iov[0].iov_base = z->header[slot];
+                    flags = MSG_ZEROCOPY;
+                }
+                TRACE_BEGIN(TRACE_REPLY, iov[0].iov_len + payload);
+                int sent = UDP_WriteV(sd, &addr, iov, iovcnt + 1, flags);
+                TRACE_END(TRACE_REPLY, iov[0].iov_len + payload);
+
+                read_stats.reads++;
+                read_stats.bytes_served += payload;
+                read_stats.bytes_copied += iov[0].iov_len;
+                // a zerocopy payload is counted when the kernel says it copied it
+                if (flags == 0)
+                    read_stats.bytes_copied += payload;
+                else if (sent >= 0)
+                    z->next++;
+                read_stats.cycles += cycles_now() - start;
+                out = iov[0].iov_len + payload;
+                break;
             }
-            // write newInode to disk
-            assigned = 1;
-            break;
-        }
-    }
-
-    if (assigned != 1)
-    {
-        return -1;
-    }
-
-    int rc = pwrite(fd, inodeBlockPtr, UFS_BLOCK_SIZE, (SUPERBLOCK->inode_region_addr + blockOffset) * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
-
-    int full = 0;
-    for (int j = 0; j < DIRECT_PTRS; j++)
-    {
-        unsigned int blockNum = pinode->direct[j];
-
-        if (blockNum == -1 && full == 0)
-        {
-            for (int k = 0; k < SUPERBLOCK->num_data; k++)
+            case MFS_CRET:
+                response.rc = server_Create(message.method.create.pinum, message.method.create.type, message.method.create.name);
+                if (response.rc >= 0)
+                    lease_revoke(message.method.create.pinum, NULL);
+                response.rc = global(response.rc);
+                reply(&addr, &response, sizeof(response));
+                break;
+            case MFS_CRET_WRITE:
+                response.rc = server_CreateWrite(message.method.create_write.pinum, message.method.create_write.type, message.method.create_write.name,
+                                                 message.method.create_write.buffer, message.method.create_write.nbytes);
+                if (response.rc >= 0)
+                {
+                    lease_revoke(message.method.create_write.pinum, NULL);
+                    lease_revoke(response.rc, NULL);
+                }
+                response.rc = global(response.rc);
+                reply(&addr, &response, sizeof(response));
+                break;
+            case MFS_UNLINK:
             {
-                if (get_bit(dataMap, k) == 0)
+                int victim = server_Lookup(message.method.unlink.pinum, message.method.unlink.name);
+                response.rc = server_Unlink(message.method.unlink.pinum, message.method.unlink.name);
+                if (response.rc == 0 && victim != -1)
                 {
-
-                    set_bit(dataMap, k);
-                    char buffer[UFS_BLOCK_SIZE];
-                    // void* blockAddr = (void*)(SUPERBLOCK->data_region_addr + k * UFS_BLOCK_SIZE);
-                    lseek(fd, (SUPERBLOCK->data_region_addr + k) * UFS_BLOCK_SIZE, SEEK_SET);
-                    read(fd, buffer, UFS_BLOCK_SIZE);
-                    dir_block_t *entryblock = (dir_block_t *)buffer;
-                    entryblock->entries[0].inum = i;
-                    strcpy(entryblock->entries[0].name, name);
-                    for (int m = 1; m < 128; m++)
-                    {
-                        entryblock->entries[m].inum = -1;
-                    }
-                    int rc = pwrite(fd, entryblock, UFS_BLOCK_SIZE, (SUPERBLOCK->data_region_addr + k) * UFS_BLOCK_SIZE);
-                    assert(rc == UFS_BLOCK_SIZE);
-
-                    pinode->size += sizeof(dir_ent_t);
-                    pinode->direct[j] = SUPERBLOCK->data_region_addr + k;
-
-                    // write pinode to disk
-                    rc = pwrite(fd, pinode, sizeof(inode_t), (SUPERBLOCK->inode_region_addr + pBlockOffset) * UFS_BLOCK_SIZE + pOffset * sizeof(inode_t));
-                    assert(rc == sizeof(inode_t));
-                    fsync(fd);
-                    return 0;
+                    lease_revoke(message.method.unlink.pinum, NULL);
+                    lease_revoke(victim, NULL);
                 }
+                reply(&addr, &response, sizeof(response));
+                break;
             }
-            full = 1;
-        }
-        else
-        {
-            char buffer[UFS_BLOCK_SIZE];
-            lseek(fd, blockNum * UFS_BLOCK_SIZE, SEEK_SET);
-            read(fd, buffer, UFS_BLOCK_SIZE);
-            dir_block_t *entryblock = (dir_block_t *)buffer;
-
-            for (int k = 0; k < 128; k++)
+            case MFS_COPY:
+                response.rc = server_Copy(message.method.copy.inum, message.method.copy.offset, message.method.copy.dinum,
+                                          message.method.copy.doffset, message.method.copy.nbytes);
+                if (response.rc >= 0)
+                {
+                    lease_revoke(message.method.copy.dinum, &addr);
+                    response.inum = message.method.copy.dinum;
+                    response.version = inode_version[response.inum];
+                }
+                reply(&addr, &response, sizeof(response));
+                break;
+            case MFS_RENAME:
             {
-                if (entryblock->entries[k].inum == -1)
+                client_message_t *m = &message;
+                int victim = server_Lookup(m->method.rename.newpinum, m->method.rename.newname);
+                response.rc = server_Rename(m->method.rename.pinum, m->method.rename.name, m->method.rename.newpinum,
+                                            m->method.rename.newname);
+                if (response.rc == 0)
                 {
-                    entryblock->entries[k].inum = i;
-                    strcpy(entryblock->entries[k].name, name);
-                    pinode->size += sizeof(dir_ent_t);
-                    int rc = pwrite(fd, entryblock, UFS_BLOCK_SIZE, blockNum * UFS_BLOCK_SIZE);
-                    assert(rc == UFS_BLOCK_SIZE);
-
-                    // write pinode to disk
-                    rc = pwrite(fd, pinode, sizeof(inode_t), (SUPERBLOCK->inode_region_addr + pBlockOffset) * UFS_BLOCK_SIZE + pOffset * sizeof(inode_t));
-                    assert(rc == sizeof(inode_t));
-                    fsync(fd);
-
-                    return 0;
+                    lease_revoke(m->method.rename.pinum, NULL);
+                    lease_revoke(m->method.rename.newpinum, NULL);
+                    if (victim != -1)
+                        lease_revoke(victim, NULL);
                 }
+                reply(&addr, &response, sizeof(response));
+                break;
             }
-        }
-    }
-    return -1;
-} 
-
-int server_Unlink(int pinum, char *name)
-{
-    for(int m = 0; m < SUPERBLOCK->num_inodes;m++)
-    if (pinum > SUPERBLOCK->num_inodes - 1 || pinum < 0)
-        return -1;
-    unsigned int bit = get_bit(inodeMap, pinum);
-    if ((int)bit == 0)
-        return -1;
-    if (strlen(name) > 28 || strlen(name) < 1)
-        return 0;
-    //find parent inode
-    char pBuffer[UFS_BLOCK_SIZE];
-    int pBlockOffset = (pinum * sizeof(inode_t)) / UFS_BLOCK_SIZE;
-    lseek(fd, (SUPERBLOCK->inode_region_addr + pBlockOffset) * UFS_BLOCK_SIZE, SEEK_SET);
-    read(fd, pBuffer, UFS_BLOCK_SIZE);
-    inode_block *pinodeBlockPtr = (inode_block *)pBuffer;
-    int pOffset = pinum - pBlockOffset * UFS_BLOCK_SIZE / sizeof(inode_t);
-    inode_t *pinode = &pinodeBlockPtr->inodes[pOffset];
-
-    if (pinode->type != UFS_DIRECTORY)
-        return -1;
-
-    dir_ent_t *targetEntry;
-    targetEntry->inum = -1;
-    dir_block_t *entryblock;
-    int i;
-    int j;
-    int found = 0;
-
-    for (i = 0; i < DIRECT_PTRS; i++)
-    {
-        int blockNum = pinode->direct[i];
-        if (blockNum == -1)
-            continue;
-        char buffer[UFS_BLOCK_SIZE];
-        lseek(fd, blockNum * UFS_BLOCK_SIZE, SEEK_SET);
-        read(fd, buffer, UFS_BLOCK_SIZE);
-        entryblock = (dir_block_t *)buffer;
-        for (j = 0; j < 128; j++)
-        {
-            if (entryblock->entries[j].inum == -1)
-                continue;
-            if (strcmp(name, entryblock->entries[j].name) == 0)
+            case MFS_SHARDS:
             {
-                found = 1;
-                targetEntry = &entryblock->entries[j];
+                response.rc = nshards;
+                strcpy(response.buffer, shard_map != NULL ? shard_map : "");
+                char *backups = response.buffer + strlen(response.buffer) + 1;
+                strcpy(backups, replica_list() != NULL ? replica_list() : "");
+                reply(&addr, &response, sizeof(response));
                 break;
             }
-        }
-        if(found == 1)
-            break;
-    }
-
-    if (targetEntry->inum == -1)
-        return 0;
-
-    int inum = targetEntry->inum;
-
-    char Buffer[UFS_BLOCK_SIZE];
-    int BlockOffset = (inum * sizeof(inode_t)) / UFS_BLOCK_SIZE;
-    lseek(fd, (SUPERBLOCK->inode_region_addr + BlockOffset) * UFS_BLOCK_SIZE, SEEK_SET);
-    read(fd, Buffer, UFS_BLOCK_SIZE);
-    inode_block *inodeBlockPtr = (inode_block *)Buffer;
-    int Offset = inum - BlockOffset * UFS_BLOCK_SIZE / sizeof(inode_t);
-    inode_t *target = &inodeBlockPtr->inodes[Offset];
-
-    if (target->type == UFS_DIRECTORY)
-    {
-        int blockNum = target->direct[0];
-        char buffer[UFS_BLOCK_SIZE];
-        lseek(fd, blockNum * UFS_BLOCK_SIZE, SEEK_SET);
-        read(fd, buffer, UFS_BLOCK_SIZE);
-        dir_block_t *entryblock2 = (dir_block_t *)buffer;
-        for(int j = 2; j < 128; j++)
-        {
-            if (entryblock2->entries[j].inum != -1)
-                return -1;
-        }
-
-        for (int i = 1; i < DIRECT_PTRS; i++)
-        {
-            if (target->direct[i] != -1)
-                return -1;
-        }
-        targetEntry->inum = -1;
-        set_bit_zero(inodeMap, inum);
-    }
-    else
-    {
-        targetEntry->inum = -1;
-        set_bit_zero(inodeMap, inum);
-        for (int i = 0; i < DIRECT_PTRS; i++)
-        {
-            if (target->direct[i] != -1)
+            case MFS_LINK:
+                response.rc = server_Link(message.method.link.pinum, message.method.link.name, message.method.link.inum);
+                if (response.rc == 0)
+                    lease_revoke(message.method.link.pinum, NULL);
+                reply(&addr, &response, sizeof(response));
+                break;
+            case MFS_RELEASE:
+                response.rc = server_Release(message.method.release.inum);
+                if (response.rc == 0)
+                    lease_revoke(message.method.release.inum, NULL);
+                reply(&addr, &response, sizeof(response));
+                break;
+            case MFS_STRIPE:
+                response.rc = server_Stripe(message.method.stripe.inum, message.method.stripe.size, &message.method.stripe.layout);
+                if (response.rc == 0)
+                {
+                    lease_revoke(message.method.stripe.inum, &addr);
+                    response.inum = message.method.stripe.inum;
+                    response.version = inode_version[response.inum];
+                }
+                reply(&addr, &response, sizeof(response));
+                break;
+            case MFS_LAYOUT:
+                response.rc = server_Layout(message.method.layout.inum, (stripe_layout_t *)response.buffer, &response.stat);
+                if (response.rc == 0)
+                    lease_reply(&response, message.method.layout.inum, &addr);
+                reply(&addr, &response, sizeof(response));
+                break;
+            case MFS_REPLICATE:
+                replica_receive(&message, &addr, apply);
+                response.rc = 0;
+                out = 0;
+                break;
+            case MFS_REPL_ACK:
+                replica_ack(&message, &addr);
+                response.rc = 0;
+                out = 0;
+                break;
+            case MFS_STATS:
             {
-                target->direct[i] == -1;
-                set_bit_zero(dataMap, target->direct[i] - SUPERBLOCK->data_region_addr);
+                MFS_ServerStats_t st;
+                stats_collect(&st);
+                st.dedup_file_blocks = dedup_stats.file_blocks;
+                st.dedup_data_blocks = dedup_stats.data_blocks;
+                replica_stats(&st);
+                memcpy(response.buffer, &st, sizeof(st));
+                response.rc = 0;
+                reply(&addr, &response, sizeof(response));
+                break;
+            }
+            case MFS_SNAPSHOT:
+                response.rc = server_Snapshot();
+                reply(&addr, &response, sizeof(response));
+                break;
+            case MFS_GROW:
+            {
+                int old_inodes = SUPERBLOCK->num_inodes;
+                response.rc = server_Grow(message.method.grow.num_inodes, message.method.grow.num_data);
+                if (response.rc == 0 && SUPERBLOCK->num_inodes > old_inodes)
+                    leases_grow(old_inodes);
+                reply(&addr, &response, sizeof(response));
+                break;
+            }
+            case MFS_SNAPSHOT_DELETE:
+                response.rc = server_SnapshotDelete(message.method.snapshot.id);
+                reply(&addr, &response, sizeof(response));
+                break;
+            case MFS_TRACE_DUMP:
+                response.rc = dump_trace();
+                reply(&addr, &response, sizeof(response));
+                break;
+            case MFS_SHUTDOWN:
+                if (stats_path != NULL)
+                    stats_dump(stats_path);
+                response.rc = server_Shutdown();
+                reply(&addr, &response, sizeof(response));
+                zerocopy_drain();
+                UDP_Close(sd);
+                print_read_stats();
+                frontend_print();
+                exit(0);
+                break;
+            default:
+                response.rc = -1;
+                reply(&addr, &response, sizeof(response));
+                break;
+            }
+            TRACE_END(TRACE_REQUEST, message.mtype);
+            unsigned long long served = stats_now_ns() - start_ns;
+            stats_request(message.mtype, response.rc, rc, out, served);
+            if (record_file != NULL)
+            {
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                unsigned long long now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+                unsigned long long waited = arrival > 0 && now - served > arrival ? now - served - arrival : 0;
+                record_request(&addr, recorded, rc, response.rc, start_ns, waited, served);
             }
         }
+        else
+        {
+            printf("Do not get message");
+            engine_Close();
+            return 0;
+        }
     }
-    pinode->size -= sizeof(dir_ent_t);
-    int rc = pwrite(fd, targetEntry,sizeof(dir_ent_t) , (SUPERBLOCK->data_region_addr + i) * UFS_BLOCK_SIZE + j*sizeof(dir_ent_t));
-    assert(rc == sizeof(dir_ent_t));
-    rc = pwrite(fd, pinode, sizeof(inode_t), (SUPERBLOCK->inode_region_addr + pBlockOffset) * UFS_BLOCK_SIZE + pOffset * sizeof(inode_t));
-    assert(rc == sizeof(inode_t));
-    fsync(fd);
-    return 0;
-}
-
-int server_Shutdown()
-{
-    bitmap_t *inodeBitMap = (bitmap_t *)(image + SUPERBLOCK->inode_bitmap_addr * UFS_BLOCK_SIZE);
-    int rc = pwrite(fd, inodeBitMap, SUPERBLOCK->inode_bitmap_len * UFS_BLOCK_SIZE, SUPERBLOCK->inode_bitmap_addr * UFS_BLOCK_SIZE);
-    assert(rc == SUPERBLOCK->inode_bitmap_len * UFS_BLOCK_SIZE);
 
-    bitmap_t *dataBitMap = (bitmap_t *)(image + SUPERBLOCK->data_bitmap_addr * UFS_BLOCK_SIZE);
-    rc = pwrite(fd, dataBitMap, SUPERBLOCK->data_bitmap_len * UFS_BLOCK_SIZE, SUPERBLOCK->data_bitmap_addr * UFS_BLOCK_SIZE);
-    assert(rc == SUPERBLOCK->data_bitmap_len * UFS_BLOCK_SIZE);
-    int ret = fsync(fd);
-    close(fd);
-
-    if (ret < 0)
-    {
-        return -1;
-    }
-    else
-    {
-        return 0;
-    }
-}
\ No newline at end of file
+}
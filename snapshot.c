@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ENGINE_INTERNAL
+#include "engine.h"
+#include "stats.h"
+#include "trace.h"
+
+// snapshots of a classic image, in the slots mkfs -n reserves after the data
+// region. taking one copies just the inode and data bitmaps into a free
+// slot, so it costs the same whatever the image holds. after that the live
+// image writes a data block the snapshot holds to a new block instead (see
+// block_write), the allocator leaves such blocks alone, and an inode table
+// block is copied into the slot right before the live image first changes
+// it. a second server can serve a snapshot read-only off the same image
+// (engine_OpenSnapshot), with the first taking and deleting snapshots
+
+int snapshot_count = 0;         // snapshots the image holds
+unsigned int *snap_busy = NULL; // data blocks one of them holds
+int snapshot_view = -1;         // slot engine_OpenSnapshot mounted, -1 for the live image
+int snapshot_view_id;
+
+snap_header_t *slot_header(int slot)
+{
+    return (snap_header_t *)block_data(SUPERBLOCK->snapshot_addr + slot * SUPERBLOCK->snapshot_len);
+}
+
+unsigned int *slot_inode_bitmap(int slot)
+{
+    return (unsigned int *)block_data(SUPERBLOCK->snapshot_addr + slot * SUPERBLOCK->snapshot_len +
+                                      snap_header_blocks(SUPERBLOCK->inode_region_len));
+}
+
+unsigned int *slot_data_bitmap(int slot)
+{
+    return slot_inode_bitmap(slot) + SUPERBLOCK->inode_bitmap_len * UFS_BLOCK_SIZE / sizeof(unsigned int);
+}
+
+// where slot keeps its copy of inode table block k
+unsigned int slot_inode_block(int slot, int k)
+{
+    return SUPERBLOCK->snapshot_addr + slot * SUPERBLOCK->snapshot_len + snap_header_blocks(SUPERBLOCK->inode_region_len) +
+           SUPERBLOCK->inode_bitmap_len + SUPERBLOCK->data_bitmap_len + k;
+}
+
+// snap_busy is the union of the data bitmaps of the snapshots there are
+void snap_busy_rebuild()
+{
+    int words = SUPERBLOCK->data_bitmap_len * UFS_BLOCK_SIZE / sizeof(unsigned int);
+    memset(snap_busy, 0, words * sizeof(unsigned int));
+    snapshot_count = 0;
+    for (int slot = 0; slot < SUPERBLOCK->snapshot_slots; slot++)
+    {
+        if (slot_header(slot)->magic != SNAP_MAGIC)
+            continue;
+        unsigned int *bits = slot_data_bitmap(slot);
+        for (int i = 0; i < words; i++)
+            snap_busy[i] |= bits[i];
+        snapshot_count++;
+    }
+}
+
+/**
+ * find the snapshots of a freshly opened classic image.
+ * return -1 if failed, 0 otherwise
+ */
+int snap_Open()
+{
+    snapshot_count = 0;
+    if (SUPERBLOCK->snapshot_slots == 0)
+        return 0;
+    snap_busy = malloc(SUPERBLOCK->data_bitmap_len * UFS_BLOCK_SIZE);
+    if (snap_busy == NULL)
+        return -1;
+    snap_busy_rebuild();
+    return 0;
+}
+
+void snap_Close()
+{
+    free(snap_busy);
+    snap_busy = NULL;
+    snapshot_count = 0;
+    snapshot_view = -1;
+}
+
+// a snapshot holds data block, so it must not be written over or reused
+int snap_holds(unsigned int block)
+{
+    return snapshot_count > 0 && get_bit(snap_busy, block - SUPERBLOCK->data_region_addr);
+}
+
+// inum is about to change: save its inode table block into every snapshot
+// still sharing it, and make that durable before the change can be.
+// return -1 if that failed, and inum must not change, 0 otherwise
+int snap_inode_cow(int inum)
+{
+    if (snapshot_count == 0)
+        return 0;
+    int k = inum / (UFS_BLOCK_SIZE / sizeof(inode_t));
+    char *live = block_data(SUPERBLOCK->inode_region_addr + k);
+    int copies = 0;
+    for (int slot = 0; slot < SUPERBLOCK->snapshot_slots; slot++)
+    {
+        snap_header_t *h = slot_header(slot);
+        if (h->magic != SNAP_MAGIC || h->copied[k])
+            continue;
+        int rc = pwrite(fd, live, UFS_BLOCK_SIZE, (off_t)slot_inode_block(slot, k) * UFS_BLOCK_SIZE);
+        if (rc != UFS_BLOCK_SIZE)
+        {
+            perror("snapshot inode copy");
+            return -1;
+        }
+        copies++;
+    }
+    if (copies == 0)
+        return 0;
+    // the copies before the flags saying they are there
+    if (fsync(fd) != 0)
+    {
+        perror("snapshot inode copy");
+        return -1;
+    }
+    for (int slot = 0; slot < SUPERBLOCK->snapshot_slots; slot++)
+    {
+        snap_header_t *h = slot_header(slot);
+        if (h->magic == SNAP_MAGIC)
+            h->copied[k] = 1;
+    }
+    __sync_synchronize();
+    // the copies are there either way, but a snapshot that forgets them
+    // after a crash would read the changed inode
+    if (fsync(fd) != 0)
+    {
+        perror("snapshot inode copy");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * take a snapshot of the image as of the last commit.
+ * return -1 if failed, the snapshot's id otherwise
+ */
+int server_Snapshot()
+{
+    if (log_layout || snapshot_view != -1)
+        return -1;
+    int slot;
+    for (slot = 0; slot < SUPERBLOCK->snapshot_slots; slot++)
+    {
+        if (slot_header(slot)->magic != SNAP_MAGIC)
+            break;
+    }
+    if (slot == SUPERBLOCK->snapshot_slots)
+        return -1;
+
+    snap_header_t *h = slot_header(slot);
+    memset(h, 0, snap_header_blocks(SUPERBLOCK->inode_region_len) * UFS_BLOCK_SIZE);
+    memcpy(slot_inode_bitmap(slot), inodeMap, SUPERBLOCK->inode_bitmap_len * UFS_BLOCK_SIZE);
+    memcpy(slot_data_bitmap(slot), dataMap, SUPERBLOCK->data_bitmap_len * UFS_BLOCK_SIZE);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    h->created = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    h->id = SUPERBLOCK->snapshot_next_id++;
+    // the slot is complete on disk before it says it holds a snapshot
+    fsync(fd);
+    h->magic = SNAP_MAGIC;
+    commit();
+
+    unsigned int *bits = slot_data_bitmap(slot);
+    for (int i = 0; i < SUPERBLOCK->data_bitmap_len * UFS_BLOCK_SIZE / (int)sizeof(unsigned int); i++)
+        snap_busy[i] |= bits[i];
+    snapshot_count++;
+    return h->id;
+}
+
+/**
+ * delete snapshot id; the blocks only it held are free again.
+ * return -1 if failed, 0 otherwise
+ */
+int server_SnapshotDelete(int id)
+{
+    if (log_layout || snapshot_view != -1)
+        return -1;
+    for (int slot = 0; slot < SUPERBLOCK->snapshot_slots; slot++)
+    {
+        snap_header_t *h = slot_header(slot);
+        if (h->magic == SNAP_MAGIC && h->id == id)
+        {
+            h->magic = 0;
+            commit();
+            snap_busy_rebuild();
+            // punch out of the image file what only it held
+            unsigned int *bits = slot_data_bitmap(slot);
+            for (int b = 0, queued = 0; b < SUPERBLOCK->num_data; b++)
+            {
+                if (!get_bit(bits, b))
+                    continue;
+                punch_queue(SUPERBLOCK->data_region_addr + b);
+                if (++queued % PUNCH_MAX == 0)
+                    punch_flush();
+            }
+            punch_flush();
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * the engine serves snapshot id: reads see the image as it was when it was
+ * taken, and writes fail. return -1 if there is no such snapshot, 0 otherwise
+ */
+int snap_Mount(int id)
+{
+    for (int slot = 0; slot < SUPERBLOCK->snapshot_slots; slot++)
+    {
+        snap_header_t *h = slot_header(slot);
+        if (h->magic == SNAP_MAGIC && h->id == id)
+        {
+            snapshot_view = slot;
+            snapshot_view_id = id;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * inode inum of the mounted snapshot, copied out since the live server may
+ * be copying its block into the slot right now; NULL if it is not in use
+ * or the snapshot was deleted. the copy lasts until the second next call
+ */
+inode_t *snap_inode_get(int inum)
+{
+    static inode_t copies[2];
+    static int next = 0;
+
+    snap_header_t *h = slot_header(snapshot_view);
+    if (h->magic != SNAP_MAGIC || h->id != snapshot_view_id)
+        return NULL;
+    if (inum > SUPERBLOCK->num_inodes - 1 || inum < 0 || get_bit(slot_inode_bitmap(snapshot_view), inum) == 0)
+        return NULL;
+
+    int per_block = UFS_BLOCK_SIZE / sizeof(inode_t);
+    int k = inum / per_block;
+    volatile int *copied = &h->copied[k];
+    inode_t *inode = &copies[next];
+    next ^= 1;
+    while (1)
+    {
+        if (*copied)
+        {
+            *inode = ((inode_t *)block_data(slot_inode_block(snapshot_view, k)))[inum % per_block];
+            break;
+        }
+        *inode = inode_table[inum];
+        __sync_synchronize();
+        // the live server copies the block before it changes it, so if it
+        // still has not, what was read is what the snapshot holds
+        if (*copied == 0)
+            break;
+    }
+    return inode;
+}
@@ -0,0 +1,103 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "stats.h"
+
+#define STATS_THREADS (256)
+
+__thread stats_t thread_stats;
+
+stats_t *stats_threads[STATS_THREADS];
+int stats_nthreads = 0;
+unsigned long long stats_start_ns = 0;
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// make the calling thread's counters part of what stats_collect reports
+void stats_register()
+{
+    pthread_mutex_lock(&stats_lock);
+    if (stats_start_ns == 0)
+        stats_start_ns = stats_now_ns();
+    if (stats_nthreads < STATS_THREADS)
+        stats_threads[stats_nthreads++] = &thread_stats;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_collect(MFS_ServerStats_t *out)
+{
+    memset(out, 0, sizeof(MFS_ServerStats_t));
+    pthread_mutex_lock(&stats_lock);
+    int n = stats_nthreads;
+    pthread_mutex_unlock(&stats_lock);
+
+    out->uptime_ms = (stats_now_ns() - stats_start_ns) / 1000000;
+    hist_t h;
+    for (int t = 0; t < MFS_STATS_TYPES; t++)
+    {
+        hist_init(&h);
+        for (int i = 0; i < n; i++)
+        {
+            hist_merge(&h, &stats_threads[i]->latency[t]);
+            out->ops[t].errors += stats_threads[i]->errors[t];
+            out->ops[t].bytes_in += stats_threads[i]->bytes_in[t];
+            out->ops[t].bytes_out += stats_threads[i]->bytes_out[t];
+        }
+        out->ops[t].count = h.total;
+        out->ops[t].ns_total = h.sum;
+        out->ops[t].ns_p50 = hist_percentile(&h, 50);
+        out->ops[t].ns_p90 = hist_percentile(&h, 90);
+        out->ops[t].ns_p99 = hist_percentile(&h, 99);
+        out->ops[t].ns_p999 = hist_percentile(&h, 99.9);
+        out->ops[t].ns_max = h.max;
+    }
+
+    hist_init(&h);
+    for (int i = 0; i < n; i++)
+    {
+        stats_t *s = stats_threads[i];
+        hist_merge(&h, &s->fsync);
+        out->inode_alloc_failures += s->inode_alloc_failures;
+        out->data_alloc_failures += s->data_alloc_failures;
+        out->lease_grants += s->lease_grants;
+        out->lease_denials += s->lease_denials;
+        out->revokes += s->revokes;
+    }
+    out->fsyncs = h.total;
+    out->fsync_ns = h.sum;
+    out->fsync_ns_p99 = hist_percentile(&h, 99);
+    out->fsync_ns_max = h.max;
+}
+
+/**
+ * append the current counters to path as one line of JSON,
+ * return -1 if failed, 0 otherwise
+ */
+int stats_dump(char *path)
+{
+    MFS_ServerStats_t st;
+    stats_collect(&st);
+
+    FILE *f = fopen(path, "a");
+    if (f == NULL)
+        return -1;
+    fprintf(f, "{\"time\":%ld,\"uptime_ms\":%llu,\"fsyncs\":%llu,\"fsync_ns\":%llu,\"fsync_ns_p99\":%llu,"
+               "\"fsync_ns_max\":%llu,\"inode_alloc_failures\":%llu,\"data_alloc_failures\":%llu,"
+               "\"lease_grants\":%llu,\"lease_denials\":%llu,\"revokes\":%llu,\"ops\":{",
+            (long)time(NULL), st.uptime_ms, st.fsyncs, st.fsync_ns, st.fsync_ns_p99, st.fsync_ns_max,
+            st.inode_alloc_failures, st.data_alloc_failures, st.lease_grants, st.lease_denials, st.revokes);
+    int first = 1;
+    for (int t = 0; t < MFS_STATS_TYPES; t++)
+    {
+        MFS_OpStats_t *o = &st.ops[t];
+        if (o->count == 0)
+            continue;
+        fprintf(f, "%s\"%d\":{\"count\":%llu,\"errors\":%llu,\"bytes_in\":%llu,\"bytes_out\":%llu,\"ns_total\":%llu,"
+                   "\"ns_p50\":%llu,\"ns_p90\":%llu,\"ns_p99\":%llu,\"ns_p999\":%llu,\"ns_max\":%llu}",
+                first ? "" : ",", t, o->count, o->errors, o->bytes_in, o->bytes_out, o->ns_total,
+                o->ns_p50, o->ns_p90, o->ns_p99, o->ns_p999, o->ns_max);
+        first = 0;
+    }
+    fprintf(f, "}}\n");
+    return fclose(f) == 0 ? 0 : -1;
+}
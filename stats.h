@@ -0,0 +1,50 @@
+#ifndef __stats_h__
+#define __stats_h__
+
+#include <time.h>
+
+#include "mfs.h"
+#include "hist.h"
+
+// server counters. every thread that handles requests bumps its own
+// thread_stats with plain increments; MFS_STATS and the periodic dump sum
+// the registered threads up, reading them without any synchronisation
+typedef struct
+{
+    hist_t latency[MFS_STATS_TYPES]; // ns, per message type
+    unsigned long long errors[MFS_STATS_TYPES];
+    unsigned long long bytes_in[MFS_STATS_TYPES];
+    unsigned long long bytes_out[MFS_STATS_TYPES];
+    hist_t fsync;
+    unsigned long long inode_alloc_failures;
+    unsigned long long data_alloc_failures;
+    unsigned long long lease_grants;
+    unsigned long long lease_denials;
+    unsigned long long revokes;
+} stats_t;
+
+extern __thread stats_t thread_stats;
+
+static inline unsigned long long stats_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void stats_request(int mtype, int rc, int bytes_in, int bytes_out, unsigned long long ns)
+{
+    if (mtype < 0 || mtype >= MFS_STATS_TYPES)
+        mtype = 0;
+    hist_record(&thread_stats.latency[mtype], ns);
+    if (rc < 0)
+        thread_stats.errors[mtype]++;
+    thread_stats.bytes_in[mtype] += bytes_in;
+    thread_stats.bytes_out[mtype] += bytes_out;
+}
+
+void stats_register();
+void stats_collect(MFS_ServerStats_t *out);
+int stats_dump(char *path);
+
+#endif // __stats_h__
@@ -0,0 +1,112 @@
+#ifndef __trace_h__
+#define __trace_h__
+
+#include "cycles.h"
+
+// request tracing, compiled in with -DMFS_TRACE (make TRACE=1). every
+// tracepoint stores one 16-byte record into the calling thread's ring,
+// which only that thread writes, so there is no locking and no atomic
+// read-modify-write. rings are written out with trace_dump and turned
+// into per-phase breakdowns and Chrome trace JSON by mfstrace
+
+enum
+{
+    // server
+    TRACE_REQUEST = 1, // arg: message type
+    TRACE_RECV,        // instant, arg: bytes received
+    TRACE_INODE,       // writing inode blocks to the log
+    TRACE_DIRSCAN,     // walking directory blocks
+    TRACE_ALLOC,       // bitmap scans, finding log space
+    TRACE_DATA,        // data block I/O or mapping
+    TRACE_FSYNC,
+    TRACE_REPLY,       // arg: bytes sent
+    // client
+    TRACE_RPC,         // async, from submit to reply; arg: session and seq
+    TRACE_SEND,        // arg: message type
+    TRACE_WAIT,        // blocked in MFS_Wait
+    TRACE_RETRY,       // instant, arg: seq
+    TRACE_EVENTS
+};
+
+#define TRACE_B (0) // span begin
+#define TRACE_E (1) // span end
+#define TRACE_I (2) // instant
+#define TRACE_AB (3) // async begin, matched to its end by event and arg
+#define TRACE_AE (4)
+
+#define TRACE_RING (1 << 16) // records per thread, oldest are overwritten
+
+typedef struct
+{
+    unsigned long long ts; // cycles_now()
+    unsigned int arg;
+    unsigned short event;
+    unsigned short kind;
+} trace_rec_t;
+
+typedef struct
+{
+    unsigned long long head; // records ever written; only the owner stores it
+    int tid;
+    trace_rec_t recs[TRACE_RING];
+} trace_ring_t;
+
+// dump file: a trace_header_t, then per ring a trace_thread_t followed by
+// its count records, oldest first
+#define TRACE_MAGIC "MFSTRACE"
+#define TRACE_VERSION (1)
+
+typedef struct
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int nthreads;
+    int pid;
+    int pad;
+    double ticks_per_us; // cycles_now() ticks per microsecond
+} trace_header_t;
+
+typedef struct
+{
+    int tid;
+    unsigned int count;
+    unsigned long long dropped; // overwritten before the dump
+} trace_thread_t;
+
+extern __thread trace_ring_t *trace_ring;
+extern const char *trace_names[TRACE_EVENTS];
+
+trace_ring_t *trace_thread_init();
+int trace_dump(const char *path);
+
+static inline void trace_record(int event, int kind, unsigned int arg)
+{
+    trace_ring_t *r = trace_ring;
+    if (r == NULL && (r = trace_thread_init()) == NULL)
+        return;
+    unsigned long long head = r->head;
+    trace_rec_t *rec = &r->recs[head & (TRACE_RING - 1)];
+    rec->ts = cycles_now();
+    rec->arg = arg;
+    rec->event = event;
+    rec->kind = kind;
+    // a dumping thread may read the ring meanwhile; publishing the new head
+    // after the record is a plain store on x86
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+#ifdef MFS_TRACE
+#define TRACE_BEGIN(event, arg) trace_record(event, TRACE_B, arg)
+#define TRACE_END(event, arg) trace_record(event, TRACE_E, arg)
+#define TRACE_INSTANT(event, arg) trace_record(event, TRACE_I, arg)
+#define TRACE_ASYNC_BEGIN(event, arg) trace_record(event, TRACE_AB, arg)
+#define TRACE_ASYNC_END(event, arg) trace_record(event, TRACE_AE, arg)
+#else
+#define TRACE_BEGIN(event, arg) do { } while (0)
+#define TRACE_END(event, arg) do { } while (0)
+#define TRACE_INSTANT(event, arg) do { } while (0)
+#define TRACE_ASYNC_BEGIN(event, arg) do { } while (0)
+#define TRACE_ASYNC_END(event, arg) do { } while (0)
+#endif
+
+#endif // __trace_h__
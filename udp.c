@@ -1,5 +1,11 @@
 #include "udp.h"
 
+#include <linux/errqueue.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+
 // create a socket and bind it to a port on the current machine
 // used to listen for incoming packets
 int UDP_Open(int port)
@@ -29,6 +35,38 @@ int UDP_Open(int port)
     return fd;
 }
 
+// UDP_Open for one of several sockets on the same port: the kernel spreads
+// datagrams across them by the sender's address and port
+int UDP_OpenShared(int port)
+{
+    int fd;
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+    {
+        perror("socket");
+        return -1;
+    }
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1)
+    {
+        perror("SO_REUSEPORT");
+        close(fd);
+        return -1;
+    }
+
+    struct sockaddr_in my_addr;
+    bzero(&my_addr, sizeof(my_addr));
+    my_addr.sin_family = AF_INET;
+    my_addr.sin_port = htons(port);
+    my_addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(fd, (struct sockaddr *)&my_addr, sizeof(my_addr)) == -1)
+    {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
 // fill sockaddr_in struct with proper goodies
 int UDP_FillSockAddr(struct sockaddr_in *addr, char *hostname, int port)
 {
@@ -61,6 +99,65 @@ int UDP_Write(int fd, struct sockaddr_in *addr, char *buffer, int n)
     return rc;
 }
 
+// gather-send one datagram from several buffers, flags are passed to sendmsg
+// (e.g. MSG_ZEROCOPY once UDP_EnableZeroCopy succeeded on this socket)
+int UDP_WriteV(int fd, struct sockaddr_in *addr, struct iovec *iov, int iovcnt, int flags)
+{
+    struct msghdr msg;
+    bzero(&msg, sizeof(msg));
+    msg.msg_name = addr;
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    int rc = sendmsg(fd, &msg, flags);
+    return rc;
+}
+
+// allow MSG_ZEROCOPY sends on this socket, returns -1 if the kernel refuses
+int UDP_EnableZeroCopy(int fd)
+{
+    int one = 1;
+    return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+}
+
+// have reads on an empty socket poll the device queue for up to usecs
+// before sleeping, returns -1 if the kernel refuses
+int UDP_EnableBusyPoll(int fd, int usecs)
+{
+    return setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs));
+}
+
+// drain MSG_ZEROCOPY completions from the error queue without blocking.
+// the kernel numbers a socket's zerocopy sends 0, 1, .. and reports them
+// done in ranges; done(first, last, copied, arg) is called for each, with
+// copied set if it had to copy them after all (e.g. over loopback).
+// returns how many sends were reported
+int UDP_ReapZeroCopy(int fd, void (*done)(unsigned int first, unsigned int last, int copied, void *arg), void *arg)
+{
+    int reaped = 0;
+    while (1)
+    {
+        char control[128];
+        struct msghdr msg;
+        bzero(&msg, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+            break;
+
+        struct cmsghdr *cm;
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            done(serr->ee_info, serr->ee_data, (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0, arg);
+            reaped += serr->ee_data - serr->ee_info + 1;
+        }
+    }
+    return reaped;
+}
+
 int UDP_Read(int fd, struct sockaddr_in *addr, char *buffer, int n)
 {
     int len = sizeof(struct sockaddr_in);
@@ -69,6 +166,42 @@ int UDP_Read(int fd, struct sockaddr_in *addr, char *buffer, int n)
     return rc;
 }
 
+// have the kernel stamp every datagram it receives, for UDP_ReadStamped
+int UDP_EnableTimestamps(int fd)
+{
+    int one = 1;
+    return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+}
+
+// UDP_Read, also handing back when the datagram arrived (CLOCK_REALTIME ns),
+// or 0 if it carries no stamp
+int UDP_ReadStamped(int fd, struct sockaddr_in *addr, char *buffer, int n, unsigned long long *arrival)
+{
+    char control[64];
+    struct iovec iov = {buffer, n};
+    struct msghdr msg;
+    bzero(&msg, sizeof(msg));
+    msg.msg_name = addr;
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    int rc = recvmsg(fd, &msg, 0);
+
+    *arrival = 0;
+    struct cmsghdr *cm;
+    for (cm = CMSG_FIRSTHDR(&msg); rc >= 0 && cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+    {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS)
+        {
+            struct timespec *ts = (struct timespec *)CMSG_DATA(cm);
+            *arrival = ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+        }
+    }
+    return rc;
+}
+
 int UDP_Close(int fd)
 {
     return close(fd);
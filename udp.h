@@ -19,6 +19,7 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <netinet/tcp.h>
 #include <netinet/in.h>
@@ -28,10 +29,19 @@
 // 
 
 int UDP_Open(int port);
+int UDP_OpenShared(int port);
 int UDP_Close(int fd);
 
 int UDP_Read(int fd, struct sockaddr_in *addr, char *buffer, int n);
 int UDP_Write(int fd, struct sockaddr_in *addr, char *buffer, int n);
+int UDP_WriteV(int fd, struct sockaddr_in *addr, struct iovec *iov, int iovcnt, int flags);
+
+int UDP_EnableZeroCopy(int fd);
+int UDP_ReapZeroCopy(int fd, void (*done)(unsigned int first, unsigned int last, int copied, void *arg), void *arg);
+int UDP_EnableBusyPoll(int fd, int usecs);
+
+int UDP_EnableTimestamps(int fd);
+int UDP_ReadStamped(int fd, struct sockaddr_in *addr, char *buffer, int n, unsigned long long *arrival);
 
 int UDP_FillSockAddr(struct sockaddr_in *addr, char *hostName, int port);
 
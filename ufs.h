@@ -3,6 +3,7 @@
 
 #define UFS_DIRECTORY    (0)
 #define UFS_REGULAR_FILE (1)
+#define UFS_STRIPED      (2) // a file whose bytes are in stripes, see stripe_layout_t
 
 #define UFS_BLOCK_SIZE (4096)
 
@@ -19,6 +20,22 @@ typedef struct {
     int  inum;      // inode number of entry (-1 means entry not used)
 } dir_ent_t;
 
+// set in an entry's inum when it names an inode of another shard, the rest
+// being the number clients know it by (see shard_global in engine.c)
+#define UFS_REMOTE (1 << 30)
+
+// block 0 of a UFS_STRIPED inode: its bytes are cut into units of unit
+// bytes, unit k going to stripe k % count, which are regular files with no
+// directory entry, on other shards or this one. inums are as clients know
+// them, the server never follows them. the inode's size is the file's
+#define UFS_MAX_STRIPES (64)
+
+typedef struct {
+    int unit;  // a multiple of UFS_BLOCK_SIZE
+    int count;
+    int inums[UFS_MAX_STRIPES];
+} stripe_layout_t;
+
 // presumed: block 0 is the super block
 typedef struct __super {
     int inode_bitmap_addr; // block address
@@ -31,7 +48,157 @@ typedef struct __super {
     int data_region_len;   // in blocks
     int num_inodes;        // just the number of inodes
     int num_data;          // and data blocks...
+    // zero in images made before these were added, i.e. the classic layout
+    int layout;            // UFS_LAYOUT_CLASSIC or UFS_LAYOUT_LOG
+    int segment_blocks;    // log: blocks per segment, data region is num_data / this
+    int checkpoint_addr;   // log: two checkpoint regions, one after the other
+    int checkpoint_len;    // log: in blocks, each
+    int snapshot_addr;     // classic: snapshot slots, after the data region
+    int snapshot_len;      // classic: in blocks, each slot
+    int snapshot_slots;    // classic: 0 if the image cannot take snapshots
+    int snapshot_next_id;  // classic: id the next snapshot gets
+    int compress;          // classic: regular files' blocks are compressed (mkfs -c)
+    int dedup;             // classic: regular files share identical blocks (mkfs -D)
+    int dedup_refs_addr;   // dedup: a reference count per data block
+    int dedup_refs_len;    // dedup: in blocks
+    int dedup_index_addr;  // dedup: the fingerprint index
+    int dedup_index_len;   // dedup: in blocks
+    int dedup_index_slots; // dedup: a power of two, at least twice num_data
+    int groups;            // classic: allocation groups, 0 (one) in older images
+    int group_inodes;      // classic: inodes in each group, a multiple of 32
+    int group_blocks;      // classic: data blocks in each group, a multiple of 32
+    int shard;             // which shard of a sharded namespace this is, 0 if none
 } super_t;
 
+#define UFS_LAYOUT_CLASSIC (0) // inodes and blocks updated in place, bitmaps
+#define UFS_LAYOUT_LOG     (1) // everything appended to segments (mkfs -l)
+
+// log layout. every commit appends a partial segment: a summary naming the
+// owner of each block that follows it, the data blocks, then blocks of the
+// inodes that changed. the inode map, kept in the checkpoint regions, says
+// where each inode's latest copy is
+#define LOG_MAGIC (0x4c4f4753)
+#define LOG_SUMMARY_ENTRIES (509)
+#define LOG_INODE_BLOCK (-2)     // summary index of a block of inodes
+#define LOG_INODES_PER_BLOCK (31)
+#define LOG_FREED (-1)           // inode type recording that the inode was freed
+
+typedef struct {
+    int inum;  // owner
+    int index; // direct[] slot, or LOG_INODE_BLOCK
+} log_entry_t;
+
+typedef struct {
+    unsigned int magic;
+    unsigned int nblocks;    // blocks after this one in the partial segment
+    unsigned long long seq;  // of the commit, one more than the last
+    unsigned int next;       // block where the next partial segment starts
+    unsigned int checksum;   // of the blocks, then seq, then the entries
+    log_entry_t entries[LOG_SUMMARY_ENTRIES];
+} log_summary_t;
+
+typedef struct {
+    int count;
+    int inums[LOG_INODES_PER_BLOCK];
+    inode_t inodes[LOG_INODES_PER_BLOCK];
+} log_inode_block_t;
+
+// a checkpoint region is this header, the inode map (num_inodes addresses,
+// block * 32 + slot, 0 for a free inode) and the segment ages (the low 32
+// bits of the seq of the last commit into each); the valid region with the
+// higher seq is used
+typedef struct {
+    unsigned int magic;
+    unsigned int checksum;   // of the map and ages, seeded with seq
+    unsigned long long seq;  // last commit it covers
+    unsigned int head;       // where the partial segment after seq starts
+    unsigned int pad;
+} log_checkpoint_t;
+
+// classic layout snapshots. a slot is this header with its copied[] flags,
+// then copies of the inode bitmap and data bitmap taken with the snapshot,
+// then room for a copy of each inode table block. copied[k] is set once the
+// live image is about to change inode block k for the first time since the
+// snapshot and its old contents are in the slot; until then the snapshot
+// shares the block with the live image. data blocks in the snapshot's data
+// bitmap are never written over while it exists
+#define SNAP_MAGIC (0x534e4150)
+
+typedef struct {
+    unsigned int magic;         // SNAP_MAGIC while the slot holds a snapshot
+    int id;
+    unsigned long long created; // CLOCK_REALTIME ns
+    int copied[];               // per inode table block
+} snap_header_t;
+
+// blocks a slot's header takes, given the super block's inode_region_len
+static inline int snap_header_blocks(int inode_region_len)
+{
+    return (sizeof(snap_header_t) + inode_region_len * sizeof(int) + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+}
+
+// compressed images. a regular file's block that compresses well is kept
+// as a fragment of a pack block shared with others, and the file's direct[]
+// slot says which: PACK_BIT, the fragment index, then the pack's block
+// number, which has to be below PACK_MAX_BLOCK. fragments are appended
+// and never changed; live has the bit of each one a file still points at
+#define PACK_BIT (0x80000000u)
+#define PACK_MAX_BLOCK (1 << 24)
+#define PACK_FRAGS (32)
+
+typedef struct {
+    unsigned short count;    // fragments appended
+    unsigned short end;      // first free byte of the block
+    unsigned int live;
+    struct {
+        unsigned short offset;
+        unsigned short length;
+    } frags[PACK_FRAGS];
+} pack_header_t;
+
+// a block that does not compress to this is written raw: less and a pack
+// holds at least two
+#define PACK_BYPASS ((UFS_BLOCK_SIZE - (int)sizeof(pack_header_t)) / 2)
+
+static inline int is_packed(unsigned int ptr)
+{
+    return (int)ptr != -1 && (ptr & PACK_BIT);
+}
+
+static inline unsigned int pack_block(unsigned int ptr)
+{
+    return ptr & (PACK_MAX_BLOCK - 1);
+}
+
+static inline int pack_frag(unsigned int ptr)
+{
+    return (ptr & ~PACK_BIT) >> 24;
+}
+
+// deduplicated images. the fingerprint index is a table of these, found
+// by linear probing from tag modulo its size; block 0 marks a free slot
+typedef struct {
+    unsigned int tag;   // fingerprint of the block's contents
+    unsigned int block;
+} dedup_entry_t;
+
+// FNV-style over 32-bit words, in four interleaved lanes so the multiplies
+// overlap; n is a multiple of 4
+static inline unsigned int log_checksum(unsigned int h, const void *data, int n)
+{
+    const unsigned int *words = (const unsigned int *)data;
+    unsigned int a = h, b = h ^ 1, c = h ^ 2, d = h ^ 3;
+    int i = 0;
+    for (; i + 4 <= n / 4; i += 4)
+    {
+        a = (a ^ words[i]) * 16777619u;
+        b = (b ^ words[i + 1]) * 16777619u;
+        c = (c ^ words[i + 2]) * 16777619u;
+        d = (d ^ words[i + 3]) * 16777619u;
+    }
+    for (; i < n / 4; i++)
+        a = (a ^ words[i]) * 16777619u;
+    return (((a * 16777619u) ^ b) * 16777619u ^ c) * 16777619u ^ d;
+}
 
 #endif // __ufs_h__